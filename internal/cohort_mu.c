@@ -0,0 +1,144 @@
+/* Copyright 2016 Google Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License. */
+
+#include "nsync_cpp.h"
+#include "platform.h"
+#include "compiler.h"
+#include "cputype.h"
+#include "nsync.h"
+#include "atomic.h"
+#include "dll.h"
+#include "sem.h"
+#include "wait_internal.h"
+#include "common.h"
+
+NSYNC_CPP_START_
+
+/* An nsync_cohort_mu is a cohort lock:  a global nsync_mu, plus an nsync_mu
+   per node.  A thread first acquires its node's lock.  The holder of a node's
+   lock owns the cohort lock if node[i].global_held is set; otherwise it must
+   also acquire the global lock, which it then holds on behalf of the node.
+   On release, if other threads on the same node are trying to acquire the
+   node's lock, and the node has not passed ownership among its threads more
+   than COHORT_BATCH times in a row, the releasing thread keeps the global lock
+   for the node, and releases only the node's lock.  Thus the global lock may
+   be released by a thread other than the one that acquired it, which nsync_mu
+   permits internally.
+
+   node[i].global_held and node[i].batch are protected by node[i].mu.
+   holder (the node index of the thread holding *cmu) is protected by *cmu.
+   node[i].waiting counts threads trying to acquire node[i].mu.  */
+
+/* The maximum number of consecutive handoffs within a node before the global
+   lock is released, allowing ownership to migrate to another node.  */
+#define COHORT_BATCH 64
+
+/* Number of acquisitions by a thread between checks of which node the thread
+   is running on.  Threads rarely change nodes, and the check may be a system
+   call.  */
+#define NODE_RECHECK 256
+
+/* The number of nodes in use:  the machine's node count, capped at
+   NSYNC_COHORT_MU_NODES_, or the value given to nsync_cohort_mu_set_nodes_().
+   0 until computed. */
+static nsync_atomic_uint32_ node_count;
+static nsync_atomic_uint32_ fake_nodes; /* whether set by nsync_cohort_mu_set_nodes_() */
+
+static THREAD_LOCAL int node_for_thread;     /* calling thread's node, when node_uses != 0 */
+static THREAD_LOCAL unsigned node_uses;      /* uses of node_for_thread since checked */
+
+/* Return the number of nodes among which an nsync_cohort_mu should
+   distinguish. */
+static uint32_t cohort_nodes (void) {
+	uint32_t nodes = ATM_LOAD_ACQ (&node_count);
+	if (nodes == 0) {
+		nodes = (uint32_t) nsync_numa_node_count_ ();
+		nodes = MAX_ (MIN_ (nodes, NSYNC_COHORT_MU_NODES_), 1);
+		ATM_CAS_REL (&node_count, 0, nodes);
+		nodes = ATM_LOAD_ACQ (&node_count);
+	}
+	return (nodes);
+}
+
+/* Return the index in cmu->node[] that the calling thread should use. */
+static uint32_t cohort_node (uint32_t nodes) {
+	int node;
+	if (ATM_LOAD (&fake_nodes) != 0) {
+		node = (int) nsync_thread_slot_ ();
+	} else if (HAVE_THREAD_LOCAL) {
+		if (node_uses == 0) {
+			node_for_thread = nsync_numa_node_ ();
+		}
+		node_uses = (node_uses + 1) % NODE_RECHECK;
+		node = node_for_thread;
+	} else {
+		node = nsync_numa_node_ ();
+	}
+	return (((uint32_t) node) % nodes);
+}
+
+void nsync_cohort_mu_set_nodes_ (int nodes) {
+	ATM_STORE (&fake_nodes, nodes >= 0);
+	ATM_STORE_REL (&node_count, nodes >= 0? (uint32_t) MAX_ (MIN_ (nodes, NSYNC_COHORT_MU_NODES_), 1) : 0);
+}
+
+void nsync_cohort_mu_init (nsync_cohort_mu *cmu) {
+	memset ((void *) cmu, 0, sizeof (*cmu));
+}
+
+void nsync_cohort_mu_lock (nsync_cohort_mu *cmu) {
+	uint32_t nodes = cohort_nodes ();
+	if (nodes == 1) {
+		nsync_mu_lock (&cmu->global);
+	} else {
+		uint32_t i = cohort_node (nodes);
+		struct nsync_cohort_mu_node_s_ *n = &cmu->node[i];
+		uint32_t old_value;
+		do {
+			old_value = ATM_LOAD (&n->waiting);
+		} while (!ATM_CAS (&n->waiting, old_value, old_value+1));
+		nsync_mu_lock (&n->mu);
+		do {
+			old_value = ATM_LOAD (&n->waiting);
+		} while (!ATM_CAS (&n->waiting, old_value, old_value-1));
+		if (!n->global_held) {
+			nsync_mu_lock (&cmu->global);
+			n->global_held = 1;
+			n->batch = 0;
+		}
+		cmu->holder = i;
+	}
+}
+
+void nsync_cohort_mu_unlock (nsync_cohort_mu *cmu) {
+	if (cohort_nodes () == 1) {
+		nsync_mu_unlock (&cmu->global);
+	} else {
+		struct nsync_cohort_mu_node_s_ *n = &cmu->node[cmu->holder];
+		if (n->batch < COHORT_BATCH && ATM_LOAD (&n->waiting) != 0) {
+			/* Another thread on this node wants the lock; pass
+			   ownership to it by keeping the global lock.  */
+			n->batch++;
+			nsync_mu_unlock (&n->mu);
+		} else {
+			/* Release the global lock last, so that *cmu is not
+			   touched once another thread may hold it.  */
+			n->global_held = 0;
+			nsync_mu_unlock (&n->mu);
+			nsync_mu_unlock (&cmu->global);
+		}
+	}
+}
+
+NSYNC_CPP_END_
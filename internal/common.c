@@ -75,8 +75,40 @@ NSYNC_CPP_START_
    simultaneously).  One could imagine a queueing mechanism that would
    guarantee to evaluate each condition at most once per wakeup, but that would
    be substantially more complex, and would still degrade if the number of
-   distinct wakeup conditions were high.  So clients are advised to resort to
-   condition variables if they have many distinct wakeup conditions. */
+   distinct wakeup conditions were high.  Clients with many distinct wakeup
+   conditions may instead use keyed waits (nsync_mu_wait_keyed()), whose
+   conditions are reevaluated only when a critical section touches the key
+   (see mu_wait.c), or may resort to condition variables. */
+
+/* Spinloops in nsync wait for other threads to take a few steps, such as
+   releasing a spinlock that guards a waiter queue.  nsync_spin_delay_()
+   first spins with exponential backoff, then yields the processor.
+
+   nsync_spin_test_and_set_or_sleep_() goes further.  If its word has still
+   not changed after SPIN_DELAY_YIELDS yields, the spinlock holder is
+   presumably not running---preempted, perhaps, or in a container whose CPU
+   quota is exhausted---and further yields would only consume processor time
+   it could use.  So the thread then sleeps, for SPIN_DELAY_SLEEP_MIN_US
+   microseconds, doubling each time up to SPIN_DELAY_SLEEP_MAX_US.  The count
+   of yields restarts whenever the word changes, so that only a stalled
+   holder leads to sleeping.
+
+   Nothing wakes such a sleeper when the spinlock is released, so a thread
+   that sleeps here delays every thread waiting for a lock it holds.  So
+   only threads that are themselves waiting, and hold no lock that nsync
+   passed to the wait, may sleep: those removing themselves from a queue
+   after a timeout or cancellation (mu_dequeue(), and the dequeues in
+   nsync_cv_wait_with_deadline() and cv_dequeue()), and those queueing on or
+   leaving a note (nsync_note_enqueue_() and nsync_note_dequeue_()).
+   Everything else---nsync_mu_unlock_slow_(), the enqueues in
+   nsync_mu_wait() and nsync_cv_wait(), nsync_cv_signal() and friends, all of
+   which run with a mutex held---uses nsync_spin_test_and_set_(), which spins
+   and yields but never sleeps, as do the spinloops that retry CAS operations
+   on words that change under ordinary contention.  */
+#define SPIN_DELAY_SPINS 7          /* attempts that spin, rather than yield */
+#define SPIN_DELAY_YIELDS 16        /* attempts that yield, after those */
+#define SPIN_DELAY_SLEEP_MIN_US 16  /* first sleep, after those */
+#define SPIN_DELAY_SLEEP_MAX_US 1024
 
 /* Used in spinloops to delay resumption of the loop.
    Usage:
@@ -85,9 +117,12 @@ NSYNC_CPP_START_
 	  attempts = nsync_spin_delay_ (attempts);
        } */
 unsigned nsync_spin_delay_ (unsigned attempts) {
-	if (attempts < 7) {
+	if (attempts < SPIN_DELAY_SPINS) {
+		/* volatile, so that the loop is not elided where CPU_RELAX_()
+		   is empty. */
 		volatile int i;
 		for (i = 0; i != 1 << attempts; i++) {
+			CPU_RELAX_ ();
 		}
 		attempts++;
 	} else {
@@ -96,20 +131,164 @@ unsigned nsync_spin_delay_ (unsigned attempts) {
 	return (attempts);
 }
 
+/* Like nsync_spin_delay_(), but sleep rather than yield once the count of
+   attempts shows that the thread being waited for is not running.  The
+   caller must reset attempts to SPIN_DELAY_SPINS when it sees progress.  */
+static unsigned spin_delay_or_sleep (unsigned attempts) {
+	if (attempts < SPIN_DELAY_SPINS) {
+		attempts = nsync_spin_delay_ (attempts);
+	} else if (attempts < SPIN_DELAY_SPINS + SPIN_DELAY_YIELDS) {
+		nsync_yield_ ();
+		attempts++;
+	} else {
+		unsigned us = SPIN_DELAY_SLEEP_MIN_US <<
+			      (attempts - (SPIN_DELAY_SPINS + SPIN_DELAY_YIELDS));
+		nsync_time_sleep (nsync_time_us (us));
+		if (us < SPIN_DELAY_SLEEP_MAX_US) {
+			attempts++;
+		}
+	}
+	return (attempts);
+}
+
 /* Spin until (*w & test) == 0, then atomically perform *w = ((*w | set) &
    ~clear), perform an acquire barrier, and return the previous value of *w.
-   */
-uint32_t nsync_spin_test_and_set_ (nsync_atomic_uint32_ *w, uint32_t test,
-				   uint32_t set, uint32_t clear) {
+   Sleep while waiting only if may_sleep!=0.  */
+static uint32_t spin_test_and_set (nsync_atomic_uint32_ *w, uint32_t test,
+				   uint32_t set, uint32_t clear, int may_sleep) {
 	unsigned attempts = 0; /* CV_SPINLOCK retry count */
 	uint32_t old = ATM_LOAD (w);
 	while ((old & test) != 0 || !ATM_CAS_ACQ (w, old, (old | set) & ~clear)) {
-		attempts = nsync_spin_delay_ (attempts);
+		uint32_t prev = old;
+		if (may_sleep) {
+			attempts = spin_delay_or_sleep (attempts);
+		} else {
+			attempts = nsync_spin_delay_ (attempts);
+		}
 		old = ATM_LOAD (w);
+		if (old != prev && attempts > SPIN_DELAY_SPINS) {
+			/* Other threads made progress. */
+			attempts = SPIN_DELAY_SPINS;
+		}
 	}
 	return (old);
 }
 
+/* Spin until (*w & test) == 0, then atomically perform *w = ((*w | set) &
+   ~clear), perform an acquire barrier, and return the previous value of *w.
+   */
+uint32_t nsync_spin_test_and_set_ (nsync_atomic_uint32_ *w, uint32_t test,
+				   uint32_t set, uint32_t clear) {
+	return (spin_test_and_set (w, test, set, clear, 0));
+}
+
+/* Like nsync_spin_test_and_set_(), but sleep if the holder of the spinlock
+   appears not to be running.  For callers that hold no lock another thread
+   might be waiting for.  */
+uint32_t nsync_spin_test_and_set_or_sleep_ (nsync_atomic_uint32_ *w, uint32_t test,
+					    uint32_t set, uint32_t clear) {
+	return (spin_test_and_set (w, test, set, clear, 1));
+}
+
+/* -------------------------------- */
+
+/* Per-thread slots used by the adaptive spinning in nsync_mu_lock_slow_().
+   See the comment on MU_SPIN_BUDGET in common.h. */
+
+union nsync_slot_blocked_u_ nsync_slot_blocked_[1 << MU_SPIN_SLOT_BITS];
+
+static nsync_atomic_uint32_ next_slot; /* used to allocate slots */
+static THREAD_LOCAL uint32_t slot_for_thread; /* 0 until allocated */
+
+/* Return the slot of the calling thread, or 0 if the platform has no cheap
+   thread-local storage.  */
+uint32_t nsync_thread_slot_ (void) {
+	uint32_t slot = 0;
+	if (HAVE_THREAD_LOCAL) {
+		slot = slot_for_thread;
+		if (slot == 0) {
+			uint32_t old_value;
+			do {
+				old_value = ATM_LOAD (&next_slot);
+			} while (!ATM_CAS (&next_slot, old_value, old_value+1));
+			/* Slot 0 is reserved to mean "unknown". */
+			slot = 1 + (old_value % ((1 << MU_SPIN_SLOT_BITS) - 1));
+			slot_for_thread = slot;
+		}
+	}
+	return (slot);
+}
+
+/* Record that the calling thread is about to sleep inside nsync
+   (blocking!=0), or has woken (blocking==0).  */
+void nsync_thread_blocking_ (int blocking) {
+	uint32_t slot = nsync_thread_slot_ ();
+	if (slot != 0) {
+		nsync_atomic_uint32_ *p = &nsync_slot_blocked_[slot].n;
+		uint32_t old_value;
+		do {
+			old_value = ATM_LOAD (p);
+		} while (!ATM_CAS (p, old_value, blocking? old_value+1 : old_value-1));
+	}
+}
+
+/* The most iterations a thread will spin in nsync_mu_lock_slow_() on a
+   multiprocessor.  Must fit in MU_SPIN_BUDGET. */
+#define SPIN_LIMIT_DEFAULT 2000
+
+/* One more than the current spin limit, or 0 if not yet computed. */
+static nsync_atomic_uint32_ spin_limit_plus_one;
+
+/* The number of threads that may spin concurrently, or 0 if not yet computed. */
+static nsync_atomic_uint32_ max_spinners;
+
+/* Compute the default spin parameters from the processor count.  Racing
+   calls compute the same values.  */
+static void spin_params_init (void) {
+	int cpus = nsync_cpu_count_ ();
+	uint32_t spinners = 1;
+	if (cpus > 2) {
+		/* Leave processors for the lock holders. */
+		spinners = (uint32_t) cpus / 2;
+	}
+	ATM_STORE (&max_spinners, spinners);
+	if (ATM_LOAD (&spin_limit_plus_one) == 0) {
+		ATM_STORE (&spin_limit_plus_one, 1 + (cpus == 1? 0 : SPIN_LIMIT_DEFAULT));
+	}
+}
+
+/* Return the maximum number of iterations any thread should spin in
+   nsync_mu_lock_slow_(); zero on a uniprocessor.  */
+uint32_t nsync_mu_spin_limit_ (void) {
+	uint32_t limit_plus_one = ATM_LOAD (&spin_limit_plus_one);
+	if (limit_plus_one == 0) {
+		spin_params_init ();
+		limit_plus_one = ATM_LOAD (&spin_limit_plus_one);
+	}
+	return (limit_plus_one - 1);
+}
+
+/* Return the number of threads that may spin concurrently in
+   nsync_mu_lock_slow_(). */
+uint32_t nsync_mu_max_spinners_ (void) {
+	uint32_t spinners = ATM_LOAD (&max_spinners);
+	if (spinners == 0) {
+		spin_params_init ();
+		spinners = ATM_LOAD (&max_spinners);
+	}
+	return (spinners);
+}
+
+/* Set the limit returned by nsync_mu_spin_limit_(); a negative value
+   restores the default.  */
+void nsync_mu_set_spin_limit_ (int limit) {
+	if (limit < 0) {
+		ATM_STORE (&spin_limit_plus_one, 0);
+	} else {
+		ATM_STORE (&spin_limit_plus_one, 1 + MIN_ ((uint32_t) limit, MU_SPIN_BUDGET));
+	}
+}
+
 /* ====================================================================================== */
 
 struct nsync_waiter_s *nsync_dll_nsync_waiter_ (nsync_dll_element_ *e) {
@@ -136,27 +315,298 @@ waiter *nsync_dll_waiter_samecond_ (nsync_dll_element_ *e) {
 
 /* -------------------------------- */
 
-static nsync_dll_list_ free_waiters = NULL;
+/* Free waiters are kept in WAITER_SHARDS free lists, each protected by its
+   own spinlock and on its own cache line.  A thread uses the shard given by
+   its slot (see nsync_thread_slot_()), so threads seldom contend for a
+   shard's lock.  If its shard is empty, a thread takes a waiter from another
+   shard before allocating.
+
+   Waiters are allocated WAITERS_PER_SLAB at a time, in a block (a slab)
+   aligned to WAITER_ALIGN bytes, with each waiter occupying a whole number
+   of WAITER_ALIGN-byte lines, so that waiters used by different threads do
+   not share a cache line.  The allocating thread is the first to touch the
+   block, so on most systems it is placed on that thread's NUMA node.  The
+   other waiters of the block go on that thread's shard.
+
+   Where thread-local storage is cheap, each thread also keeps one spare
+   waiter besides the one it reserves, which serves the common case of a
+   wait nested within another, such as nsync_wait_n() on a condition variable,
+   without touching the shards at all.
+
+   A slab whose waiters are all free may be deallocated by
+   nsync_waiter_pool_trim(), which is called automatically when a thread
+   exits and more than WAITER_POOL_HIGH waiters are free.  A thread that wakes
+   another (nsync_waiter_wakeup_()) may still touch the woken thread's waiter
+   after the woken thread has returned it to the pool, so each waking thread
+   increments a counter in waking[] while it does so, and
+   nsync_waiter_pool_trim() waits for each counter to be seen zero before
+   deallocating.  Slabs from a client allocator (nsync_malloc_ptr_) are never
+   deallocated.
+
+   Each slab is entered in waiter_slabs[], if there is room, so that its
+   waiters can be named by 32-bit ids:  the waiter j of the slab at index k
+   has id k*WAITERS_PER_SLAB+j+1.  */
+#define WAITER_SHARDS 16
+#define WAITERS_PER_SLAB 16
+#define WAITER_ALIGN 64 /* assumed cache line size */
+#define WAITER_POOL_HIGH 1024 /* free waiters above which thread exit trims */
+#define WAKING_LINES 64
+#define WAITER_SLABS_MAX 4096 /* slabs whose waiters have ids */
+
+/* Bytes occupied by a waiter, and by the header of a slab.  */
+#define WAITER_SIZE ((sizeof (waiter) + WAITER_ALIGN - 1) & ~(size_t) (WAITER_ALIGN - 1))
+#define WAITER_SLAB_HEADER_SIZE ((sizeof (struct waiter_slab_s) + WAITER_ALIGN - 1) & \
+				 ~(size_t) (WAITER_ALIGN - 1))
+
+/* The header of a slab, in the line before its waiters. */
+struct waiter_slab_s {
+	void *mem;      /* address returned by malloc(), or NULL if not to be freed */
+	uint32_t free;  /* waiters found free by nsync_waiter_pool_trim() */
+	struct waiter_slab_s *next; /* in list of slabs to deallocate */
+	uint32_t index; /* 1 + index in waiter_slabs[], or 0 if not there */
+};
+
+static union waiter_shard_u {
+	struct {
+		nsync_atomic_uint32_ mu; /* spinlock; protects fields below */
+		nsync_dll_list_ free;    /* free waiter structs */
+		uint32_t free_count;     /* number of elements of free */
+	} s;
+	char pad[WAITER_ALIGN];
+} waiter_shard[WAITER_SHARDS];
+
+/* waking[i].n counts threads in nsync_waiter_wakeup_() with slots congruent
+   to i, modulo WAKING_LINES.  */
+static union waking_u {
+	nsync_atomic_uint32_ n;
+	char pad[WAITER_ALIGN];
+} waking[WAKING_LINES];
+
+static nsync_atomic_uint32_ waiters_live; /* waiters in slabs not deallocated */
+static nsync_atomic_uint32_ waiters_peak; /* maximum value of waiters_live */
+static nsync_atomic_uint32_ trim_mu;      /* spinlock; held during trimming */
+
+/* Slabs whose waiters have ids, indexed by id; see nsync_waiter_by_id_().  An
+   entry is set before any of the slab's waiters is used, and cleared only
+   when the slab is deallocated.  */
+static struct waiter_slab_s *waiter_slabs[WAITER_SLABS_MAX];
+static nsync_atomic_uint32_ waiter_slabs_mu; /* spinlock; protects changes to waiter_slabs[] */
+
+/* Return the index in waiter_shard[] that the calling thread should use. */
+static uint32_t waiter_shard_index (void) {
+	uint32_t slot = nsync_thread_slot_ ();
+	if (slot == 0) {
+		/* No thread-local storage; threads' stacks are disjoint. */
+		char local;
+		slot = (uint32_t) (((uintptr_t) &local) >> 16);
+	}
+	return (slot % WAITER_SHARDS);
+}
+
+/* Add *w to the free list of shard i. */
+static void waiter_shard_put (uint32_t i, waiter *w) {
+	union waiter_shard_u *ws = &waiter_shard[i];
+	nsync_spin_test_and_set_ (&ws->s.mu, 1, 1, 0);
+	ws->s.free = nsync_dll_make_first_in_list_ (ws->s.free, &w->nw.q);
+	ws->s.free_count++;
+	ATM_STORE_REL (&ws->s.mu, 0); /* release store */
+}
+
+/* Remove and return a waiter from the free list of shard i, or return NULL
+   if it is empty. */
+static waiter *waiter_shard_get (uint32_t i) {
+	union waiter_shard_u *ws = &waiter_shard[i];
+	waiter *w = NULL;
+	if (ws->s.free != NULL) { /* racy check avoids locking empty shards */
+		nsync_dll_element_ *q;
+		nsync_spin_test_and_set_ (&ws->s.mu, 1, 1, 0);
+		q = nsync_dll_first_ (ws->s.free);
+		if (q != NULL) {
+			ws->s.free = nsync_dll_remove_ (ws->s.free, q);
+			ws->s.free_count--;
+			w = DLL_WAITER (q);
+		}
+		ATM_STORE_REL (&ws->s.mu, 0); /* release store */
+	}
+	return (w);
+}
+
+/* Return the number of waiters on the shards' free lists.  The result is
+   approximate, since the shards are not locked.  */
+static uint32_t waiters_free (void) {
+	uint32_t n = 0;
+	uint32_t i;
+	for (i = 0; i != WAITER_SHARDS; i++) {
+		n += waiter_shard[i].s.free_count;
+	}
+	return (n);
+}
+
+void nsync_waiter_wakeup_ (struct nsync_waiter_s *nw) {
+	nsync_atomic_uint32_ *n = &waking[nsync_thread_slot_ () % WAKING_LINES].n;
+	nsync_semaphore *sem = nw->sem; /* *nw may be gone once waiting is 0 */
+	uint32_t old_value;
+	do {
+		old_value = ATM_LOAD (n);
+	} while (!ATM_CAS (n, old_value, old_value+1));
+	ATM_STORE_REL (&nw->waiting, 0);
+	nsync_mu_semaphore_v (sem);
+	do {
+		old_value = ATM_LOAD (n);
+	} while (!ATM_CAS_REL (n, old_value, old_value-1));
+}
+
+/* The number of waiters nsync_waiter_wakeup_list_() wakes at a time.  It is
+   large enough that the readers released by a writer are usually woken by a
+   single nsync_mu_semaphore_v_n(), which can wake all those queued on one
+   mutex together.  */
+#define WAKE_BATCH 256
+
+void nsync_waiter_wakeup_list_ (nsync_dll_list_ list) {
+	nsync_atomic_uint32_ *n = &waking[nsync_thread_slot_ () % WAKING_LINES].n;
+	uint32_t old_value;
+	do {
+		old_value = ATM_LOAD (n);
+	} while (!ATM_CAS (n, old_value, old_value+1));
+	while (!nsync_dll_is_empty_ (list)) {
+		nsync_semaphore *sem[WAKE_BATCH];
+		nsync_dll_element_ *p;
+		int count = 0;
+		/* Each waiter is unlinked, and its semaphore noted, before it may
+		   reuse its link.  */
+		while (count != WAKE_BATCH && (p = nsync_dll_first_ (list)) != NULL) {
+			struct nsync_waiter_s *nw = DLL_NSYNC_WAITER (p);
+			list = nsync_dll_remove_ (list, p);
+			sem[count++] = nw->sem;
+			ATM_STORE_REL (&nw->waiting, 0);
+		}
+		nsync_mu_semaphore_v_n (sem, count);
+	}
+	do {
+		old_value = ATM_LOAD (n);
+	} while (!ATM_CAS_REL (n, old_value, old_value-1));
+}
+
+/* Add n to waiters_live, and update waiters_peak. */
+static void waiters_live_add (uint32_t n) {
+	uint32_t old_value;
+	do {
+		old_value = ATM_LOAD (&waiters_live);
+	} while (!ATM_CAS (&waiters_live, old_value, old_value+n));
+	old_value += n;
+	while (old_value > ATM_LOAD (&waiters_peak)) {
+		uint32_t peak = ATM_LOAD (&waiters_peak);
+		if (old_value > peak) {
+			ATM_CAS (&waiters_peak, peak, old_value);
+		}
+	}
+}
+
+/* Deallocate the slabs of which all the waiters are free, except those from a
+   client allocator, and return the number of waiters deallocated.  */
+uint32_t nsync_waiter_pool_trim (void) {
+	struct waiter_slab_s *dead = NULL;
+	uint32_t freed = 0;
+	uint32_t i;
+	IGNORE_RACES_START ();
+	nsync_spin_test_and_set_ (&trim_mu, 1, 1, 0);
+	for (i = 0; i != WAITER_SHARDS; i++) {
+		nsync_spin_test_and_set_ (&waiter_shard[i].s.mu, 1, 1, 0);
+	}
+	/* Count the free waiters of each slab, listing the slabs that are
+	   entirely free.  */
+	for (i = 0; i != WAITER_SHARDS; i++) {
+		nsync_dll_element_ *q;
+		for (q = nsync_dll_first_ (waiter_shard[i].s.free); q != NULL;
+		     q = nsync_dll_next_ (waiter_shard[i].s.free, q)) {
+			struct waiter_slab_s *slab = DLL_WAITER (q)->slab;
+			slab->free++;
+			if (slab->free == WAITERS_PER_SLAB && slab->mem != NULL) {
+				slab->next = dead;
+				dead = slab;
+			}
+		}
+	}
+	/* Remove the waiters of those slabs, and reset the counts.  */
+	for (i = 0; i != WAITER_SHARDS; i++) {
+		union waiter_shard_u *ws = &waiter_shard[i];
+		nsync_dll_element_ *q;
+		nsync_dll_element_ *next;
+		for (q = nsync_dll_first_ (ws->s.free); q != NULL; q = next) {
+			struct waiter_slab_s *slab = DLL_WAITER (q)->slab;
+			next = nsync_dll_next_ (ws->s.free, q);
+			if (slab->free == WAITERS_PER_SLAB && slab->mem != NULL) {
+				ws->s.free = nsync_dll_remove_ (ws->s.free, q);
+				ws->s.free_count--;
+				freed++;
+			} else {
+				slab->free = 0;
+			}
+		}
+	}
+	for (i = WAITER_SHARDS; i != 0; i--) {
+		ATM_STORE_REL (&waiter_shard[i-1].s.mu, 0); /* release store */
+	}
+	if (dead != NULL) {
+		unsigned attempts;
+		uint32_t old_value;
+		/* Wait for threads that may still be waking the waiters. */
+		for (i = 0; i != WAKING_LINES; i++) {
+			attempts = 0;
+			while (ATM_LOAD_ACQ (&waking[i].n) != 0) {
+				attempts = nsync_spin_delay_ (attempts);
+			}
+		}
+		nsync_spin_test_and_set_ (&waiter_slabs_mu, 1, 1, 0);
+		while (dead != NULL) {
+			struct waiter_slab_s *slab = dead;
+			dead = dead->next;
+			if (slab->index != 0) {
+				waiter_slabs[slab->index - 1] = NULL;
+			}
+			free (slab->mem);
+		}
+		ATM_STORE_REL (&waiter_slabs_mu, 0); /* release store */
+		do {
+			old_value = ATM_LOAD (&waiters_live);
+		} while (!ATM_CAS (&waiters_live, old_value, old_value-freed));
+	}
+	ATM_STORE_REL (&trim_mu, 0); /* release store */
+	IGNORE_RACES_END ();
+	return (freed);
+}
 
-/* free_waiters points to a doubly-linked list of free waiter structs. */
-static nsync_atomic_uint32_ free_waiters_mu; /* spinlock; protects free_waiters */
+/* Fill in *stats with statistics about the waiter pool. */
+void nsync_waiter_pool_stats (struct nsync_waiter_pool_stats_s *stats) {
+	stats->live = ATM_LOAD (&waiters_live);
+	stats->free = waiters_free ();
+	stats->peak = ATM_LOAD (&waiters_peak);
+}
 
 static THREAD_LOCAL waiter *waiter_for_thread;
+static THREAD_LOCAL waiter *spare_waiter_for_thread; /* free, unless NULL */
 static void waiter_destroy (void *v) {
 	waiter *w = (waiter *) v;
+	waiter *spare = spare_waiter_for_thread;
 	/* Reset waiter_for_thread in case another thread-local variable reuses
 	   the waiter in its destructor while the waiter is taken by the other
-	   thread from free_waiters. This can happen as the destruction order
+	   thread from the free lists. This can happen as the destruction order
 	   of thread-local variables can be arbitrary in some platform e.g.
 	   POSIX.  */
 	waiter_for_thread = NULL;
+	spare_waiter_for_thread = NULL;
 	IGNORE_RACES_START ();
 	ASSERT ((w->flags & (WAITER_RESERVED|WAITER_IN_USE)) == WAITER_RESERVED);
 	w->flags &= ~WAITER_RESERVED;
-	nsync_spin_test_and_set_ (&free_waiters_mu, 1, 1, 0);
-	free_waiters = nsync_dll_make_first_in_list_ (free_waiters, &w->nw.q);
-	ATM_STORE_REL (&free_waiters_mu, 0); /* release store */
+	waiter_shard_put (waiter_shard_index (), w);
+	if (spare != NULL) {
+		waiter_shard_put (waiter_shard_index (), spare);
+	}
 	IGNORE_RACES_END ();
+	/* Threads often exit in bursts, leaving their waiters free. */
+	if (waiters_free () > WAITER_POOL_HIGH && ATM_LOAD (&trim_mu) == 0) {
+		nsync_waiter_pool_trim ();
+	}
 }
 
 /* If non-nil, nsync_malloc_ptr_ points to a malloc-like routine that allocated
@@ -167,10 +617,81 @@ static void waiter_destroy (void *v) {
    client declaration that uses an initializer.  */
 void *(*nsync_malloc_ptr_) (size_t size);
 
+/* Enter *slab in waiter_slabs[], if there is room, and return
+   1 + its index there, or 0.  */
+static uint32_t waiter_slab_register (struct waiter_slab_s *slab) {
+	uint32_t index = 0;
+	uint32_t k;
+	nsync_spin_test_and_set_ (&waiter_slabs_mu, 1, 1, 0);
+	for (k = 0; k != WAITER_SLABS_MAX && index == 0; k++) {
+		if (waiter_slabs[k] == NULL) {
+			waiter_slabs[k] = slab;
+			index = k + 1;
+		}
+	}
+	ATM_STORE_REL (&waiter_slabs_mu, 0); /* release store */
+	return (index);
+}
+
+waiter *nsync_waiter_by_id_ (uint32_t id) {
+	char *base = (char *) waiter_slabs[(id - 1) / WAITERS_PER_SLAB];
+	return ((waiter *) (base + WAITER_SLAB_HEADER_SIZE +
+			    ((id - 1) % WAITERS_PER_SLAB) * WAITER_SIZE));
+}
+
+/* Allocate a slab of WAITERS_PER_SLAB new waiters, put all but one on
+   shard i, and return the remaining one.  */
+static waiter *waiter_slab_new (uint32_t i) {
+	size_t size = WAITER_SIZE;
+	size_t header_size = WAITER_SLAB_HEADER_SIZE;
+	size_t slab_size = header_size + size * WAITERS_PER_SLAB + WAITER_ALIGN - 1;
+	struct waiter_slab_s *slab;
+	char *mem;
+	char *base;
+	waiter *w = NULL;
+	int j;
+	if (nsync_malloc_ptr_ != NULL) { /* Use client's malloc() */
+		mem = (char *) (*nsync_malloc_ptr_) (slab_size);
+	} else {  /* standard malloc () */
+		mem = (char *) malloc (slab_size);
+	}
+	base = mem + ((WAITER_ALIGN - (((uintptr_t) mem) & (WAITER_ALIGN - 1))) &
+		      (WAITER_ALIGN - 1));
+	slab = (struct waiter_slab_s *) base;
+	slab->mem = (nsync_malloc_ptr_ != NULL? NULL : (void *) mem);
+	slab->free = 0;
+	slab->next = NULL;
+	slab->index = waiter_slab_register (slab);
+	for (j = 0; j != WAITERS_PER_SLAB; j++) {
+		w = (waiter *) (base + header_size + j * size);
+		w->tag = WAITER_TAG;
+		w->nw.tag = NSYNC_WAITER_TAG;
+		nsync_mu_semaphore_init (&w->sem);
+		w->nw.sem = &w->sem;
+		nsync_dll_init_ (&w->nw.q, &w->nw);
+		NSYNC_ATOMIC_UINT32_STORE_ (&w->nw.waiting, 0);
+		w->nw.flags = NSYNC_WAITER_FLAG_MUCV;
+		ATM_STORE (&w->remove_count, 0);
+		nsync_dll_init_ (&w->same_condition, w);
+		w->slab = slab;
+		w->id = 0;
+		if (slab->index != 0) {
+			w->id = (slab->index - 1) * WAITERS_PER_SLAB + j + 1;
+		}
+		w->pending_next = 0;
+		w->run = NULL;
+		w->flags = 0;
+		if (j != WAITERS_PER_SLAB - 1) {
+			waiter_shard_put (i, w);
+		}
+	}
+	waiters_live_add (WAITERS_PER_SLAB);
+	return (w);
+}
+
 /* Return a pointer to an unused waiter struct.
    Ensures that the enclosed timer is stopped and its channel drained. */
 waiter *nsync_waiter_new_ (void) {
-	nsync_dll_element_ *q;
 	waiter *tw;
 	waiter *w;
 	if (HAVE_THREAD_LOCAL) {
@@ -181,29 +702,20 @@ waiter *nsync_waiter_new_ (void) {
 	w = tw;
 	if (w == NULL || (w->flags & (WAITER_RESERVED|WAITER_IN_USE)) != WAITER_RESERVED) {
 		w = NULL;
-		nsync_spin_test_and_set_ (&free_waiters_mu, 1, 1, 0);
-		q = nsync_dll_first_ (free_waiters);
-		if (q != NULL) { /* If free list is non-empty, dequeue an item. */
-			free_waiters = nsync_dll_remove_ (free_waiters, q);
-			w = DLL_WAITER (q);
+		if (HAVE_THREAD_LOCAL && tw != NULL) {
+			w = spare_waiter_for_thread;
+			spare_waiter_for_thread = NULL;
 		}
-		ATM_STORE_REL (&free_waiters_mu, 0); /* release store */
-		if (w == NULL) { /* If free list was empty, allocate an item. */
-			if (nsync_malloc_ptr_ != NULL) { /* Use client's malloc() */
-				w = (waiter *) (*nsync_malloc_ptr_) (sizeof (*w));
-			} else {  /* standard malloc () */
-				w = (waiter *) malloc (sizeof (*w));
+		if (w == NULL) {
+			uint32_t i = waiter_shard_index ();
+			uint32_t j;
+			w = waiter_shard_get (i);
+			for (j = 1; w == NULL && j != WAITER_SHARDS; j++) {
+				w = waiter_shard_get ((i + j) % WAITER_SHARDS);
+			}
+			if (w == NULL) { /* If free lists were empty, allocate. */
+				w = waiter_slab_new (i);
 			}
-			w->tag = WAITER_TAG;
-			w->nw.tag = NSYNC_WAITER_TAG;
-			nsync_mu_semaphore_init (&w->sem);
-			w->nw.sem = &w->sem;
-			nsync_dll_init_ (&w->nw.q, &w->nw);
-			NSYNC_ATOMIC_UINT32_STORE_ (&w->nw.waiting, 0);
-			w->nw.flags = NSYNC_WAITER_FLAG_MUCV;
-			ATM_STORE (&w->remove_count, 0);
-			nsync_dll_init_ (&w->same_condition, w);
-			w->flags = 0;
 		}
 		if (tw == NULL) {
 			w->flags |= WAITER_RESERVED;
@@ -221,10 +733,13 @@ waiter *nsync_waiter_new_ (void) {
 void nsync_waiter_free_ (waiter *w) {
 	ASSERT ((w->flags & WAITER_IN_USE) != 0);
 	w->flags &= ~WAITER_IN_USE;
-	if ((w->flags & WAITER_RESERVED) == 0) {
-		nsync_spin_test_and_set_ (&free_waiters_mu, 1, 1, 0);
-		free_waiters = nsync_dll_make_first_in_list_ (free_waiters, &w->nw.q);
-		ATM_STORE_REL (&free_waiters_mu, 0); /* release store */
+	if ((w->flags & WAITER_RESERVED) != 0) {
+		/* kept by its thread */
+	} else if (HAVE_THREAD_LOCAL && spare_waiter_for_thread == NULL &&
+		   waiter_for_thread != NULL) {
+		spare_waiter_for_thread = w;
+	} else {
+		waiter_shard_put (waiter_shard_index (), w);
 	}
 }
 
@@ -253,4 +768,31 @@ static lock_type Xreader_type = {
 };
 lock_type *nsync_reader_type_ = &Xreader_type;
 
+
+/* ulock_type points to a lock_type that describes how to manipulate a mu for a
+   holder of an upgradable read lock. */
+static lock_type Xulock_type = {
+	MU_UZERO_TO_ACQUIRE,
+	MU_UADD_TO_ACQUIRE,
+	MU_UHELD_IF_NON_ZERO,
+	MU_USET_WHEN_WAITING,
+	MU_UCLEAR_ON_ACQUIRE,
+	MU_UCLEAR_ON_UNCONTENDED_RELEASE
+};
+lock_type *nsync_ulock_type_ = &Xulock_type;
+
+
+/* downgrade_type points to a lock_type whose release converts a write lock on a
+   mu into a read lock.  Its release leaves the read lock held, so a writer
+   released with it must clear MU_ALL_FALSE as any writer would.  */
+static lock_type Xdowngrade_type = {
+	MU_WZERO_TO_ACQUIRE,
+	MU_DADD_TO_ACQUIRE,
+	MU_WHELD_IF_NON_ZERO,
+	MU_WSET_WHEN_WAITING,
+	MU_WCLEAR_ON_ACQUIRE,
+	MU_WCLEAR_ON_UNCONTENDED_RELEASE
+};
+lock_type *nsync_downgrade_type_ = &Xdowngrade_type;
+
 NSYNC_CPP_END_
@@ -70,6 +70,25 @@ NSYNC_CPP_START_
 /* Yield the CPU. Platform specific. */
 void nsync_yield_ (void);
 
+/* Return the number of processors available, or 0 if unknown.
+   Platform specific. */
+int nsync_cpu_count_ (void);
+
+/* Return the number of NUMA nodes (at least 1), and the node of the processor
+   on which the calling thread is running (0 if unknown).  Platform specific. */
+int nsync_numa_node_count_ (void);
+int nsync_numa_node_ (void);
+
+/* Return the processor on which the calling thread is running (0 if
+   unknown).  Platform specific. */
+int nsync_cpu_ (void);
+
+/* Hint to the processor that the caller is in a spin loop, if the
+   architecture has such a hint. */
+#if !defined(CPU_RELAX_)
+#define CPU_RELAX_() do { } while (0)
+#endif
+
 /* Retrieve the per-thread cache of the waiter object.  Platform specific. */
 void *nsync_per_thread_waiter_ (void (*dest) (void *));
 
@@ -90,6 +109,12 @@ unsigned nsync_spin_delay_ (unsigned attempts);
 uint32_t nsync_spin_test_and_set_ (nsync_atomic_uint32_ *w, uint32_t test,
 				   uint32_t set, uint32_t clear);
 
+/* Like nsync_spin_test_and_set_(), but sleep if the holder of the spinlock
+   appears not to be running.  The caller must hold no nsync lock, since
+   nothing wakes the sleeper when the spinlock is released.  */
+uint32_t nsync_spin_test_and_set_or_sleep_ (nsync_atomic_uint32_ *w, uint32_t test,
+					    uint32_t set, uint32_t clear);
+
 /* Abort after printing the nul-temrinated string s[]. */
 void nsync_panic_ (const char *s);
 
@@ -105,6 +130,12 @@ void nsync_panic_ (const char *s);
    - At least one of the MU_WLOCK or MU_RLOCK_FIELD fields must be zero.
    - MU_WLOCK indicates that a write lock is held.
    - MU_RLOCK_FIELD is a count of readers with read locks.
+   - MU_ULOCK indicates that some thread holds an upgradable read lock,
+     which excludes other such threads.  The thread is also counted in
+     MU_RLOCK_FIELD, except while MU_UPGRADE is set.
+   - MU_UPGRADE indicates that the thread holding MU_ULOCK is converting it
+     to a write lock.  It excludes other threads as a write lock would, but
+     waits for the remaining readers to release.
 
    - MU_SPINLOCK represents a spinlock that must be held when manipulating the
      waiter queue.
@@ -132,6 +163,11 @@ void nsync_panic_ (const char *s);
      writer since then.  This allows a reader lock to be released without
      testing conditions again.  It is legal to fail to set this, but illegal
      to set it inappropriately.
+   - MU_KEYS_FALSE, when set with MU_ALL_FALSE, indicates further that every
+     waiter in that scan had a keyed condition (see nsync_mu_wait_keyed()), and
+     no key has been touched since.  This allows a writer lock to be released
+     without testing conditions again.  nsync_mu_touch_key() clears it.  It is
+     ignored if MU_ALL_FALSE is clear.
  */
 #define MU_WLOCK ((uint32_t) (1 << 0)) /* writer lock is held. */
 #define MU_SPINLOCK ((uint32_t) (1 << 1)) /* spinlock is held (protects waiters). */
@@ -141,12 +177,15 @@ void nsync_panic_ (const char *s);
 #define MU_WRITER_WAITING ((uint32_t) (1 << 5)) /* there is a writer waiting */
 #define MU_LONG_WAIT ((uint32_t) (1 << 6)) /* the waiter at the head of the queue has been waiting a long time */
 #define MU_ALL_FALSE ((uint32_t) (1 << 7)) /* all waiter conditions are false */
-#define MU_RLOCK ((uint32_t) (1 << 8)) /* low-order bit of reader count, which uses rest of word */
+#define MU_ULOCK ((uint32_t) (1 << 8)) /* upgradable read lock is held */
+#define MU_UPGRADE ((uint32_t) (1 << 9)) /* upgradable read lock is being upgraded */
+#define MU_KEYS_FALSE ((uint32_t) (1 << 10)) /* all waiter conditions are keyed, and false */
+#define MU_RLOCK ((uint32_t) (1 << 11)) /* low-order bit of reader count, which uses rest of word */
 
 /* The constants below are derived from those above. */
 #define MU_RLOCK_FIELD (~(uint32_t) (MU_RLOCK - 1)) /* mask of reader count field */
 
-#define MU_ANY_LOCK (MU_WLOCK | MU_RLOCK_FIELD) /* mask for any lock held */
+#define MU_ANY_LOCK (MU_WLOCK | MU_RLOCK_FIELD | MU_UPGRADE) /* mask for any lock held */
 
 #define MU_WZERO_TO_ACQUIRE (MU_ANY_LOCK | MU_LONG_WAIT) /* bits to be zero to acquire write lock */
 #define MU_WADD_TO_ACQUIRE (MU_WLOCK)         /* add to acquire a write lock */
@@ -156,13 +195,24 @@ void nsync_panic_ (const char *s);
 #define MU_WCLEAR_ON_UNCONTENDED_RELEASE (MU_ALL_FALSE) /* clear if a writer releases w/o waking */
 
 /* bits to be zero to acquire read lock */
-#define MU_RZERO_TO_ACQUIRE (MU_WLOCK | MU_WRITER_WAITING | MU_LONG_WAIT)
+#define MU_RZERO_TO_ACQUIRE (MU_WLOCK | MU_UPGRADE | MU_WRITER_WAITING | MU_LONG_WAIT)
 #define MU_RADD_TO_ACQUIRE (MU_RLOCK)         /* add to acquire a read lock */
 #define MU_RHELD_IF_NON_ZERO (MU_RLOCK_FIELD) /* if any of these bits are set, read lock is held */
 #define MU_RSET_WHEN_WAITING (MU_WAITING)     /* indicate that some thread is waiting */
 #define MU_RCLEAR_ON_ACQUIRE ((uint32_t) 0)              /* nothing to clear when a read acquires */
 #define MU_RCLEAR_ON_UNCONTENDED_RELEASE ((uint32_t) 0)  /* nothing to clear when a read releases */
 
+/* bits to be zero to acquire an upgradable read lock */
+#define MU_UZERO_TO_ACQUIRE (MU_RZERO_TO_ACQUIRE | MU_ULOCK)
+#define MU_UADD_TO_ACQUIRE (MU_RLOCK + MU_ULOCK) /* add to acquire an upgradable read lock */
+#define MU_UHELD_IF_NON_ZERO (MU_ULOCK)       /* if any of these bits are set, upgradable lock is held */
+#define MU_USET_WHEN_WAITING (MU_WAITING)     /* indicate that some thread is waiting */
+#define MU_UCLEAR_ON_ACQUIRE ((uint32_t) 0)              /* nothing to clear when acquired */
+#define MU_UCLEAR_ON_UNCONTENDED_RELEASE ((uint32_t) 0)  /* nothing to clear when released */
+
+/* subtract to convert a write lock to a read lock */
+#define MU_DADD_TO_ACQUIRE (MU_WLOCK - MU_RLOCK)
+
 
 /* A lock_type holds the values needed to manipulate a mu in some mode (read or
    write).  This allows some of the code to be generic, and parameterized by
@@ -183,12 +233,183 @@ extern lock_type *nsync_writer_type_;
 /* reader_type points to a lock_type that describes how to manipulate a mu for a reader. */
 extern lock_type *nsync_reader_type_;
 
+/* ulock_type points to a lock_type that describes how to manipulate a mu for a
+   holder of an upgradable read lock. */
+extern lock_type *nsync_ulock_type_;
+
+/* downgrade_type points to a lock_type whose release converts a write lock on a
+   mu into a read lock.  It is used only with nsync_mu_unlock_slow_(). */
+extern lock_type *nsync_downgrade_type_;
+
+/* ---------- */
+
+/* Adaptive spinning in nsync_mu_lock_slow_().
+
+   Before queueing itself, a thread that finds an nsync_mu held may spin
+   briefly, on the theory that a short critical section will end sooner than
+   a sleep/wakeup round trip through the semaphore.  Spinning is pointless
+   if the holder is itself blocked, so each thread is given a small "slot"
+   number, which a writer records in nsync_mu.spin when it acquires, and the
+   thread counts itself in nsync_slot_blocked_[slot].n whenever it sleeps
+   inside nsync.  Several threads may share a slot; that merely makes spinners
+   give up more readily.
+
+   nsync_mu.spin holds:
+   - in its top MU_SPIN_SLOT_BITS bits, the slot of the last thread to acquire
+     the mutex in write mode (zero if unknown),
+   - the MU_FAIR bit, set by nsync_mu_set_fair(),
+   - the reader-bias state (see below),
+   - in its low MU_SPIN_BUDGET_BITS bits, the number of iterations a thread
+     should spin before blocking, learned from recent acquisitions (zero if
+     nothing has been learned yet).
+   It is written only by a thread that holds the mutex in write mode, except
+   that a thread holding it in read mode via mu->word may use CAS to update
+   the MU_RBIAS_READS field and set MU_RBIAS.  */
+#define MU_SPIN_SLOT_BITS 10
+#define MU_SPIN_SLOT_SHIFT (32 - MU_SPIN_SLOT_BITS)
+#define MU_SPIN_SLOT ((uint32_t) ~(uint32_t) 0 << MU_SPIN_SLOT_SHIFT) /* mask of owner's slot */
+#define MU_FAIR ((uint32_t) 1 << (MU_SPIN_SLOT_SHIFT - 1)) /* unlock hands off to the first waiter */
+#define MU_RBIAS_MODE ((uint32_t) 1 << (MU_SPIN_SLOT_SHIFT - 2)) /* set by nsync_mu_set_reader_bias() */
+#define MU_RBIAS ((uint32_t) 1 << (MU_SPIN_SLOT_SHIFT - 3)) /* readers may use the visible-readers table */
+#define MU_SPIN_BUDGET_BITS 12
+#define MU_SPIN_BUDGET ((uint32_t) ((1 << MU_SPIN_BUDGET_BITS) - 1)) /* mask of spin budget */
+#define MU_RBIAS_READ ((uint32_t) 1 << MU_SPIN_BUDGET_BITS) /* unit of MU_RBIAS_READS */
+#define MU_RBIAS_READS ((uint32_t) (MU_RBIAS - MU_RBIAS_READ)) /* mask of reads since last write */
+
+/* nsync_slot_blocked_[i].n counts threads with slot i that are blocked in
+   nsync.  Each count has a cache line to itself, because a thread updates its
+   count around every sleep.  */
+extern union nsync_slot_blocked_u_ {
+	nsync_atomic_uint32_ n;
+	char pad[64]; /* assumed cache line size */
+} nsync_slot_blocked_[1 << MU_SPIN_SLOT_BITS];
+
+/* Return the slot of the calling thread, or 0 if the platform has no cheap
+   thread-local storage.  */
+uint32_t nsync_thread_slot_ (void);
+
+/* Record that the calling thread is about to sleep inside nsync
+   (blocking!=0), or has woken (blocking==0).  */
+void nsync_thread_blocking_ (int blocking);
+
+/* Return the maximum number of iterations any thread should spin in
+   nsync_mu_lock_slow_(); zero on a uniprocessor.  */
+uint32_t nsync_mu_spin_limit_ (void);
+
+/* Return the number of threads that may spin concurrently in
+   nsync_mu_lock_slow_(), so that on a loaded machine spinners do not keep
+   lock holders from running.  */
+uint32_t nsync_mu_max_spinners_ (void);
+
+/* Set the limit returned by nsync_mu_spin_limit_(); a negative value
+   restores the default.  For benchmarks and tests.  */
+void nsync_mu_set_spin_limit_ (int limit);
+
+/* Record the calling thread as the writer holding *mu, and restart the count
+   of reads since the last write.  mu->spin is written only if that changes
+   it, so a thread that reacquires a mutex it last held does not dirty the
+   cache line again.  */
+#define MU_SET_OWNER_(mu_) \
+	do { \
+		if (HAVE_THREAD_LOCAL) { \
+			uint32_t old_spin_ = ATM_LOAD (&(mu_)->spin); \
+			uint32_t new_spin_ = (old_spin_ & ~(MU_SPIN_SLOT | MU_RBIAS_READS)) | \
+					     (nsync_thread_slot_ () << MU_SPIN_SLOT_SHIFT); \
+			if (new_spin_ != old_spin_) { \
+				ATM_STORE (&(mu_)->spin, new_spin_); \
+			} \
+		} \
+	} while (0)
+
+/* Reader bias (see nsync_mu_set_reader_bias()).
+
+   While MU_RBIAS is set in mu->spin, a thread may acquire *mu in read mode
+   without touching mu->word, by publishing (thread, mu) in an entry of a
+   global visible-readers table; the entries used by a thread lie on a cache
+   line shared with few other threads.  A thread acquiring *mu in write mode
+   first acquires it via mu->word as usual, which stops further readers using
+   mu->word, and then revokes the bias:  it clears MU_RBIAS and waits until
+   no table entry names *mu.  While MU_RBIAS_MODE is set and MU_RBIAS is clear,
+   each read acquisition via mu->word increments MU_RBIAS_READS, and writers
+   reset it; once enough reads occur without an intervening write, a reader
+   sets MU_RBIAS again.  Bias is used only if HAVE_THREAD_LOCAL.  */
+
+/* Called by a thread that has just acquired *mu in write mode.  If MU_RBIAS is
+   set, revoke the bias and wait for threads holding *mu in read mode via the
+   visible-readers table to release it, until abs_deadline expires or
+   cancel_note is notified.  Return 0 if they released it, and otherwise
+   ETIMEDOUT or ECANCELED; then MU_RBIAS is left clear, and the caller must
+   set it again before releasing *mu.  */
+int nsync_mu_rbias_revoke_ (nsync_mu *mu, nsync_time abs_deadline, nsync_note cancel_note);
+
+/* Revoke any reader bias on *mu; see nsync_mu_rbias_revoke_().  */
+#define MU_RBIAS_REVOKE_(mu_) \
+	do { \
+		if ((ATM_LOAD (&(mu_)->spin) & MU_RBIAS) != 0) { \
+			nsync_mu_rbias_revoke_ ((mu_), nsync_time_no_deadline, NULL); \
+		} \
+	} while (0)
+
+/* Return whether the calling thread holds *mu in read mode via the
+   visible-readers table.  */
+int nsync_mu_rbias_held_ (const nsync_mu *mu);
+
+/* If the calling thread holds *mu in read mode via the visible-readers table,
+   release and reacquire it so that the hold is recorded in mu->word, and return
+   non-zero; otherwise return 0.  Other threads may acquire *mu in write mode
+   during the call.  Used where the mode in which *mu is held must be deduced
+   from mu->word.  */
+int nsync_mu_rbias_unbias_ (nsync_mu *mu);
+
+/* Whether a release of *mu that leaves mu->word==w_ must wake a thread in
+   nsync_mu_upgrade(), which is waiting for the last other reader to leave.  */
+#define MU_UPGRADE_READY_(w_) (((w_) & (MU_UPGRADE | MU_WLOCK | MU_RLOCK_FIELD)) == MU_UPGRADE)
+
+/* Wake the thread waiting in nsync_mu_upgrade (mu).  Does not access *mu,
+   which the woken thread may free at once.  */
+void nsync_mu_upgrade_wake_ (nsync_mu *mu);
+
+/* Acquire *mu in read mode, recording the hold in mu->word even if *mu is
+   reader-biased.  */
+void nsync_mu_rlock_word_ (nsync_mu *mu);
+
+/* ---------- */
+
+/* For tests and benchmarks:  make nsync_cohort_mu behave as though the machine
+   had the specified number of NUMA nodes, with threads assigned to nodes by
+   their slots (see nsync_thread_slot_()).  A negative value restores the
+   default.  Requires that no nsync_cohort_mu be in use.  */
+void nsync_cohort_mu_set_nodes_ (int nodes);
+
 /* ---------- */
 
 /* Bits in nsync_cv.word */
 
 #define CV_SPINLOCK ((uint32_t) (1 << 0)) /* protects waiters */
 #define CV_NON_EMPTY ((uint32_t) (1 << 1)) /* waiters list is non-empty */
+#define CV_POLICY ((uint32_t) (3 << 2)) /* NSYNC_CV_* wakeup policy, shifted */
+#define CV_POLICY_SHIFT 2
+#define CV_LIFO ((uint32_t) (1 << 2)) /* NSYNC_CV_LIFO << CV_POLICY_SHIFT */
+#define CV_CPU ((uint32_t) (2 << 2))  /* NSYNC_CV_CPU << CV_POLICY_SHIFT */
+
+/* Under CV_LIFO and CV_CPU, waiters are queued at the head of
+   nsync_cv.waiters, rather than at the tail, so nsync_cv_signal() finds the
+   most recent first.  Under CV_CPU, it looks at up to CV_CPU_SCAN of them for
+   one that was on the caller's processor.  */
+#define CV_CPU_SCAN 8
+
+/* Set while some waiter on nsync_cv.waiters may be in nsync_cv_wait_pred(),
+   whose predicate nsync_cv_signal() and nsync_cv_broadcast() must evaluate.
+   It is cleared only when the list empties.  */
+#define CV_PRED ((uint32_t) (1 << 4))
+
+/* The remaining bits of nsync_cv.word hold the broadcast generation, which
+   nsync_cv_broadcast() advances as it detaches the whole waiter list.  A waiter
+   records the generation in nw.cv_gen when it is queued, so it is on
+   nsync_cv.waiters only while the two match, and (for a waiter embedded in a
+   waiter struct) its remove_count is unchanged.  */
+#define CV_GEN_INC ((uint32_t) (1 << 5)) /* increment of the generation */
+#define CV_GEN_MASK (~(CV_GEN_INC - 1))  /* bits holding the generation */
 
 /* ---------- */
 
@@ -197,6 +418,8 @@ struct wait_condition_s {
 	int (*f) (const void *v);
 	const void *v;
 	int (*eq) (const void *a, const void *b);
+	const void *key;  /* if non-NULL, f need be evaluated only if key touched */
+	uint32_t key_gen; /* generation of key when f was last evaluated */
 };
 
 /* Return whether wait conditions *a_ and *b_ are equal and non-null. */
@@ -209,7 +432,7 @@ struct wait_condition_s {
 
 /* ---------- */
 
-#define NOTIFIED_TIME(n_) (ATM_LOAD_ACQ (&(n_)->notified) != 0? nsync_time_zero : \
+#define NOTIFIED_TIME(n_) ((ATM_LOAD_ACQ (&(n_)->notified) & NOTE_NOTIFIED) != 0? nsync_time_zero : \
 			   (n_)->expiry_time_valid? (n_)->expiry_time : nsync_time_no_deadline)
 
 /* A waiter represents a single waiter on a cv or a mu.
@@ -223,24 +446,44 @@ struct wait_condition_s {
 
    To wakeup:
    Remove *w from the relevant queue then:
+    nsync_waiter_wakeup_ (&w.nw);
+   which does:
     ATM_STORE_REL (&w.waiting, 0);
-    nsync_mu_semaphore_v (&w.sem); */
+    nsync_mu_semaphore_v (&w.sem);
+
+   The fields are ordered by use, since waiters are allocated on cache-line
+   boundaries (see internal/common.c).  The first line holds what the waiting
+   and waking threads touch on every wait:  the queue link, the waiting flag,
+   the remove count, the flags and, where it is small, the semaphore.  The
+   second holds what unlockers examine while scanning a queue.  The rest,
+   including the debugging tag, is touched rarely.  */
 typedef struct {
-	uint32_t tag;              /* debug DLL_NSYNC_WAITER, DLL_WAITER, DLL_WAITER_SAMECOND */
-	nsync_semaphore sem;       /* Thread waits on this semaphore. */
 	struct nsync_waiter_s nw;  /* An embedded nsync_waiter_s. */
-	struct nsync_mu_s_ *cv_mu;  /* pointer to nsync_mu associated with a cv wait */
-	lock_type *l_type;         /* Lock type of the mu, or nil if not associated with a mu. */
 	nsync_atomic_uint32_ remove_count;   /* count of removals from queue */
+	int flags;                 /* see WAITER_* bits below */
+	nsync_semaphore sem;       /* Thread waits on this semaphore. */
+
 	struct wait_condition_s cond; /* A condition on which to acquire a mu. */
 	nsync_dll_element_ same_condition;   /* Links neighbours in nw.q with same non-nil condition. */
-	int flags;                    /* see WAITER_* bits below */
+
+	lock_type *l_type;         /* Lock type of the mu, or nil if not associated with a mu. */
+	struct nsync_mu_s_ *cv_mu;  /* pointer to nsync_mu associated with a cv wait */
+	void (*run) (void *arg);      /* operation from nsync_mu_run_locked(), or nil */
+	void *run_arg;                /* argument for run */
+	struct waiter_slab_s *slab;   /* block from which waiter was allocated */
+	int cpu;                      /* processor when queued on an NSYNC_CV_CPU cv */
+	uint32_t id;                  /* see nsync_waiter_by_id_(); 0 if none */
+	uint32_t pending_next;        /* id of next waiter on a mu's pending stack, or 0 */
+	struct nsync_mu_s_ *pending_mu; /* mu for which waiter is on a pending stack */
+	uint32_t tag;              /* debug DLL_NSYNC_WAITER, DLL_WAITER, DLL_WAITER_SAMECOND */
 } waiter;
 static const uint32_t WAITER_TAG = 0x0590239f;
 static const uint32_t NSYNC_WAITER_TAG = 0x726d2ba9;
 
 #define WAITER_RESERVED 0x1  /* waiter reserved by a thread, even when not in use */
 #define WAITER_IN_USE   0x2  /* waiter in use by a thread */
+#define WAITER_HANDOFF  0x4  /* waker passed ownership of the mu to this waiter */
+#define WAITER_RAN      0x8  /* mu holder ran w->run on this waiter's behalf */
 
 #define CONTAINER(t_,f_,p_)  ((t_ *) (((char *) (p_)) - offsetof (t_, f_)))
 #define ASSERT(x) do { if (!(x)) { *(volatile int *)0 = 0; } } while (0)
@@ -268,32 +511,90 @@ waiter *nsync_waiter_new_ (void);
 /* Return an unused waiter struct *w to the free pool. */
 void nsync_waiter_free_ (waiter *w);
 
+/* Return the waiter w with w->id == id, which must be non-zero and belong
+   to a waiter that is in use.  A waiter's id is fixed when it is allocated,
+   and fits in 32 bits, so that it can be pushed atomically on a pending
+   stack of nsync_mu waiters (see nsync_mu_drain_pending_()).  Waiters allocated
+   once the table of ids is full have id 0.  */
+waiter *nsync_waiter_by_id_ (uint32_t id);
+
+/* Wake the thread waiting on *nw, which the caller has removed from the
+   queue it was on:  set nw->waiting to 0, and release *nw->sem.  Once
+   nw->waiting is 0, the woken thread may free the waiter containing *nw, so
+   the release is bracketed in a way that nsync_waiter_pool_trim() waits for
+   before it deallocates waiters.  */
+void nsync_waiter_wakeup_ (struct nsync_waiter_s *nw);
+
+/* Remove each element from list (of nw.q fields), and wake the thread
+   waiting on it, as nsync_waiter_wakeup_() would, but waking the threads as
+   a group with nsync_mu_semaphore_v_n().  */
+void nsync_waiter_wakeup_list_ (nsync_dll_list_ list);
+
 /* ---------- */
 
 /* The internals of an nync_note.  See internal/note.c for details of locking
    discipline.  */
+#define NOTE_SHARDS 8 /* number of shards of the children of a note */
+
+/* A shard of the children of an nsync_note. */
+struct nsync_note_shard_s_ {
+        nsync_mu mu;                /* protects fields below */
+        nsync_cv changed_cv;        /* signalled when changes is incremented */
+        uint32_t changes;           /* incremented when a child removes itself */
+        nsync_dll_list_ children;   /* list of children in this shard */
+};
+
 struct nsync_note_s_ {
-        nsync_dll_element_ parent_child_link; /* parent's children, under parent->note_mu  */
+        nsync_dll_element_ parent_child_link; /* parent's shard's children, under its mu */
         int expiry_time_valid;      /* whether expiry_time is valid; r/o after init */
         nsync_time expiry_time;     /* expiry time, if expiry_time_valid != 0; r/o after init */
-        nsync_mu note_mu;          /* protects fields below except "notified" */
-        nsync_cv no_children_cv;    /* signalled when children becomes empty */
+        nsync_mu note_mu;          /* protects fields below except as noted */
+        nsync_cv idle_cv;           /* signalled when disconnecting or in_cascade becomes zero */
         uint32_t disconnecting;     /* non-zero => node is being disconnected */
-        nsync_atomic_uint32_ notified;   /* non-zero if the note has been notified */
+        int in_cascade;             /* disconnected by a notifier, but not yet notified */
+        nsync_atomic_uint32_ notified;   /* NOTE_NOTIFIED and NOTE_SPINLOCK bits */
         struct nsync_note_s_ *parent;     /* points to parent, if any */
-        nsync_dll_element_ *children; /* list of children */
-        nsync_dll_element_ *waiters;  /* list of waiters */
+        uint32_t shard;             /* index of parent's shard containing parent_child_link */
+        nsync_atomic_uint32_ shards_ready; /* whether shards has been set */
+        struct nsync_note_shard_s_ *shards; /* NOTE_SHARDS shards of children, or NULL */
+        nsync_dll_element_ *waiters;  /* list of waiters, under NOTE_SPINLOCK */
+        int timer_armed;            /* whether ever placed on the expiry wheel */
+        int timer_by_parent;        /* expiry covered by an armed ancestor */
+        nsync_atomic_uint32_ timer_covered; /* timer_armed || timer_by_parent */
+        nsync_dll_element_ timer_link; /* in *timer_slot, under its expiry wheel's lock */
+        nsync_dll_list_ *timer_slot; /* wheel slot holding timer_link, or NULL */
 };
 
+/* Bits in nsync_note_s_.notified. */
+#define NOTE_NOTIFIED ((uint32_t) 1) /* the note has been notified */
+#define NOTE_SPINLOCK ((uint32_t) 2) /* protects the waiters list */
+
 /* ---------- */
 
 void nsync_mu_lock_slow_ (nsync_mu *mu, waiter *w, uint32_t clear, lock_type *l_type);
+int nsync_mu_lock_slow_with_deadline_ (nsync_mu *mu, waiter *w, uint32_t clear,
+				       lock_type *l_type, nsync_time abs_deadline,
+				       nsync_note cancel_note);
 void nsync_mu_unlock_slow_ (nsync_mu *mu, lock_type *l_type);
+void nsync_mu_drain_pending_ (nsync_mu *mu);
 nsync_dll_list_ nsync_remove_from_mu_queue_ (nsync_dll_list_ mu_queue, nsync_dll_element_ *e);
+int nsync_mu_key_touched_ (const nsync_mu *mu, struct wait_condition_s *cond);
 void nsync_maybe_merge_conditions_ (nsync_dll_element_ *p, nsync_dll_element_ *n);
 nsync_time nsync_note_notified_deadline_ (nsync_note n);
+int nsync_note_enqueue_ (nsync_note n, struct nsync_waiter_s *nw);
+int nsync_note_dequeue_ (nsync_note n, struct nsync_waiter_s *nw);
 int nsync_sem_wait_with_cancel_ (waiter *w, nsync_time abs_deadline,
 				 nsync_note cancel_note);
+
+/* Return abs_deadline rounded up by the process-wide timer slack; see
+   nsync_time_set_slack().  Applied to deadlines before blocking on a
+   semaphore. */
+nsync_time nsync_deadline_with_slack_ (nsync_time abs_deadline);
+
+/* Return whether abs_deadline has passed, reading a cheap coarse clock in
+   preference to nsync_time_now() where that suffices to tell; see
+   time_internal.c.  */
+int nsync_time_expired_ (nsync_time abs_deadline);
 NSYNC_CPP_END_
 
 #endif /*NSYNC_INTERNAL_COMMON_H_*/
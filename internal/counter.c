@@ -69,13 +69,9 @@ uint32_t nsync_counter_add (nsync_counter c, int32_t delta) {
 			ASSERT (value < value - delta); /* Crash on overflow. */
 		}
 		if (value == 0) {
-			nsync_dll_element_ *p;
-			while ((p = nsync_dll_first_ (c->waiters)) != NULL) {
-				struct nsync_waiter_s *nw = DLL_NSYNC_WAITER (p);
-				c->waiters = nsync_dll_remove_ (c->waiters, p);
-				ATM_STORE_REL (&nw->waiting, 0);
-				nsync_mu_semaphore_v (nw->sem);
-			}
+			nsync_dll_list_ to_wake = c->waiters;
+			c->waiters = NULL;
+			nsync_waiter_wakeup_list_ (to_wake);
 		}
 		nsync_mu_unlock (&c->counter_mu);
 	}
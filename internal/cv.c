@@ -30,6 +30,76 @@ void nsync_cv_init (nsync_cv *cv) {
         memset ((void *) cv, 0, sizeof (*cv));
 }
 
+/* Set the wakeup policy of *cv. */
+void nsync_cv_set_policy (nsync_cv *cv, int policy) {
+	uint32_t old_word;
+	IGNORE_RACES_START ();
+	old_word = nsync_spin_test_and_set_ (&cv->word, CV_SPINLOCK, CV_SPINLOCK, 0);
+	ATM_STORE_REL (&cv->word, (old_word & ~CV_POLICY) |
+		       ((((uint32_t) policy) << CV_POLICY_SHIFT) & CV_POLICY)); /* release store */
+	IGNORE_RACES_END ();
+}
+
+/* Add *e to list, at the tail under NSYNC_CV_FIFO, or otherwise at the head, as
+   given by the policy in cv_word, and return the new list.  */
+static nsync_dll_list_ cv_enqueue_waiter (nsync_dll_list_ list, nsync_dll_element_ *e,
+					  uint32_t cv_word) {
+	if ((cv_word & CV_POLICY) != 0) {
+		list = nsync_dll_make_first_in_list_ (list, e);
+	} else {
+		list = nsync_dll_make_last_in_list_ (list, e);
+	}
+	return (list);
+}
+
+/* Return the first of the first CV_CPU_SCAN elements of the non-empty list
+   that was queued by nsync_cv_wait() on processor cpu, or the first element if
+   there is none. */
+static nsync_dll_element_ *cv_cpu_waiter (nsync_dll_list_ list, int cpu) {
+	nsync_dll_element_ *first = nsync_dll_first_ (list);
+	nsync_dll_element_ *p;
+	int i;
+	for (p = first, i = 0; p != NULL && i != CV_CPU_SCAN;
+	     p = nsync_dll_next_ (list, p), i++) {
+		if ((DLL_NSYNC_WAITER (p)->flags & NSYNC_WAITER_FLAG_MUCV) != 0 &&
+		    DLL_WAITER (p)->cpu == cpu) {
+			return (p);
+		}
+	}
+	return (first);
+}
+
+/* Return whether the element *p of an nsync_cv's waiter list should be woken:
+   true unless it is waiting in nsync_cv_wait_pred() and its predicate is
+   false.  The caller of nsync_cv_signal() or nsync_cv_broadcast() must then
+   hold the waiter's nsync_mu (see nsync_cv_wait_pred()), so a hold is taken
+   to be the caller's:  nsync cannot tell exactly which thread holds an
+   nsync_mu.  If the nsync_mu is free, the caller cannot be holding it, so
+   the waiter is woken to evaluate the predicate itself.  */
+static int cv_waiter_ready (nsync_dll_element_ *p) {
+	int ready = 1;
+	if ((DLL_NSYNC_WAITER (p)->flags & NSYNC_WAITER_FLAG_MUCV) != 0) {
+		waiter *w = DLL_WAITER (p);
+		if (w->cond.f != NULL && w->cv_mu != NULL &&
+		    (ATM_LOAD (&w->cv_mu->word) & MU_ANY_LOCK) != 0) {
+			ready = (*w->cond.f) (w->cond.v);
+		}
+	}
+	return (ready);
+}
+
+/* Return the first element of the non-empty list, other than *skip, that
+   cv_waiter_ready() accepts, or NULL if there is none.  *skip is an element
+   that cv_waiter_ready() has just rejected, so that no predicate is
+   evaluated twice.  */
+static nsync_dll_element_ *cv_first_ready (nsync_dll_list_ list, nsync_dll_element_ *skip) {
+	nsync_dll_element_ *p = nsync_dll_first_ (list);
+	while (p != NULL && (p == skip || !cv_waiter_ready (p))) {
+		p = nsync_dll_next_ (list, p);
+	}
+	return (p);
+}
+
 /* Wake the cv waiters in the circular list pointed to by
    to_wake_list, which may not be NULL.  If the waiter is associated with a
    nsync_mu, the "wakeup" may consist of transferring the waiters to the nsync_mu's
@@ -75,13 +145,17 @@ static void wake_waiters (nsync_dll_list_ to_wake_list, int all_readers) {
 			int first_is_writer = first_w->l_type == nsync_writer_type_;
 			int transferred_a_writer = 0;
 			int woke_areader = 0;
+			nsync_mu_drain_pending_ (pmu);
 			/* Transfer the first waiter iff it can't acquire *pmu. */
 			if (first_cant_acquire) {
 				to_wake_list = nsync_dll_remove_ (to_wake_list, first_waiter);
 				pmu->waiters = nsync_dll_make_last_in_list_ (pmu->waiters, first_waiter);
 				/* tell nsync_cv_wait_with_deadline() that we
-				   moved the waiter to *pmu's queue.  */
+				   moved the waiter to *pmu's queue.  Any
+				   nsync_cv_wait_pred() predicate must not be
+				   taken for an nsync_mu_wait() condition.  */
 				first_w->cv_mu = NULL;
+				first_w->cond.f = NULL;
 				/* first_nw.waiting is already 1, from being on
 				   cv's waiter queue.  */
 				transferred_a_writer = first_is_writer;
@@ -112,6 +186,7 @@ static void wake_waiters (nsync_dll_list_ to_wake_list, int all_readers) {
 					   that we moved the waiter to *pmu's
 					   queue.  */
 					p_w->cv_mu = NULL;
+					p_w->cond.f = NULL;
 					/* p_nw->waiting is already 1, from
 					   being on cv's waiter queue.  */
 					transferred_a_writer = transferred_a_writer || p_is_writer;
@@ -136,14 +211,7 @@ static void wake_waiters (nsync_dll_list_ to_wake_list, int all_readers) {
 	}
 
 	/* Wake any waiters we didn't manage to enqueue on the mu. */
-	for (p = nsync_dll_first_ (to_wake_list); p != NULL; p = next) {
-		struct nsync_waiter_s *p_nw = DLL_NSYNC_WAITER (p);
-		next = nsync_dll_next_ (to_wake_list, p);
-		to_wake_list = nsync_dll_remove_ (to_wake_list, p);
-		/* Wake the waiter. */
-		ATM_STORE_REL (&p_nw->waiting, 0); /* release store */
-		nsync_mu_semaphore_v (p_nw->sem);
-	}
+	nsync_waiter_wakeup_list_ (to_wake_list);
 }
 
 /* ------------------------------------------ */
@@ -157,33 +225,27 @@ static void void_mu_lock (void *mu) {
 static void void_mu_unlock (void *mu) {
 	nsync_mu_unlock ((nsync_mu *) mu);
 }
+static nsync_mu *void_mu_self (void *mu) {
+	return ((nsync_mu *) mu);
+}
 
-/* Atomically release *pmu (which must be held on entry)
-   and block the calling thread on *pcv.  Then wait until awakened by a
-   call to nsync_cv_signal() or nsync_cv_broadcast() (or a spurious wakeup), or by the time
-   reaching abs_deadline, or by cancel_note being notified.  In all cases,
-   reacquire *pmu, and return the reason for the call returned (0, ETIMEDOUT,
-   or ECANCELED).  Callers should abs_deadline==nsync_time_no_deadline for no
-   deadline, and cancel_note==NULL for no cancellation.  nsync_cv_wait_with_deadline()
-   should be used in a loop, as with all Mesa-style condition variables.  See
-   examples above.
+/* The lock functions of an nsync_mu. */
+static const struct nsync_lock_funcs_s mu_lock_funcs = {
+	&void_mu_lock,
+	&void_mu_unlock,
+	&void_mu_self,
+	NULL
+};
 
-   There are two reasons for using an absolute deadline, rather than a relative
-   timeout---these are why pthread_cond_timedwait() also uses an absolute
-   deadline.  First, condition variable waits have to be used in a loop; with
-   an absolute times, the deadline does not have to be recomputed on each
-   iteration.  Second, in most real programmes, some activity (such as an RPC
-   to a server, or when guaranteeing response time in a UI), there is a
-   deadline imposed by the specification or the caller/user; relative delays
-   can shift arbitrarily with scheduling delays, and so after multiple waits
-   might extend beyond the expected deadline.  Relative delays tend to be more
-   convenient mostly in tests and trivial examples than they are in real
-   programmes. */
-int nsync_cv_wait_with_deadline_generic (nsync_cv *pcv, void *pmu,
-					 void (*lock) (void *), void (*unlock) (void *),
-					 nsync_time abs_deadline,
-					 nsync_note cancel_note) {
+/* As nsync_cv_wait_with_deadline_funcs(), except that if pred!=NULL, *pmu
+   has an nsync_mu, and the thread is woken only when (*pred) (pred_arg) is
+   true, as evaluated by the waker.  */
+static int cv_wait_with_deadline (nsync_cv *pcv, void *pmu,
+				  const struct nsync_lock_funcs_s *funcs,
+				  int (*pred) (const void *pred_arg), const void *pred_arg,
+				  nsync_time abs_deadline, nsync_note cancel_note) {
 	nsync_mu *cv_mu = NULL;
+	int is_native_mu = (funcs->mu == &void_mu_self); /* If true, *pmu is an nsync_mu. */
 	int is_reader_mu;
 	uint32_t old_word;
 	uint32_t remove_count;
@@ -192,18 +254,30 @@ int nsync_cv_wait_with_deadline_generic (nsync_cv *pcv, void *pmu,
 	int outcome = 0;
 	waiter *w;
 	IGNORE_RACES_START ();
+	if (funcs->mu != NULL) {
+		cv_mu = (*funcs->mu) (pmu);
+	}
+	if (cv_mu != NULL) {
+		if (nsync_mu_rbias_unbias_ (cv_mu)) {
+			/* *cv_mu was held in read mode via the visible-readers
+			   table, where the code below cannot see the hold.
+			   It has been released and reacquired; a wakeup in
+			   the interval might have been missed, so return as
+			   though woken spuriously.  */
+			IGNORE_RACES_END ();
+			return (0);
+		}
+	}
 	w = nsync_waiter_new_ ();
 	ATM_STORE (&w->nw.waiting, 1);
-	w->cond.f = NULL; /* Not using a conditional critical section. */
-	w->cond.v = NULL;
+	/* Not using a conditional critical section, but perhaps a predicate
+	   for the waker to evaluate.  */
+	w->cond.f = pred;
+	w->cond.v = pred_arg;
 	w->cond.eq = NULL;
-	if (lock == &void_mu_lock ||
-	    lock == (void (*) (void *)) &nsync_mu_lock ||
-	    lock == (void (*) (void *)) &nsync_mu_rlock) {
-		cv_mu = (nsync_mu *) pmu;
-	}
-	w->cv_mu = cv_mu;       /* If *pmu is an nsync_mu, record its address, else record NULL. */
-	is_reader_mu = 0; /* If true, an nsync_mu in reader mode. */
+	w->cond.key = NULL;
+	w->cv_mu = cv_mu;       /* If *pmu has an nsync_mu, record its address, else record NULL. */
+	is_reader_mu = 0; /* If true, *pmu is an nsync_mu in reader mode. */
 	if (cv_mu == NULL) {
 		w->l_type = NULL;
 	} else {
@@ -218,24 +292,31 @@ int nsync_cv_wait_with_deadline_generic (nsync_cv *pcv, void *pmu,
 			w->l_type = nsync_writer_type_;
 		} else if (is_reader) {
 			w->l_type = nsync_reader_type_;
-			is_reader_mu = 1;
+			is_reader_mu = is_native_mu;
 		} else {
 			nsync_panic_ ("mu not held on entry to nsync_cv_wait_with_deadline()\n");
 		}
 	}
 
+	w->cpu = -1;
+	if ((ATM_LOAD (&pcv->word) & CV_POLICY) == CV_CPU) {
+		w->cpu = nsync_cpu_ ();
+	}
+
 	/* acquire spinlock, set non-empty */
 	old_word = nsync_spin_test_and_set_ (&pcv->word, CV_SPINLOCK, CV_SPINLOCK|CV_NON_EMPTY, 0);
-	pcv->waiters = nsync_dll_make_last_in_list_ (pcv->waiters, &w->nw.q);
+	pcv->waiters = cv_enqueue_waiter (pcv->waiters, &w->nw.q, old_word);
+	w->nw.cv_gen = old_word & CV_GEN_MASK;
 	remove_count = ATM_LOAD (&w->remove_count);
 	/* Release the spin lock. */
-	ATM_STORE_REL (&pcv->word, old_word|CV_NON_EMPTY); /* release store */
+	ATM_STORE_REL (&pcv->word, old_word|CV_NON_EMPTY|
+		       (pred != NULL? CV_PRED : 0)); /* release store */
 
 	/* Release *pmu. */
 	if (is_reader_mu) {
 		nsync_mu_runlock (cv_mu);
 	} else {
-		(*unlock) (pmu);
+		(*funcs->unlock) (pmu);
 	}
 
 	/* wait until awoken or a timeout. */
@@ -249,15 +330,17 @@ int nsync_cv_wait_with_deadline_generic (nsync_cv *pcv, void *pmu,
 		if (sem_outcome != 0 && ATM_LOAD (&w->nw.waiting) != 0) {
 			/* A timeout or cancellation occurred, and no wakeup.
 			   Acquire *pcv's spinlock, and confirm.  */
-			old_word = nsync_spin_test_and_set_ (&pcv->word, CV_SPINLOCK,
-							     CV_SPINLOCK, 0);
+			old_word = nsync_spin_test_and_set_or_sleep_ (&pcv->word, CV_SPINLOCK,
+								      CV_SPINLOCK, 0);
 			/* Check that w wasn't removed from the queue after we
 			   checked above, but before we acquired the spinlock.
-			   The test of remove_count confirms that the waiter *w
-			   is still governed by *pcv's spinlock; otherwise, some
-			   other thread is about to set w.waiting==0.  */
+			   The tests of the generation and remove_count confirm
+			   that the waiter *w is still governed by *pcv's
+			   spinlock; otherwise, some other thread is about to
+			   set w.waiting==0.  */
 			if (ATM_LOAD (&w->nw.waiting) != 0) {
-				if (remove_count == ATM_LOAD (&w->remove_count)) {
+				if ((old_word & CV_GEN_MASK) == w->nw.cv_gen &&
+				    remove_count == ATM_LOAD (&w->remove_count)) {
 					uint32_t old_value;
 					/* still in cv waiter queue */
 					/* Not woken, so remove *w from cv
@@ -270,7 +353,7 @@ int nsync_cv_wait_with_deadline_generic (nsync_cv *pcv, void *pmu,
 						old_value = ATM_LOAD (&w->remove_count);
 					} while (!ATM_CAS (&w->remove_count, old_value, old_value+1));
 					if (nsync_dll_is_empty_ (pcv->waiters)) {
-						old_word &= ~(CV_NON_EMPTY);
+						old_word &= ~(CV_NON_EMPTY|CV_PRED);
 					}
 					ATM_STORE_REL (&w->nw.waiting, 0); /* release store */
 				}
@@ -295,19 +378,74 @@ int nsync_cv_wait_with_deadline_generic (nsync_cv *pcv, void *pmu,
 		nsync_mu_lock_slow_ (cv_mu, w, MU_DESIG_WAKER, w->l_type);
 		RWLOCK_TRYACQUIRE (1, cv_mu, w->l_type == nsync_writer_type_);
 		nsync_waiter_free_ (w);
+		if (funcs->acquired != NULL) {
+			(*funcs->acquired) (pmu);
+		}
 	} else {
 		/* Traditional case: We've woken from the cv, and need to reacquire *pmu. */
 		nsync_waiter_free_ (w);
 		if (is_reader_mu) {
-			nsync_mu_rlock (cv_mu);
+			/* Keep the hold in cv_mu->word, so that a repeated
+			   wait need not release it as above.  */
+			nsync_mu_rlock_word_ (cv_mu);
+			RWLOCK_TRYACQUIRE (1, cv_mu, 0);
 		} else {
-			(*lock) (pmu);
+			(*funcs->lock) (pmu);
 		}
 	}
 	IGNORE_RACES_END ();
 	return (outcome);
 }
 
+/* Atomically release *pmu (which must be held on entry)
+   and block the calling thread on *pcv.  Then wait until awakened by a
+   call to nsync_cv_signal() or nsync_cv_broadcast() (or a spurious wakeup), or by the time
+   reaching abs_deadline, or by cancel_note being notified.  In all cases,
+   reacquire *pmu, and return the reason for the call returned (0, ETIMEDOUT,
+   or ECANCELED).  Callers should abs_deadline==nsync_time_no_deadline for no
+   deadline, and cancel_note==NULL for no cancellation.  nsync_cv_wait_with_deadline()
+   should be used in a loop, as with all Mesa-style condition variables.  See
+   examples above.
+
+   There are two reasons for using an absolute deadline, rather than a relative
+   timeout---these are why pthread_cond_timedwait() also uses an absolute
+   deadline.  First, condition variable waits have to be used in a loop; with
+   an absolute times, the deadline does not have to be recomputed on each
+   iteration.  Second, in most real programmes, some activity (such as an RPC
+   to a server, or when guaranteeing response time in a UI), there is a
+   deadline imposed by the specification or the caller/user; relative delays
+   can shift arbitrarily with scheduling delays, and so after multiple waits
+   might extend beyond the expected deadline.  Relative delays tend to be more
+   convenient mostly in tests and trivial examples than they are in real
+   programmes. */
+int nsync_cv_wait_with_deadline_generic (nsync_cv *pcv, void *pmu,
+					 void (*lock) (void *), void (*unlock) (void *),
+					 nsync_time abs_deadline,
+					 nsync_note cancel_note) {
+	struct nsync_lock_funcs_s funcs;
+	funcs.lock = lock;
+	funcs.unlock = unlock;
+	funcs.mu = NULL;
+	funcs.acquired = NULL;
+	if (lock == &void_mu_lock ||
+	    lock == (void (*) (void *)) &nsync_mu_lock ||
+	    lock == (void (*) (void *)) &nsync_mu_rlock) {
+		funcs.mu = &void_mu_self;
+	}
+	return (cv_wait_with_deadline (pcv, pmu, &funcs, NULL, NULL,
+				       abs_deadline, cancel_note));
+}
+
+/* Like nsync_cv_wait_with_deadline_generic(), but with the lock described by
+   *funcs, so that waiters can be transferred to an nsync_mu within it. */
+int nsync_cv_wait_with_deadline_funcs (nsync_cv *pcv, void *l,
+				       const struct nsync_lock_funcs_s *funcs,
+				       nsync_time abs_deadline,
+				       nsync_note cancel_note) {
+	return (cv_wait_with_deadline (pcv, l, funcs, NULL, NULL,
+				       abs_deadline, cancel_note));
+}
+
 /* Wake at least one thread if any are currently blocked on *pcv.  If
    the chosen thread is a reader on an nsync_mu, wake all readers and, if
    possible, a writer. */
@@ -316,14 +454,30 @@ void nsync_cv_signal (nsync_cv *pcv) {
 	if ((ATM_LOAD_ACQ (&pcv->word) & CV_NON_EMPTY) != 0) { /* acquire load */
 		nsync_dll_list_ to_wake_list = NULL; /* waiters that we will wake */
 		int all_readers = 0;
+		int cpu = -1;
+		uint32_t old_word;
+		nsync_dll_element_ *first = NULL;
+		if ((ATM_LOAD (&pcv->word) & CV_POLICY) == CV_CPU) {
+			cpu = nsync_cpu_ ();
+		}
 		/* acquire spinlock */
-		uint32_t old_word = nsync_spin_test_and_set_ (&pcv->word, CV_SPINLOCK,
-							      CV_SPINLOCK, 0);
+		old_word = nsync_spin_test_and_set_ (&pcv->word, CV_SPINLOCK, CV_SPINLOCK, 0);
 		if (!nsync_dll_is_empty_ (pcv->waiters)) {
-			/* Point to first waiter that enqueued itself, and
-			   detach it from all others.  */
+			/* Choose the waiter the policy favours---the first
+			   that enqueued itself, unless the policy queues at
+			   the head---or, if its nsync_cv_wait_pred()
+			   predicate is false, the first whose is true.  */
+			first = nsync_dll_first_ (pcv->waiters);
+			if ((old_word & CV_POLICY) == CV_CPU && cpu != -1) {
+				first = cv_cpu_waiter (pcv->waiters, cpu);
+			}
+			if ((old_word & CV_PRED) != 0 && !cv_waiter_ready (first)) {
+				first = cv_first_ready (pcv->waiters, first);
+			}
+		}
+		if (first != NULL) {
+			/* Detach the chosen waiter from all others.  */
 			struct nsync_waiter_s *first_nw;
-			nsync_dll_element_ *first = nsync_dll_first_ (pcv->waiters);
 			pcv->waiters = nsync_dll_remove_ (pcv->waiters, first);
 			first_nw = DLL_NSYNC_WAITER (first);
 			if ((first_nw->flags & NSYNC_WAITER_FLAG_MUCV) != 0) {
@@ -358,7 +512,9 @@ void nsync_cv_signal (nsync_cv *pcv) {
 					int should_wake;
 					next = nsync_dll_next_ (pcv->waiters, p);
 					should_wake = 0;
-					if ((p_nw->flags & NSYNC_WAITER_FLAG_MUCV) != 0 &&
+					if ((old_word & CV_PRED) != 0 && !cv_waiter_ready (p)) {
+						/* leave it queued; its predicate is false */
+					} else if ((p_nw->flags & NSYNC_WAITER_FLAG_MUCV) != 0 &&
 					     DLL_WAITER (p)->l_type == nsync_reader_type_) {
 						should_wake = 1;
 					} else if (!woke_writer) {
@@ -382,7 +538,7 @@ void nsync_cv_signal (nsync_cv *pcv) {
 				}
 			}
 			if (nsync_dll_is_empty_ (pcv->waiters)) {
-				old_word &= ~(CV_NON_EMPTY);
+				old_word &= ~(CV_NON_EMPTY|CV_PRED);
 			}
 		}
 		/* Release spinlock. */
@@ -399,32 +555,55 @@ void nsync_cv_broadcast (nsync_cv *pcv) {
 	IGNORE_RACES_START ();
 	if ((ATM_LOAD_ACQ (&pcv->word) & CV_NON_EMPTY) != 0) { /* acquire load */
 		nsync_dll_element_ *p;
-		nsync_dll_element_ *next;
 		int all_readers;
-		nsync_dll_list_ to_wake_list = NULL;   /* waiters that we will wake */
+		nsync_dll_list_ to_wake_list;   /* waiters that we will wake */
 		/* acquire spinlock */
-		nsync_spin_test_and_set_ (&pcv->word, CV_SPINLOCK, CV_SPINLOCK, 0);
-		p = NULL;
-		next = NULL;
+		uint32_t old_word = nsync_spin_test_and_set_ (&pcv->word, CV_SPINLOCK,
+							      CV_SPINLOCK, 0);
+		if ((old_word & CV_PRED) != 0) {
+			/* Some waiters may be in nsync_cv_wait_pred(); detach
+			   only those whose predicates are true, and leave the
+			   rest queued.  */
+			nsync_dll_element_ *next;
+			to_wake_list = NULL;
+			for (p = nsync_dll_first_ (pcv->waiters); p != NULL; p = next) {
+				next = nsync_dll_next_ (pcv->waiters, p);
+				if (cv_waiter_ready (p)) {
+					pcv->waiters = nsync_dll_remove_ (pcv->waiters, p);
+					if ((DLL_NSYNC_WAITER (p)->flags & NSYNC_WAITER_FLAG_MUCV) != 0) {
+						uint32_t old_value;
+						do {
+							old_value = ATM_LOAD (&DLL_WAITER (p)->remove_count);
+						} while (!ATM_CAS (&DLL_WAITER (p)->remove_count,
+								   old_value, old_value+1));
+					}
+					to_wake_list = nsync_dll_make_last_in_list_ (to_wake_list, p);
+				}
+			}
+			if (nsync_dll_is_empty_ (pcv->waiters)) {
+				old_word &= ~(CV_NON_EMPTY|CV_PRED);
+			}
+			/* Release spinlock. */
+			ATM_STORE_REL (&pcv->word, old_word); /* release store */
+		} else {
+			/* Detach the entire waiter list, which we leave empty.
+			   Rather than marking each waiter as removed, advance
+			   the generation, so the time the spinlock is held
+			   does not depend on the number of waiters.  */
+			to_wake_list = pcv->waiters;
+			pcv->waiters = NULL;
+			/* Release spinlock, mark queue empty, and advance the
+			   generation, keeping the policy. */
+			ATM_STORE_REL (&pcv->word, ((old_word + CV_GEN_INC) & CV_GEN_MASK) |
+				       (old_word & CV_POLICY)); /* release store */
+		}
+		/* The detached waiters are now ours alone. */
 		all_readers = 1;
-		/* Wake entire waiter list, which we leave empty. */
-		for (p = nsync_dll_first_ (pcv->waiters); p != NULL; p = next) {
-			struct nsync_waiter_s *p_nw = DLL_NSYNC_WAITER (p);
-			next = nsync_dll_next_ (pcv->waiters, p);
-			all_readers = all_readers && (p_nw->flags & NSYNC_WAITER_FLAG_MUCV) != 0 &&
+		for (p = nsync_dll_first_ (to_wake_list); p != NULL && all_readers;
+		     p = nsync_dll_next_ (to_wake_list, p)) {
+			all_readers = (DLL_NSYNC_WAITER (p)->flags & NSYNC_WAITER_FLAG_MUCV) != 0 &&
 				      (DLL_WAITER (p)->l_type == nsync_reader_type_);
-			pcv->waiters = nsync_dll_remove_ (pcv->waiters, p);
-			if ((p_nw->flags & NSYNC_WAITER_FLAG_MUCV) != 0) {
-				uint32_t old_value;
-				do {    
-					old_value = ATM_LOAD (&DLL_WAITER (p)->remove_count);
-				} while (!ATM_CAS (&DLL_WAITER (p)->remove_count,
-						   old_value, old_value+1));
-			}
-			to_wake_list = nsync_dll_make_last_in_list_ (to_wake_list, p);
 		}
-		/* Release spinlock and mark queue empty. */
-		ATM_STORE_REL (&pcv->word, 0); /* release store */
 		if (!nsync_dll_is_empty_ (to_wake_list)) {    /* Wake them. */
 			wake_waiters (to_wake_list, all_readers);
 		}
@@ -436,9 +615,24 @@ void nsync_cv_broadcast (nsync_cv *pcv) {
 int nsync_cv_wait_with_deadline (nsync_cv *pcv, nsync_mu *pmu,
 				 nsync_time abs_deadline,
 				 nsync_note cancel_note) {
-	return (nsync_cv_wait_with_deadline_generic (pcv, pmu, &void_mu_lock,
-						     &void_mu_unlock,
-						     abs_deadline, cancel_note));
+	return (cv_wait_with_deadline (pcv, pmu, &mu_lock_funcs, NULL, NULL,
+				       abs_deadline, cancel_note));
+}
+
+/* Wait on *pcv until (*pred) (pred_arg) is true, with the waker evaluating
+   the predicate. */
+int nsync_cv_wait_pred (nsync_cv *pcv, nsync_mu *pmu,
+			int (*pred) (const void *pred_arg), const void *pred_arg,
+			nsync_time abs_deadline, nsync_note cancel_note) {
+	int outcome = 0;
+	while (outcome == 0 && !(*pred) (pred_arg)) {
+		outcome = cv_wait_with_deadline (pcv, pmu, &mu_lock_funcs,
+						 pred, pred_arg, abs_deadline, cancel_note);
+	}
+	if (outcome != 0 && (*pred) (pred_arg)) {
+		outcome = 0;
+	}
+	return (outcome);
 }
 
 /* Atomically release *pmu and block the caller on *pcv.  Wait
@@ -461,7 +655,8 @@ static int cv_enqueue (void *v, struct nsync_waiter_s *nw) {
 	nsync_cv *pcv = (nsync_cv *) v;
 	/* acquire spinlock */
 	uint32_t old_word = nsync_spin_test_and_set_ (&pcv->word, CV_SPINLOCK, CV_SPINLOCK, 0);
-	pcv->waiters = nsync_dll_make_last_in_list_ (pcv->waiters, &nw->q);
+	pcv->waiters = cv_enqueue_waiter (pcv->waiters, &nw->q, old_word);
+	nw->cv_gen = old_word & CV_GEN_MASK;
 	ATM_STORE (&nw->waiting, 1);
 	/* Release spinlock. */
 	ATM_STORE_REL (&pcv->word, old_word | CV_NON_EMPTY); /* release store */
@@ -472,17 +667,30 @@ static int cv_dequeue (void *v, struct nsync_waiter_s *nw) {
 	nsync_cv *pcv = (nsync_cv *) v;
 	int was_queued = 0;
 	/* acquire spinlock */
-	uint32_t old_word = nsync_spin_test_and_set_ (&pcv->word, CV_SPINLOCK, CV_SPINLOCK, 0);
+	uint32_t old_word = nsync_spin_test_and_set_or_sleep_ (&pcv->word, CV_SPINLOCK, CV_SPINLOCK, 0);
+	int detached = 0;
 	if (ATM_LOAD_ACQ (&nw->waiting) != 0) {
-		pcv->waiters = nsync_dll_remove_ (pcv->waiters, &nw->q);
-		ATM_STORE (&nw->waiting, 0);
-		was_queued = 1;
+		if ((old_word & CV_GEN_MASK) == nw->cv_gen) {
+			pcv->waiters = nsync_dll_remove_ (pcv->waiters, &nw->q);
+			ATM_STORE (&nw->waiting, 0);
+			was_queued = 1;
+		} else {
+			detached = 1;
+		}
 	}
 	if (nsync_dll_is_empty_ (pcv->waiters)) {
-		old_word &= ~(CV_NON_EMPTY);
+		old_word &= ~(CV_NON_EMPTY|CV_PRED);
 	}
 	/* Release spinlock. */
 	ATM_STORE_REL (&pcv->word, old_word); /* release store */
+	if (detached) {
+		/* *nw was detached by nsync_cv_broadcast(), which has yet to
+		   wake it.  Wait for that, since *nw may be freed on return. */
+		unsigned attempts = 0;
+		while (ATM_LOAD_ACQ (&nw->waiting) != 0) {
+			attempts = nsync_spin_delay_ (attempts);
+		}
+	}
 	return (was_queued);
 }
 
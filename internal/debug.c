@@ -113,6 +113,9 @@ static const struct bit_name mu_bit[] = {
         { MU_WRITER_WAITING, "writer" },
         { MU_LONG_WAIT,      "long" },
         { MU_ALL_FALSE,      "false" },
+        { MU_ULOCK,          "ulock" },
+        { MU_UPGRADE,        "upgrade" },
+        { MU_KEYS_FALSE,     "keysfalse" },
         { 0,                 "" }  /* sentinel */
 };
 
@@ -120,6 +123,9 @@ static const struct bit_name mu_bit[] = {
 static const struct bit_name cv_bit[] = {
         { CV_SPINLOCK,       "spin" },
         { CV_NON_EMPTY,      "wait" },
+        { CV_LIFO,           "lifo" },
+        { CV_CPU,            "cpu" },
+        { CV_PRED,           "pred" },
         { 0,                 "" }  /* sentinel */
 };
 
@@ -127,6 +133,7 @@ static const struct bit_name cv_bit[] = {
 static const struct bit_name waiter_flags_bit[] = {
         { WAITER_RESERVED,   "rsrvd" },
         { WAITER_IN_USE,     "in_use" },
+        { WAITER_HANDOFF,    "handoff" },
         { 0,                 "" }  /* sentinel */
 };
 
@@ -169,6 +176,7 @@ static void emit_waiters (struct emit_buf *b, nsync_dll_list_ list) {
                         emit_print (b, " %s removes=%i cond=(%i %i %i)",
                                     w->l_type == nsync_writer_type_? "writer" :
                                     w->l_type == nsync_reader_type_? "reader" :
+                                    w->l_type == nsync_ulock_type_? "ulock" :
                                                                      "??????",
                                     (uintptr_t) ATM_LOAD (&w->remove_count),
                                     (uintptr_t) w->cond.f,
@@ -202,6 +210,7 @@ static char *emit_mu_state (struct emit_buf *b, nsync_mu *mu,
         if ((word & MU_WAITING) != 0 && print_waiters &&  /* can benefit from lock */
 	    (blocking || (word & MU_SPINLOCK) == 0)) {  /* willing, or no need to wait */
                 word = nsync_spin_test_and_set_ (&mu->word, MU_SPINLOCK, MU_SPINLOCK, 0);
+                nsync_mu_drain_pending_ (mu);
                 acquired = 1;
         }
         readers = word / MU_RLOCK;
@@ -31,6 +31,269 @@ void nsync_mu_init (nsync_mu *mu) {
 	RWLOCK_CREATE (mu);
 }
 
+void nsync_mu_set_fair (nsync_mu *mu, int fair) {
+	uint32_t old_spin = ATM_LOAD (&mu->spin);
+	ATM_STORE (&mu->spin, fair? (old_spin | MU_FAIR) : (old_spin & ~MU_FAIR));
+}
+
+void nsync_mu_set_reader_bias (nsync_mu *mu, int bias) {
+	uint32_t old_spin = ATM_LOAD (&mu->spin);
+	if (bias && HAVE_THREAD_LOCAL) {
+		ATM_STORE (&mu->spin, old_spin | MU_RBIAS_MODE);
+	} else {
+		ATM_STORE (&mu->spin, old_spin & ~(MU_RBIAS_MODE | MU_RBIAS | MU_RBIAS_READS));
+	}
+}
+
+/* ---------- */
+
+/* A thread that must wait for other threads to release *mu, without queueing
+   on *mu itself, blocks on the entry of mu_park[] chosen by the mutex's
+   address:  nsync_mu_upgrade() waits there for the other readers to leave,
+   and nsync_mu_rbias_revoke_() for the readers that hold *mu via the
+   visible-readers table.  A releasing thread wakes every thread in the
+   entry with mu_park_wake() without accessing *mu, which a woken thread may
+   free at once.  Distinct mutexes may share an entry, so a woken thread
+   checks its condition again.  */
+#define MU_PARKS 64
+static struct mu_park_s {
+	nsync_mu mu;
+	nsync_cv cv;
+} mu_park[MU_PARKS];
+
+/* Return the entry of mu_park[] used for *mu. */
+static struct mu_park_s *mu_park_for (const nsync_mu *mu) {
+	return (&mu_park[(((uintptr_t) mu) / sizeof (*mu)) % MU_PARKS]);
+}
+
+/* Wake the threads blocked on *park. */
+static void mu_park_wake (struct mu_park_s *park) {
+	nsync_mu_lock (&park->mu);
+	nsync_cv_broadcast (&park->cv);
+	nsync_mu_unlock (&park->mu);
+}
+
+/* ---------- */
+
+/* The visible-readers table used by reader-biased mutexes; see the comment on
+   MU_RBIAS in common.h.
+
+   A thread uses only the entries in line nsync_thread_slot_() % RBIAS_LINES,
+   and for a given nsync_mu, only the one at index rbias_way(mu) within that
+   line.  So a writer need examine just one entry per line, and most threads
+   have a line to themselves.
+
+   An entry's state is 0 if the entry is free, and otherwise the rbias_id() of
+   the thread using it, with RBIAS_BUSY set while the entry is being claimed
+   and its mu field may not yet be valid.  A thread claims a free entry with a
+   CAS, then publishes the mu field by clearing RBIAS_BUSY, then checks that
+   MU_RBIAS is still set.  A revoking writer clears MU_RBIAS and then reads
+   each entry with a read-modify-write operation, so either the reader sees
+   MU_RBIAS clear, or the writer sees the claimed entry.
+
+   A writer that finds an entry still naming its mutex after spinning
+   briefly sets RBIAS_WAKE in the entry's state and blocks in the mutex's
+   mu_park[] entry.  A reader frees its entry with a CAS, and if RBIAS_WAKE
+   was set, wakes the park.  */
+#define RBIAS_LINES 256
+#define RBIAS_WAYS 4 /* entries per line */
+#define RBIAS_BUSY ((uint32_t) 1)
+#define RBIAS_WAKE ((uint32_t) 2) /* a writer waits for the entry to be freed */
+
+/* The number of calls to nsync_spin_delay_() after which a writer waiting
+   for a reader to free an entry blocks instead.  */
+#define RBIAS_REVOKE_SPINS 10
+
+/* The number of read acquisitions via mu->word, with no intervening write
+   acquisition, after which a reader sets MU_RBIAS.  Must fit in
+   MU_RBIAS_READS.  */
+#define RBIAS_ENABLE_READS 64
+
+struct rbias_entry_s {
+	nsync_atomic_uint32_ state;
+	const nsync_mu *mu; /* valid when state is non-zero and RBIAS_BUSY is clear */
+};
+
+static struct rbias_line_s {
+	struct rbias_entry_s entry[RBIAS_WAYS];
+} rbias_table[RBIAS_LINES];
+
+static nsync_atomic_uint32_ next_rbias_id; /* used to allocate ids */
+static THREAD_LOCAL uint32_t rbias_id_for_thread; /* 0 until allocated */
+
+/* Return a non-zero identifier for the calling thread, distinct from those of
+   other live threads, with RBIAS_BUSY and RBIAS_WAKE clear.  */
+static uint32_t rbias_id (void) {
+	uint32_t id = rbias_id_for_thread;
+	if (id == 0) {
+		uint32_t old_value;
+		do {
+			old_value = ATM_LOAD (&next_rbias_id);
+		} while (!ATM_CAS (&next_rbias_id, old_value, old_value+1));
+		id = (1 + (old_value % 0x3fffffff)) << 2;
+		rbias_id_for_thread = id;
+	}
+	return (id);
+}
+
+/* Return the index within each line of the entries used for *mu. */
+static uint32_t rbias_way (const nsync_mu *mu) {
+	return (((uint32_t) (((uintptr_t) mu) / sizeof (*mu))) % RBIAS_WAYS);
+}
+
+/* Return the calling thread's entry for *mu. */
+static struct rbias_entry_s *rbias_entry (const nsync_mu *mu) {
+	return (&rbias_table[nsync_thread_slot_ () % RBIAS_LINES].entry[rbias_way (mu)]);
+}
+
+int nsync_mu_rbias_held_ (const nsync_mu *mu) {
+	int held = 0;
+	if ((ATM_LOAD (&mu->spin) & MU_RBIAS_MODE) != 0) {
+		struct rbias_entry_s *e = rbias_entry (mu);
+		held = ((ATM_LOAD (&e->state) & ~RBIAS_WAKE) == rbias_id () && e->mu == mu);
+	}
+	return (held);
+}
+
+/* Free the calling thread's entry *e, which names *mu, and wake any writer
+   waiting for it in nsync_mu_rbias_revoke_().  */
+static void rbias_release (struct rbias_entry_s *e, const nsync_mu *mu) {
+	struct mu_park_s *park = mu_park_for (mu); /* *mu may be freed once *e is */
+	uint32_t old_state;
+	do {
+		old_state = ATM_LOAD (&e->state);
+	} while (!ATM_CAS_REL (&e->state, old_state, 0)); /* release CAS */
+	if ((old_state & RBIAS_WAKE) != 0) {
+		mu_park_wake (park);
+	}
+}
+
+/* Attempt to acquire *mu in read mode via the visible-readers table, and
+   return non-zero iff successful.  */
+static int mu_rbias_rlock (nsync_mu *mu) {
+	int result = 0;
+	if ((ATM_LOAD (&mu->spin) & MU_RBIAS) != 0) {
+		struct rbias_entry_s *e = rbias_entry (mu);
+		uint32_t id = rbias_id ();
+		if (ATM_CAS_RELACQ (&e->state, 0, id | RBIAS_BUSY)) {
+			e->mu = mu;
+			ATM_STORE_REL (&e->state, id); /* release store */
+			if ((ATM_LOAD_ACQ (&mu->spin) & MU_RBIAS) != 0) {
+				result = 1;
+			} else {
+				/* A writer is revoking the bias. */
+				rbias_release (e, mu);
+			}
+		}
+	}
+	return (result);
+}
+
+/* If the calling thread holds *mu in read mode via the visible-readers table,
+   release it and return non-zero; otherwise return 0.  */
+static int mu_rbias_runlock (nsync_mu *mu) {
+	int result = 0;
+	if ((ATM_LOAD (&mu->spin) & MU_RBIAS_MODE) != 0) {
+		struct rbias_entry_s *e = rbias_entry (mu);
+		result = ((ATM_LOAD (&e->state) & ~RBIAS_WAKE) == rbias_id () && e->mu == mu);
+		if (result) {
+			rbias_release (e, mu);
+		}
+	}
+	return (result);
+}
+
+/* Called by a thread that has just acquired *mu in read mode via mu->word.
+   If *mu is in reader-bias mode, count the read, and set MU_RBIAS if enough
+   reads have occurred since the last write.  */
+static void mu_rbias_count_read (nsync_mu *mu) {
+	uint32_t old_spin = ATM_LOAD (&mu->spin);
+	while ((old_spin & (MU_RBIAS_MODE | MU_RBIAS)) == MU_RBIAS_MODE) {
+		uint32_t new_spin = old_spin + MU_RBIAS_READ;
+		if ((new_spin & MU_RBIAS_READS) >= RBIAS_ENABLE_READS * MU_RBIAS_READ) {
+			new_spin = (new_spin & ~MU_RBIAS_READS) | MU_RBIAS;
+		}
+		if (ATM_CAS (&mu->spin, old_spin, new_spin)) {
+			break;
+		}
+		old_spin = ATM_LOAD (&mu->spin);
+	}
+}
+
+/* Return e->state, read with a read-modify-write operation so that it is
+   ordered with the CAS of a thread claiming *e.  */
+static uint32_t rbias_state (struct rbias_entry_s *e) {
+	uint32_t state;
+	do {
+		state = ATM_LOAD (&e->state);
+	} while (!ATM_CAS_RELACQ (&e->state, state, state));
+	return (state);
+}
+
+/* Block until *e no longer has state state|RBIAS_WAKE and names *mu, or
+   until abs_deadline expires or cancel_note is notified.  */
+static void rbias_park (nsync_mu *mu, struct rbias_entry_s *e, uint32_t state,
+			nsync_time abs_deadline, nsync_note cancel_note) {
+	struct mu_park_s *park = mu_park_for (mu);
+	int outcome = 0;
+	nsync_mu_lock (&park->mu);
+	while (outcome == 0 && ATM_LOAD_ACQ (&e->state) == (state | RBIAS_WAKE) && e->mu == mu) {
+		outcome = nsync_cv_wait_with_deadline (&park->cv, &park->mu,
+						       abs_deadline, cancel_note);
+	}
+	nsync_mu_unlock (&park->mu);
+}
+
+int nsync_mu_rbias_revoke_ (nsync_mu *mu, nsync_time abs_deadline, nsync_note cancel_note) {
+	int outcome = 0;
+	uint32_t old_spin = ATM_LOAD (&mu->spin);
+	if ((old_spin & MU_RBIAS) != 0) {
+		uint32_t way = rbias_way (mu);
+		uint32_t i;
+		ATM_STORE (&mu->spin, old_spin & ~MU_RBIAS);
+		for (i = 0; outcome == 0 && i != RBIAS_LINES; i++) {
+			struct rbias_entry_s *e = &rbias_table[i].entry[way];
+			unsigned attempts = 0;
+			unsigned spins = 0;
+			uint32_t state = rbias_state (e);
+			while (outcome == 0 && state != 0 &&
+			       ((state & RBIAS_BUSY) != 0 || e->mu == mu)) {
+				if (cancel_note != NULL && nsync_note_is_notified (cancel_note)) {
+					outcome = ECANCELED;
+				} else if (nsync_time_expired_ (abs_deadline)) {
+					outcome = ETIMEDOUT;
+				} else if (spins < RBIAS_REVOKE_SPINS || (state & RBIAS_BUSY) != 0) {
+					/* Claims are brief, so spin on RBIAS_BUSY. */
+					attempts = nsync_spin_delay_ (attempts);
+					spins++;
+				} else if ((state & RBIAS_WAKE) != 0 ||
+					   ATM_CAS (&e->state, state, state | RBIAS_WAKE)) {
+					rbias_park (mu, e, state & ~RBIAS_WAKE, abs_deadline, cancel_note);
+				}
+				state = rbias_state (e);
+			}
+		}
+	}
+	return (outcome);
+}
+
+/* Called by a thread holding *mu in write mode, after
+   nsync_mu_rbias_revoke_() failed, and before it releases *mu:  set MU_RBIAS
+   again, because readers still hold *mu via the visible-readers table.  */
+static void mu_rbias_restore (nsync_mu *mu) {
+	ATM_STORE (&mu->spin, ATM_LOAD (&mu->spin) | MU_RBIAS);
+}
+
+int nsync_mu_rbias_unbias_ (nsync_mu *mu) {
+	int result = mu_rbias_runlock (mu);
+	if (result) {
+		nsync_mu_rlock_word_ (mu);
+	}
+	return (result);
+}
+
+/* ---------- */
+
 /* Release the mutex spinlock. */
 static void mu_release_spinlock (nsync_mu *mu) {
 	uint32_t old_word = ATM_LOAD (&mu->word);
@@ -39,21 +302,322 @@ static void mu_release_spinlock (nsync_mu *mu) {
 	}
 }
 
-/* Lock *mu using the specified lock_type, waiting on *w if necessary.
+/* Bounds on the number of iterations nsync_mu_lock_slow_() spins on a held
+   mutex before queueing; see the comment on MU_SPIN_BUDGET in common.h.  The
+   budget starts at SPIN_BUDGET_INITIAL, moves towards twice the number of
+   iterations after which spinning threads acquire, and shrinks when spinning
+   threads fail to acquire.  It never falls below SPIN_BUDGET_MIN, so that a
+   mutex whose hold times shorten can relearn a larger budget.  */
+#define SPIN_BUDGET_INITIAL 100
+#define SPIN_BUDGET_MIN 10
+
+static nsync_atomic_uint32_ spinners; /* threads spinning in nsync_mu_lock_slow_() */
+
+/* Return the number of iterations the calling thread should spin on *mu before
+   queueing itself.  */
+static uint32_t mu_spin_budget (nsync_mu *mu) {
+	uint32_t limit = nsync_mu_spin_limit_ ();
+	uint32_t budget = 0;
+	if (limit != 0) {
+		budget = ATM_LOAD (&mu->spin) & MU_SPIN_BUDGET;
+		if (budget == 0) {
+			budget = SPIN_BUDGET_INITIAL;
+		}
+		budget = MIN_ (budget, limit);
+	}
+	return (budget);
+}
+
+/* Update the spin budget of *mu, which the calling thread holds in write mode.
+   If spins!=0, the thread acquired after spinning that many iterations; otherwise
+   it spun for its entire budget and then had to block.  */
+static void mu_spin_learn (nsync_mu *mu, uint32_t spins) {
+	uint32_t old_spin = ATM_LOAD (&mu->spin);
+	uint32_t budget = old_spin & MU_SPIN_BUDGET;
+	uint32_t limit = nsync_mu_spin_limit_ ();
+	if (budget == 0) {
+		budget = SPIN_BUDGET_INITIAL;
+	}
+	if (spins != 0) {
+		uint32_t target = MIN_ (2 * spins, limit);
+		if (target > budget) {
+			budget += (target - budget + 7) / 8;
+		} else {
+			budget -= (budget - target) / 8;
+		}
+	} else {
+		budget -= budget / 4;
+	}
+	budget = MAX_ (MIN_ (budget, limit), SPIN_BUDGET_MIN);
+	ATM_STORE (&mu->spin, (old_spin & ~MU_SPIN_BUDGET) | budget);
+}
+
+/* Return whether a thread spinning on *mu, whose word was old_word, might
+   soon see it released:  false if a writer holds it and that writer is known
+   to be blocked.  Readers are assumed to be running.  */
+static int mu_holder_running (nsync_mu *mu, uint32_t old_word) {
+	int running = 1;
+	if ((old_word & MU_WLOCK) != 0) {
+		uint32_t slot = ATM_LOAD (&mu->spin) >> MU_SPIN_SLOT_SHIFT;
+		running = (slot == 0 || ATM_LOAD (&nsync_slot_blocked_[slot].n) == 0);
+	}
+	return (running);
+}
+
+/* Attempt to count the calling thread as a spinner, and return whether it
+   succeeded.  On a loaded machine, spinners would take processors from lock
+   holders, so the number of concurrent spinners is bounded.  */
+static int mu_start_spinning (void) {
+	uint32_t max_spinners = nsync_mu_max_spinners_ ();
+	uint32_t old_value;
+	do {
+		old_value = ATM_LOAD (&spinners);
+	} while (old_value < max_spinners && !ATM_CAS (&spinners, old_value, old_value+1));
+	return (old_value < max_spinners);
+}
+
+/* Stop counting the calling thread as a spinner. */
+static void mu_stop_spinning (void) {
+	uint32_t old_value;
+	do {
+		old_value = ATM_LOAD (&spinners);
+	} while (!ATM_CAS (&spinners, old_value, old_value-1));
+}
+
+/* If the thread that woke *w passed it ownership of *mu, which happens only
+   if *mu is in fair mode, clear the indication and return non-zero.  In that
+   case *mu is already held in the mode the waiter requested, and MU_LONG_WAIT
+   is cleared if long_wait is non-zero.  */
+static int mu_take_handoff (nsync_mu *mu, waiter *w, uint32_t long_wait) {
+	int handed_off = ((w->flags & WAITER_HANDOFF) != 0);
+	if (handed_off) {
+		w->flags &= ~WAITER_HANDOFF;
+		if (long_wait != 0) {
+			uint32_t old_word;
+			do {
+				old_word = ATM_LOAD (&mu->word);
+			} while (!ATM_CAS (&mu->word, old_word, old_word & ~long_wait));
+		}
+	}
+	return (handed_off);
+}
+
+/* The calling thread has just acquired *mu in mode l_type.  If that is write
+   mode, record the thread as the owner and revoke any reader bias, waiting
+   for readers that rely on it until abs_deadline or until cancel_note is
+   notified.  Return 0 if *mu remains held, or otherwise release *mu and
+   return ETIMEDOUT or ECANCELED.  */
+static int mu_acquired (nsync_mu *mu, lock_type *l_type,
+			nsync_time abs_deadline, nsync_note cancel_note) {
+	int outcome = 0;
+	if (l_type == nsync_writer_type_) {
+		MU_SET_OWNER_ (mu);
+		if ((ATM_LOAD (&mu->spin) & MU_RBIAS) != 0) {
+			outcome = nsync_mu_rbias_revoke_ (mu, abs_deadline, cancel_note);
+			if (outcome != 0) {
+				mu_rbias_restore (mu);
+				RWLOCK_TRYACQUIRE (1, mu, 1);
+				nsync_mu_unlock (mu);
+			}
+		}
+	}
+	return (outcome);
+}
+
+/* Threads that block in nsync_mu_lock_slow_with_deadline_() for the first
+   time, with no operation to run, queue without *mu's spinlock:  they push
+   the ids of their waiters (see nsync_waiter_by_id_()) with a CAS on a
+   pending stack chosen by *mu's address, and a thread that later holds the
+   spinlock moves them to mu->waiters.  The stacks are kept here rather than
+   in each nsync_mu so that an nsync_mu stays two words and a pointer.  A
+   stack may hold the waiters of several mutexes, so each waiter records its
+   mutex in w->pending_mu, and a thread removes only its own mutex's waiters,
+   while holding the stack's lock; as only that thread pops, there's no ABA
+   problem.  The other enqueues, and all removals and condition evaluations,
+   remain under *mu's spinlock, and each thread that holds the spinlock and
+   examines mu->waiters first calls nsync_mu_drain_pending_().  */
+#define PENDING_STACKS 64
+
+static union pending_stack_u {
+	struct {
+		nsync_atomic_uint32_ head; /* id of the last waiter pushed, or 0 */
+		nsync_atomic_uint32_ lock; /* spinlock; held while waiters are removed */
+	} s;
+	char pad[64]; /* assumed cache line size */
+} pending_stack[PENDING_STACKS];
+
+/* Return the pending stack for *mu. */
+static union pending_stack_u *mu_pending_stack (const nsync_mu *mu) {
+	return (&pending_stack[(((uintptr_t) mu) / 16) % PENDING_STACKS]);
+}
+
+/* Move the waiters for *mu on its pending stack to the end of mu->waiters,
+   in the order they were pushed.  Requires that the caller hold *mu's
+   spinlock.  */
+void nsync_mu_drain_pending_ (nsync_mu *mu) {
+	union pending_stack_u *ps = mu_pending_stack (mu);
+	if (ATM_LOAD (&ps->s.head) != 0) {
+		nsync_dll_list_ pending = NULL;
+		waiter *prev = NULL; /* the last waiter kept on the stack */
+		uint32_t id;
+		nsync_spin_test_and_set_ (&ps->s.lock, 1, 1, 0);
+		id = ATM_LOAD_ACQ (&ps->s.head);
+		while (id != 0) {
+			waiter *w = nsync_waiter_by_id_ (id);
+			uint32_t next = w->pending_next;
+			if (w->pending_mu != mu) {
+				prev = w;
+			} else {
+				if (prev != NULL) {
+					prev->pending_next = next;
+				} else if (!ATM_CAS_ACQ (&ps->s.head, id, next)) {
+					/* Others were pushed above *w; unlink it
+					   from the last of them.  */
+					prev = nsync_waiter_by_id_ (ATM_LOAD_ACQ (&ps->s.head));
+					while (prev->pending_next != id) {
+						prev = nsync_waiter_by_id_ (prev->pending_next);
+					}
+					prev->pending_next = next;
+				}
+				pending = nsync_dll_make_first_in_list_ (pending, &w->nw.q);
+			}
+			id = next;
+		}
+		ATM_STORE_REL (&ps->s.lock, 0);
+		if (pending != NULL) {
+			mu->waiters = nsync_dll_make_last_in_list_ (mu->waiters,
+								    nsync_dll_last_ (pending));
+		}
+	}
+}
+
+/* The calling thread, queued on *w in *mu's queue by nsync_mu_lock_slow_with_deadline_()
+   with w->remove_count==remove_count, timed out or was cancelled.  Remove *w
+   from the queue and return non-zero, unless another thread has already
+   removed it to wake it, in which case return 0.  If long_wait is non-zero,
+   clear MU_LONG_WAIT, which was set by this thread.  */
+static int mu_dequeue (nsync_mu *mu, waiter *w, uint32_t remove_count, uint32_t long_wait) {
+	int removed = 0;
+	uint32_t clear = MU_SPINLOCK;
+	uint32_t old_word;
+	nsync_spin_test_and_set_or_sleep_ (&mu->word, MU_SPINLOCK, MU_SPINLOCK, 0);
+	nsync_mu_drain_pending_ (mu);
+	/* The check of remove_count confirms that *w is still governed by
+	   *mu's spinlock; see mu_try_acquire_after_timeout_or_cancel().  */
+	if (ATM_LOAD (&w->nw.waiting) != 0 && remove_count == ATM_LOAD (&w->remove_count)) {
+		mu->waiters = nsync_remove_from_mu_queue_ (mu->waiters, &w->nw.q);
+		ATM_STORE (&w->nw.waiting, 0);
+		removed = 1;
+		clear |= long_wait;
+		if (nsync_dll_is_empty_ (mu->waiters)) {
+			clear |= MU_WAITING | MU_WRITER_WAITING | MU_CONDITION | MU_ALL_FALSE;
+		}
+	}
+	do {
+		old_word = ATM_LOAD (&mu->word);
+	} while (!ATM_CAS_REL (&mu->word, old_word, old_word & ~clear));
+	return (removed);
+}
+
+/* Queue *w, which has w->nw.waiting==1 and w->remove_count==remove_count,
+   to wait for *mu in mode l_type, by pushing it on *mu's pending stack, and then
+   mark *mu as having waiters, as acquiring the spinlock to queue would.  If
+   meanwhile *mu can be acquired (zero_to_acquire is as in
+   nsync_mu_lock_slow_with_deadline_()), instead remove *w from the queue
+   and return 0, so that the caller may retry.  Otherwise, return 1; *w may
+   already have been woken.  */
+static int mu_push_waiter (nsync_mu *mu, waiter *w, uint32_t remove_count,
+			   lock_type *l_type, uint32_t zero_to_acquire) {
+	unsigned attempts = 0;
+	uint32_t head;
+	union pending_stack_u *ps = mu_pending_stack (mu);
+	w->pending_mu = mu;
+	do {
+		head = ATM_LOAD (&ps->s.head);
+		w->pending_next = head;
+	} while (!ATM_CAS_REL (&ps->s.head, head, w->id));
+	for (;;) {
+		uint32_t old_word = ATM_LOAD (&mu->word);
+		if (ATM_LOAD_ACQ (&w->nw.waiting) == 0) {
+			return (1);
+		} else if ((old_word & zero_to_acquire) == 0) {
+			/* The holder released *mu before seeing *w. */
+			return (!mu_dequeue (mu, w, remove_count, 0));
+		} else if ((old_word & MU_SPINLOCK) == 0 &&
+			   ATM_CAS_REL (&mu->word, old_word,
+					(old_word|l_type->set_when_waiting) & ~MU_ALL_FALSE)) {
+			/* The CAS orders the push before the next
+			   acquisition of the spinlock, whose holder will
+			   therefore find *w.  */
+			return (1);
+		} else {
+			attempts = nsync_spin_delay_ (attempts);
+		}
+	}
+}
+
+/* The calling thread was woken from *mu's queue after it timed out or was
+   cancelled, so it may be *mu's designated waker.  Acquire *mu in mode
+   l_type if that can be done without blocking, and return 0.  Otherwise,
+   give up the role of designated waker, so that the holder of *mu wakes
+   another waiter when it releases *mu, and return outcome.  MU_LONG_WAIT is
+   cleared if long_wait is non-zero.  */
+static int mu_acquire_or_abandon (nsync_mu *mu, lock_type *l_type,
+				  uint32_t long_wait, int outcome) {
+	unsigned attempts = 0;
+	uint32_t zero_to_acquire = l_type->zero_to_acquire &
+				   ~(MU_WRITER_WAITING | MU_LONG_WAIT);
+	for (;;) {
+		uint32_t old_word = ATM_LOAD (&mu->word);
+		if ((old_word & zero_to_acquire) == 0) {
+			if (ATM_CAS_ACQ (&mu->word, old_word,
+					 (old_word+l_type->add_to_acquire) &
+					  ~(MU_DESIG_WAKER|long_wait|l_type->clear_on_acquire))) {
+				return (0);
+			}
+		} else if ((old_word & MU_SPINLOCK) == 0 && (old_word & MU_ANY_LOCK) != 0) {
+			/* *mu is held; its holder will see the waiters on release. */
+			if (ATM_CAS_REL (&mu->word, old_word,
+					 old_word & ~(MU_DESIG_WAKER|long_wait))) {
+				return (outcome);
+			}
+		} else {
+			attempts = nsync_spin_delay_ (attempts);
+		}
+	}
+}
+
+/* Lock *mu using the specified lock_type, waiting on *w if necessary, until
+   abs_deadline or until cancel_note is notified.  Return 0 if *mu was
+   acquired, and otherwise ETIMEDOUT or ECANCELED.
+   If w->run is non-nil, the holder of *mu may instead run w->run while *w is
+   queued, in which case WAITER_RAN is set in w->flags, and 0 is returned
+   without acquiring *mu.
    "clear" should be zero if the thread has not previously slept on *mu, and
    MU_DESIG_WAKER if it has; this represents bits that nsync_mu_lock_slow_() must clear when
    it either acquires or sleeps on *mu.  The caller owns *w on return; it is in a valid
    state to be returned to the free pool. */
-void nsync_mu_lock_slow_ (nsync_mu *mu, waiter *w, uint32_t clear, lock_type *l_type) {
+int nsync_mu_lock_slow_with_deadline_ (nsync_mu *mu, waiter *w, uint32_t clear,
+				       lock_type *l_type, nsync_time abs_deadline,
+				       nsync_note cancel_note) {
 	uint32_t zero_to_acquire;
 	uint32_t wait_count;
 	uint32_t long_wait;
+	uint32_t spin_budget; /* iterations to spin on a held mutex before queueing */
+	uint32_t spins;  /* iterations spun since entry or last wakeup */
+	int spinning;    /* whether this thread is counted in "spinners" */
+	int spin_failed; /* whether this thread exhausted its spin budget and blocked */
+	uint32_t remove_count; /* w->remove_count when *w was last queued */
 	unsigned attempts = 0; /* attempt count; used for spinloop backoff */
 	w->cv_mu = NULL;      /* not a cv wait */
 	w->cond.f = NULL; /* Not using a conditional critical section. */
 	w->cond.v = NULL;
 	w->cond.eq = NULL;
 	w->l_type = l_type;
+	if (mu_take_handoff (mu, w, 0)) {
+		/* woken from *mu's queue by an unlocker that passed us *mu */
+		return (mu_acquired (mu, l_type, abs_deadline, cancel_note));
+	}
 	zero_to_acquire = l_type->zero_to_acquire;
 	if (clear != 0) {
 		/* Only the constraints of mutual exclusion should stop a designated waker. */
@@ -61,26 +625,56 @@ void nsync_mu_lock_slow_ (nsync_mu *mu, waiter *w, uint32_t clear, lock_type *l_
 	}
 	wait_count = 0; /* number of times we waited, and were woken. */
 	long_wait = 0; /* set to MU_LONG_WAIT when wait_count gets large */
+	spin_budget = mu_spin_budget (mu);
+	spins = 0;
+	spinning = 0;
+	spin_failed = 0;
 	for (;;) {
 		uint32_t old_word = ATM_LOAD (&mu->word);
+		int queued = 0; /* whether *w was queued in this iteration */
 		if ((old_word & zero_to_acquire) == 0) {
 			/* lock can be acquired; try to acquire, possibly
 			   clearing MU_DESIG_WAKER and MU_LONG_WAIT.  */
 			if (ATM_CAS_ACQ (&mu->word, old_word,
 					 (old_word+l_type->add_to_acquire) &
 					  ~(clear|long_wait|l_type->clear_on_acquire))) {
-				return;
+				if (spinning) {
+					mu_stop_spinning ();
+				}
+				if (l_type == nsync_writer_type_) {
+					if (wait_count == 0 && spins != 0) {
+						mu_spin_learn (mu, spins);
+					} else if (spin_failed) {
+						mu_spin_learn (mu, 0);
+					}
+				}
+				return (mu_acquired (mu, l_type, abs_deadline, cancel_note));
 			}
+		} else if (spins < spin_budget && w->run == NULL &&
+			   (old_word & zero_to_acquire & ~MU_ANY_LOCK) == 0 &&
+			   mu_holder_running (mu, old_word) &&
+			   (spinning || (spinning = mu_start_spinning ()) != 0)) {
+			/* Only the lock being held prevents acquisition,
+			   and the holder may release it soon; spin rather
+			   than queue.  */
+			spins++;
+			CPU_RELAX_ ();
+		} else if (wait_count == 0 && clear == 0 && w->run == NULL && w->id != 0) {
+			/* First wait goes to end of queue, without the spinlock. */
+			ATM_STORE (&w->nw.waiting, 1);
+			remove_count = ATM_LOAD (&w->remove_count);
+			queued = mu_push_waiter (mu, w, remove_count, l_type, zero_to_acquire);
 		} else if ((old_word&MU_SPINLOCK) == 0 &&
 			   ATM_CAS_ACQ (&mu->word, old_word,
 					(old_word|MU_SPINLOCK|long_wait|
 					 l_type->set_when_waiting) & ~(clear | MU_ALL_FALSE))) {
-
 			/* Spinlock is now held, and lock is held by someone
 			   else; MU_WAITING has also been set; queue ourselves.
 			   There's no need to adjust same_condition here,
 			   because w.condition==NULL.  */
 			ATM_STORE (&w->nw.waiting, 1);
+			remove_count = ATM_LOAD (&w->remove_count);
+			nsync_mu_drain_pending_ (mu);
 			if (wait_count == 0) {
 				/* first wait goes to end of queue */
 				mu->waiters = nsync_dll_make_last_in_list_ (mu->waiters,
@@ -97,10 +691,63 @@ void nsync_mu_lock_slow_ (nsync_mu *mu, waiter *w, uint32_t clear, lock_type *l_
 			   holder could be concurrently unlocking, even though
 			   we hold the spinlock. */
 			mu_release_spinlock (mu);
+			queued = 1;
+		} else {
+			attempts = nsync_spin_delay_ (attempts);
+		}
+		if (queued) {
+			int sem_outcome;
+			if (spinning) {
+				mu_stop_spinning ();
+				spinning = 0;
+			}
+			if (wait_count == 0 && spin_budget != 0 && spins >= spin_budget) {
+				spin_failed = 1;
+			}
 
-			/* wait until awoken. */
+			/* wait until awoken, or a timeout or cancellation. */
+			sem_outcome = 0;
+			attempts = 0;
 			while (ATM_LOAD_ACQ (&w->nw.waiting) != 0) { /* acquire load */
-				nsync_mu_semaphore_p (&w->sem);
+				if (sem_outcome == 0) {
+					if (l_type == nsync_reader_type_) {
+						/* Readers queued together are
+						   usually woken together. */
+						nsync_mu_semaphore_set_group (&w->sem, (uintptr_t) mu);
+					}
+					sem_outcome = nsync_sem_wait_with_cancel_ (w, abs_deadline,
+										   cancel_note);
+					nsync_mu_semaphore_set_group (&w->sem, 0);
+					if (sem_outcome != 0 &&
+					    mu_dequeue (mu, w, remove_count, long_wait)) {
+						return (sem_outcome);
+					}
+				} else {
+					/* Being woken; will ultimately yield. */
+					attempts = nsync_spin_delay_ (attempts);
+				}
+			}
+			if ((w->flags & WAITER_RAN) != 0) {
+				/* The holder ran w->run, and removed *w from
+				   the queue without making this thread a
+				   designated waker.  */
+				if (long_wait != 0) {
+					uint32_t old_word;
+					do {
+						old_word = ATM_LOAD (&mu->word);
+					} while (!ATM_CAS (&mu->word, old_word, old_word & ~long_wait));
+				}
+				return (0);
+			}
+			if (mu_take_handoff (mu, w, long_wait)) {
+				return (mu_acquired (mu, l_type, abs_deadline, cancel_note));
+			}
+			if (sem_outcome != 0) {
+				/* Woken after timing out or being cancelled. */
+				if (mu_acquire_or_abandon (mu, l_type, long_wait, sem_outcome) != 0) {
+					return (sem_outcome);
+				}
+				return (mu_acquired (mu, l_type, abs_deadline, cancel_note));
 			}
 			wait_count++;
 			/* If the thread has been woken more than this many
@@ -116,15 +763,23 @@ void nsync_mu_lock_slow_ (nsync_mu *mu, waiter *w, uint32_t clear, lock_type *l_
 			}
 
 			attempts = 0;
+			spins = 0;
 			clear = MU_DESIG_WAKER;
 			/* Threads that have been woken at least once don't care
 			   about waiting writers or long waiters. */
 			zero_to_acquire &= ~(MU_WRITER_WAITING | MU_LONG_WAIT);
 		}
-		attempts = nsync_spin_delay_ (attempts);
 	}
 }
 
+/* Lock *mu using the specified lock_type, waiting on *w if necessary.
+   "clear" is as for nsync_mu_lock_slow_with_deadline_().  The caller owns *w
+   on return; it is in a valid state to be returned to the free pool. */
+void nsync_mu_lock_slow_ (nsync_mu *mu, waiter *w, uint32_t clear, lock_type *l_type) {
+	nsync_mu_lock_slow_with_deadline_ (mu, w, clear, l_type,
+					   nsync_time_no_deadline, NULL);
+}
+
 /* Attempt to acquire *mu in writer mode without blocking, and return non-zero
    iff successful.  Return non-zero with high probability if *mu was free on
    entry.  */
@@ -139,8 +794,18 @@ int nsync_mu_trylock (nsync_mu *mu) {
 			  ATM_CAS_ACQ (&mu->word, old_word,
 				       (old_word + MU_WADD_TO_ACQUIRE) & ~MU_WCLEAR_ON_ACQUIRE));
 	}
+	if (result) {
+		MU_SET_OWNER_ (mu);
+	}
 	IGNORE_RACES_END ();
 	RWLOCK_TRYACQUIRE (result, mu, 1);
+	if (result && (ATM_LOAD (&mu->spin) & MU_RBIAS) != 0 &&
+	    nsync_mu_rbias_revoke_ (mu, nsync_time_zero, NULL) != 0) {
+		/* Readers hold *mu via the visible-readers table. */
+		mu_rbias_restore (mu);
+		nsync_mu_unlock (mu);
+		result = 0;
+	}
 	return (result);
 }
 
@@ -157,10 +822,38 @@ void nsync_mu_lock (nsync_mu *mu) {
 			nsync_waiter_free_ (w);
 		}
 	}
+	MU_SET_OWNER_ (mu);
+	MU_RBIAS_REVOKE_ (mu);
 	IGNORE_RACES_END ();
 	RWLOCK_TRYACQUIRE (1, mu, 1);
 }
 
+/* Block until *mu is free and then acquire it in writer mode, unless
+   abs_deadline expires or cancel_note is notified first.  */
+int nsync_mu_lock_with_deadline (nsync_mu *mu, nsync_time abs_deadline,
+				 nsync_note cancel_note) {
+	int outcome;
+	IGNORE_RACES_START ();
+	if (ATM_CAS_ACQ (&mu->word, 0, MU_WADD_TO_ACQUIRE)) { /* acquire CAS */
+		outcome = mu_acquired (mu, nsync_writer_type_, abs_deadline, cancel_note);
+	} else {
+		uint32_t old_word = ATM_LOAD (&mu->word);
+		if ((old_word&MU_WZERO_TO_ACQUIRE) == 0 &&
+		    ATM_CAS_ACQ (&mu->word, old_word,
+				 (old_word+MU_WADD_TO_ACQUIRE) & ~MU_WCLEAR_ON_ACQUIRE)) {
+			outcome = mu_acquired (mu, nsync_writer_type_, abs_deadline, cancel_note);
+		} else {
+			waiter *w = nsync_waiter_new_ ();
+			outcome = nsync_mu_lock_slow_with_deadline_ (mu, w, 0, nsync_writer_type_,
+								     abs_deadline, cancel_note);
+			nsync_waiter_free_ (w);
+		}
+	}
+	IGNORE_RACES_END ();
+	RWLOCK_TRYACQUIRE (outcome == 0, mu, 1);
+	return (outcome);
+}
+
 /* Attempt to acquire *mu in reader mode without blocking, and return non-zero
    iff successful.  Returns non-zero with high probability if *mu was free on
    entry.  It may fail to acquire if a writer is waiting, to avoid starvation.
@@ -168,22 +861,29 @@ void nsync_mu_lock (nsync_mu *mu) {
 int nsync_mu_rtrylock (nsync_mu *mu) {
 	int result;
 	IGNORE_RACES_START ();
-	if (ATM_CAS_ACQ (&mu->word, 0, MU_RADD_TO_ACQUIRE)) { /* acquire CAS */
+	if (mu_rbias_rlock (mu)) {
 		result = 1;
 	} else {
-		uint32_t old_word = ATM_LOAD (&mu->word);
-		result = ((old_word&MU_RZERO_TO_ACQUIRE) == 0 &&
-			  ATM_CAS_ACQ (&mu->word, old_word,
-				       (old_word+MU_RADD_TO_ACQUIRE) & ~MU_RCLEAR_ON_ACQUIRE));
+		if (ATM_CAS_ACQ (&mu->word, 0, MU_RADD_TO_ACQUIRE)) { /* acquire CAS */
+			result = 1;
+		} else {
+			uint32_t old_word = ATM_LOAD (&mu->word);
+			result = ((old_word&MU_RZERO_TO_ACQUIRE) == 0 &&
+				  ATM_CAS_ACQ (&mu->word, old_word,
+					       (old_word+MU_RADD_TO_ACQUIRE) & ~MU_RCLEAR_ON_ACQUIRE));
+		}
+		if (result) {
+			mu_rbias_count_read (mu);
+		}
 	}
 	IGNORE_RACES_END ();
 	RWLOCK_TRYACQUIRE (result, mu, 0);
 	return (result);
 }
 
-/* Block until *mu can be acquired in reader mode and then acquire it. */
-void nsync_mu_rlock (nsync_mu *mu) {
-	IGNORE_RACES_START ();
+/* Block until *mu can be acquired in reader mode via mu->word and then
+   acquire it. */
+void nsync_mu_rlock_word_ (nsync_mu *mu) {
 	if (!ATM_CAS_ACQ (&mu->word, 0, MU_RADD_TO_ACQUIRE)) { /* acquire CAS */
 		uint32_t old_word = ATM_LOAD (&mu->word);
 		if ((old_word&MU_RZERO_TO_ACQUIRE) != 0 ||
@@ -194,6 +894,60 @@ void nsync_mu_rlock (nsync_mu *mu) {
 			nsync_waiter_free_ (w);
 		}
 	}
+	mu_rbias_count_read (mu);
+}
+
+/* Block until *mu can be acquired in reader mode and then acquire it. */
+void nsync_mu_rlock (nsync_mu *mu) {
+	IGNORE_RACES_START ();
+	if (!mu_rbias_rlock (mu)) {
+		nsync_mu_rlock_word_ (mu);
+	}
+	IGNORE_RACES_END ();
+	RWLOCK_TRYACQUIRE (1, mu, 0);
+}
+
+/* Block until *mu can be acquired in reader mode and then acquire it, unless
+   abs_deadline expires or cancel_note is notified first.  */
+int nsync_mu_rlock_with_deadline (nsync_mu *mu, nsync_time abs_deadline,
+				  nsync_note cancel_note) {
+	int outcome = 0;
+	IGNORE_RACES_START ();
+	if (!mu_rbias_rlock (mu)) {
+		if (!ATM_CAS_ACQ (&mu->word, 0, MU_RADD_TO_ACQUIRE)) { /* acquire CAS */
+			uint32_t old_word = ATM_LOAD (&mu->word);
+			if ((old_word&MU_RZERO_TO_ACQUIRE) != 0 ||
+			    !ATM_CAS_ACQ (&mu->word, old_word,
+					  (old_word+MU_RADD_TO_ACQUIRE) & ~MU_RCLEAR_ON_ACQUIRE)) {
+				waiter *w = nsync_waiter_new_ ();
+				outcome = nsync_mu_lock_slow_with_deadline_ (
+					mu, w, 0, nsync_reader_type_, abs_deadline, cancel_note);
+				nsync_waiter_free_ (w);
+			}
+		}
+		if (outcome == 0) {
+			mu_rbias_count_read (mu);
+		}
+	}
+	IGNORE_RACES_END ();
+	RWLOCK_TRYACQUIRE (outcome == 0, mu, 0);
+	return (outcome);
+}
+
+/* Block until *mu can be acquired in upgradable read mode and then acquire
+   it. */
+void nsync_mu_ulock (nsync_mu *mu) {
+	IGNORE_RACES_START ();
+	if (!ATM_CAS_ACQ (&mu->word, 0, MU_UADD_TO_ACQUIRE)) { /* acquire CAS */
+		uint32_t old_word = ATM_LOAD (&mu->word);
+		if ((old_word&MU_UZERO_TO_ACQUIRE) != 0 ||
+		    !ATM_CAS_ACQ (&mu->word, old_word,
+				  (old_word+MU_UADD_TO_ACQUIRE) & ~MU_UCLEAR_ON_ACQUIRE)) {
+			waiter *w = nsync_waiter_new_ ();
+			nsync_mu_lock_slow_ (mu, w, 0, nsync_ulock_type_);
+			nsync_waiter_free_ (w);
+		}
+	}
 	IGNORE_RACES_END ();
 	RWLOCK_TRYACQUIRE (1, mu, 0);
 }
@@ -268,9 +1022,10 @@ void nsync_mu_unlock_slow_ (nsync_mu *mu, lock_type *l_type) {
 	for (;;) {
 		uint32_t old_word = ATM_LOAD (&mu->word);
 		int testing_conditions = ((old_word & MU_CONDITION) != 0);
+		int fair = ((ATM_LOAD (&mu->spin) & MU_FAIR) != 0);
 		uint32_t early_release_mu = l_type->add_to_acquire;
 		uint32_t late_release_mu = 0;
-		if (testing_conditions) {
+		if (testing_conditions || fair) {
 			/* Convert to a writer lock, and release later.
 			   - A writer lock is currently needed to test conditions
 			     because exclusive access is needed to the list to
@@ -281,19 +1036,31 @@ void nsync_mu_unlock_slow_ (nsync_mu *mu, lock_type *l_type) {
 			     cannot have made any new ones true because some
 			     might have been true before the reader region started.
 			     The MU_ALL_FALSE test below shortcuts the case where
-			     the conditions are known all to be false.  */
+			     the conditions are known all to be false.
+			   - In fair mode, the lock must not become free while
+			     the waiters are examined, so that it can be passed
+			     directly to the waiters that are woken.  */
 			early_release_mu = l_type->add_to_acquire - MU_WLOCK;
 			late_release_mu = MU_WLOCK;
 		}
 		if ((old_word&MU_WAITING) == 0 || (old_word&MU_DESIG_WAKER) != 0 ||
 		    (old_word & MU_RLOCK_FIELD) > MU_RLOCK ||
-		    (old_word & (MU_RLOCK|MU_ALL_FALSE)) == (MU_RLOCK|MU_ALL_FALSE)) {
+		    (old_word & (MU_RLOCK|MU_ALL_FALSE)) == (MU_RLOCK|MU_ALL_FALSE) ||
+		    (old_word & (MU_KEYS_FALSE|MU_ALL_FALSE)) == (MU_KEYS_FALSE|MU_ALL_FALSE)) {
 			/* no one to wake, there's a designated waker waking
-			   up, there are still readers, or it's a reader and all waiters
-			   have false conditions */
-			if (ATM_CAS_REL (&mu->word, old_word,
-					 (old_word - l_type->add_to_acquire) &
-					 ~l_type->clear_on_uncontended_release)) {
+			   up, there are still readers, it's a reader and all waiters
+			   have false conditions, or all waiters have keyed false
+			   conditions whose keys have not been touched */
+			uint32_t clear = l_type->clear_on_uncontended_release;
+			uint32_t new_word;
+			if ((old_word & MU_KEYS_FALSE) != 0) {
+				clear &= ~MU_ALL_FALSE;
+			}
+			new_word = (old_word - l_type->add_to_acquire) & ~clear;
+			if (ATM_CAS_REL (&mu->word, old_word, new_word)) {
+				if (MU_UPGRADE_READY_ (new_word)) {
+					nsync_mu_upgrade_wake_ (mu);
+				}
 				return;
 			}
 		} else if ((old_word&MU_SPINLOCK) == 0 &&
@@ -301,8 +1068,16 @@ void nsync_mu_unlock_slow_ (nsync_mu *mu, lock_type *l_type) {
                                            (old_word-early_release_mu)|MU_SPINLOCK|MU_DESIG_WAKER)) {
 			nsync_dll_list_ wake;
 			lock_type *wake_type;
+			uint32_t woken; /* number of waiters on wake */
 			uint32_t clear_on_release;
 			uint32_t set_on_release;
+			uint32_t handoff; /* lock bits passed to woken waiters */
+			uint32_t new_word; /* value stored by the release CAS */
+			int all_keyed; /* whether all false conditions found were keyed */
+			/* If *mu is being downgraded, it remains held in read mode,
+			   so only waiters that can acquire alongside a reader are
+			   woken.  */
+			int readers_only = (l_type == nsync_downgrade_type_);
 			/* The spinlock is now held, and we've set the
 			   designated wake flag, since we're likely to wake a
 			   thread that will become that designated waker.  If
@@ -320,23 +1095,28 @@ void nsync_mu_unlock_slow_ (nsync_mu *mu, lock_type *l_type) {
 			   were checking conditions, and terminates only if no
 			   new waiters arrive in one loop iteration.  */
 			nsync_dll_list_ waiters = NULL;
-			nsync_dll_list_ new_waiters = mu->waiters;
+			nsync_dll_list_ new_waiters;
+			nsync_mu_drain_pending_ (mu);
+			new_waiters = mu->waiters;
 			mu->waiters = NULL;
 
 			/* Remove a waiter from the queue, if possible. */
 			wake = NULL;       /* waiters to wake. */
 			wake_type = NULL; /* type of waiter(s) on wake, or NULL if wake is empty. */
+			woken = 0;
 			clear_on_release = MU_SPINLOCK;
 			set_on_release = MU_ALL_FALSE;
+			all_keyed = 1;
 			while (!nsync_dll_is_empty_ (new_waiters)) { /* some new waiters to consider */
 				p = nsync_dll_first_ (new_waiters);
 				if (testing_conditions) {
 					/* Should we continue to test conditions? */
-					if (wake_type == nsync_writer_type_) {
-						/* No, because we're already waking a writer,
-						   and need wake no others.*/
+					if (wake_type != NULL && wake_type != nsync_reader_type_) {
+						/* No, because we're already waking a writer
+						   (or an upgradable reader), and need wake
+						   no others.*/
 						testing_conditions = 0;
-					} else if (wake_type == NULL &&
+					} else if (wake_type == NULL && !readers_only &&
 						DLL_WAITER (p)->l_type != nsync_reader_type_ &&
 						DLL_WAITER (p)->cond.f == NULL) {
 						/* No, because we've woken no one, but the
@@ -358,7 +1138,8 @@ void nsync_mu_unlock_slow_ (nsync_mu *mu, lock_type *l_type) {
 				   "while (!nsync_dll_is_empty_ (new_waiters))" loop,
 				   and stop looking when we run out of waiters, or we find
 				   a writer to wake up. */
-				while (p != NULL && wake_type != nsync_writer_type_) {
+				while (p != NULL &&
+				       (wake_type == NULL || wake_type == nsync_reader_type_)) {
 					int p_has_condition;
 					next = nsync_dll_next_ (new_waiters, p);
 					p_has_condition = (DLL_WAITER (p)->cond.f != NULL);
@@ -366,8 +1147,25 @@ void nsync_mu_unlock_slow_ (nsync_mu *mu, lock_type *l_type) {
 						nsync_panic_ ("checking a waiter condition "
 							      "while unlocked\n");
 					}
-					if (p_has_condition && !condition_true (p)) {
+					if (readers_only &&
+					    (DLL_WAITER (p)->l_type->zero_to_acquire & MU_RLOCK) != 0) {
+						/* A writer, which cannot acquire while
+						   the downgraded lock is held. */
+						set_on_release |= DLL_WAITER (p)->l_type->set_when_waiting &
+								  MU_WRITER_WAITING;
+						set_on_release &= ~MU_ALL_FALSE;
+					} else if (p_has_condition && DLL_WAITER (p)->cond.key != NULL &&
+						   !nsync_mu_key_touched_ (mu, &DLL_WAITER (p)->cond)) {
+						/* A keyed condition whose key has not been
+						   touched since it was last found false, so
+						   it is still false.  Other waiters with the
+						   same condition may have other keys, so they
+						   are not skipped. */
+					} else if (p_has_condition && !condition_true (p)) {
 						/* condition is false */
+						if (DLL_WAITER (p)->cond.key == NULL) {
+							all_keyed = 0;
+						}
 						/* skip to the end of the same_condition group. */
 						next = skip_past_same_condition (new_waiters, p);
 					} else if (wake_type == NULL ||
@@ -377,11 +1175,13 @@ void nsync_mu_unlock_slow_ (nsync_mu *mu, lock_type *l_type) {
 							new_waiters, p);
 						wake = nsync_dll_make_last_in_list_ (wake, p);
 						wake_type = DLL_WAITER (p)->l_type;
+						woken++;
 					} else {
-						/* Failing to wake a writer
-						   that could acquire if it
-						   were first.  */
-						set_on_release |= MU_WRITER_WAITING;
+						/* Failing to wake a writer (or an
+						   upgradable reader) that could
+						   acquire if it were first.  */
+						set_on_release |= DLL_WAITER (p)->l_type->set_when_waiting &
+								  MU_WRITER_WAITING;
 						set_on_release &= ~MU_ALL_FALSE;
 					}
 					p = next;
@@ -406,6 +1206,7 @@ void nsync_mu_unlock_slow_ (nsync_mu *mu, lock_type *l_type) {
 				waiters = nsync_dll_make_last_in_list_ (waiters,
 								 nsync_dll_last_ (new_waiters));
 				/* Pick up the next set of new waiters. */
+				nsync_mu_drain_pending_ (mu);
 				new_waiters = mu->waiters;
 				mu->waiters = NULL;
 			}
@@ -421,6 +1222,11 @@ void nsync_mu_unlock_slow_ (nsync_mu *mu, lock_type *l_type) {
 			if ((set_on_release & MU_ALL_FALSE) == 0) {
 				/* If not explicitly setting MU_ALL_FALSE, clear it. */
 				clear_on_release |= MU_ALL_FALSE;
+			} else if (all_keyed && testing_conditions) {
+				set_on_release |= MU_KEYS_FALSE;
+			}
+			if ((set_on_release & MU_KEYS_FALSE) == 0) {
+				clear_on_release |= MU_KEYS_FALSE;
 			}
 
 			if (nsync_dll_is_empty_ (mu->waiters)) {
@@ -433,19 +1239,38 @@ void nsync_mu_unlock_slow_ (nsync_mu *mu, lock_type *l_type) {
 			   late_release_mu is non-zero.  Other bits are set or
 			   cleared according to whether we woke any threads,
 			   whether any waiters remain, and whether any of them
-			   are writers.  */
+			   are writers.
+			   In fair mode, the woken waiters acquire *mu in this
+			   thread's release CAS, so they need not race with
+			   other threads for it, and none is a designated
+			   waker.  That is possible only if no lock held by
+			   another thread excludes them.  */
 			old_word = ATM_LOAD (&mu->word);
-			while (!ATM_CAS_REL (&mu->word, old_word,
-					     ((old_word-late_release_mu)|set_on_release) &
-					     ~clear_on_release)) { /* release CAS */
+			for (;;) {
+				uint32_t clear = clear_on_release;
+				handoff = 0;
+				if (fair && woken != 0 &&
+				    ((old_word - late_release_mu) & wake_type->zero_to_acquire &
+				     (MU_ANY_LOCK | MU_ULOCK)) == 0) {
+					handoff = woken * wake_type->add_to_acquire;
+					clear |= MU_DESIG_WAKER;
+				}
+				new_word = ((old_word-late_release_mu+handoff)|set_on_release) & ~clear;
+				if (ATM_CAS_REL (&mu->word, old_word, new_word)) { /* release CAS */
+					break;
+				}
 				old_word = ATM_LOAD (&mu->word);
 			}
+			if (handoff != 0) {
+				for (p = nsync_dll_first_ (wake); p != NULL;
+				     p = nsync_dll_next_ (wake, p)) {
+					DLL_WAITER (p)->flags |= WAITER_HANDOFF;
+				}
+			}
 			/* Wake the waiters. */
-			for (p = nsync_dll_first_ (wake); p != NULL; p = next) {
-				next = nsync_dll_next_ (wake, p);
-				wake = nsync_dll_remove_ (wake, p);
-				ATM_STORE_REL (&DLL_NSYNC_WAITER (p)->waiting, 0);
-				nsync_mu_semaphore_v (&DLL_WAITER (p)->sem);
+			nsync_waiter_wakeup_list_ (wake);
+			if (MU_UPGRADE_READY_ (new_word)) {
+				nsync_mu_upgrade_wake_ (mu);
 			}
 			return;
 		}
@@ -492,7 +1317,9 @@ void nsync_mu_runlock (nsync_mu *mu) {
 	RWLOCK_RELEASE (mu, 0);
 	IGNORE_RACES_START ();
 	/* See comment in nsync_mu_unlock(). */
-	if (!ATM_CAS_REL (&mu->word, MU_RLOCK, 0)) {
+	if (mu_rbias_runlock (mu)) {
+		/* Released the hold in the visible-readers table. */
+	} else if (!ATM_CAS_REL (&mu->word, MU_RLOCK, 0)) {
 		uint32_t old_word = ATM_LOAD (&mu->word);
                 /* Sanity check:  mutex must not be held in write mode and
                    reader count must not be 0.  */
@@ -514,11 +1341,320 @@ void nsync_mu_runlock (nsync_mu *mu) {
 		} else if (!ATM_CAS_REL (&mu->word, old_word, old_word - MU_RLOCK)) {
 			/* CAS attempt failed, so take slow path. */
 			nsync_mu_unlock_slow_ (mu, nsync_reader_type_);
+		} else if (MU_UPGRADE_READY_ (old_word - MU_RLOCK)) {
+			nsync_mu_upgrade_wake_ (mu);
 		}
 	}
 	IGNORE_RACES_END ();
 }
 
+/* Unlock *mu, which must be held in upgradable read mode, and wake waiters,
+   if appropriate. */
+void nsync_mu_uunlock (nsync_mu *mu) {
+	RWLOCK_RELEASE (mu, 0);
+	IGNORE_RACES_START ();
+	/* See comment in nsync_mu_unlock(). */
+	if (!ATM_CAS_REL (&mu->word, MU_UADD_TO_ACQUIRE, 0)) {
+		uint32_t old_word = ATM_LOAD (&mu->word);
+		/* Sanity check:  mutex must be held in upgradable read mode.  */
+		if ((old_word & (MU_WLOCK | MU_ULOCK | MU_UPGRADE)) != MU_ULOCK ||
+		    (old_word & MU_RLOCK_FIELD) == 0) {
+			nsync_panic_ ("attempt to nsync_mu_uunlock() an nsync_mu "
+				      "not held in upgradable read mode\n");
+		} else if ((old_word & (MU_WAITING | MU_DESIG_WAKER)) == MU_WAITING ||
+			   !ATM_CAS_REL (&mu->word, old_word, old_word - MU_UADD_TO_ACQUIRE)) {
+			/* There may be waiters to wake, or the CAS attempt
+			   failed, so take slow path. */
+			nsync_mu_unlock_slow_ (mu, nsync_ulock_type_);
+		}
+	}
+	IGNORE_RACES_END ();
+}
+
+/* Atomically convert *mu from being held in write mode to being held in read
+   mode by the calling thread, and wake waiting readers, if appropriate.  */
+void nsync_mu_downgrade (nsync_mu *mu) {
+	RWLOCK_RELEASE (mu, 1);
+	IGNORE_RACES_START ();
+	if (!ATM_CAS_REL (&mu->word, MU_WLOCK, MU_RLOCK)) {
+		uint32_t old_word = ATM_LOAD (&mu->word);
+		/* Sanity check:  mutex must be held in write mode.  */
+		if ((old_word & (MU_WLOCK | MU_RLOCK_FIELD)) != MU_WLOCK) {
+			nsync_panic_ ("attempt to nsync_mu_downgrade() an nsync_mu "
+				      "not held in write mode\n");
+		} else if ((old_word & (MU_WAITING | MU_DESIG_WAKER)) == MU_WAITING ||
+			   !ATM_CAS_REL (&mu->word, old_word,
+					 (old_word - MU_DADD_TO_ACQUIRE) & ~MU_ALL_FALSE)) {
+			/* There are waiters and no designated waker, or the
+			   CAS attempt failed, so take slow path, which wakes
+			   only readers. */
+			nsync_mu_unlock_slow_ (mu, nsync_downgrade_type_);
+		}
+	}
+	IGNORE_RACES_END ();
+	RWLOCK_TRYACQUIRE (1, mu, 0);
+}
+
+/* A thread in nsync_mu_upgrade() waits for the other readers to leave in
+   the entry of mu_park[] for the mutex.  While MU_UPGRADE is set, no new
+   reader or writer may acquire *mu, so the thread that releases the last
+   other read hold sees MU_UPGRADE_READY_() of the word it stores, and calls
+   nsync_mu_upgrade_wake_().  */
+
+/* Block until *mu, on which MU_UPGRADE is set, has no other readers, and is
+   not held in write mode by a releasing reader.  */
+static void mu_upgrade_park (nsync_mu *mu) {
+	struct mu_park_s *park = mu_park_for (mu);
+	nsync_mu_lock (&park->mu);
+	while ((ATM_LOAD_ACQ (&mu->word) & (MU_WLOCK | MU_RLOCK_FIELD)) != 0) {
+		nsync_cv_wait (&park->cv, &park->mu);
+	}
+	nsync_mu_unlock (&park->mu);
+}
+
+void nsync_mu_upgrade_wake_ (nsync_mu *mu) {
+	mu_park_wake (mu_park_for (mu));
+}
+
+/* Convert *mu from being held in upgradable read mode to being held in write
+   mode by the calling thread, waiting for other readers to release it.  */
+void nsync_mu_upgrade (nsync_mu *mu) {
+	unsigned attempts = 0;
+	uint32_t old_word;
+	RWLOCK_RELEASE (mu, 0);
+	IGNORE_RACES_START ();
+	old_word = ATM_LOAD (&mu->word);
+	if ((old_word & (MU_WLOCK | MU_ULOCK | MU_UPGRADE)) != MU_ULOCK ||
+	    (old_word & MU_RLOCK_FIELD) == 0) {
+		nsync_panic_ ("attempt to nsync_mu_upgrade() an nsync_mu "
+			      "not held in upgradable read mode\n");
+	}
+	for (;;) {
+		if ((old_word & MU_WLOCK) != 0) {
+			/* A releasing reader holds *mu in write mode
+			   while it wakes waiters; wait for it.  */
+			attempts = nsync_spin_delay_ (attempts);
+		} else if ((old_word & MU_RLOCK_FIELD) == MU_RLOCK) {
+			/* The calling thread is the only reader. */
+			if (ATM_CAS_ACQ (&mu->word, old_word,
+					 (old_word - MU_UADD_TO_ACQUIRE + MU_WLOCK) &
+					 ~MU_WCLEAR_ON_ACQUIRE)) {
+				break;
+			}
+		} else if (ATM_CAS (&mu->word, old_word, old_word - MU_RLOCK + MU_UPGRADE)) {
+			/* Wait for the other readers to leave.  */
+			old_word = ATM_LOAD_ACQ (&mu->word);
+			while ((old_word & (MU_WLOCK | MU_RLOCK_FIELD)) != 0 ||
+			       !ATM_CAS_ACQ (&mu->word, old_word,
+					     (old_word - MU_UPGRADE - MU_ULOCK + MU_WLOCK) &
+					     ~MU_WCLEAR_ON_ACQUIRE)) {
+				if ((old_word & (MU_WLOCK | MU_RLOCK_FIELD)) != 0) {
+					mu_upgrade_park (mu);
+				}
+				old_word = ATM_LOAD_ACQ (&mu->word);
+			}
+			break;
+		}
+		old_word = ATM_LOAD (&mu->word);
+	}
+	MU_SET_OWNER_ (mu);
+	MU_RBIAS_REVOKE_ (mu);
+	IGNORE_RACES_END ();
+	RWLOCK_TRYACQUIRE (1, mu, 1);
+}
+
+/* Return whether mus[i] also appears in mus[0,..,i-1]. */
+static int mu_n_dup (nsync_mu **mus, int i) {
+	int j;
+	for (j = 0; j != i && mus[j] != mus[i]; j++) {
+	}
+	return (j != i);
+}
+
+/* Return whether mus[i] should be acquired in read mode:  whether read is
+   non-NULL and every occurrence of mus[i] in mus[0,..,n-1] is to be read.  */
+static int mu_n_read (nsync_mu **mus, const int *read, int n, int i) {
+	int result = (read != NULL);
+	int j;
+	for (j = 0; result && j != n; j++) {
+		result = (mus[j] != mus[i] || read[j]);
+	}
+	return (result);
+}
+
+/* Release mus[j] for each j in [0,n) for which held is non-zero bit j.  */
+static void mu_n_release (nsync_mu **mus, const int *read, int n, uint32_t held) {
+	int i;
+	for (i = 0; i != n; i++) {
+		if ((held & (((uint32_t) 1) << i)) != 0) {
+			if (mu_n_read (mus, read, n, i)) {
+				nsync_mu_runlock (mus[i]);
+			} else {
+				nsync_mu_unlock (mus[i]);
+			}
+		}
+	}
+}
+
+/* Acquire each of mus[0,..,n-1], in read mode if read!=NULL and read[i] is
+   non-zero, and in write mode otherwise.
+   Rather than acquire the locks in an order fixed by their addresses, which
+   leaves a thread holding some of the locks while it waits for others, the
+   thread blocks, holding nothing, on whichever lock it last failed to get,
+   and then tries to acquire the rest without blocking.  If one is
+   unavailable, it releases those it holds, and blocks on that one.  This
+   cannot deadlock, and a thread blocks in the normal queue of some lock on
+   each failed attempt, rather than spinning.  */
+void nsync_mu_rwlock_n (nsync_mu **mus, const int *read, int n) {
+	int first = 0; /* index of the lock to block on */
+	if (n > 32) {
+		nsync_panic_ ("nsync_mu_rwlock_n() with more than 32 locks\n");
+	}
+	while (n > 0) {
+		uint32_t held = ((uint32_t) 1) << first;
+		int failed = -1;
+		int i;
+		if (mu_n_read (mus, read, n, first)) {
+			nsync_mu_rlock (mus[first]);
+		} else {
+			nsync_mu_lock (mus[first]);
+		}
+		for (i = 0; failed == -1 && i != n; i++) {
+			if (mus[i] != mus[first] && !mu_n_dup (mus, i)) {
+				int acquired;
+				if (mu_n_read (mus, read, n, i)) {
+					acquired = nsync_mu_rtrylock (mus[i]);
+				} else {
+					acquired = nsync_mu_trylock (mus[i]);
+				}
+				if (acquired) {
+					held |= ((uint32_t) 1) << i;
+				} else {
+					failed = i;
+				}
+			}
+		}
+		if (failed == -1) {
+			return;
+		}
+		mu_n_release (mus, read, n, held);
+		first = failed;
+	}
+}
+
+/* Release each of mus[0,..,n-1], which must have been acquired by
+   nsync_mu_rwlock_n (mus, read, n).  */
+void nsync_mu_rwunlock_n (nsync_mu **mus, const int *read, int n) {
+	uint32_t held = 0;
+	int i;
+	for (i = 0; i != n; i++) {
+		if (!mu_n_dup (mus, i)) {
+			held |= ((uint32_t) 1) << i;
+		}
+	}
+	mu_n_release (mus, read, n, held);
+}
+
+/* The maximum number of operations queued by nsync_mu_run_locked() that a
+   holder of an nsync_mu runs on behalf of other threads before releasing
+   it.  This bounds the time the calling thread spends on others' work.  */
+#define RUN_BATCH 64
+
+/* *mu is held in write mode by the calling thread.  Remove from *mu's queue
+   and run the operations that other threads have queued with
+   nsync_mu_run_locked(), including those queued meanwhile, up to RUN_BATCH
+   in all.  Return the list of their waiters, which are to be woken with
+   mu_wake_ran() once *mu has been released.  */
+static nsync_dll_list_ mu_run_queued (nsync_mu *mu) {
+	nsync_dll_list_ ran = NULL;
+	int count = 0;
+	int found = 1;
+	while (found != 0 && count < RUN_BATCH &&
+	       (ATM_LOAD (&mu->word) & MU_WAITING) != 0) {
+		nsync_dll_list_ batch = NULL;
+		nsync_dll_element_ *p;
+		nsync_dll_element_ *next;
+		uint32_t clear = MU_SPINLOCK;
+		uint32_t old_word;
+		found = 0;
+		nsync_spin_test_and_set_ (&mu->word, MU_SPINLOCK, MU_SPINLOCK, 0);
+		nsync_mu_drain_pending_ (mu);
+		for (p = nsync_dll_first_ (mu->waiters);
+		     p != NULL && count + found < RUN_BATCH; p = next) {
+			next = nsync_dll_next_ (mu->waiters, p);
+			if (DLL_WAITER (p)->run != NULL) {
+				mu->waiters = nsync_remove_from_mu_queue_ (mu->waiters, p);
+				batch = nsync_dll_make_last_in_list_ (batch, p);
+				found++;
+			}
+		}
+		if (nsync_dll_is_empty_ (mu->waiters)) {
+			clear |= MU_WAITING | MU_WRITER_WAITING | MU_CONDITION | MU_ALL_FALSE;
+		}
+		do {
+			old_word = ATM_LOAD (&mu->word);
+		} while (!ATM_CAS_REL (&mu->word, old_word, old_word & ~clear));
+		/* Run the operations with the spinlock released. */
+		for (p = nsync_dll_first_ (batch); p != NULL; p = nsync_dll_next_ (batch, p)) {
+			(*DLL_WAITER (p)->run) (DLL_WAITER (p)->run_arg);
+		}
+		ran = nsync_dll_make_last_in_list_ (ran, nsync_dll_last_ (batch));
+		count += found;
+	}
+	return (ran);
+}
+
+/* Wake the waiters on list ran, as returned by mu_run_queued(). */
+static void mu_wake_ran (nsync_dll_list_ ran) {
+	nsync_dll_element_ *p;
+	for (p = nsync_dll_first_ (ran); p != NULL; p = nsync_dll_next_ (ran, p)) {
+		DLL_WAITER (p)->flags |= WAITER_RAN;
+	}
+	nsync_waiter_wakeup_list_ (ran);
+}
+
+/* Run (*fn) (arg) with *mu held in write mode, perhaps in another thread that
+   holds *mu, and return when it has run.  */
+void nsync_mu_run_locked (nsync_mu *mu, void (*fn) (void *arg), void *arg) {
+	int ran = 0;
+	if (!nsync_mu_trylock (mu)) {
+		waiter *w;
+		IGNORE_RACES_START ();
+		w = nsync_waiter_new_ ();
+		w->run = fn;
+		w->run_arg = arg;
+		nsync_mu_lock_slow_ (mu, w, 0, nsync_writer_type_);
+		ran = ((w->flags & WAITER_RAN) != 0);
+		w->flags &= ~WAITER_RAN;
+		w->run = NULL;
+		nsync_waiter_free_ (w);
+		IGNORE_RACES_END ();
+		RWLOCK_TRYACQUIRE (!ran, mu, 1);
+	}
+	if (!ran) {
+		nsync_dll_list_ queued;
+		(*fn) (arg);
+		IGNORE_RACES_START ();
+		queued = mu_run_queued (mu);
+		IGNORE_RACES_END ();
+		nsync_mu_unlock (mu);
+		IGNORE_RACES_START ();
+		mu_wake_ran (queued);
+		IGNORE_RACES_END ();
+	}
+}
+
+/* Acquire each of mus[0,..,n-1] in write mode. */
+void nsync_mu_lock_n (nsync_mu **mus, int n) {
+	nsync_mu_rwlock_n (mus, NULL, n);
+}
+
+/* Release each of mus[0,..,n-1], which must have been acquired by
+   nsync_mu_lock_n (mus, n).  */
+void nsync_mu_unlock_n (nsync_mu **mus, int n) {
+	nsync_mu_rwunlock_n (mus, NULL, n);
+}
+
 /* Abort if *mu is not held in write mode. */
 void nsync_mu_assert_held (const nsync_mu *mu) {
 	IGNORE_RACES_START ();
@@ -531,7 +1667,7 @@ void nsync_mu_assert_held (const nsync_mu *mu) {
 /* Abort if *mu is not held in read or write mode. */
 void nsync_mu_rassert_held (const nsync_mu *mu) {
 	IGNORE_RACES_START ();
-	if ((ATM_LOAD (&mu->word) & MU_ANY_LOCK) == 0) {
+	if ((ATM_LOAD (&mu->word) & MU_ANY_LOCK) == 0 && !nsync_mu_rbias_held_ (mu)) {
 		nsync_panic_ ("nsync_mu not held in some mode\n");
 	}
 	IGNORE_RACES_END ();
@@ -540,11 +1676,13 @@ void nsync_mu_rassert_held (const nsync_mu *mu) {
 /* Return whether *mu is held in read mode.
    Requires that *mu is held in some mode. */
 int nsync_mu_is_reader (const nsync_mu *mu) {
-	uint32_t word;
+	uint32_t word = 0;
 	IGNORE_RACES_START ();
-	word = ATM_LOAD (&mu->word);
-	if ((word & MU_ANY_LOCK) == 0) {
-		nsync_panic_ ("nsync_mu not held in some mode\n");
+	if (!nsync_mu_rbias_held_ (mu)) {
+		word = ATM_LOAD (&mu->word);
+		if ((word & MU_ANY_LOCK) == 0) {
+			nsync_panic_ ("nsync_mu not held in some mode\n");
+		}
 	}
 	IGNORE_RACES_END ();
 	return ((word & MU_WLOCK) == 0);
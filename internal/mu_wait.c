@@ -73,6 +73,13 @@ static int mu_try_acquire_after_timeout_or_cancel (nsync_mu *mu, lock_type *l_ty
 	       !ATM_CAS_ACQ (&mu->word, old_word,
 			     (old_word+MU_WADD_TO_ACQUIRE+MU_SPINLOCK) &
 			     ~MU_WCLEAR_ON_ACQUIRE)) {
+		if (ATM_LOAD_ACQ (&w->nw.waiting) == 0) {
+			/* Woken after all.  If *mu is in fair mode, the
+			   waker may have passed *mu to this thread, so it
+			   must not wait for *mu here.  */
+			RWLOCK_TRYACQUIRE (0, mu, l_type == nsync_writer_type_);
+			return (0);
+		}
 		/* Failed to acquire.  If we can, set the MU_WRITER_WAITING bit
 		   to avoid being starved by readers. */
 		if ((old_word & (MU_WRITER_WAITING | MU_SPINLOCK)) == 0) {
@@ -102,6 +109,10 @@ static int mu_try_acquire_after_timeout_or_cancel (nsync_mu *mu, lock_type *l_ty
 
 		/* Release spinlock but keep desired lock type. */
 		ATM_STORE_REL (&mu->word, old_word+l_type->add_to_acquire); /* release store */
+		if (l_type == nsync_writer_type_) {
+			MU_SET_OWNER_ (mu);
+			MU_RBIAS_REVOKE_ (mu);
+		}
 		success = 1;
 	} else {
 		/* Release spinlock and *mu. */
@@ -111,38 +122,64 @@ static int mu_try_acquire_after_timeout_or_cancel (nsync_mu *mu, lock_type *l_ty
 	return (success);
 }
 
-/* Return when at least one of:  the condition is true, the
-   deadline expires, or cancel_note is notified.  It may unlock and relock *mu
-   while blocked waiting for one of these events, but always returns with *mu
-   held.  It returns 0 iff the condition is true on return, and otherwise
-   either ETIMEDOUT or ECANCELED, depending on why the call returned early.  Use
-   abs_deadline==nsync_time_no_deadline for no deadline, and cancel_note==NULL for no
-   cancellation.
+/* Keyed waits.  nsync_mu_touch_key (mu, key) increments key_gen[i], for an
+   index i hashed from mu and key.  A waiter with a keyed condition records
+   key_gen[i] when its condition is found false, and nsync_mu_unlock_slow_()
+   reevaluates the condition only if key_gen[i] has since changed.  Unrelated
+   keys that share an index cause only extra evaluations.  Both the touch and
+   the comparison happen with the mutex held in write mode, so the mutex
+   orders them.  If a scan of the waiters finds only keyed conditions, all
+   false, it sets MU_KEYS_FALSE, and until some key is touched, writers then
+   release the mutex without scanning the waiters at all.
 
-   Requires that *mu be held on entry.
-   Requires that condition.eval() neither modify state protected by *mu, nor
-   return a value dependent on state not protected by *mu.  To depend on time,
-   use the abs_deadline parameter.
-   (Conventional use of condition variables have the same restrictions on the
-   conditions tested by the while-loop.)
-   The implementation calls condition.eval() only with *mu held, though not
-   always from the calling thread, and may elect to hold only a read lock
-   during the call, even if the client is attempting to acquire only write
-   locks.
+   The generations are global rather than per mutex, because an nsync_mu has
+   no room for a table and no destructor to free one.  Each has a cache
+   line to itself, so that touches on unrelated mutexes do not contend.  */
+#define KEY_GENS 1024
+static union key_gen_u {
+	nsync_atomic_uint32_ gen;
+	char pad[64]; /* assumed cache line size */
+} key_gen[KEY_GENS];
 
-   The nsync_mu_wait() and nsync_mu_wait_with_deadline() calls can be used instead of condition
-   variables.  In many straightforward situations they are of equivalent
-   performance and are somewhat easier to use, because unlike condition
-   variables, they do not require that the waits be placed in a loop, and they
-   do not require explicit wakeup calls.  In the current implementation, use of
-   nsync_mu_wait() and nsync_mu_wait_with_deadline() can take longer if many distinct
-   wait conditions are used.  In such cases, use an explicit condition variable
-   per wakeup condition for best performance. */
-int nsync_mu_wait_with_deadline (nsync_mu *mu,
-				 int (*condition) (const void *condition_arg),
-				 const void *condition_arg,
-				 int (*condition_arg_eq) (const void *a, const void *b),
-				 nsync_time abs_deadline, nsync_note cancel_note) {
+/* Return the element of key_gen[] for key on *mu. */
+static nsync_atomic_uint32_ *mu_key_gen (const nsync_mu *mu, const void *key) {
+	uintptr_t h = ((uintptr_t) key) * 2654435761u + (uintptr_t) mu;
+	h ^= h >> 17;
+	return (&key_gen[h % KEY_GENS].gen);
+}
+
+/* Record that a critical section on *mu, which the calling thread holds in
+   write mode, may have made true conditions waited for with key.  */
+void nsync_mu_touch_key (nsync_mu *mu, const void *key) {
+	nsync_atomic_uint32_ *g = mu_key_gen (mu, key);
+	uint32_t old_value;
+	do {
+		old_value = ATM_LOAD (g);
+	} while (!ATM_CAS (g, old_value, old_value+1));
+	/* The release of *mu must now test conditions. */
+	do {
+		old_value = ATM_LOAD (&mu->word);
+	} while ((old_value & MU_KEYS_FALSE) != 0 &&
+		 !ATM_CAS (&mu->word, old_value, old_value & ~MU_KEYS_FALSE));
+}
+
+/* Return whether cond->key has been touched on *mu since cond->key_gen was
+   recorded, and record the current generation.  */
+int nsync_mu_key_touched_ (const nsync_mu *mu, struct wait_condition_s *cond) {
+	uint32_t gen = ATM_LOAD (mu_key_gen (mu, cond->key));
+	int touched = (gen != cond->key_gen);
+	cond->key_gen = gen;
+	return (touched);
+}
+
+/* As nsync_mu_wait_with_deadline(), but if key is non-NULL, the condition is
+   reevaluated only after nsync_mu_touch_key (mu, key).  */
+static int mu_wait_with_deadline (nsync_mu *mu,
+				  int (*condition) (const void *condition_arg),
+				  const void *condition_arg,
+				  int (*condition_arg_eq) (const void *a, const void *b),
+				  const void *key,
+				  nsync_time abs_deadline, nsync_note cancel_note) {
 	lock_type *l_type;
 	int first_wait;
 	int condition_is_true;
@@ -150,14 +187,17 @@ int nsync_mu_wait_with_deadline (nsync_mu *mu,
 	int outcome;
 	/* Work out in which mode the lock is held. */
 	uint32_t old_word;
+	int rbias_held;
 	IGNORE_RACES_START ();
+	/* A hold in the visible-readers table is not recorded in mu->word. */
+	rbias_held = nsync_mu_rbias_held_ (mu);
 	old_word = ATM_LOAD (&mu->word);
-	if ((old_word & MU_ANY_LOCK) == 0) {
+	if (!rbias_held && (old_word & MU_ANY_LOCK) == 0) {
 		nsync_panic_ ("nsync_mu not held in some mode when calling "
 		       "nsync_mu_wait_with_deadline()\n");
 	}
 	l_type = nsync_writer_type_;
-	if ((old_word & MU_RHELD_IF_NON_ZERO) != 0) {
+	if (rbias_held || (old_word & MU_RHELD_IF_NON_ZERO) != 0) {
 		l_type = nsync_reader_type_;
 	}
 
@@ -179,6 +219,13 @@ int nsync_mu_wait_with_deadline (nsync_mu *mu,
 		if (w == NULL) {
 			w = nsync_waiter_new_ (); /* get a waiter struct if we need one. */
 		}
+		if (rbias_held) {
+			/* The release below works on mu->word, so move the hold
+			   there.  *mu is about to be released anyway, so that a
+			   writer may acquire it meanwhile does not matter. */
+			nsync_mu_rbias_unbias_ (mu);
+			rbias_held = 0;
+		}
 
 		/* Prepare to wait. */
 		w->cv_mu = NULL; /* not a condition variable wait */
@@ -186,6 +233,10 @@ int nsync_mu_wait_with_deadline (nsync_mu *mu,
 		w->cond.f = condition;
 		w->cond.v = condition_arg;
 		w->cond.eq = condition_arg_eq;
+		w->cond.key = key;
+		if (key != NULL) {
+			w->cond.key_gen = ATM_LOAD (mu_key_gen (mu, key));
+		}
 		has_condition = 0; /* set to MU_CONDITION if condition is non-NULL */
 		if (condition != NULL) {
 			has_condition = MU_CONDITION;
@@ -196,6 +247,7 @@ int nsync_mu_wait_with_deadline (nsync_mu *mu,
 		/* Acquire spinlock. */
 		old_word = nsync_spin_test_and_set_ (&mu->word, MU_SPINLOCK,
 			MU_SPINLOCK|MU_WAITING|has_condition, MU_ALL_FALSE);
+		nsync_mu_drain_pending_ (mu);
 		had_waiters = ((old_word & (MU_DESIG_WAKER | MU_WAITING)) == MU_WAITING);
 		/* Queue the waiter. */
 		if (first_wait) {
@@ -226,6 +278,8 @@ int nsync_mu_wait_with_deadline (nsync_mu *mu,
 			/* The lock will be fully released, there are waiters, and
 			   no designated waker, so wake waiters. */
 			nsync_mu_unlock_slow_ (mu, l_type);
+		} else if (MU_UPGRADE_READY_ ((old_word - add_to_acquire) & ~MU_SPINLOCK)) {
+			nsync_mu_upgrade_wake_ (mu);
 		}
 
 		/* wait until awoken or a timeout. */
@@ -269,6 +323,62 @@ int nsync_mu_wait_with_deadline (nsync_mu *mu,
 	return (outcome);
 }
 
+/* Return when at least one of:  the condition is true, the
+   deadline expires, or cancel_note is notified.  It may unlock and relock *mu
+   while blocked waiting for one of these events, but always returns with *mu
+   held.  It returns 0 iff the condition is true on return, and otherwise
+   either ETIMEDOUT or ECANCELED, depending on why the call returned early.  Use
+   abs_deadline==nsync_time_no_deadline for no deadline, and cancel_note==NULL for no
+   cancellation.
+
+   Requires that *mu be held on entry.
+   Requires that condition.eval() neither modify state protected by *mu, nor
+   return a value dependent on state not protected by *mu.  To depend on time,
+   use the abs_deadline parameter.
+   (Conventional use of condition variables have the same restrictions on the
+   conditions tested by the while-loop.)
+   The implementation calls condition.eval() only with *mu held, though not
+   always from the calling thread, and may elect to hold only a read lock
+   during the call, even if the client is attempting to acquire only write
+   locks.
+
+   The nsync_mu_wait() and nsync_mu_wait_with_deadline() calls can be used instead of condition
+   variables.  In many straightforward situations they are of equivalent
+   performance and are somewhat easier to use, because unlike condition
+   variables, they do not require that the waits be placed in a loop, and they
+   do not require explicit wakeup calls.  In the current implementation, use of
+   nsync_mu_wait() and nsync_mu_wait_with_deadline() can take longer if many distinct
+   wait conditions are used.  In such cases, use an explicit condition variable
+   per wakeup condition for best performance. */
+int nsync_mu_wait_with_deadline (nsync_mu *mu,
+				 int (*condition) (const void *condition_arg),
+				 const void *condition_arg,
+				 int (*condition_arg_eq) (const void *a, const void *b),
+				 nsync_time abs_deadline, nsync_note cancel_note) {
+	return (mu_wait_with_deadline (mu, condition, condition_arg, condition_arg_eq,
+				       NULL, abs_deadline, cancel_note));
+}
+
+/* As nsync_mu_wait_with_deadline(), but the condition need be reevaluated
+   only after nsync_mu_touch_key (mu, key).  */
+int nsync_mu_wait_keyed_with_deadline (nsync_mu *mu,
+				       int (*condition) (const void *condition_arg),
+				       const void *condition_arg, const void *key,
+				       nsync_time abs_deadline, nsync_note cancel_note) {
+	return (mu_wait_with_deadline (mu, condition, condition_arg, NULL,
+				       key, abs_deadline, cancel_note));
+}
+
+/* As nsync_mu_wait(), but the condition need be reevaluated only after
+   nsync_mu_touch_key (mu, key).  */
+void nsync_mu_wait_keyed (nsync_mu *mu, int (*condition) (const void *condition_arg),
+			  const void *condition_arg, const void *key) {
+	if (mu_wait_with_deadline (mu, condition, condition_arg, NULL, key,
+				   nsync_time_no_deadline, NULL) != 0) {
+		nsync_panic_ ("nsync_mu_wait_keyed woke but condition not true\n");
+	}
+}
+
 /* Return when the condition is true.  Perhaps unlock and relock *mu
    while blocked waiting for the condition to become true.  It is equivalent to
    a call to nsync_mu_wait_with_deadline() with abs_deadline==nsync_time_no_deadline, and
@@ -28,28 +28,62 @@ NSYNC_CPP_START_
 /* Locking discipline for the nsync_note implementation:
 
    Each nsync_note has a lock "note_mu" which protects the "parent" pointer,
-   "waiters" list, and "disconnecting" count.  It also protects the "children"
-   list; thus each node's "parent_child_link", which links together the
-   children of a single parent, is protected by the parent's "note_mu".
+   the "shard" index, and the "disconnecting" and "in_cascade" fields.
 
-   To connect a parent to a child, or to disconnect one, the parent's lock must
-   be held to manipulate its child list, and the child's lock must be held to
-   change the parent pointer, so both must be held simultaneously.
-   The locking order is "parent before child".
+   A note's children are spread over NOTE_SHARDS shards, allocated when the
+   first child is attached, so that threads creating and freeing children
+   of a popular note (such as one per server, with a child per request) need
+   not all acquire the same lock.  Each shard has a lock "mu" that protects
+   its "children" list and "changes" count; thus each node's
+   "parent_child_link", which links together the children in one shard, is
+   protected by that shard's lock.  The shard of a child is chosen from its
+   address.
+
+   The "waiters" list is instead protected by the NOTE_SPINLOCK bit in
+   "notified", which is held only briefly, and never while acquiring another
+   lock.  The NOTE_NOTIFIED bit is set with both "note_mu" and NOTE_SPINLOCK
+   held, and the waiters list is emptied at the same time, so a thread that
+   finds NOTE_NOTIFIED clear while holding NOTE_SPINLOCK may queue a waiter
+   that will be woken by the notification.  "expiry_time" and
+   "expiry_time_valid" are read-only once nsync_note_new() has returned, so
+   whether a note has been notified or has expired can be checked without
+   any lock.  A child is attached only while its parent's shard lock is held
+   and NOTE_NOTIFIED is clear in the parent, and a notifier sets
+   NOTE_NOTIFIED before it examines the shards, so no child can be attached
+   to a note after the note's children have been notified.
+
+   To connect a parent to a child, or to disconnect one, the parent's shard
+   lock must be held to manipulate its child list, and the child's note_mu
+   must be held to change the parent pointer, so both must be held
+   simultaneously.  The locking order is: a note's "note_mu", then its
+   shard locks, then its children's "note_mu", and so on down the tree.
 
    Operations like notify and free are given a node pointer n and must
    disconnect *n from its parent n->parent.  The call must hold n->note_mu to
-   read n->parent, but need to release n->note_mu to acquire
-   n->parent->note_mu.  The parent could be disconnected and freed while
-   n->note_mu is not held.  The n->disconnecting count handles this; the
-   operation acquires n->note_mu, increments n->disconnecting, and can then
-   release n->note_mu, and acquire n->parent->note_mu and n->note_mu is the
-   correct order.  n->disconnecting!=0 indicates that a thread is already in
-   the processes of disconnecting n from n->parent.  A thread freeing or
-   notifying the parent should not perform the disconnection of that child, but
-   should instead wait for the "children" list to become empty via
-   WAIT_FOR_NO_CHILDREN().  WAKEUP_NO_CHILDREN() should be used whenever this
-   condition could become true.  */
+   read n->parent, but need to release n->note_mu to acquire the parent's
+   shard lock.  The parent could be disconnected and freed while n->note_mu
+   is not held.  The n->disconnecting count handles this; the operation
+   acquires n->note_mu, increments n->disconnecting, and can then release
+   n->note_mu, and acquire the shard lock and n->note_mu in the correct
+   order.  n->disconnecting!=0 indicates that a thread is already in the
+   processes of disconnecting n from n->parent.  A thread freeing or
+   notifying the parent should not perform the disconnection of that child,
+   but should instead wait for it to leave the shard via
+   WAIT_FOR_CONDITION().  WAKEUP_CONDITION() should be used whenever such a
+   condition could become true.  A thread that wishes to notify n while
+   another is disconnecting it notifies n without touching n->parent, and
+   leaves the disconnection to the other thread, which could otherwise find
+   the parent freed.  For the same reason nsync_note_free() waits for other
+   disconnections of its note to finish before it starts.
+
+   Notification does not recurse.  A notifier notifies its note and moves
+   each of the note's children to a list, setting their "in_cascade" flags
+   and releasing their locks, and then notifies each note on the list in
+   turn, appending that note's own children.  Thus at most a note, one of
+   its shards, and one child are locked at once, however wide or deep the
+   tree.  A note whose "in_cascade" flag is set has been disconnected from
+   its parent but not yet notified; nsync_note_free() waits for the flag to
+   be cleared.  */
 
 /* Set the expiry time in *n to t */
 static void set_expiry_time (nsync_note n, nsync_time t) {
@@ -60,103 +94,552 @@ static void set_expiry_time (nsync_note n, nsync_time t) {
 /* Return a pointer to the note containing nsync_dll_element_ *e. */
 #define DLL_NOTE(e) ((nsync_note)((e)->container))
 
-/* Return whether n->children is empty.  Assumes n->note_mu held. */
-static int no_children (const void *v) {
-	return (nsync_dll_is_empty_ (((nsync_note)v)->children));
-}
-
-#define WAIT_FOR_NO_CHILDREN(pred_, n_) nsync_mu_wait (&(n_)->note_mu, &pred_, (n_), NULL)
-#define WAKEUP_NO_CHILDREN(n_) do { } while (0)
+#define WAIT_FOR_CONDITION(mu_, cv_, pred_, arg_) nsync_mu_wait ((mu_), &pred_, (arg_), NULL)
+#define WAKEUP_CONDITION(cv_) do { } while (0)
 
 /*
 // These lines can be used in place of those above if conditional critical
 // sections have been removed from the source.
-#define WAIT_FOR_NO_CHILDREN(pred_, n_) do { \
-		while (!pred_ (n_)) { nsync_cv_wait (&(n_)->no_children_cv, &(n_)->note_mu); } \
+#define WAIT_FOR_CONDITION(mu_, cv_, pred_, arg_) do { \
+		while (!pred_ (arg_)) { nsync_cv_wait ((cv_), (mu_)); } \
 	} while (0)
-#define WAKEUP_NO_CHILDREN(n_) nsync_cv_broadcast (&(n_)->no_children_cv)
+#define WAKEUP_CONDITION(cv_) nsync_cv_broadcast (cv_)
 */
 
-/* Notify *n and all its descendants that are not already disconnnecting.
-   n->note_mu is held.  May release and reacquire n->note_mu.
-   parent->note_mu is held if parent != NULL. */
-static void note_notify_child (nsync_note n, nsync_note parent) {
-	nsync_time t;
-	t = NOTIFIED_TIME (n);
-	if (nsync_time_cmp (t, nsync_time_zero) > 0) {
+/* Return whether no other thread is disconnecting or notifying *n.
+   Assumes n->note_mu held. */
+static int note_idle (const void *v) {
+	const struct nsync_note_s_ *n = (const struct nsync_note_s_ *) v;
+	return (n->disconnecting == 0 && !n->in_cascade);
+}
+
+/* Argument to shard_changed(). */
+struct shard_changed_arg_s {
+	struct nsync_note_shard_s_ *s;  /* the shard */
+	uint32_t changes;               /* the value of s->changes seen */
+};
+
+/* Return whether a child has left a shard since the caller looked at it.
+   Assumes the shard's lock held. */
+static int shard_changed (const void *v) {
+	const struct shard_changed_arg_s *a = (const struct shard_changed_arg_s *) v;
+	return (a->s->changes != a->changes);
+}
+
+/* Return the shards of n's children, or NULL if n has never had children. */
+static struct nsync_note_shard_s_ *note_shards (nsync_note n) {
+	struct nsync_note_shard_s_ *shards = NULL;
+	if (ATM_LOAD_ACQ (&n->shards_ready) != 0) { /* acquire load */
+		shards = n->shards;
+	}
+	return (shards);
+}
+
+/* Return the shards of n's children, allocating them if need be, or NULL if
+   they cannot be allocated. */
+static struct nsync_note_shard_s_ *note_shards_alloc (nsync_note n) {
+	struct nsync_note_shard_s_ *shards = note_shards (n);
+	if (shards == NULL) {
+		nsync_mu_lock (&n->note_mu);
+		shards = n->shards;
+		if (shards == NULL) {
+			size_t size = NOTE_SHARDS * sizeof (shards[0]);
+			shards = (struct nsync_note_shard_s_ *) malloc (size);
+			if (shards != NULL) {
+				memset ((void *) shards, 0, size);
+				n->shards = shards;
+				ATM_STORE_REL (&n->shards_ready, 1); /* release store */
+			}
+		}
+		nsync_mu_unlock (&n->note_mu);
+	}
+	return (shards);
+}
+
+/* Called with n->note_mu held, and n->disconnecting incremented by the caller.
+   If n has a parent, acquire the lock of the parent's shard containing n,
+   releasing and reacquiring n->note_mu if needed, and return the shard.
+   Otherwise, return NULL.  */
+static struct nsync_note_shard_s_ *lock_parent_shard (nsync_note n) {
+	struct nsync_note_shard_s_ *s = NULL;
+	if (n->parent != NULL) {
+		s = &note_shards (n->parent)[n->shard];
+		if (!nsync_mu_trylock (&s->mu)) {
+			nsync_mu_unlock (&n->note_mu);
+			nsync_mu_lock (&s->mu);
+			nsync_mu_lock (&n->note_mu);
+		}
+	}
+	return (s);
+}
+
+/* Remove *n from shard *s of its parent, and release the shard's lock.
+   Requires s==lock_parent_shard (n), with n->note_mu still held. */
+static void unlink_from_parent (nsync_note n, struct nsync_note_shard_s_ *s) {
+	s->children = nsync_dll_remove_ (s->children, &n->parent_child_link);
+	s->changes++;
+	WAKEUP_CONDITION (&s->changed_cv);
+	n->parent = NULL;
+	nsync_mu_unlock (&s->mu);
+}
+
+static void note_arm (nsync_note n);
+static void note_notify_locked (nsync_note n, nsync_dll_list_ *cascade);
+
+/* Remove from shard *s each child that no other thread is disconnecting,
+   and wait for the others to remove themselves.  If adopter!=NULL, the
+   children are moved to *adopter_shard, the shard of adopter whose lock the
+   caller holds.  Otherwise, if cascade!=NULL, they are appended to *cascade
+   with their in_cascade flags set, to be notified by the caller, except that
+   those that have never had children are notified at once.  Otherwise, they
+   are left without a parent.  Requires that the lock of the note
+   containing *s be held.  */
+static void drain_shard (struct nsync_note_shard_s_ *s, nsync_note adopter,
+			 struct nsync_note_shard_s_ *adopter_shard,
+			 nsync_dll_list_ *cascade) {
+	nsync_mu_lock (&s->mu);
+	while (!nsync_dll_is_empty_ (s->children)) {
+		struct shard_changed_arg_s arg;
 		nsync_dll_element_ *p;
 		nsync_dll_element_ *next;
-		ATM_STORE_REL (&n->notified, 1);
-		while ((p = nsync_dll_first_ (n->waiters)) != NULL) {
-			struct nsync_waiter_s *nw = DLL_NSYNC_WAITER (p);
-			n->waiters = nsync_dll_remove_ (n->waiters, p);
-			ATM_STORE_REL (&nw->waiting, 0);
-			nsync_mu_semaphore_v (nw->sem);
-		}
-		for (p = nsync_dll_first_ (n->children); p != NULL; p = next) {
+		arg.s = s;
+		arg.changes = s->changes;
+		for (p = nsync_dll_first_ (s->children); p != NULL; p = next) {
 			nsync_note child = DLL_NOTE (p);
-			next = nsync_dll_next_ (n->children, p);
+			next = nsync_dll_next_ (s->children, p);
 			nsync_mu_lock (&child->note_mu);
 			if (child->disconnecting == 0) {
-				note_notify_child (child, n);
+				s->children = nsync_dll_remove_ (s->children, p);
+				if (adopter != NULL) {
+					child->parent = adopter;
+					child->shard = (uint32_t) (adopter_shard - adopter->shards);
+					adopter_shard->children = nsync_dll_make_last_in_list_ (
+						adopter_shard->children, p);
+				} else if (cascade == NULL) {
+					child->parent = NULL;
+				} else if (child->shards == NULL) {
+					/* A leaf can be notified at once, without recursion. */
+					child->parent = NULL;
+					note_notify_locked (child, cascade);
+				} else {
+					child->parent = NULL;
+					child->in_cascade = 1;
+					*cascade = nsync_dll_make_last_in_list_ (*cascade, p);
+				}
+				if (child->timer_by_parent && cascade == NULL) {
+					/* The old parent no longer covers the child's expiry.
+					   note_arm() sets timer_covered again only if the
+					   service is running. */
+					child->timer_by_parent = 0;
+					ATM_STORE (&child->timer_covered, 0);
+					note_arm (child);
+				}
 			}
 			nsync_mu_unlock (&child->note_mu);
 		}
-		WAIT_FOR_NO_CHILDREN (no_children, n);
-		if (parent != NULL) {
-			parent->children = nsync_dll_remove_ (parent->children,
-						              &n->parent_child_link);
-			WAKEUP_NO_CHILDREN (parent);
-			n->parent = NULL;
+		if (!nsync_dll_is_empty_ (s->children)) {
+			WAIT_FOR_CONDITION (&s->mu, &s->changed_cv, shard_changed, &arg);
+		}
+	}
+	nsync_mu_unlock (&s->mu);
+}
+
+/* If *n has not been notified, notify it, wake its waiters, and append its
+   children to *cascade as drain_shard() does.  n->note_mu is held. */
+static void note_notify_locked (nsync_note n, nsync_dll_list_ *cascade) {
+	nsync_time t;
+	t = NOTIFIED_TIME (n);
+	if (nsync_time_cmp (t, nsync_time_zero) > 0) {
+		nsync_dll_list_ to_wake;
+		nsync_spin_test_and_set_ (&n->notified, NOTE_SPINLOCK, NOTE_SPINLOCK, 0);
+		to_wake = n->waiters;
+		n->waiters = NULL;
+		ATM_STORE_REL (&n->notified, NOTE_NOTIFIED); /* release store */
+		nsync_waiter_wakeup_list_ (to_wake);
+		if (n->shards != NULL) {
+			int i;
+			for (i = 0; i != NOTE_SHARDS; i++) {
+				drain_shard (&n->shards[i], NULL, NULL, cascade);
+			}
 		}
 	}
 }
 
+/* Notify each note on list cascade, and their descendants.  The notes have
+   their in_cascade flags set.  No locks are held. */
+static void note_cascade (nsync_dll_list_ cascade) {
+	nsync_dll_element_ *p;
+	while ((p = nsync_dll_first_ (cascade)) != NULL) {
+		nsync_note n = DLL_NOTE (p);
+		cascade = nsync_dll_remove_ (cascade, p);
+		nsync_mu_lock (&n->note_mu);
+		note_notify_locked (n, &cascade);
+		n->in_cascade = 0;
+		WAKEUP_CONDITION (&n->idle_cv);
+		nsync_mu_unlock (&n->note_mu);
+	}
+}
+
 /* Notify *n and all its descendants that are not already disconnnecting.
    No locks are held. */
 static void notify (nsync_note n) {
 	nsync_time t;
+	nsync_dll_list_ cascade = NULL;
 	nsync_mu_lock (&n->note_mu);
 	t = NOTIFIED_TIME (n);
 	if (nsync_time_cmp (t, nsync_time_zero) > 0) {
-		nsync_note parent;
-		n->disconnecting++;
-		parent = n->parent;
-		if (parent != NULL && !nsync_mu_trylock (&parent->note_mu)) {
-			nsync_mu_unlock (&n->note_mu);
-			nsync_mu_lock (&parent->note_mu);
-			nsync_mu_lock (&n->note_mu);
-		}
-		note_notify_child (n, parent);
-		if (parent != NULL) {
-			nsync_mu_unlock (&parent->note_mu);
+		if (n->disconnecting != 0) {
+			/* Another thread will disconnect n from its parent. */
+			note_notify_locked (n, &cascade);
+		} else {
+			struct nsync_note_shard_s_ *s;
+			n->disconnecting++;
+			s = lock_parent_shard (n);
+			note_notify_locked (n, &cascade);
+			if (s != NULL) {
+				unlink_from_parent (n, s);
+			}
+			n->disconnecting--;
+			WAKEUP_CONDITION (&n->idle_cv);
 		}
-		n->disconnecting--;
 	}
 	nsync_mu_unlock (&n->note_mu);
+	note_cascade (cascade);
 }
 
+/* --------------------------------------------------- */
+
+/* The expiry service.
+
+   Without it, a note is notified at its deadline only when some thread next
+   looks at it, and each waiter on a note sleeps with the note's deadline as
+   its own timeout.  While nsync_note_expiry_run() is running, notes created
+   with a finite deadline are instead placed on a hierarchical timing wheel,
+   and the thread running nsync_note_expiry_run() notifies each on time with
+   notify().  Its descendants are reached iteratively:  note_notify_locked()
+   notifies leaf children at once and queues the others on a cascade list,
+   which note_cascade() works through.  A note whose
+   deadline was inherited from a parent that is itself covered is not placed
+   on the wheel, since notifying the parent notifies it too; should the
+   parent be freed first, the note is placed on the wheel then.
+
+   The wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots.  Slot i of level k
+   holds the notes that expire in the tick whose bits [k*WHEEL_BITS,
+   (k+1)*WHEEL_BITS) are i, for notes too distant for level k-1.  Whenever
+   the level-0 index wraps to zero, the current slot of the next level up is
+   redistributed among the lower levels.  Insertion and removal are O(1), and
+   each note is moved at most WHEEL_LEVELS-1 times.  Deadlines beyond the
+   range of the wheel are placed at its far end, and re-placed as they
+   approach.
+
+   So that threads creating and freeing notes on different processors do
+   not contend, there are WHEEL_SHARDS wheels, and a note is placed on the
+   one chosen by the page holding it, as its shard in its parent is.  The
+   expiry thread processes every wheel on each wakeup.
+
+   Locking: each wheel's mu protects its fields, and the timer_link and
+   timer_slot of each note on it.  It is a leaf, acquired after any
+   note_mu, and the expiry thread releases it to notify a note.  A note
+   being notified is recorded in its wheel's "firing" field, so that
+   nsync_note_free() can wait for the notification to finish before freeing
+   it.  expiry.mu protects expiry.kicked, and is acquired with no wheel's mu
+   held; it is taken by note_arm() only when a note expires before its
+   wheel's wake_time, the time at which the expiry thread next processes
+   the wheel.  */
+
+#define WHEEL_BITS 6                               /* log2 of slots per level */
+#define WHEEL_SLOTS (1 << WHEEL_BITS)              /* slots per level */
+#define WHEEL_MASK ((uint32_t) (WHEEL_SLOTS - 1))  /* mask for slot index */
+#define WHEEL_LEVELS 4                             /* number of levels */
+#define WHEEL_MAX_TICKS ((((uint32_t) 1) << (WHEEL_LEVELS * WHEEL_BITS)) - 1) /* range */
+#define WHEEL_TICK_MS 1                            /* milliseconds per tick */
+#define WHEEL_SHARDS 8                             /* number of wheels */
+
+struct note_wheel_s {
+	nsync_mu mu;             /* protects the fields below */
+	nsync_cv fired_cv;       /* broadcast when "firing" becomes NULL */
+	uint32_t now;            /* the next tick to process */
+	nsync_time now_time;     /* the time at which tick "now" ends */
+	nsync_time wake_time;    /* when the expiry thread will next process this wheel */
+	uint32_t armed;          /* number of notes in slots */
+	nsync_note firing;       /* note being notified by the expiry thread, or NULL */
+	nsync_dll_list_ slot[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static struct note_wheel_s wheels[WHEEL_SHARDS];
+
+static struct {
+	nsync_mu mu;             /* protects "kicked" */
+	nsync_cv cv;             /* signalled when "kicked" is set */
+	int kicked;              /* whether an earlier deadline has been armed */
+	nsync_atomic_uint32_ running; /* whether nsync_note_expiry_run() is running */
+} expiry;
+
+/* Return the wheel on which *n is placed. */
+static struct note_wheel_s *note_wheel (nsync_note n) {
+	return (&wheels[(((uintptr_t) n) >> 12) % WHEEL_SHARDS]);
+}
+
+/* Return the number of ticks after w->now in which time t falls, at most
+   WHEEL_MAX_TICKS.  Requires w->mu held. */
+static uint32_t wheel_ticks (struct note_wheel_s *w, nsync_time t) {
+	uint32_t ticks = 0;
+	if (nsync_time_cmp (t, w->now_time) > 0) {
+		nsync_time d = nsync_time_sub (t, w->now_time);
+		if (NSYNC_TIME_SEC (d) >= (WHEEL_MAX_TICKS / 1000) * WHEEL_TICK_MS) {
+			ticks = WHEEL_MAX_TICKS;
+		} else {
+			uint32_t ms = ((uint32_t) NSYNC_TIME_SEC (d)) * 1000 +
+				      (((uint32_t) NSYNC_TIME_NSEC (d)) + 999999) / 1000000;
+			ticks = (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+			if (ticks > WHEEL_MAX_TICKS) {
+				ticks = WHEEL_MAX_TICKS;
+			}
+		}
+	}
+	return (ticks);
+}
+
+/* Place *n in the slot of *w for its expiry time.  Requires w->mu held,
+   and n not in a slot. */
+static void wheel_insert (struct note_wheel_s *w, nsync_note n) {
+	uint32_t delta = wheel_ticks (w, n->expiry_time);
+	uint32_t t = w->now + delta;
+	int level = 0;
+	while (level != WHEEL_LEVELS - 1 &&
+	       delta >= (((uint32_t) 1) << ((level + 1) * WHEEL_BITS))) {
+		level++;
+	}
+	n->timer_slot = &w->slot[level][(t >> (level * WHEEL_BITS)) & WHEEL_MASK];
+	*n->timer_slot = nsync_dll_make_last_in_list_ (*n->timer_slot, &n->timer_link);
+	w->armed++;
+}
+
+/* Remove *n from its slot in *w, if any.  Requires w->mu held. */
+static void wheel_remove (struct note_wheel_s *w, nsync_note n) {
+	if (n->timer_slot != NULL) {
+		*n->timer_slot = nsync_dll_remove_ (*n->timer_slot, &n->timer_link);
+		n->timer_slot = NULL;
+		w->armed--;
+	}
+}
+
+/* Redistribute the notes in slot index of the given level of *w among the
+   lower levels.  Requires w->mu held. */
+static void wheel_cascade (struct note_wheel_s *w, int level, uint32_t index) {
+	nsync_dll_list_ list = w->slot[level][index];
+	nsync_dll_element_ *e;
+	while ((e = nsync_dll_first_ (list)) != NULL) {
+		nsync_note n = DLL_NOTE (e);
+		list = nsync_dll_remove_ (list, e);
+		w->slot[level][index] = list;
+		n->timer_slot = NULL;
+		w->armed--;
+		wheel_insert (w, n);
+	}
+}
+
+/* Notify the notes on *w whose ticks end no later than time t, and advance
+   w->now past t.  Requires w->mu held; releases it while notifying each
+   note. */
+static void wheel_run_until (struct note_wheel_s *w, nsync_time t) {
+	nsync_time tick_time = nsync_time_ms (WHEEL_TICK_MS);
+	while (nsync_time_cmp (w->now_time, t) <= 0) {
+		uint32_t tick = w->now;
+		nsync_dll_list_ *slot;
+		nsync_dll_element_ *e;
+		if (w->armed == 0) {
+			/* Nothing to fire; skip the intervening ticks. */
+			w->now_time = t;
+		}
+		if ((tick & WHEEL_MASK) == 0) {
+			int level;
+			uint32_t index = 0;
+			for (level = 1; level != WHEEL_LEVELS && index == 0; level++) {
+				index = (tick >> (level * WHEEL_BITS)) & WHEEL_MASK;
+				wheel_cascade (w, level, index);
+			}
+		}
+		slot = &w->slot[0][tick & WHEEL_MASK];
+		while ((e = nsync_dll_first_ (*slot)) != NULL) {
+			nsync_note n = DLL_NOTE (e);
+			wheel_remove (w, n);
+			w->firing = n;
+			nsync_mu_unlock (&w->mu);
+			notify (n);
+			nsync_mu_lock (&w->mu);
+			w->firing = NULL;
+			nsync_cv_broadcast (&w->fired_cv);
+		}
+		w->now = tick + 1;
+		w->now_time = nsync_time_add (w->now_time, tick_time);
+	}
+}
+
+/* Return when the expiry thread must next process *w: the end of the first
+   tick with a non-empty level-0 slot, or of the next tick that causes a
+   cascade, or nsync_time_no_deadline if *w is empty.  Requires w->mu held. */
+static nsync_time wheel_next_time (struct note_wheel_s *w) {
+	nsync_time result = nsync_time_no_deadline;
+	if (w->armed != 0) {
+		uint32_t i = 0;
+		while (w->slot[0][(w->now + i) & WHEEL_MASK] == NULL &&
+		       ((w->now + i) & WHEEL_MASK) != 0) {
+			i++;
+		}
+		result = nsync_time_add (w->now_time, nsync_time_ms (i * WHEEL_TICK_MS));
+	}
+	return (result);
+}
+
+/* If the expiry service is running, place *n on its wheel.  Requires
+   n->note_mu held, or that *n be not yet visible to other threads.  A note
+   armed as the service stops stays on its wheel until the service next
+   runs, as do all notes armed earlier.  */
+static void note_arm (nsync_note n) {
+	if (ATM_LOAD (&expiry.running) != 0) {
+		struct note_wheel_s *w = note_wheel (n);
+		int kick;
+		nsync_mu_lock (&w->mu);
+		wheel_insert (w, n);
+		n->timer_armed = 1;
+		ATM_STORE (&n->timer_covered, 1);
+		kick = (nsync_time_cmp (n->expiry_time, w->wake_time) < 0);
+		nsync_mu_unlock (&w->mu);
+		if (kick) {
+			nsync_mu_lock (&expiry.mu);
+			expiry.kicked = 1;
+			nsync_cv_signal (&expiry.cv);
+			nsync_mu_unlock (&expiry.mu);
+		}
+	}
+}
+
+/* Remove *n from its wheel, waiting for any notification of *n by the
+   expiry thread to finish.  Requires that n->timer_armed be set, and no
+   note_mu held. */
+static void note_disarm (nsync_note n) {
+	struct note_wheel_s *w = note_wheel (n);
+	nsync_mu_lock (&w->mu);
+	while (w->firing == n) {
+		nsync_cv_wait (&w->fired_cv, &w->mu);
+	}
+	wheel_remove (w, n);
+	nsync_mu_unlock (&w->mu);
+}
+
+/* Process every wheel up to the current time, and return the earliest time
+   at which one must next be processed.  Requires expiry.mu not held. */
+static nsync_time wheels_run (void) {
+	nsync_time wake_time = nsync_time_no_deadline;
+	int i;
+	for (i = 0; i != WHEEL_SHARDS; i++) {
+		struct note_wheel_s *w = &wheels[i];
+		nsync_mu_lock (&w->mu);
+		wheel_run_until (w, nsync_time_now ());
+		w->wake_time = wheel_next_time (w);
+		if (nsync_time_cmp (w->wake_time, wake_time) < 0) {
+			wake_time = w->wake_time;
+		}
+		nsync_mu_unlock (&w->mu);
+	}
+	return (wake_time);
+}
+
+void nsync_note_expiry_run (nsync_note stop) {
+	nsync_mu_lock (&expiry.mu);
+	if (ATM_LOAD (&expiry.running) == 0) {
+		nsync_time wake_time;
+		int i;
+		for (i = 0; i != WHEEL_SHARDS; i++) {
+			nsync_mu_lock (&wheels[i].mu);
+			if (wheels[i].armed == 0) {
+				wheels[i].now_time = nsync_time_now ();
+			}
+			nsync_mu_unlock (&wheels[i].mu);
+		}
+		ATM_STORE (&expiry.running, 1);
+		/* *stop is checked only by the wait, which releases expiry.mu;
+		   notifying *stop may require note locks acquired before it.
+		   A note armed after its wheel was processed, but before the
+		   wait, sets expiry.kicked, so that the wheels are processed
+		   again at once. */
+		do {
+			expiry.kicked = 0;
+			nsync_mu_unlock (&expiry.mu);
+			wake_time = wheels_run ();
+			nsync_mu_lock (&expiry.mu);
+		} while (nsync_cv_wait_with_deadline (&expiry.cv, &expiry.mu,
+						      expiry.kicked? nsync_time_zero : wake_time,
+						      stop) != ECANCELED);
+		ATM_STORE (&expiry.running, 0);
+	}
+	nsync_mu_unlock (&expiry.mu);
+}
+
+/* --------------------------------------------------- */
+
 /* Return the deadline by which *n is certain to be notified,
    setting it to zero if it already has passed that time.
-   Requires n->note_mu not held on entry.
+   Requires n->note_mu not held on entry.  Acquires no lock unless *n is
+   to be notified.
 
    Not static; used in sem_wait.c */
 nsync_time nsync_note_notified_deadline_ (nsync_note n) {
-	nsync_time ntime;
-	if (ATM_LOAD_ACQ (&n->notified) != 0) {
+	nsync_time ntime = NOTIFIED_TIME (n);
+	if (nsync_time_cmp (ntime, nsync_time_zero) > 0 &&
+	    nsync_time_cmp (ntime, nsync_time_no_deadline) != 0 &&
+	    nsync_time_expired_ (ntime)) {
+		notify (n);
 		ntime = nsync_time_zero;
+	}
+	return (ntime);
+}
+
+/* If *n has not been notified, add *nw to its waiters, set nw->waiting, and
+   return non-zero.  Otherwise, clear nw->waiting, and return 0.  Requires
+   n->note_mu not held by the caller.
+
+   Not static; used in sem_wait.c */
+int nsync_note_enqueue_ (nsync_note n, struct nsync_waiter_s *nw) {
+	int waiting = 0;
+	uint32_t old_word = nsync_spin_test_and_set_or_sleep_ (&n->notified, NOTE_SPINLOCK,
+							       NOTE_SPINLOCK, 0);
+	if ((old_word & NOTE_NOTIFIED) == 0) {
+		n->waiters = nsync_dll_make_last_in_list_ (n->waiters, &nw->q);
+		ATM_STORE (&nw->waiting, 1);
+		waiting = 1;
 	} else {
-		nsync_mu_lock (&n->note_mu);
-		ntime = NOTIFIED_TIME (n);
-		nsync_mu_unlock (&n->note_mu);
-		if (nsync_time_cmp (ntime, nsync_time_zero) > 0) {
-			if (nsync_time_cmp (ntime, nsync_time_now ()) <= 0) {
-				notify (n);
-				ntime = nsync_time_zero;
-			}
+		ATM_STORE (&nw->waiting, 0);
+	}
+	ATM_STORE_REL (&n->notified, old_word); /* release store */
+	return (waiting);
+}
+
+/* Remove *nw, queued by nsync_note_enqueue_(), from the waiters of *n and
+   return non-zero, unless *n has been notified, in which case the notifier
+   has removed *nw; wait until it has woken *nw, and return 0.  Requires
+   n->note_mu not held by the caller.
+
+   Not static; used in sem_wait.c */
+int nsync_note_dequeue_ (nsync_note n, struct nsync_waiter_s *nw) {
+	int was_queued = 0;
+	uint32_t old_word = nsync_spin_test_and_set_or_sleep_ (&n->notified, NOTE_SPINLOCK,
+							       NOTE_SPINLOCK, 0);
+	if ((old_word & NOTE_NOTIFIED) == 0) {
+		n->waiters = nsync_dll_remove_ (n->waiters, &nw->q);
+		ATM_STORE (&nw->waiting, 0);
+		was_queued = 1;
+	}
+	ATM_STORE_REL (&n->notified, old_word); /* release store */
+	if (!was_queued) {
+		/* The notifier may still be unlinking *nw. */
+		unsigned attempts = 0;
+		while (ATM_LOAD_ACQ (&nw->waiting) != 0) {
+			attempts = nsync_spin_delay_ (attempts);
 		}
 	}
-	return (ntime);
+	return (was_queued);
 }
 
 int nsync_note_is_notified (nsync_note n) {
@@ -171,67 +654,82 @@ nsync_note nsync_note_new (nsync_note parent,
 			   nsync_time abs_deadline) {
 	nsync_note n = (nsync_note) malloc (sizeof (*n));
 	if (n != NULL) {
+		int by_parent = 0; /* whether the parent's expiry covers n's */
 		memset ((void *) n, 0, sizeof (*n));
 		nsync_dll_init_ (&n->parent_child_link, n);
+		nsync_dll_init_ (&n->timer_link, n);
 		set_expiry_time (n, abs_deadline);
 		if (!nsync_note_is_notified (n) && parent != NULL) {
+			struct nsync_note_shard_s_ *shards = note_shards_alloc (parent);
+			struct nsync_note_shard_s_ *s;
 			nsync_time parent_time;
-			nsync_mu_lock (&parent->note_mu);
+			if (shards == NULL) {
+				free (n);
+				return (NULL);
+			}
+			/* Choose the shard by page, so that threads allocating
+			   from different arenas tend to use different shards, yet
+			   a walk of a shard visits neighbouring notes. */
+			n->shard = (uint32_t) (((uintptr_t) n) >> 12) % NOTE_SHARDS;
+			s = &shards[n->shard];
+			nsync_mu_lock (&s->mu);
 			parent_time = NOTIFIED_TIME (parent);
 			if (nsync_time_cmp (parent_time, abs_deadline) < 0) {
 				set_expiry_time (n, parent_time);
+				by_parent = (ATM_LOAD (&parent->timer_covered) != 0);
+				n->timer_by_parent = by_parent;
+				ATM_STORE (&n->timer_covered, by_parent);
 			}
 			if (nsync_time_cmp (parent_time, nsync_time_zero) > 0) {
 				n->parent = parent;
-				parent->children = nsync_dll_make_last_in_list_ (parent->children,
-					&n->parent_child_link);
+				s->children = nsync_dll_make_last_in_list_ (s->children,
+									    &n->parent_child_link);
 			}
-			nsync_mu_unlock (&parent->note_mu);
+			nsync_mu_unlock (&s->mu);
+		}
+		if (!by_parent &&
+		    nsync_time_cmp (n->expiry_time, nsync_time_no_deadline) != 0 &&
+		    nsync_time_cmp (NOTIFIED_TIME (n), nsync_time_zero) > 0) {
+			note_arm (n);
 		}
 	}
 	return (n);
 }
 
 void nsync_note_free (nsync_note n) {
-	nsync_note parent;
-	nsync_dll_element_ *p;
-	nsync_dll_element_ *next;
+	struct nsync_note_shard_s_ *s;
+	nsync_note adopter = NULL;
+	nsync_dll_list_ cascade = NULL;
+	int armed;
 	nsync_mu_lock (&n->note_mu);
+	/* Wait for any notification of n by another thread to finish. */
+	WAIT_FOR_CONDITION (&n->note_mu, &n->idle_cv, note_idle, n);
 	n->disconnecting++;
 	ASSERT (nsync_dll_is_empty_ (n->waiters));
-	parent = n->parent;
-	if (parent != NULL && !nsync_mu_trylock (&parent->note_mu)) {
-		nsync_mu_unlock (&n->note_mu);
-		nsync_mu_lock (&parent->note_mu);
-		nsync_mu_lock (&n->note_mu);
+	s = lock_parent_shard (n);
+	if (s != NULL && (ATM_LOAD_ACQ (&n->parent->notified) & NOTE_NOTIFIED) == 0) {
+		adopter = n->parent;
 	}
-	for (p = nsync_dll_first_ (n->children); p != NULL; p = next) {
-		nsync_note child = DLL_NOTE (p);
-		next = nsync_dll_next_ (n->children, p);
-		nsync_mu_lock (&child->note_mu);
-		if (child->disconnecting == 0) {
-			n->children = nsync_dll_remove_ (n->children,
-							 &child->parent_child_link);
-			if (parent != NULL) {
-				child->parent = parent;
-				parent->children = nsync_dll_make_last_in_list_ (
-					parent->children, &child->parent_child_link);
-			} else {
-				child->parent = NULL;
-			}
+	if (n->shards != NULL) {
+		int i;
+		for (i = 0; i != NOTE_SHARDS; i++) {
+			/* If the parent has been notified, notify the children
+			   rather than have it adopt them. */
+			drain_shard (&n->shards[i], adopter, s,
+				     (s != NULL && adopter == NULL)? &cascade : NULL);
 		}
-		nsync_mu_unlock (&child->note_mu);
 	}
-	WAIT_FOR_NO_CHILDREN (no_children, n);
-	if (parent != NULL) {
-		parent->children = nsync_dll_remove_ (parent->children,
-						      &n->parent_child_link);
-		WAKEUP_NO_CHILDREN (parent);
-		n->parent = NULL;
-		nsync_mu_unlock (&parent->note_mu);
+	if (s != NULL) {
+		unlink_from_parent (n, s);
 	}
 	n->disconnecting--;
+	armed = n->timer_armed;
 	nsync_mu_unlock (&n->note_mu);
+	note_cascade (cascade);
+	if (armed) {
+		note_disarm (n);
+	}
+	free (n->shards);
 	free (n);
 }
 
@@ -260,37 +758,13 @@ static nsync_time note_ready_time (void *v, struct nsync_waiter_s *nw UNUSED) {
 }
 
 static int note_enqueue (void *v, struct nsync_waiter_s *nw) {
-	int waiting = 0;
-	nsync_note n = (nsync_note) v;
-	nsync_time ntime;
-	nsync_mu_lock (&n->note_mu);
-	ntime = NOTIFIED_TIME (n);
-	if (nsync_time_cmp (ntime, nsync_time_zero) > 0) {
-		n->waiters = nsync_dll_make_last_in_list_ (n->waiters, &nw->q);
-		ATM_STORE (&nw->waiting, 1);
-		waiting = 1;
-	} else {
-		ATM_STORE (&nw->waiting, 0);
-		waiting = 0;
-	}
-	nsync_mu_unlock (&n->note_mu);
-	return (waiting);
+	return (nsync_note_enqueue_ ((nsync_note) v, nw));
 }
 
 static int note_dequeue (void *v, struct nsync_waiter_s *nw) {
-	int was_queued = 0;
 	nsync_note n = (nsync_note) v;
-	nsync_time ntime;
 	nsync_note_notified_deadline_ (n);
-	nsync_mu_lock (&n->note_mu);
-	ntime = NOTIFIED_TIME (n);
-	if (nsync_time_cmp (ntime, nsync_time_zero) > 0) {
-		n->waiters = nsync_dll_remove_ (n->waiters, &nw->q);
-		ATM_STORE (&nw->waiting, 0);
-		was_queued = 1;
-	}
-	nsync_mu_unlock (&n->note_mu);
-	return (was_queued);
+	return (nsync_note_dequeue_ (n, nw));
 }
 
 const struct nsync_waitable_funcs_s nsync_note_waitable_funcs = {
@@ -22,9 +22,19 @@
 
 NSYNC_CPP_START_
 
+/* A build whose semaphore implementation is known to need little space
+   defines NSYNC_SEMAPHORE_SIZE_ to the number of bytes it needs, so that
+   waiters stay small; see platform/linux/platform.h.  Each implementation
+   checks at compile time that it fits.  */
+#if defined(NSYNC_SEMAPHORE_SIZE_)
+typedef struct nsync_semaphore_s_ {
+	uint32_t sem_space[(NSYNC_SEMAPHORE_SIZE_ + 3) / 4]; /* space used by implementation */
+} nsync_semaphore;
+#else
 typedef struct nsync_semaphore_s_ {
 	void *sem_space[32]; /* space used by implementation */
 } nsync_semaphore;
+#endif
 
 /* Initialize *s; the initial value is 0. */
 void nsync_mu_semaphore_init (nsync_semaphore *s);
@@ -40,6 +50,17 @@ int nsync_mu_semaphore_p_with_deadline (nsync_semaphore *s, nsync_time abs_deadl
 /* Ensure that the count of *s is at least 1. */
 void nsync_mu_semaphore_v (nsync_semaphore *s);
 
+/* Ensure that the count of each of *s[0,..,n-1] is at least 1, as n calls of
+   nsync_mu_semaphore_v() would, but perhaps with fewer system calls.  */
+void nsync_mu_semaphore_v_n (nsync_semaphore *s[], int n);
+
+/* Hint that until the next call, threads waiting on *s are likely to be
+   woken by nsync_mu_semaphore_v_n() together with those waiting on other
+   semaphores given the same non-zero group, so that they can be woken with
+   fewer system calls.  A group of 0 cancels the hint.  Implementations may
+   ignore the hint.  Called only by the thread that waits on *s.  */
+void nsync_mu_semaphore_set_group (nsync_semaphore *s, uintptr_t group);
+
 NSYNC_CPP_END_
 
 #endif /*NSYNC_INTERNAL_SEM_H_*/
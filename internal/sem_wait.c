@@ -33,7 +33,10 @@ int nsync_sem_wait_with_cancel_ (waiter *w, nsync_time abs_deadline,
 			         nsync_note cancel_note) {
 	int sem_outcome;
 	if (cancel_note == NULL) {
-		sem_outcome = nsync_mu_semaphore_p_with_deadline (&w->sem, abs_deadline);
+		nsync_thread_blocking_ (1);
+		sem_outcome = nsync_mu_semaphore_p_with_deadline (
+			&w->sem, nsync_deadline_with_slack_ (abs_deadline));
+		nsync_thread_blocking_ (0);
 	} else {
 		nsync_time cancel_time;
 		cancel_time = nsync_note_notified_deadline_ (cancel_note);
@@ -43,36 +46,27 @@ int nsync_sem_wait_with_cancel_ (waiter *w, nsync_time abs_deadline,
 			nw.tag = NSYNC_WAITER_TAG;
 			nw.sem = &w->sem;
 			nsync_dll_init_ (&nw.q, &nw);
-			ATM_STORE (&nw.waiting, 1);
 			nw.flags = 0;
-			nsync_mu_lock (&cancel_note->note_mu);
-			cancel_time = NOTIFIED_TIME (cancel_note);
-			if (nsync_time_cmp (cancel_time, nsync_time_zero) > 0) {
+			/* cancel_time is unchanged unless *cancel_note has
+			   since been notified, which the enqueue detects. */
+			if (nsync_note_enqueue_ (cancel_note, &nw)) {
 				nsync_time local_abs_deadline;
 				int deadline_is_nearer = 0;
-				cancel_note->waiters = nsync_dll_make_last_in_list_ (
-					cancel_note->waiters, &nw.q);
 				local_abs_deadline = cancel_time;
 				if (nsync_time_cmp (abs_deadline, cancel_time) < 0) {
 					local_abs_deadline = abs_deadline;
 					deadline_is_nearer = 1;
 				}
-				nsync_mu_unlock (&cancel_note->note_mu);
+				nsync_thread_blocking_ (1);
 				sem_outcome = nsync_mu_semaphore_p_with_deadline (&w->sem,
-					local_abs_deadline);
+					nsync_deadline_with_slack_ (local_abs_deadline));
+				nsync_thread_blocking_ (0);
 				if (sem_outcome == ETIMEDOUT && !deadline_is_nearer) {
 					sem_outcome = ECANCELED;
 					nsync_note_notify (cancel_note);
 				}
-				nsync_mu_lock (&cancel_note->note_mu);
-				cancel_time = NOTIFIED_TIME (cancel_note);
-				if (nsync_time_cmp (cancel_time,
-						    nsync_time_zero) > 0) {
-					cancel_note->waiters = nsync_dll_remove_ (
-						cancel_note->waiters, &nw.q);
-				}
+				nsync_note_dequeue_ (cancel_note, &nw);
 			}
-			nsync_mu_unlock (&cancel_note->note_mu);
 		}
 	}
 	return (sem_outcome);
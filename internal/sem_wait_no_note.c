@@ -30,7 +30,12 @@ NSYNC_CPP_START_
      abs_deadline expires---return ETIMEDOUT.
      Ignores cancel_note. */
 int nsync_sem_wait_with_cancel_ (waiter *w, nsync_time abs_deadline, nsync_note cancel_note UNUSED) {
-	return (nsync_mu_semaphore_p_with_deadline (&w->sem, abs_deadline));
+	int sem_outcome;
+	nsync_thread_blocking_ (1);
+	sem_outcome = nsync_mu_semaphore_p_with_deadline (
+		&w->sem, nsync_deadline_with_slack_ (abs_deadline));
+	nsync_thread_blocking_ (0);
+	return (sem_outcome);
 }
 
 NSYNC_CPP_END_
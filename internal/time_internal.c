@@ -16,7 +16,9 @@
 #include "platform.h"
 #include "compiler.h"
 #include "cputype.h"
+#include "nsync_time_init.h"
 #include "nsync_time.h"
+#include "atomic.h"
 
 NSYNC_CPP_START_
 
@@ -30,4 +32,132 @@ nsync_time nsync_time_us (unsigned us) {
 	return (nsync_time_s_ns (s, 1000 * (us % (1000 * 1000))));
 }
 
+/* The process-wide timer slack, in nanoseconds, at most one second. */
+static nsync_atomic_uint32_ time_slack_ns;
+
+/* Return slack in nanoseconds, limited to one second. */
+static uint32_t slack_to_ns (nsync_time slack) {
+	uint32_t ns = 0;
+	if (nsync_time_cmp (slack, nsync_time_s_ns (1, 0)) >= 0) {
+		ns = 1000 * 1000 * 1000;
+	} else if (nsync_time_cmp (slack, nsync_time_zero) > 0) {
+		ns = (uint32_t) NSYNC_TIME_NSEC (slack);
+	}
+	return (ns);
+}
+
+/* Return abs_deadline rounded up to the end of its bucket, where each second
+   is divided into buckets of slack_ns nanoseconds, the last perhaps shorter.
+   Deadlines are rounded to the same instants in all threads, so that their
+   expiries can share a wakeup.  */
+static nsync_time round_deadline (nsync_time abs_deadline, uint32_t slack_ns) {
+	nsync_time result = abs_deadline;
+	if (slack_ns != 0 && nsync_time_cmp (abs_deadline, nsync_time_no_deadline) != 0) {
+		uint32_t ns = (uint32_t) NSYNC_TIME_NSEC (abs_deadline);
+		uint32_t r = ns % slack_ns;
+		if (r != 0) {
+			ns += slack_ns - r;
+			if (ns >= 1000 * 1000 * 1000) {
+				result = nsync_time_s_ns (NSYNC_TIME_SEC (abs_deadline) + 1, 0);
+			} else {
+				result = nsync_time_s_ns (NSYNC_TIME_SEC (abs_deadline), ns);
+			}
+			if (nsync_time_cmp (result, abs_deadline) < 0) { /* overflow */
+				result = abs_deadline;
+			}
+		}
+	}
+	return (result);
+}
+
+void nsync_time_set_slack (nsync_time slack) {
+	ATM_STORE (&time_slack_ns, slack_to_ns (slack));
+}
+
+nsync_time nsync_time_slack (void) {
+	return (nsync_time_s_ns (0, ATM_LOAD (&time_slack_ns)));
+}
+
+nsync_time nsync_time_with_slack (nsync_time abs_deadline, nsync_time slack) {
+	return (round_deadline (abs_deadline, slack_to_ns (slack)));
+}
+
+/* Return abs_deadline adjusted by the process-wide timer slack.  Used before
+   blocking on a semaphore with a deadline. */
+nsync_time nsync_deadline_with_slack_ (nsync_time abs_deadline) {
+	return (round_deadline (abs_deadline, ATM_LOAD (&time_slack_ns)));
+}
+
+#if defined(NSYNC_COARSE_CLOCK_)
+/* NSYNC_COARSE_CLOCK_ lags nsync_time_now() by its resolution, plus however
+   long the timer tick that advances it is delayed, which is usually well
+   under a millisecond, but can be more in a virtual machine.  The coarse
+   clock is trusted to show that a deadline has not passed only if the
+   deadline is more than COARSE_MARGIN_NS beyond the coarse time. */
+#define COARSE_MARGIN_NS (100 * 1000 * 1000)
+
+/* The resolution of NSYNC_COARSE_CLOCK_ plus COARSE_MARGIN_NS in nanoseconds,
+   0 if not yet known, or COARSE_UNUSABLE if the clock cannot be read or is
+   too coarse to be worth reading. */
+static nsync_atomic_uint32_ coarse_margin_ns;
+#define COARSE_UNUSABLE (~(uint32_t) 0)
+
+/* Return the value of coarse_margin_ns, computing it if necessary. */
+static uint32_t coarse_margin (void) {
+	uint32_t margin_ns = ATM_LOAD (&coarse_margin_ns);
+	if (margin_ns == 0) {
+		struct timespec res;
+		struct timespec ts;
+		margin_ns = COARSE_UNUSABLE;
+		if (clock_getres (NSYNC_COARSE_CLOCK_, &res) == 0 &&
+		    clock_gettime (NSYNC_COARSE_CLOCK_, &ts) == 0 &&
+		    res.tv_sec == 0 && res.tv_nsec < COARSE_MARGIN_NS) {
+			margin_ns = (uint32_t) res.tv_nsec + COARSE_MARGIN_NS;
+		}
+		ATM_STORE (&coarse_margin_ns, margin_ns);
+	}
+	return (margin_ns);
+}
+#endif
+
+/* Return whether abs_deadline has passed.  Where there is a coarse clock, it
+   is read first, and nsync_time_now() is read only if the deadline is too
+   close to the coarse time for the coarse clock to tell.  The answer is thus
+   the same as comparing with nsync_time_now(), but usually cheaper, because
+   the deadlines that are checked most often are far from expiry.  */
+int nsync_time_expired_ (nsync_time abs_deadline) {
+	int expired = -1; /* -1 means not yet known */
+#if defined(NSYNC_COARSE_CLOCK_)
+	uint32_t margin_ns = coarse_margin ();
+	if (margin_ns != COARSE_UNUSABLE) {
+		/* Compare field by field; this path must cost much less than
+		   nsync_time_now() to be worthwhile.  The margin is under a
+		   second, so the nanoseconds matter only if the seconds differ
+		   by at most one.  */
+		struct timespec ts;
+		time_t dsec;
+		clock_gettime (NSYNC_COARSE_CLOCK_, &ts);
+		dsec = NSYNC_TIME_SEC (abs_deadline) - ts.tv_sec;
+		if (dsec > 1) {
+			expired = 0;
+		} else if (dsec < -1) {
+			expired = 1;
+		} else {
+			int64_t dns = ((int64_t) dsec) * 1000 * 1000 * 1000 +
+				      (int64_t) NSYNC_TIME_NSEC (abs_deadline) -
+				      (int64_t) ts.tv_nsec;
+			if (dns <= 0) {
+				expired = 1;
+			} else if (dns > (int64_t) margin_ns) {
+				expired = 0;
+			}
+		}
+	}
+#endif
+	if (expired < 0) {
+		expired = (nsync_time_cmp (abs_deadline, nsync_time_now ()) <= 0);
+	}
+	return (expired);
+}
+
 NSYNC_CPP_END_
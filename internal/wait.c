@@ -62,6 +62,7 @@ int nsync_wait_n (void *mu, void (*lock) (void *), void (*unlock) (void *),
 				(*unlock) (mu);
 				unlocked = 1;
 			}
+			nsync_thread_blocking_ (1);
 			do {
 				min_ntime = abs_deadline;
 				for (j = 0; j != count; j++) {
@@ -74,7 +75,8 @@ int nsync_wait_n (void *mu, void (*lock) (void *), void (*unlock) (void *),
 				}
 			} while (nsync_time_cmp (min_ntime, nsync_time_zero) > 0 &&
 				 nsync_mu_semaphore_p_with_deadline (&w->sem,
-					min_ntime) == 0);
+					nsync_deadline_with_slack_ (min_ntime)) == 0);
+			nsync_thread_blocking_ (0);
 		}
 
 		/* An attempt was made above to enqueue waitable[0..i-1].
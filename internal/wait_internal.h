@@ -22,11 +22,12 @@ NSYNC_CPP_START_
    on a client's object, those functions are called with v pointing to the
    client's object and nw pointing to a struct nsync_waiter_s. */
 struct nsync_waiter_s {
-	uint32_t tag; /* used for debugging */
 	nsync_dll_element_ q; /* used to link children of parent */
-	nsync_atomic_uint32_ waiting; /* non-zero <=> the waiter is waiting */
 	struct nsync_semaphore_s_ *sem; /* *sem will be Ved when waiter is woken */
+	nsync_atomic_uint32_ waiting; /* non-zero <=> the waiter is waiting */
 	uint32_t flags; /* see below */
+	uint32_t cv_gen; /* generation of the nsync_cv on which queued; see internal/common.h */
+	uint32_t tag; /* used for debugging; last, where padding would be */
 };
 
 #define NSYNC_WAITER_FLAG_MUCV 0x1 /* set if waiter is embedded in Mu/CV's internal structures */
@@ -17,4 +17,9 @@
 
 #define ATM_LD_IS_ACQ_ST_IS_REL_ 0
 
+/* Hint to the processor that the caller is in a spin loop. */
+#if defined(__GNUC__)
+#define CPU_RELAX_() __asm__ __volatile__ ("yield")
+#endif
+
 #endif /*NSYNC_PLATFORM_AARCH64_CPUTYPE_H_*/
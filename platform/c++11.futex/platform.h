@@ -24,4 +24,9 @@
 #include <linux/futex.h>
 #include <sys/syscall.h>
 
+/* The futex semaphore needs two ints; see platform/linux/platform.h. */
+#if !defined(NSYNC_SEMAPHORE_NOT_FUTEX_)
+#define NSYNC_SEMAPHORE_SIZE_ 8
+#endif
+
 #endif /*NSYNC_PLATFORM_CPP11_FUTEX_PLATFORM_H_*/
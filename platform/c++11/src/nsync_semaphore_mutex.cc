@@ -117,4 +117,16 @@ void nsync_mu_semaphore_v (nsync_semaphore *s) {
 	mc_mu.unlock ();
 }
 
+/* Ensure that the count of each of *s[0,..,n-1] is at least 1. */
+void nsync_mu_semaphore_v_n (nsync_semaphore *s[], int n) {
+	int i;
+	for (i = 0; i != n; i++) {
+		nsync_mu_semaphore_v (s[i]);
+	}
+}
+
+/* Each semaphore is woken separately, so the grouping hint is ignored. */
+void nsync_mu_semaphore_set_group (nsync_semaphore *s UNUSED, uintptr_t group UNUSED) {
+}
+
 NSYNC_CPP_END_
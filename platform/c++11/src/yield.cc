@@ -21,4 +21,22 @@ void nsync_yield_ (void) {
 	std::this_thread::yield ();
 }
 
+int nsync_cpu_count_ (void) {
+	return ((int) std::thread::hardware_concurrency ());
+}
+
+/* C++11 has no portable way to find NUMA nodes; assume a single node. */
+int nsync_numa_node_count_ (void) {
+	return (1);
+}
+
+int nsync_numa_node_ (void) {
+	return (0);
+}
+
+/* Nor to find the current processor. */
+int nsync_cpu_ (void) {
+	return (0);
+}
+
 NSYNC_CPP_END_
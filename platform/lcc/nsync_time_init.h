@@ -21,4 +21,13 @@
 #define NSYNC_TIME_STATIC_INIT(t,ns) { (t), (ns) }
 #endif
 
+/* NSYNC_CLOCK_ is the clock read by nsync_time_now(), and the clock against
+   which the semaphores interpret absolute deadlines; see
+   platform/posix/nsync_time_init.h.  No coarse clock is used with lcc.  */
+#if defined(NSYNC_USE_MONOTONIC_CLOCK)
+#define NSYNC_CLOCK_ CLOCK_MONOTONIC
+#else
+#define NSYNC_CLOCK_ CLOCK_REALTIME
+#endif
+
 #endif /*NSYNC_PLATFORM_LCC_NSYNC_TIME_INIT_H_*/
@@ -35,4 +35,11 @@
 #include <stdio.h>
 #include <stdarg.h>
 
+/* Linux builds use the futex semaphore in
+   platform/linux/src/nsync_semaphore_futex.c, which needs two ints,
+   unless the build defines NSYNC_SEMAPHORE_NOT_FUTEX_.  */
+#if !defined(NSYNC_SEMAPHORE_NOT_FUTEX_)
+#define NSYNC_SEMAPHORE_SIZE_ 8
+#endif
+
 #endif /*NSYNC_PLATFORM_LINUX_PLATFORM_H_*/
@@ -13,6 +13,7 @@
   limitations under the License. */
 
 #include "headers.h"
+#include "nsync_time_init.h"
 
 NSYNC_CPP_START_
 
@@ -42,56 +43,171 @@ static const int assert_int_size = 1 /
 #define FUTEX_PRIVATE_FLAG_ 0
 #endif
 
+/* FUTEX_WAIT_BITSET measures absolute timeouts against CLOCK_MONOTONIC unless
+   given FUTEX_CLOCK_REALTIME; the clock must match NSYNC_CLOCK_.  */
+#if defined(NSYNC_USE_MONOTONIC_CLOCK)
+#define FUTEX_CLOCK_ 0
+#else
+#define FUTEX_CLOCK_ FUTEX_CLOCK_REALTIME
+#endif
+
 #if defined(FUTEX_WAIT_BITSET)
-#define FUTEX_WAIT_ (FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG_ | FUTEX_CLOCK_REALTIME)
+#define FUTEX_WAIT_ (FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG_ | FUTEX_CLOCK_)
 #define FUTEX_WAIT_BITS_ FUTEX_BITSET_MATCH_ANY
 #else
 #define FUTEX_WAIT_ (FUTEX_WAIT | FUTEX_PRIVATE_FLAG_)
 #define FUTEX_WAIT_BITS_ 0
 #endif
 #define FUTEX_WAKE_ (FUTEX_WAKE | FUTEX_PRIVATE_FLAG_)
+#if defined(FUTEX_WAIT_BITSET) && defined(FUTEX_WAKE_BITSET)
+#define FUTEX_WAKE_BITS_ (FUTEX_WAKE_BITSET | FUTEX_PRIVATE_FLAG_)
+#define SEM_GROUPING 1 /* sleepers may wait on a group's word; see below */
+#else
+#define FUTEX_WAKE_BITS_ FUTEX_WAKE_
+#define SEM_GROUPING 0
+#endif
+#if defined(FUTEX_WAKE_OP) && defined(FUTEX_OP)
+#define FUTEX_WAKE_OP_ (FUTEX_WAKE_OP | FUTEX_PRIVATE_FLAG_)
+/* With FUTEX_WAKE_OP_, leave the second word unchanged (add 0), and wake a
+   thread on it if its old value is non-negative, which it always is, since
+   the sleeper count is small.  */
+#define FUTEX_OP_WAKE_BOTH_ FUTEX_OP (FUTEX_OP_ADD, 0, FUTEX_OP_CMP_GE, 0)
+#endif
 #define FUTEX_TIMEOUT_IS_ABSOLUTE (FUTEX_WAIT_BITS_ != 0)
 
 #define ASSERT(x) do { if (!(x)) { *(volatile int *)0 = 0; } } while (0)
 
+/* The low byte of a semaphore's word is its count, and the high half the
+   number of threads that are, or are about to be, blocked in FUTEX_WAIT on
+   it.  nsync_mu_semaphore_v() issues FUTEX_WAKE only if that number is
+   non-zero.  A thread adds itself to the number before FUTEX_WAIT, using the
+   value it stored as the value FUTEX_WAIT expects, so it cannot sleep through
+   a v() that saw no sleepers.
+
+   A semaphore given a group by nsync_mu_semaphore_set_group() has its
+   sleepers wait instead on the group's word in sem_group[], with
+   FUTEX_WAIT_BITSET and a bit chosen by the semaphore's address, and
+   records the group in the SEM_GROUP field of its word.  Each waker
+   increments the group's word and wakes the group with FUTEX_WAKE_BITSET,
+   so nsync_mu_semaphore_v_n() releases all the sleepers of a group with
+   one system call.  A sleeper reads the group's word before adding itself
+   to the sleepers, so it cannot sleep through a v() that saw it.  Unrelated
+   sleepers that share a group's word and bit merely wake spuriously.  */
 struct futex {
-	int i;  /* lo half=count; hi half=waiter count */
+	int i;  /* count, group and waiter count; see SEM_COUNT etc. */
+	uint32_t group; /* 1 + index in sem_group[] for sleepers, or 0 */
 };
 
+#define SEM_COUNT ((uint32_t) 0xff)      /* mask for count */
+#define SEM_GROUP_SHIFT 8
+#define SEM_GROUP ((uint32_t) 0xff << SEM_GROUP_SHIFT) /* group of sleepers, or 0 */
+#define SEM_SLEEPER ((uint32_t) 0x10000) /* one sleeping thread */
+#define SEM_SLEEPERS ((uint32_t) ~(uint32_t) 0 << 16) /* mask for waiter count */
+
+#define SEM_GROUPS 64 /* number of group words */
+
+/* sem_group[i].word is the word on which the sleepers of group i+1 wait. */
+static union sem_group_u {
+	nsync_atomic_uint32_ word;
+	char pad[64]; /* assumed cache line size */
+} sem_group[SEM_GROUPS];
+
+/* The number of times nsync_mu_semaphore_p() polls the count before
+   sleeping, if the machine has more than one CPU.  Short, because a thread
+   that is to be woken soon has usually been woken already, and callers of
+   nsync_mu_semaphore_p() do their own spinning first.  */
+#define SEM_SPIN 32
+
 static nsync_semaphore *sem_big_enough_for_futex = (nsync_semaphore *) (uintptr_t)(1 /
 	(sizeof (struct futex) <= sizeof (*sem_big_enough_for_futex)));
 
+/* Number of online CPUs, or 0 if not yet known. */
+static nsync_atomic_uint32_ cpus;
+
 /* Initialize *s; the initial value is 0. */
 void nsync_mu_semaphore_init (nsync_semaphore *s) {
 	struct futex *f = (struct futex *) s;
 	f->i = 0;
+	f->group = 0;
 }
 
-/* Wait until the count of *s exceeds 0, and decrement it. */
-void nsync_mu_semaphore_p (nsync_semaphore *s) {
+void nsync_mu_semaphore_set_group (nsync_semaphore *s, uintptr_t group) {
 	struct futex *f = (struct futex *) s;
-	int i;
+	f->group = 0;
+	if (SEM_GROUPING && group != 0) {
+		f->group = 1 + (uint32_t) ((group / 16) % SEM_GROUPS);
+	}
+}
+
+/* Return the FUTEX_WAIT_BITSET bit used by sleepers on *f in a group. */
+static uint32_t sem_group_bit (const struct futex *f) {
+	return ((uint32_t) 1 << ((((uintptr_t) f) / 64) % 32));
+}
+
+/* Wake the sleepers in group, which is non-zero, that wait with a bit in
+   bits.  */
+static void sem_group_wake (uint32_t group, uint32_t bits) {
+	nsync_atomic_uint32_ *g = &sem_group[group - 1].word;
+	uint32_t old_value;
 	do {
-		i = ATM_LOAD ((nsync_atomic_uint32_ *) &f->i);
-		if (i == 0) {
-                        int futex_result = futex (&f->i, FUTEX_WAIT_, i, NULL,
-                                                  NULL, FUTEX_WAIT_BITS_);
-			ASSERT (futex_result == 0 || errno == EINTR ||
-				errno == EWOULDBLOCK);
+		old_value = ATM_LOAD (g);
+	} while (!ATM_CAS_RELACQ (g, old_value, old_value+1));
+	ASSERT (futex ((int *) g, FUTEX_WAKE_BITS_, INT_MAX, NULL, NULL, (int) bits) >= 0);
+}
+
+/* Decrement the count of *s and return non-zero if it is non-zero, polling
+   briefly if there is more than one CPU.  Otherwise return 0.  */
+static int sem_try_p (nsync_atomic_uint32_ *w) {
+	uint32_t n = ATM_LOAD (&cpus);
+	int spin = 0;
+	uint32_t i;
+	if (n == 0) {
+		long c = sysconf (_SC_NPROCESSORS_ONLN);
+		n = (c < 1? 1 : (uint32_t) c);
+		ATM_STORE (&cpus, n);
+	}
+	if (n > 1) {
+		spin = SEM_SPIN;
+	}
+	for (;;) {
+		i = ATM_LOAD (w);
+		if ((i & SEM_COUNT) != 0) {
+			if (ATM_CAS_ACQ (w, i, i - 1)) {
+				return (1);
+			}
+		} else if (spin == 0) {
+			return (0);
+		} else {
+			spin--;
+#if defined(CPU_RELAX_)
+			CPU_RELAX_ ();
+#endif
 		}
-	} while (i == 0 || !ATM_CAS_ACQ ((nsync_atomic_uint32_ *) &f->i, i, i-1));
+	}
 }
 
-/* Wait until one of:
-   the count of *s is non-zero, in which case decrement *s and return 0;
-   or abs_deadline expires, in which case return ETIMEDOUT. */
-int nsync_mu_semaphore_p_with_deadline (nsync_semaphore *s, nsync_time abs_deadline) {
-	struct futex *f = (struct futex *)s;
-	int i;
+/* Wait until the count of *s exceeds 0, or until abs_deadline expires,
+   and return 0 or ETIMEDOUT respectively, decrementing the count if 0 is
+   returned.  */
+static int sem_p (nsync_semaphore *s, nsync_time abs_deadline) {
+	struct futex *f = (struct futex *) s;
+	nsync_atomic_uint32_ *w = (nsync_atomic_uint32_ *) &f->i;
 	int result = 0;
-	do {
-		i = ATM_LOAD ((nsync_atomic_uint32_ *) &f->i);
-		if (i == 0) {
+	while (result == 0 && !sem_try_p (w)) {
+		uint32_t group = f->group;
+		int *word = &f->i; /* the word to wait on */
+		uint32_t bits = FUTEX_WAIT_BITS_;
+		uint32_t expected = 0; /* the value FUTEX_WAIT expects *word to have */
+		uint32_t i;
+		uint32_t new_i;
+		if (group != 0) {
+			word = (int *) &sem_group[group - 1].word;
+			bits = sem_group_bit (f);
+			expected = ATM_LOAD_ACQ (&sem_group[group - 1].word);
+		}
+		i = ATM_LOAD (w);
+		new_i = ((i & ~SEM_GROUP) | (group << SEM_GROUP_SHIFT)) + SEM_SLEEPER;
+		if ((i & SEM_COUNT) == 0 && ATM_CAS (w, i, new_i)) {
 			int futex_result;
 			struct timespec ts_buf;
 			const struct timespec *ts = NULL;
@@ -115,7 +231,10 @@ int nsync_mu_semaphore_p_with_deadline (nsync_semaphore *s, nsync_time abs_deadl
 				}
 				ts = &ts_buf;
 			}
-			futex_result = futex (&f->i, FUTEX_WAIT_, i, ts, NULL, FUTEX_WAIT_BITS_);
+			if (group == 0) {
+				expected = new_i;
+			}
+			futex_result = futex (word, FUTEX_WAIT_, (int) expected, ts, NULL, (int) bits);
 			ASSERT (futex_result == 0 || errno == EINTR || errno == EWOULDBLOCK ||
 				errno == ETIMEDOUT);
 			/* Some systems don't wait as long as they are told. */ 
@@ -123,19 +242,125 @@ int nsync_mu_semaphore_p_with_deadline (nsync_semaphore *s, nsync_time abs_deadl
 			    nsync_time_cmp (abs_deadline, nsync_time_now ()) <= 0) {
 				result = ETIMEDOUT;
 			}
+			do {
+				i = ATM_LOAD (w);
+				new_i = i - SEM_SLEEPER;
+				if ((new_i & SEM_SLEEPERS) == 0) {
+					new_i &= ~SEM_GROUP; /* the last sleeper leaves */
+				}
+			} while (!ATM_CAS (w, i, new_i));
 		}
-	} while (result == 0 && (i == 0 || !ATM_CAS_ACQ ((nsync_atomic_uint32_ *) &f->i, i, i - 1)));
+	}
 	return (result);
 }
 
+/* Wait until the count of *s exceeds 0, and decrement it. */
+void nsync_mu_semaphore_p (nsync_semaphore *s) {
+	sem_p (s, nsync_time_no_deadline);
+}
+
+/* Wait until one of:
+   the count of *s is non-zero, in which case decrement *s and return 0;
+   or abs_deadline expires, in which case return ETIMEDOUT. */
+int nsync_mu_semaphore_p_with_deadline (nsync_semaphore *s, nsync_time abs_deadline) {
+	return (sem_p (s, abs_deadline));
+}
+
+/* Return the word a semaphore should hold after a v() operation, given its
+   old value.  The count saturates at 1, so that it cannot carry into the
+   sleeper count.  A v() that finds the count non-zero need wake no one: no
+   thread starts to sleep while the count is non-zero, and the v() that made
+   it so woke a sleeper if there was one.  The CAS is still performed, for its
+   release barrier.  */
+static uint32_t sem_v_value (uint32_t old_value) {
+	return (old_value + ((old_value & SEM_COUNT) == 0));
+}
+
 /* Ensure that the count of *s is at least 1. */
 void nsync_mu_semaphore_v (nsync_semaphore *s) {
 	struct futex *f = (struct futex *) s;
-        uint32_t old_value;
-        do {    
-                old_value = ATM_LOAD ((nsync_atomic_uint32_ *) &f->i);
-        } while (!ATM_CAS_REL ((nsync_atomic_uint32_ *) &f->i, old_value, old_value+1));
-	ASSERT (futex (&f->i, FUTEX_WAKE_, 1, NULL, NULL, 0) >= 0);
+	nsync_atomic_uint32_ *w = (nsync_atomic_uint32_ *) &f->i;
+	uint32_t old_value;
+	do {
+		old_value = ATM_LOAD (w);
+	} while (!ATM_CAS_REL (w, old_value, sem_v_value (old_value)));
+	if ((old_value & SEM_COUNT) == 0 && (old_value & SEM_SLEEPERS) != 0) {
+		/* Some thread may be blocked in FUTEX_WAIT. */
+		uint32_t group = (old_value & SEM_GROUP) >> SEM_GROUP_SHIFT;
+		if (group == 0) {
+			ASSERT (futex (&f->i, FUTEX_WAKE_, 1, NULL, NULL, 0) >= 0);
+		} else {
+			sem_group_wake (group, sem_group_bit (f));
+		}
+	}
+}
+
+/* The number of semaphores without a group whose counts
+   nsync_mu_semaphore_v_n() raises before waking their sleepers, and the
+   number of distinct groups whose wakeups it defers.  */
+#define V_N_BATCH 32
+#define V_N_GROUPS 8
+
+/* Ensure that the count of each of *s[0,..,n-1] is at least 1.  All the
+   counts in a batch are raised before any thread is woken, so a thread that
+   has not yet gone to sleep need not.  The sleepers of each group are woken
+   with one system call once every count has been raised, so that no sleeper
+   is woken only to find its count still zero; those of semaphores without a
+   group are woken two per system call, where FUTEX_WAKE_OP is available.  */
+void nsync_mu_semaphore_v_n (nsync_semaphore *s[], int n) {
+	uint32_t group[V_N_GROUPS]; /* distinct groups with sleepers */
+	uint32_t bits[V_N_GROUPS];  /* bits[g] are the sleepers' bits in group[g] */
+	int groups = 0;
+	int i = 0;
+	int j;
+	while (i != n) {
+		int *sleepy[V_N_BATCH];  /* words of ungrouped semaphores with sleepers */
+		int k = 0;
+		for (; i != n && k != V_N_BATCH; i++) {
+			struct futex *f = (struct futex *) s[i];
+			nsync_atomic_uint32_ *w = (nsync_atomic_uint32_ *) &f->i;
+			uint32_t old_value;
+			do {
+				old_value = ATM_LOAD (w);
+			} while (!ATM_CAS_REL (w, old_value, sem_v_value (old_value)));
+			if ((old_value & SEM_COUNT) == 0 && (old_value & SEM_SLEEPERS) != 0) {
+				uint32_t g = (old_value & SEM_GROUP) >> SEM_GROUP_SHIFT;
+				if (g == 0) {
+					sleepy[k++] = &f->i;
+				} else {
+					for (j = 0; j != groups && group[j] != g; j++) {
+					}
+					if (j == V_N_GROUPS) {  /* table full; flush it */
+						for (j = 0; j != groups; j++) {
+							sem_group_wake (group[j], bits[j]);
+						}
+						groups = 0;
+						j = 0;
+					}
+					if (j == groups) {
+						group[groups] = g;
+						bits[groups] = 0;
+						groups++;
+					}
+					bits[j] |= sem_group_bit (f);
+				}
+			}
+		}
+		j = 0;
+#if defined(FUTEX_WAKE_OP_)
+		for (; j + 1 < k; j += 2) {
+			ASSERT (futex (sleepy[j], FUTEX_WAKE_OP_, 1,
+				       (const struct timespec *) (uintptr_t) 1,
+				       sleepy[j+1], FUTEX_OP_WAKE_BOTH_) >= 0);
+		}
+#endif
+		for (; j != k; j++) {
+			ASSERT (futex (sleepy[j], FUTEX_WAKE_, 1, NULL, NULL, 0) >= 0);
+		}
+	}
+	for (j = 0; j != groups; j++) {
+		sem_group_wake (group[j], bits[j]);
+	}
 }
 
 NSYNC_CPP_END_
@@ -39,4 +39,10 @@ int clock_gettime (clockid_t clk_id, struct timespec *tp);
 #define TIMER_ABSTIME 1
 #endif /*CLOCK_REALTIME*/
 
+/* MacOS lacks pthread_condattr_setclock(), and dispatch_walltime() takes
+   only times of day, so no semaphore can wait on a monotonic deadline.  */
+#if defined(NSYNC_USE_MONOTONIC_CLOCK)
+#error "NSYNC_USE_MONOTONIC_CLOCK is not supported on MacOS"
+#endif
+
 #endif /*NSYNC_PLATFORM_MACOS_PLATFORM_H_*/
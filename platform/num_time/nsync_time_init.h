@@ -20,4 +20,15 @@
 	 (((nsync_time) (t))*1000*1000*1000) + (nsync_time) (ns) : \
 	 ((((nsync_time) (t))*1000) + (nsync_time) (ns / (1000 * 1000))))
 
+/* NSYNC_CLOCK_ is the clock read by nsync_time_now(), and the clock against
+   which the semaphores interpret absolute deadlines.  It is CLOCK_MONOTONIC if
+   the build defines NSYNC_USE_MONOTONIC_CLOCK, and CLOCK_REALTIME otherwise.
+   NSYNC_COARSE_CLOCK_ is not defined, because a 32-bit nsync_time counts from
+   an address-space-specific moment rather than from the clock's epoch.  */
+#if defined(NSYNC_USE_MONOTONIC_CLOCK)
+#define NSYNC_CLOCK_ CLOCK_MONOTONIC
+#else
+#define NSYNC_CLOCK_ CLOCK_REALTIME
+#endif
+
 #endif /*NSYNC_PLATFORM_NUM_TIME_NSYNC_TIME_INIT_H_*/
@@ -38,7 +38,7 @@ const nsync_time nsync_time_zero = 0;
 static nsync_once initial_time_once = NSYNC_ONCE_INIT;
 struct timespec nsync_time_initial_;
 static void get_initial_time (void) {
-	clock_gettime (CLOCK_REALTIME, &nsync_time_initial_);
+	clock_gettime (NSYNC_CLOCK_, &nsync_time_initial_);
 }
 
 nsync_time nsync_time_s_ns (time_t s, unsigned ns) {
@@ -57,7 +57,7 @@ nsync_time nsync_time_now (void) {
 	if (sizeof (nsync_time) < 8) {
 		nsync_run_once (&initial_time_once, &get_initial_time);
 	}
-	clock_gettime (CLOCK_REALTIME, &ts);
+	clock_gettime (NSYNC_CLOCK_, &ts);
 	return (nsync_time_s_ns (
 			ts.tv_sec - (sizeof (nsync_time) < 8? nsync_time_initial_.tv_sec: 0),
 			ts.tv_nsec));
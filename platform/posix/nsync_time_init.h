@@ -17,4 +17,31 @@
 
 #define NSYNC_TIME_STATIC_INIT(t,ns) { (t), (ns) }
 
+/* NSYNC_CLOCK_ is the clock read by nsync_time_now(), and the clock against
+   which the semaphores interpret absolute deadlines.  It is CLOCK_REALTIME
+   unless the build defines NSYNC_USE_MONOTONIC_CLOCK, in which case it is
+   CLOCK_MONOTONIC, which does not jump when the time of day is set, but whose
+   epoch is not the Unix epoch.
+
+   NSYNC_COARSE_CLOCK_, if defined, is a clock with the same epoch that is
+   cheaper to read, but that may lag NSYNC_CLOCK_ by up to its resolution.
+   It is used to check cheaply whether deadlines have passed.  It is not
+   defined when nsync_time is some other library's type, whose epoch nsync
+   does not control.  */
+#if defined(NSYNC_USE_MONOTONIC_CLOCK)
+#if defined(NSYNC_USE_CPP11_TIMEPOINT) || defined(NSYNC_USE_GPR_TIMESPEC)
+#error "NSYNC_USE_MONOTONIC_CLOCK requires nsync's own time representation"
+#endif
+#define NSYNC_CLOCK_ CLOCK_MONOTONIC
+#if defined(CLOCK_MONOTONIC_COARSE)
+#define NSYNC_COARSE_CLOCK_ CLOCK_MONOTONIC_COARSE
+#endif
+#else
+#define NSYNC_CLOCK_ CLOCK_REALTIME
+#if defined(CLOCK_REALTIME_COARSE) && !defined(NSYNC_USE_CPP11_TIMEPOINT) && \
+    !defined(NSYNC_USE_GPR_TIMESPEC)
+#define NSYNC_COARSE_CLOCK_ CLOCK_REALTIME_COARSE
+#endif
+#endif
+
 #endif /*NSYNC_PLATFORM_POSIX_NSYNC_TIME_INIT_H_*/
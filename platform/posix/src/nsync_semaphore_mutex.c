@@ -13,6 +13,7 @@
   limitations under the License. */
 
 #include "headers.h"
+#include "nsync_time_init.h"
 
 NSYNC_CPP_START_
 
@@ -31,8 +32,15 @@ static nsync_semaphore *sem_big_enough_for_mutex_cond =
 /* Initialize *s; the initial value is 0. */
 void nsync_mu_semaphore_init (nsync_semaphore *s) {
 	struct mutex_cond *mc = (struct mutex_cond *) s;
+	pthread_condattr_t attr;
 	ASSERT (pthread_mutex_init (&mc->mu, NULL) == 0);
-	ASSERT (pthread_cond_init (&mc->cv, NULL) == 0);
+	ASSERT (pthread_condattr_init (&attr) == 0);
+#if defined(NSYNC_USE_MONOTONIC_CLOCK)
+	/* pthread_cond_timedwait() must measure deadlines on NSYNC_CLOCK_. */
+	ASSERT (pthread_condattr_setclock (&attr, NSYNC_CLOCK_) == 0);
+#endif
+	ASSERT (pthread_cond_init (&mc->cv, &attr) == 0);
+	ASSERT (pthread_condattr_destroy (&attr) == 0);
 	mc->i = 0;
 }
 
@@ -89,4 +97,16 @@ void nsync_mu_semaphore_v (nsync_semaphore *s) {
 	ASSERT (pthread_mutex_unlock (&mc->mu) == 0);
 }
 
+/* Ensure that the count of each of *s[0,..,n-1] is at least 1. */
+void nsync_mu_semaphore_v_n (nsync_semaphore *s[], int n) {
+	int i;
+	for (i = 0; i != n; i++) {
+		nsync_mu_semaphore_v (s[i]);
+	}
+}
+
+/* Each semaphore is woken separately, so the grouping hint is ignored. */
+void nsync_mu_semaphore_set_group (nsync_semaphore *s UNUSED, uintptr_t group UNUSED) {
+}
+
 NSYNC_CPP_END_
@@ -13,6 +13,7 @@
   limitations under the License. */
 
 #include "headers.h"
+#include "nsync_time_init.h"
 
 NSYNC_CPP_START_
 
@@ -43,11 +44,31 @@ int nsync_mu_semaphore_p_with_deadline (nsync_semaphore *s,
 		}
 	} else {
 		int rc;
-		struct timespec ts;
-		memset (&ts, 0, sizeof (ts));
-		ts.tv_sec = NSYNC_TIME_SEC (abs_deadline);
-		ts.tv_nsec = NSYNC_TIME_NSEC (abs_deadline);
 		do {
+			struct timespec ts;
+			memset (&ts, 0, sizeof (ts));
+#if defined(NSYNC_USE_MONOTONIC_CLOCK)
+			/* sem_timedwait() measures deadlines on CLOCK_REALTIME,
+			   so translate abs_deadline from NSYNC_CLOCK_. */
+			{
+				nsync_time now = nsync_time_now ();
+				struct timespec rt_now;
+				clock_gettime (CLOCK_REALTIME, &rt_now);
+				if (nsync_time_cmp (abs_deadline, now) > 0) {
+					nsync_time rel = nsync_time_sub (abs_deadline, now);
+					rt_now.tv_sec += NSYNC_TIME_SEC (rel);
+					rt_now.tv_nsec += NSYNC_TIME_NSEC (rel);
+					if (rt_now.tv_nsec >= 1000 * 1000 * 1000) {
+						rt_now.tv_nsec -= 1000 * 1000 * 1000;
+						rt_now.tv_sec++;
+					}
+				}
+				ts = rt_now;
+			}
+#else
+			ts.tv_sec = NSYNC_TIME_SEC (abs_deadline);
+			ts.tv_nsec = NSYNC_TIME_NSEC (abs_deadline);
+#endif
 			rc = sem_timedwait ((sem_t *)s, &ts);
 		} while (rc != 0 &&
 			 (errno == EINTR ||
@@ -65,4 +86,16 @@ void nsync_mu_semaphore_v (nsync_semaphore *s) {
 	ASSERT (sem_post ((sem_t *)s) == 0);
 }
 
+/* Ensure that the count of each of *s[0,..,n-1] is at least 1. */
+void nsync_mu_semaphore_v_n (nsync_semaphore *s[], int n) {
+	int i;
+	for (i = 0; i != n; i++) {
+		nsync_mu_semaphore_v (s[i]);
+	}
+}
+
+/* Each semaphore is woken separately, so the grouping hint is ignored. */
+void nsync_mu_semaphore_set_group (nsync_semaphore *s UNUSED, uintptr_t group UNUSED) {
+}
+
 NSYNC_CPP_END_
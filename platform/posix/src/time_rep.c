@@ -44,7 +44,7 @@ nsync_time nsync_time_s_ns (time_t s, unsigned ns) {
 
 nsync_time nsync_time_now (void) {
 	struct timespec ts;
-	clock_gettime (CLOCK_REALTIME, &ts);
+	clock_gettime (NSYNC_CLOCK_, &ts);
 	return (ts);
 }
 
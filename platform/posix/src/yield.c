@@ -20,4 +20,63 @@ void nsync_yield_ (void) {
 	sched_yield ();
 }
 
+int nsync_cpu_count_ (void) {
+	int n = 0;
+#if defined(_SC_NPROCESSORS_ONLN)
+	n = (int) sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+	return (n < 0? 0 : n);
+}
+
+/* Linux lists the online NUMA nodes in /sys/devices/system/node/online as
+   ranges, such as "0" or "0-1,3"; the last number is the highest node
+   number.  The getcpu() system call gives the caller's node.  Elsewhere,
+   assume a single node.  */
+int nsync_numa_node_count_ (void) {
+	int nodes = 1;
+#if defined(SYS_getcpu)
+	FILE *f = fopen ("/sys/devices/system/node/online", "r");
+	if (f != NULL) {
+		int c;
+		int n = -1;
+		while ((c = getc (f)) != EOF) {
+			if ('0' <= c && c <= '9') {
+				n = (n < 0? 0 : n * 10) + (c - '0');
+			} else if (n >= 0) {
+				nodes = n + 1;
+				n = -1;
+			}
+		}
+		if (n >= 0) {
+			nodes = n + 1;
+		}
+		fclose (f);
+	}
+#endif
+	return (nodes);
+}
+
+int nsync_numa_node_ (void) {
+	int node = 0;
+#if defined(SYS_getcpu)
+	unsigned cpu;
+	unsigned n;
+	if (syscall (SYS_getcpu, &cpu, &n, NULL) == 0) {
+		node = (int) n;
+	}
+#endif
+	return (node);
+}
+
+int nsync_cpu_ (void) {
+	int cpu = 0;
+#if defined(SYS_getcpu)
+	unsigned c;
+	if (syscall (SYS_getcpu, &c, NULL, NULL) == 0) {
+		cpu = (int) c;
+	}
+#endif
+	return (cpu);
+}
+
 NSYNC_CPP_END_
@@ -16,6 +16,7 @@
 #define NSYNC_PUBLIC_NSYNC_H_
 
 #include "nsync_mu.h"
+#include "nsync_cohort_mu.h"
 #include "nsync_mu_wait.h"
 #include "nsync_cv.h"
 #include "nsync_note.h"
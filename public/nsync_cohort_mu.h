@@ -0,0 +1,82 @@
+/* Copyright 2016 Google Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License. */
+
+#ifndef NSYNC_PUBLIC_NSYNC_COHORT_MU_H_
+#define NSYNC_PUBLIC_NSYNC_COHORT_MU_H_
+
+#include <inttypes.h>
+#include "nsync_cpp.h"
+#include "nsync_mu.h"
+#include "nsync_atomic.h"
+
+NSYNC_CPP_START_
+
+/* An nsync_cohort_mu is an exclusive lock for machines with several NUMA
+   nodes.  If initialized to all zeroes, it is valid and unlocked.
+
+   It behaves like an nsync_mu used only in write mode, but when it is
+   contended by threads on different nodes, it tends to pass ownership to
+   other threads on the releasing thread's node for a bounded number of
+   consecutive acquisitions before letting it migrate to another node.  This
+   keeps the lock, and the data it protects, in one node's caches for longer.
+   On a machine with a single node, it is an nsync_mu.
+
+   As with nsync_mu, a thread that acquires an nsync_cohort_mu should release
+   it, and must not reacquire it while holding it.
+
+   Example usage:
+	static struct foo {
+		nsync_cohort_mu mu; // protects fields below
+		int a;
+	} p;
+	...
+	nsync_cohort_mu_lock (&p.mu);
+	p.a++;
+	nsync_cohort_mu_unlock (&p.mu); */
+
+/* Upper bound on the number of nodes an nsync_cohort_mu distinguishes;
+   threads on nodes with higher numbers share local locks.  */
+#define NSYNC_COHORT_MU_NODES_ 8
+
+/* Per-node state of an nsync_cohort_mu.  The padding keeps the fields of
+   different nodes on different cache lines.  */
+struct nsync_cohort_mu_node_s_ {
+	nsync_mu mu;                  /* internal use only */
+	nsync_atomic_uint32_ waiting; /* internal use only */
+	uint32_t batch;               /* internal use only */
+	int global_held;              /* internal use only */
+	char pad[64];                 /* internal use only */
+};
+
+typedef struct nsync_cohort_mu_s_ {
+	nsync_mu global;       /* internal use only */
+	uint32_t holder;       /* internal use only */
+	char pad[64];          /* internal use only */
+	struct nsync_cohort_mu_node_s_ node[NSYNC_COHORT_MU_NODES_]; /* internal use only */
+} nsync_cohort_mu;
+
+/* Zero *cmu.  Equivalent to setting it to all zeroes. */
+void nsync_cohort_mu_init (nsync_cohort_mu *cmu);
+
+/* Block until *cmu is free and then acquire it.
+   Requires that the calling thread not already hold *cmu.  */
+void nsync_cohort_mu_lock (nsync_cohort_mu *cmu);
+
+/* Unlock *cmu, which must have been acquired by the calling thread, and wake
+   waiters, if appropriate.  */
+void nsync_cohort_mu_unlock (nsync_cohort_mu *cmu);
+
+NSYNC_CPP_END_
+
+#endif /*NSYNC_PUBLIC_NSYNC_COHORT_MU_H_*/
@@ -94,12 +94,32 @@ typedef struct nsync_cv_s_ {
 #define NSYNC_CV_INIT { NSYNC_ATOMIC_UINT32_INIT_, 0 }
 void nsync_cv_init (nsync_cv *cv);
 
+/* Wakeup policies for nsync_cv_set_policy().  They determine which waiter
+   nsync_cv_signal() wakes, and the order in which waiters woken together are
+   queued on an nsync_mu.  */
+#define NSYNC_CV_FIFO 0 /* the thread that has waited longest (the default) */
+#define NSYNC_CV_LIFO 1 /* the thread that began waiting most recently */
+#define NSYNC_CV_CPU 2  /* a recent waiter that last ran on the caller's
+			   processor, if any, otherwise as NSYNC_CV_LIFO */
+
+/* Set the wakeup policy of *cv to one of the NSYNC_CV_* values above.  Under
+   NSYNC_CV_FIFO, the thread woken is the one whose caches are likely to be
+   coldest; in a pool of worker threads, NSYNC_CV_LIFO instead wakes the worker
+   that ran most recently, and lets idle workers stay asleep.  NSYNC_CV_CPU
+   also favours a worker that would run on the signalling thread's processor,
+   at the cost of finding the current processor in each wait and signal.  A
+   change of policy affects threads that begin waiting after the call.  */
+void nsync_cv_set_policy (nsync_cv *cv, int policy);
+
 /* Wake at least one thread if any are currently blocked on *cv.  If
    the chosen thread is a reader on an nsync_mu, wake all readers and, if
-   possible, a writer. */
+   possible, a writer.  If *cv may have waiters in nsync_cv_wait_pred(), the
+   caller must hold their nsync_mu; see nsync_cv_wait_pred(). */
 void nsync_cv_signal (nsync_cv *cv);
 
-/* Wake all threads currently blocked on *cv. */
+/* Wake all threads currently blocked on *cv.  If *cv may have waiters in
+   nsync_cv_wait_pred(), the caller must hold their nsync_mu; see
+   nsync_cv_wait_pred(). */
 void nsync_cv_broadcast (nsync_cv *cv);
 
 /* Atomically release "mu" (which must be held on entry) and block the caller
@@ -135,6 +155,37 @@ int nsync_cv_wait_with_deadline (nsync_cv *cv, nsync_mu *mu,
                                  nsync_time abs_deadline,
 				 struct nsync_note_s_ *cancel_note);
 
+/* Atomically release "mu" (which must be held on entry) and block the
+   calling thread on *cv until (*pred) (pred_arg) is true, the time reaches
+   abs_deadline, or cancel_note is notified; then reacquire "mu".  Return 0
+   iff (*pred) (pred_arg) is true on return, and otherwise ETIMEDOUT or
+   ECANCELED.  Use abs_deadline==nsync_time_no_deadline for no deadline, and
+   cancel_note==NULL for no cancellation.  Unlike nsync_cv_wait(), the call
+   need not be placed in a loop.
+
+   The predicate is evaluated by the threads that call nsync_cv_signal() and
+   nsync_cv_broadcast(), which wake (or transfer to "mu") only the waiters
+   whose predicates are true; nsync_cv_signal() passes over waiters whose
+   predicates are false, and leaves them waiting.  So while *cv may have
+   nsync_cv_wait_pred() waiters, nsync_cv_signal() and nsync_cv_broadcast()
+   must be called with "mu" held, in either mode; nsync cannot tell which
+   thread holds "mu", so a call made while another thread holds it would
+   evaluate predicates concurrently with that thread.  The predicate, like an
+   nsync_mu_wait() condition, must depend only on state protected by "mu",
+   and must not block or acquire locks.  Example:
+	static int queue_non_empty (const void *v) {
+		return (((const struct queue *) v)->count != 0);
+	}
+	...
+	nsync_mu_lock (&d->mu);
+	nsync_cv_wait_pred (&d->cv, &d->mu, &queue_non_empty, &d->q[i],
+			    nsync_time_no_deadline, NULL);
+	... remove an item from d->q[i] ...
+	nsync_mu_unlock (&d->mu);  */
+int nsync_cv_wait_pred (nsync_cv *cv, nsync_mu *mu,
+			int (*pred) (const void *pred_arg), const void *pred_arg,
+			nsync_time abs_deadline, struct nsync_note_s_ *cancel_note);
+
 /* Like nsync_cv_wait_with_deadline(), but allow an arbitrary lock *v to be used,
    given its (*lock)(mu) and (*unlock)(mu) routines.  */
 int nsync_cv_wait_with_deadline_generic (nsync_cv *cv,
@@ -142,6 +193,54 @@ int nsync_cv_wait_with_deadline_generic (nsync_cv *cv,
 				   nsync_time abs_deadline,
 				   struct nsync_note_s_ *cancel_note);
 
+/* Describes a lock type for nsync_cv_wait_with_deadline_funcs().  If the lock
+   is, or contains, an nsync_mu that it acquires and releases in the same
+   mode as the lock, (*mu) (l) should return that nsync_mu.  A thread woken
+   from an nsync_cv may then be moved directly to the nsync_mu's queue, so it
+   is not woken only to block again on the lock.  Such a thread acquires the
+   nsync_mu itself rather than calling (*lock) (l), and then calls
+   (*acquired) (l), if acquired!=NULL, to let a wrapper update state of its
+   own, such as an owner field.  Other lock types should set mu=NULL and
+   acquired=NULL, and are woken and relocked with (*lock) (l), as in
+   nsync_cv_wait_with_deadline_generic().
+   Example:
+	struct owned_mu {
+		nsync_mu mu;
+		pthread_t owner;
+	};
+	static void owned_mu_lock (void *l) {
+		nsync_mu_lock (&((struct owned_mu *) l)->mu);
+		((struct owned_mu *) l)->owner = pthread_self ();
+	}
+	static void owned_mu_unlock (void *l) {
+		nsync_mu_unlock (&((struct owned_mu *) l)->mu);
+	}
+	static nsync_mu *owned_mu_mu (void *l) {
+		return (&((struct owned_mu *) l)->mu);
+	}
+	static void owned_mu_acquired (void *l) {
+		((struct owned_mu *) l)->owner = pthread_self ();
+	}
+	static const struct nsync_lock_funcs_s owned_mu_funcs = {
+		&owned_mu_lock, &owned_mu_unlock, &owned_mu_mu, &owned_mu_acquired
+	};
+	...
+	nsync_cv_wait_with_deadline_funcs (&cv, &omu, &owned_mu_funcs,
+					   nsync_time_no_deadline, NULL); */
+struct nsync_lock_funcs_s {
+	void (*lock) (void *l);       /* acquire *l */
+	void (*unlock) (void *l);     /* release *l */
+	nsync_mu *(*mu) (void *l);    /* return the nsync_mu in *l, or NULL */
+	void (*acquired) (void *l);   /* called after (*mu) (l) is acquired for *l */
+};
+
+/* Like nsync_cv_wait_with_deadline_generic(), but with the lock *l described
+   by *funcs.  */
+int nsync_cv_wait_with_deadline_funcs (nsync_cv *cv, void *l,
+				       const struct nsync_lock_funcs_s *funcs,
+				       nsync_time abs_deadline,
+				       struct nsync_note_s_ *cancel_note);
+
 NSYNC_CV_CPP_OVERLOAD_
 NSYNC_CPP_END_
 
@@ -18,10 +18,12 @@
 #include <inttypes.h>
 #include "nsync_cpp.h"
 #include "nsync_atomic.h"
+#include "nsync_time.h"
 
 NSYNC_CPP_START_
 
 struct nsync_dll_element_s_;
+struct nsync_note_s_;
 
 /* An nsync_mu is a lock.  If initialized to all zeroes, it is valid and unlocked.
 
@@ -58,22 +60,66 @@ struct nsync_dll_element_s_;
 	nsync_mu_wait (&p.mu, &a_is_zero, &p, NULL);
 	// The current thread now has exclusive access to p.a and p.b, and p.a==0.
 	...
-	nsync_mu_unlock (&p.mu); */
+	nsync_mu_unlock (&p.mu);
+
+   ABI note:  the "spin" field was added to hold per-mutex spinning, owner and
+   reader-bias state that cannot be shared between mutexes.  On LP64 targets
+   it occupies what was padding, so sizeof (nsync_mu) remains 16, but on
+   ILP32 targets nsync_mu grew from 8 to 12 bytes, and NSYNC_MU_INIT gained
+   an element.  Code that embeds or initializes an nsync_mu must be
+   recompiled against this header; it is not binary-compatible with earlier
+   releases.  */
 typedef struct nsync_mu_s_ {
 	nsync_atomic_uint32_ word; /* internal use only */
+	nsync_atomic_uint32_ spin; /* internal use only */
 	struct nsync_dll_element_s_ *waiters; /* internal use only */
 } nsync_mu;
 
 /* An nsync_mu should be zeroed to initialize, which can be accomplished by
    initializing with static initializer NSYNC_MU_INIT, or by setting the entire
    structure to all zeroes, or using nsync_mu_init().  */
-#define NSYNC_MU_INIT { NSYNC_ATOMIC_UINT32_INIT_, 0 }
+#define NSYNC_MU_INIT { NSYNC_ATOMIC_UINT32_INIT_, NSYNC_ATOMIC_UINT32_INIT_, 0 }
 void nsync_mu_init (nsync_mu *mu);
 
+/* Set whether *mu is in fair mode (fair!=0) or throughput mode (fair==0, the
+   default).  In throughput mode, a thread that finds *mu free may acquire it
+   ahead of threads already queued for it, and a woken thread competes with
+   such threads to acquire.  In fair mode, whenever there are threads queued
+   for *mu, nsync_mu_unlock() and nsync_mu_runlock() pass *mu directly to the
+   first queued thread (or to the queued readers), which bounds the time a
+   queued thread waits at the cost of throughput under contention.
+   Requires that *mu be held in write mode by the calling thread, or not yet
+   in use by other threads.  */
+void nsync_mu_set_fair (nsync_mu *mu, int fair);
+
+/* Set whether *mu may be reader-biased (bias!=0), or not (bias==0, the
+   default).  When a reader-biased nsync_mu is read far more often than
+   written, nsync_mu_rlock() and nsync_mu_runlock() record a reader in a
+   table shared by all nsync_mu values, on a cache line that is usually
+   private to the calling thread, rather than updating *mu, so read-only
+   critical sections on different processors do not contend.  In exchange,
+   nsync_mu_lock() must then examine the table, and wait for the readers it
+   finds, after which the bias stays off until reads again greatly outnumber
+   writes.  The semantics of the other calls are unchanged, except that
+   nsync_cv_wait() and its variants may return spuriously when *mu is held in
+   read mode.  Requires that *mu be held in write mode by the calling thread,
+   or not yet in use by other threads.  */
+void nsync_mu_set_reader_bias (nsync_mu *mu, int bias);
+
 /* Block until *mu is free and then acquire it in writer mode.
    Requires that the calling thread not already hold *mu in any mode.  */
 void nsync_mu_lock (nsync_mu *mu);
 
+/* Block until *mu is free and then acquire it in writer mode, as
+   nsync_mu_lock() does, and return 0, unless abs_deadline expires or
+   cancel_note is notified first, in which case return ETIMEDOUT or ECANCELED
+   respectively without acquiring *mu.  Use
+   abs_deadline==nsync_time_no_deadline for no deadline, and cancel_note==NULL
+   for no cancellation.  A thread that gives up leaves *mu's queue at once.
+   Requires that the calling thread not already hold *mu in any mode.  */
+int nsync_mu_lock_with_deadline (nsync_mu *mu, nsync_time abs_deadline,
+				 struct nsync_note_s_ *cancel_note);
+
 /* Unlock *mu, which must have been acquired in write mode by the calling
    thread, and wake waiters, if appropriate.  */
 void nsync_mu_unlock (nsync_mu *mu);
@@ -87,6 +133,12 @@ int nsync_mu_trylock (nsync_mu *mu);
    Requires that the calling thread not already hold *mu in any mode. */
 void nsync_mu_rlock (nsync_mu *mu);
 
+/* Block until *mu can be acquired in reader mode and then acquire it, and
+   return 0, unless abs_deadline expires or cancel_note is notified first; see
+   nsync_mu_lock_with_deadline().  */
+int nsync_mu_rlock_with_deadline (nsync_mu *mu, nsync_time abs_deadline,
+				  struct nsync_note_s_ *cancel_note);
+
 /* Unlock *mu, which must have been acquired in read mode by the calling
    thread, and wake waiters, if appropriate.  */
 void nsync_mu_runlock (nsync_mu *mu);
@@ -97,6 +149,81 @@ void nsync_mu_runlock (nsync_mu *mu);
    */
 int nsync_mu_rtrylock (nsync_mu *mu);
 
+/* Atomically convert *mu, which must be held in write mode by the calling
+   thread, to being held in read mode by that thread, and wake waiting
+   readers, if appropriate.  No writer can acquire *mu in between.  The
+   calling thread should later release *mu with nsync_mu_runlock().  */
+void nsync_mu_downgrade (nsync_mu *mu);
+
+/* Block until *mu can be acquired in upgradable read mode and then acquire
+   it.  An upgradable read lock is a read lock that at most one thread may
+   hold at a time; it may be held alongside ordinary read locks.  Its holder
+   may later convert it to a write lock with nsync_mu_upgrade(), or release
+   it with nsync_mu_uunlock().  In nsync_mu_wait() and nsync_cv_wait() and
+   their variants, an upgradable read lock is treated as a read lock, except
+   that while the thread waits, other threads still cannot acquire *mu in
+   upgradable read mode.  Requires that the calling thread not already hold
+   *mu in any mode.  */
+void nsync_mu_ulock (nsync_mu *mu);
+
+/* Unlock *mu, which must have been acquired in upgradable read mode by the
+   calling thread, and wake waiters, if appropriate.  */
+void nsync_mu_uunlock (nsync_mu *mu);
+
+/* Convert *mu, which must be held in upgradable read mode by the calling
+   thread, to being held in write mode by that thread, blocking until other
+   readers have released it.  New readers and writers cannot acquire *mu in
+   the meantime.  The calling thread should later release *mu with
+   nsync_mu_unlock().  */
+void nsync_mu_upgrade (nsync_mu *mu);
+
+/* Block until each of mus[0,..,n-1] can be acquired in write mode and then
+   acquire them all, without risk of deadlock with other calls of
+   nsync_mu_lock_n() or nsync_mu_rwlock_n(), whatever the order of the
+   elements of mus[].  An nsync_mu may appear in mus[] more than once; it is
+   acquired once.  Requires that 0 <= n <= 32, and that the calling thread
+   hold none of mus[] in any mode.
+   Example:
+	nsync_mu *mus[2];
+	mus[0] = &from->mu;
+	mus[1] = &to->mu;
+	nsync_mu_lock_n (mus, 2);
+	from->balance -= amount;
+	to->balance += amount;
+	nsync_mu_unlock_n (mus, 2);  */
+void nsync_mu_lock_n (nsync_mu **mus, int n);
+
+/* Unlock each of mus[0,..,n-1], which must have been acquired by
+   nsync_mu_lock_n (mus, n) in the calling thread.  */
+void nsync_mu_unlock_n (nsync_mu **mus, int n);
+
+/* As nsync_mu_lock_n(), except that mus[i] is acquired in read mode if
+   read!=NULL and read[i] is non-zero.  If an nsync_mu appears in mus[] more
+   than once, it is acquired in read mode only if each of its appearances
+   requests read mode.  */
+void nsync_mu_rwlock_n (nsync_mu **mus, const int *read, int n);
+
+/* Unlock each of mus[0,..,n-1], which must have been acquired by
+   nsync_mu_rwlock_n (mus, read, n) in the calling thread.  */
+void nsync_mu_rwunlock_n (nsync_mu **mus, const int *read, int n);
+
+/* Run (*fn) (arg) with *mu held in write mode, and return once it has run.
+   If *mu is free, the calling thread acquires it, runs (*fn) (arg), and
+   releases it.  Otherwise the calling thread queues the operation, and
+   either the thread holding *mu runs it on the caller's behalf before
+   releasing *mu, or the caller later acquires *mu and runs it itself, along
+   with any operations other threads have queued.  Running a batch of small
+   critical sections in one thread keeps the data they touch in that thread's
+   cache, which can greatly increase the throughput of a heavily contended
+   lock.  Requires that (*fn) (arg) not block, not depend on which thread runs
+   it, and not acquire or release *mu, and that the calling thread not hold
+   *mu in any mode.
+   Example:
+	static void counter_inc (void *v) { (*(int *) v)++; }
+	...
+	nsync_mu_run_locked (&counter_mu, &counter_inc, &counter);  */
+void nsync_mu_run_locked (nsync_mu *mu, void (*fn) (void *arg), void *arg);
+
 /* May abort if *mu is not held in write mode by the calling thread. */
 void nsync_mu_assert_held (const nsync_mu *mu);
 
@@ -108,6 +235,7 @@ void nsync_mu_rassert_held (const nsync_mu *mu);
    Requires that the calling thread holds *mu in some mode. */
 int nsync_mu_is_reader (const nsync_mu *mu);
 
+NSYNC_MU_CPP_OVERLOAD_
 NSYNC_CPP_END_
 
 #endif /*NSYNC_PUBLIC_NSYNC_MU_H_*/
@@ -58,8 +58,12 @@
    *condition_arg_eq will not be invoked unless the "condition" pointers
    are equal, and the "condition_arg" pointers are unequal.
 
-   If many waiters wait for distinct conditions simultaneously, condition
-   variables may be faster.
+   If many waiters wait for distinct conditions simultaneously, each unlock
+   may evaluate many conditions.  Keyed waits avoid this:  a waiter using
+   nsync_mu_wait_keyed() names a key (any pointer, typically the address of
+   the data its condition reads), and its condition is reevaluated only after
+   a critical section calls nsync_mu_touch_key() with that key.  Otherwise,
+   condition variables may be faster.
  */
 
 #include "nsync_cpp.h"
@@ -110,6 +114,34 @@ int nsync_mu_wait_with_deadline (nsync_mu *mu,
 				 nsync_time abs_deadline,
 				 struct nsync_note_s_ *cancel_note);
 
+/* As nsync_mu_wait(), except that (*condition) (condition_arg) need not be
+   reevaluated until after a critical section on *mu calls
+   nsync_mu_touch_key (mu, key).  Requires that key be non-NULL, and that
+   every critical section that may make the condition true call
+   nsync_mu_touch_key (mu, key) before releasing *mu.  Example:
+      // Waiter, holding mu:  wait for slot[i] to become non-zero.
+      nsync_mu_wait_keyed (&mu, &int_is_non_zero, &slot[i], &slot[i]);
+      // Thread setting slot[i], holding mu in write mode:
+      slot[i] = 1;
+      nsync_mu_touch_key (&mu, &slot[i]);  */
+void nsync_mu_wait_keyed (nsync_mu *mu, int (*condition) (const void *condition_arg),
+			  const void *condition_arg, const void *key);
+
+/* As nsync_mu_wait_with_deadline(), except that the condition need not be
+   reevaluated until after nsync_mu_touch_key (mu, key); see
+   nsync_mu_wait_keyed().  */
+int nsync_mu_wait_keyed_with_deadline (nsync_mu *mu,
+				       int (*condition) (const void *condition_arg),
+				       const void *condition_arg, const void *key,
+				       nsync_time abs_deadline,
+				       struct nsync_note_s_ *cancel_note);
+
+/* Record that the current critical section on *mu may have made true the
+   conditions of nsync_mu_wait_keyed() and nsync_mu_wait_keyed_with_deadline()
+   calls with key "key", so that they are reevaluated when *mu is released.
+   Requires that *mu be held in write mode by the calling thread.  */
+void nsync_mu_touch_key (nsync_mu *mu, const void *key);
+
 /* Unlock *mu, which must be held in write mode, and wake waiters, if
    appropriate.  Unlike nsync_mu_unlock(), this call is not required to wake
    nsync_mu_wait/nsync_mu_wait_with_deadline calls on conditions that were
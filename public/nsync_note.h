@@ -61,6 +61,22 @@ int nsync_note_wait (nsync_note n, nsync_time abs_deadline);
    of its ancestors.  */
 nsync_time nsync_note_expiry (nsync_note n);
 
+/* Run the note expiry service on the calling thread until stop is notified
+   (forever if stop==NULL), then return.  Otherwise, a note is notified at its
+   deadline only when some thread next examines it, which suffices for
+   nsync_note_wait() and nsync_wait_n(), but not for threads that merely poll
+   nsync_note_is_notified().  While the service runs, notes created with a
+   finite deadline are notified at their deadlines, to within a millisecond
+   or so, along with their descendants.  Notes created while the service is
+   not running are not affected.  At most one call runs at a time; a call made
+   while another is running returns immediately.
+
+   A client wishing to use the service will typically devote a thread to it:
+        nsync_note stop = nsync_note_new (NULL, nsync_time_no_deadline);
+        ... start a thread that calls nsync_note_expiry_run (stop) ...
+        ... at shutdown: nsync_note_notify (stop); join the thread ...  */
+void nsync_note_expiry_run (nsync_note stop);
+
 NSYNC_NOTE_CPP_OVERLOAD_
 NSYNC_CPP_END_
 
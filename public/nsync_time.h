@@ -22,7 +22,9 @@
    time.  Often the first such moment is an address-space-wide epoch, such as
    the Unix epoch, but clients should not rely on the epoch in one address
    space being the same as that in another.  Intervals relative to the epoch
-   are known as absolute times.
+   are known as absolute times.  C builds that define NSYNC_USE_MONOTONIC_CLOCK
+   use the epoch of CLOCK_MONOTONIC, which is unaffected by changes to the time
+   of day, and is often the time the system booted.
 
    The internals of nsync_time should be treated as opaque by clients.
    See nsync_time_internal.h. */
@@ -56,6 +58,26 @@ nsync_time nsync_time_us (unsigned us);
 /* Return an nsync_time constructed from second and nanosecond components */
 nsync_time nsync_time_s_ns (time_t s, unsigned ns);
 
+/* Timer slack allows nsync to delay the expiry of a timed wait, so that
+   expiries that are close together can be handled by one wakeup rather than
+   many.  Deadlines are rounded up to the next boundary of a grid of
+   intervals of length slack (at most one second) that is the same in all
+   threads; thus a wait may time out as much as slack late, but never early.
+
+   nsync_time_set_slack() sets the slack applied to every timed wait in the
+   process, such as nsync_cv_wait_with_deadline(), nsync_mu_wait_with_deadline(),
+   nsync_wait_n(), and waits on notes with deadlines.  The default is
+   nsync_time_zero, which leaves deadlines unchanged.  nsync_time_slack()
+   returns the current setting.
+
+   nsync_time_with_slack() returns abs_deadline rounded as described, for a
+   single wait with a different slack from the rest of the process:
+        nsync_cv_wait_with_deadline (&cv, &mu,
+                nsync_time_with_slack (deadline, nsync_time_ms (5)), NULL);  */
+void nsync_time_set_slack (nsync_time slack);
+nsync_time nsync_time_slack (void);
+nsync_time nsync_time_with_slack (nsync_time abs_deadline, nsync_time slack);
+
 NSYNC_CPP_END_
 
 #endif /*NSYNC_PUBLIC_NSYNC_TIME_H_*/
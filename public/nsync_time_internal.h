@@ -129,6 +129,33 @@ nsync_cpp_time_point_ nsync_to_time_point_ (nsync_time);
 		return (nsync_cv_wait_with_deadline_generic (cv, mu, lock, unlock, \
 				nsync_from_time_point_ (abs_deadline), \
 				cancel_note)); \
+	} \
+	static inline int nsync_cv_wait_with_deadline_funcs (nsync_cv *cv, \
+		void *l, const struct nsync_lock_funcs_s *funcs, \
+		nsync_cpp_time_point_ abs_deadline, struct nsync_note_s_ *cancel_note) { \
+		return (nsync_cv_wait_with_deadline_funcs (cv, l, funcs, \
+				nsync_from_time_point_ (abs_deadline), \
+				cancel_note)); \
+	} \
+	static inline int nsync_cv_wait_pred (nsync_cv *cv, nsync_mu *mu, \
+		int (*pred) (const void *pred_arg), const void *pred_arg, \
+		nsync_cpp_time_point_ abs_deadline, struct nsync_note_s_ *cancel_note) { \
+		return (nsync_cv_wait_pred (cv, mu, pred, pred_arg, \
+				nsync_from_time_point_ (abs_deadline), \
+				cancel_note)); \
+	}
+#define NSYNC_MU_CPP_OVERLOAD_ \
+	static inline int nsync_mu_lock_with_deadline (nsync_mu *mu, \
+		nsync_cpp_time_point_ abs_deadline, struct nsync_note_s_ *cancel_note) { \
+		return (nsync_mu_lock_with_deadline (mu, \
+				nsync_from_time_point_ (abs_deadline), \
+				cancel_note)); \
+	} \
+	static inline int nsync_mu_rlock_with_deadline (nsync_mu *mu, \
+		nsync_cpp_time_point_ abs_deadline, struct nsync_note_s_ *cancel_note) { \
+		return (nsync_mu_rlock_with_deadline (mu, \
+				nsync_from_time_point_ (abs_deadline), \
+				cancel_note)); \
 	}
 #define NSYNC_MU_WAIT_CPP_OVERLOAD_ \
 	static inline int nsync_mu_wait_with_deadline (nsync_mu *mu, \
@@ -139,6 +166,14 @@ nsync_cpp_time_point_ nsync_to_time_point_ (nsync_time);
 						     condition_arg_eq, \
 						     nsync_from_time_point_ (abs_deadline), \
 						     cancel_note)); \
+	} \
+	static inline int nsync_mu_wait_keyed_with_deadline (nsync_mu *mu, \
+		int (*condition) (const void *condition_arg), const void *condition_arg, \
+		const void *key, nsync_cpp_time_point_ abs_deadline, \
+		struct nsync_note_s_ *cancel_note) { \
+		return (nsync_mu_wait_keyed_with_deadline (mu, condition, condition_arg, \
+							   key, nsync_from_time_point_ (abs_deadline), \
+							   cancel_note)); \
 	}
 #define NSYNC_NOTE_CPP_OVERLOAD_ \
 	static inline nsync_note nsync_note_new (nsync_note parent, \
@@ -176,6 +211,7 @@ NSYNC_CPP_END_
 #if !defined(NSYNC_COUNTER_CPP_OVERLOAD_)
 #define NSYNC_COUNTER_CPP_OVERLOAD_
 #define NSYNC_CV_CPP_OVERLOAD_
+#define NSYNC_MU_CPP_OVERLOAD_
 #define NSYNC_MU_WAIT_CPP_OVERLOAD_
 #define NSYNC_NOTE_CPP_OVERLOAD_
 #define NSYNC_WAITER_CPP_OVERLOAD_
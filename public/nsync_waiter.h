@@ -123,6 +123,26 @@ int nsync_wait_n (void *mu, void (*lock) (void *), void (*unlock) (void *),
 
 /* --------------------------------------------------- */
 
+/* Each thread that blocks in nsync uses a "waiter" struct, taken from a pool
+   and returned to it when the thread exits.  The pool grows with the number
+   of threads blocked at once, and shrinks again when a burst of thread exits
+   leaves many waiters free.  */
+struct nsync_waiter_pool_stats_s {
+	uint32_t live;  /* waiters allocated and not deallocated */
+	uint32_t free;  /* of those, the number in the pool (approximate) */
+	uint32_t peak;  /* maximum value of live */
+};
+
+/* Fill in *stats with statistics about the pool of waiters. */
+void nsync_waiter_pool_stats (struct nsync_waiter_pool_stats_s *stats);
+
+/* Deallocate memory held by free waiters in the pool, where possible, and
+   return the number of waiters deallocated.  Memory from a client-supplied
+   allocator is never deallocated.  */
+uint32_t nsync_waiter_pool_trim (void);
+
+/* --------------------------------------------------- */
+
 /* A "struct nsync_waitable_s" implementation must implement these functions.
    Clients should ignore the internals. */
 struct nsync_waiter_s;
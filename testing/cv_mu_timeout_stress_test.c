@@ -545,10 +545,167 @@ static void test_mu_cv_timeout_stress (testing t) {
 	} while (!run_stress_test (&s, t, "test_mu_cv_timeout_stress"));
 }
 
+/* Like test_mu_cv_timeout_stress(), but with a process-wide timer slack, so
+   that the timeouts are rounded up.  */
+static void test_mu_cv_timeout_stress_slack (testing t) {
+	nsync_time_set_slack (nsync_time_ms (1));
+	test_mu_cv_timeout_stress (t);
+	nsync_time_set_slack (nsync_time_zero);
+}
+
+/* --------------------------- */
+
+/* Check that nsync_time_with_slack() rounds deadlines up to the ends of
+   buckets shared by all deadlines, and that a wait under process-wide
+   slack never times out early.  */
+static void test_time_slack (testing t) {
+	static const struct {
+		time_t s;
+		unsigned ns;
+		time_t rounded_s;
+		unsigned rounded_ns;
+	} cases[] = {
+		{ 1000, 1234567, 1000, 2000000 },
+		{ 1000, 2000000, 1000, 2000000 },
+		{ 1000, 999000001, 1001, 0 },
+		{ 0, 0, 0, 0 }
+	};
+	nsync_time slack = nsync_time_ms (1);
+	nsync_time deadline;
+	nsync_time start;
+	nsync_mu mu;
+	nsync_cv cv;
+	int outcome;
+	int i;
+	for (i = 0; i != (int) (sizeof (cases) / sizeof (cases[0])); i++) {
+		nsync_time d = nsync_time_s_ns (cases[i].s, cases[i].ns);
+		nsync_time want = nsync_time_s_ns (cases[i].rounded_s, cases[i].rounded_ns);
+		if (nsync_time_cmp (nsync_time_with_slack (d, slack), want) != 0) {
+			TEST_ERROR (t, ("nsync_time_with_slack() rounded case %d wrongly", i));
+		}
+		if (nsync_time_cmp (nsync_time_with_slack (d, nsync_time_zero), d) != 0) {
+			TEST_ERROR (t, ("nsync_time_with_slack() changed case %d with no slack", i));
+		}
+	}
+	if (nsync_time_cmp (nsync_time_with_slack (nsync_time_no_deadline, slack),
+			    nsync_time_no_deadline) != 0) {
+		TEST_ERROR (t, ("nsync_time_with_slack() changed nsync_time_no_deadline"));
+	}
+
+	nsync_time_set_slack (nsync_time_ms (5));
+	if (nsync_time_cmp (nsync_time_slack (), nsync_time_ms (5)) != 0) {
+		TEST_ERROR (t, ("nsync_time_slack() did not return the slack set"));
+	}
+	nsync_mu_init (&mu);
+	nsync_cv_init (&cv);
+	for (i = 0; i != 20; i++) {
+		start = nsync_time_now ();
+		deadline = nsync_time_add (start, nsync_time_us (rand () % 10000));
+		nsync_mu_lock (&mu);
+		outcome = nsync_cv_wait_with_deadline (&cv, &mu, deadline, NULL);
+		nsync_mu_unlock (&mu);
+		if (outcome != ETIMEDOUT) {
+			TEST_ERROR (t, ("nsync_cv_wait_with_deadline() returned %d", outcome));
+		}
+		if (nsync_time_cmp (nsync_time_now (), deadline) < 0) {
+			TEST_ERROR (t, ("wait with slack timed out early"));
+		}
+	}
+	nsync_time_set_slack (nsync_time_zero);
+}
+
+/* The state of benchmark_cv_timeouts() and benchmark_cv_timeouts_slack(). */
+struct timeout_bench_s {
+	int per_thread;     /* timed waits per thread */
+	nsync_time *woke;   /* the times at which the waits ended */
+	nsync_counter done; /* decremented as each thread finishes */
+};
+
+#define TIMEOUT_BENCH_THREADS 64
+
+/* Wait b->per_thread times on a condition variable that is never signalled,
+   each time until a random deadline up to STRESS_MAX_DELAY_MICROS away,
+   recording when each wait ends in b->woke[i * b->per_thread ...]. */
+static void timeout_bench_thread (struct timeout_bench_s *b, int i) {
+	nsync_mu mu;
+	nsync_cv cv;
+	int k;
+	nsync_mu_init (&mu);
+	nsync_cv_init (&cv);
+	nsync_mu_lock (&mu);
+	for (k = 0; k != b->per_thread; k++) {
+		nsync_time deadline = nsync_time_add (nsync_time_now (),
+			nsync_time_us (rand () % STRESS_MAX_DELAY_MICROS));
+		nsync_cv_wait_with_deadline (&cv, &mu, deadline, NULL);
+		b->woke[i * b->per_thread + k] = nsync_time_now ();
+	}
+	nsync_mu_unlock (&mu);
+	nsync_counter_add (b->done, -1);
+}
+
+CLOSURE_DECL_BODY2 (timeout_bench_thread, struct timeout_bench_s *, int)
+
+static int time_cmp (const void *a, const void *b) {
+	return (nsync_time_cmp (*(const nsync_time *) a, *(const nsync_time *) b));
+}
+
+/* Wait-end times closer than this are counted as one wakeup. */
+#define TIMEOUT_BENCH_WAKEUP_GAP_US 50
+
+/* Measure TIMEOUT_BENCH_THREADS threads performing testing_n (t) timed waits
+   in all, with the process-wide timer slack set to slack.  With -v, report
+   the number of separate wakeups, found by grouping the times at which waits
+   ended, and the CPU time used. */
+static void benchmark_cv_timeouts_n (testing t, nsync_time slack) {
+	struct timeout_bench_s b;
+	nsync_time gap = nsync_time_us (TIMEOUT_BENCH_WAKEUP_GAP_US);
+	clock_t cpu = clock ();
+	int total;
+	int wakeups;
+	int i;
+	b.per_thread = (testing_n (t) + TIMEOUT_BENCH_THREADS - 1) / TIMEOUT_BENCH_THREADS;
+	total = b.per_thread * TIMEOUT_BENCH_THREADS;
+	b.woke = (nsync_time *) malloc (total * sizeof (b.woke[0]));
+	b.done = nsync_counter_new (TIMEOUT_BENCH_THREADS);
+	nsync_time_set_slack (slack);
+	for (i = 0; i != TIMEOUT_BENCH_THREADS; i++) {
+		closure_fork (closure_timeout_bench_thread (&timeout_bench_thread, &b, i));
+	}
+	nsync_counter_wait (b.done, nsync_time_no_deadline);
+	nsync_time_set_slack (nsync_time_zero);
+	cpu = clock () - cpu;
+	qsort (b.woke, total, sizeof (b.woke[0]), &time_cmp);
+	wakeups = 0;
+	for (i = 0; i != total; i++) {
+		if (i == 0 || nsync_time_cmp (nsync_time_sub (b.woke[i], b.woke[i - 1]), gap) > 0) {
+			wakeups++;
+		}
+	}
+	if (testing_verbose (t)) {
+		TEST_LOG (t, ("slack %dus: %d timeouts, %d wakeups, %.3fs CPU\n",
+			      (int) (NSYNC_TIME_NSEC (slack) / 1000), total, wakeups,
+			      (double) cpu / CLOCKS_PER_SEC));
+	}
+	nsync_counter_free (b.done);
+	free (b.woke);
+}
+
+static void benchmark_cv_timeouts (testing t) {
+	benchmark_cv_timeouts_n (t, nsync_time_zero);
+}
+
+static void benchmark_cv_timeouts_slack (testing t) {
+	benchmark_cv_timeouts_n (t, nsync_time_ms (1));
+}
+
 int main (int argc, char *argv[]) {
 	testing_base tb = testing_new (argc, argv, 0);
 	TEST_RUN (tb, test_cv_timeout_stress);
 	TEST_RUN (tb, test_mu_timeout_stress);
 	TEST_RUN (tb, test_mu_cv_timeout_stress);
+	TEST_RUN (tb, test_mu_cv_timeout_stress_slack);
+	TEST_RUN (tb, test_time_slack);
+	BENCHMARK_RUN (tb, benchmark_cv_timeouts);
+	BENCHMARK_RUN (tb, benchmark_cv_timeouts_slack);
 	return (testing_base_exit (tb));
 }
@@ -764,6 +764,660 @@ static void test_cv_transfer (testing t) {
 }
 
 
+/* --------------------------- */
+
+/* The state shared by the threads of benchmark_cv_broadcast_n(). */
+struct broadcast_state {
+	nsync_mu mu;     /* protects fields below */
+	nsync_cv cv;     /* broadcast when gen changes */
+	int gen;         /* incremented by each broadcast */
+	int waiting;     /* number of waiters waiting for gen to change */
+	int waiters;     /* number of waiter threads; constant after init */
+	int rounds;      /* number of broadcasts; constant after init */
+	int running;     /* number of waiter threads that have not finished */
+};
+
+/* Return whether all the waiters of *(struct broadcast_state *)v are waiting.
+   Used as a condition for nsync_mu_wait(). */
+static int all_waiting (const void *v) {
+	const struct broadcast_state *bs = (const struct broadcast_state *) v;
+	return (bs->waiting == bs->waiters);
+}
+
+/* Return whether all the waiters of *(struct broadcast_state *)v have
+   finished.  Used as a condition for nsync_mu_wait(). */
+static int none_running (const void *v) {
+	return (((const struct broadcast_state *) v)->running == 0);
+}
+
+/* Wait for bs->rounds broadcasts on bs->cv.  The body of the waiter threads
+   of benchmark_cv_broadcast_n(). */
+static void broadcast_waiter (struct broadcast_state *bs) {
+	int r;
+	nsync_mu_lock (&bs->mu);
+	for (r = 0; r != bs->rounds; r++) {
+		int gen = bs->gen;
+		bs->waiting++;
+		while (bs->gen == gen) {
+			nsync_cv_wait (&bs->cv, &bs->mu);
+		}
+	}
+	bs->running--;
+	nsync_mu_unlock (&bs->mu);
+}
+
+CLOSURE_DECL_BODY1 (broadcast_waiter, struct broadcast_state *)
+
+/* Measure the cost per woken thread of nsync_cv_broadcast() on a condition
+   variable with "waiters" waiting threads.  */
+static void benchmark_cv_broadcast_n (testing t, int waiters) {
+	struct broadcast_state bs;
+	int i;
+	memset ((void *) &bs, 0, sizeof (bs));
+	bs.waiters = waiters;
+	bs.rounds = testing_n (t) / waiters;
+	bs.running = waiters;
+	for (i = 0; i != waiters; i++) {
+		closure_fork (closure_broadcast_waiter (&broadcast_waiter, &bs));
+	}
+	nsync_mu_lock (&bs.mu);
+	for (i = 0; i != bs.rounds; i++) {
+		nsync_mu_wait (&bs.mu, &all_waiting, &bs, NULL);
+		bs.waiting = 0;
+		bs.gen++;
+		nsync_cv_broadcast (&bs.cv);
+	}
+	nsync_mu_wait (&bs.mu, &none_running, &bs, NULL);
+	nsync_mu_unlock (&bs.mu);
+}
+
+static void benchmark_cv_broadcast_16 (testing t) {
+	benchmark_cv_broadcast_n (t, 16);
+}
+
+static void benchmark_cv_broadcast_1024 (testing t) {
+	benchmark_cv_broadcast_n (t, 1024);
+}
+
+/* --------------------------- */
+
+/* The state shared by the threads of test_cv_policy(). */
+#define POLICY_WAITERS 3
+struct policy_state {
+	nsync_mu mu;     /* protects fields below */
+	nsync_cv cv;     /* signalled when tokens is incremented */
+	int arrived;     /* number of waiters that have started waiting */
+	int started;     /* number of waiters forked */
+	int tokens;      /* each lets one waiter finish */
+	int woken;       /* number of waiters that have finished */
+	int order[POLICY_WAITERS]; /* order[i] is the index of the i'th to finish */
+};
+
+static int policy_arrived (const void *v) {
+	const struct policy_state *ps = (const struct policy_state *) v;
+	return (ps->arrived == ps->started);
+}
+
+static int policy_token_taken (const void *v) {
+	return (((const struct policy_state *) v)->tokens == 0);
+}
+
+/* Record arrival, wait for a token, then record the order of wakeup. */
+static void policy_waiter (struct policy_state *ps) {
+	int i;
+	nsync_mu_lock (&ps->mu);
+	i = ps->arrived++;
+	while (ps->tokens == 0) {
+		nsync_cv_wait (&ps->cv, &ps->mu);
+	}
+	ps->tokens--;
+	ps->order[ps->woken++] = i;
+	nsync_mu_unlock (&ps->mu);
+}
+
+CLOSURE_DECL_BODY1 (policy_waiter, struct policy_state *)
+
+/* Check that nsync_cv_signal() wakes waiters in the order that the policy
+   of the condition variable requires.  */
+static void test_cv_policy (testing t) {
+	static const int policies[] = { NSYNC_CV_FIFO, NSYNC_CV_LIFO, NSYNC_CV_CPU };
+	int p;
+	for (p = 0; p != (int) (sizeof (policies) / sizeof (policies[0])); p++) {
+		struct policy_state ps;
+		int i;
+		memset ((void *) &ps, 0, sizeof (ps));
+		nsync_cv_set_policy (&ps.cv, policies[p]);
+		/* Start the waiters one at a time, so their order in the queue
+		   is known. */
+		for (i = 0; i != POLICY_WAITERS; i++) {
+			nsync_mu_lock (&ps.mu);
+			ps.started++;
+			closure_fork (closure_policy_waiter (&policy_waiter, &ps));
+			nsync_mu_wait (&ps.mu, &policy_arrived, &ps, NULL);
+			nsync_mu_unlock (&ps.mu);
+		}
+		for (i = 0; i != POLICY_WAITERS; i++) {
+			nsync_mu_lock (&ps.mu);
+			ps.tokens++;
+			nsync_cv_signal (&ps.cv);
+			nsync_mu_wait (&ps.mu, &policy_token_taken, &ps, NULL);
+			nsync_mu_unlock (&ps.mu);
+		}
+		for (i = 0; i != POLICY_WAITERS; i++) {
+			int expected = (policies[p] == NSYNC_CV_FIFO? i : POLICY_WAITERS - 1 - i);
+			/* Under NSYNC_CV_CPU, the order depends on the
+			   processors the waiters ran on; check only that all
+			   were woken. */
+			if (policies[p] != NSYNC_CV_CPU && ps.order[i] != expected) {
+				TEST_ERROR (t, ("policy %d: waiter %d woken %d'th; expected %d",
+						policies[p], ps.order[i], i, expected));
+			}
+		}
+		if (ps.woken != POLICY_WAITERS) {
+			TEST_ERROR (t, ("policy %d: %d waiters woken; expected %d",
+					policies[p], ps.woken, POLICY_WAITERS));
+		}
+	}
+}
+
+/* --------------------------- */
+
+/* The state shared by the threads of benchmark_cv_pool_n(). */
+#define POOL_WORKERS 8
+#define POOL_WORK_BYTES 16384
+struct pool_state {
+	nsync_mu mu;     /* protects fields below */
+	nsync_cv work_cv; /* signalled when a task is queued */
+	nsync_cv done_cv; /* signalled when a task is done */
+	int queued;      /* tasks queued but not yet started */
+	int done;        /* tasks completed */
+	int stop;        /* workers should exit */
+	int running;     /* workers that have not exited */
+	unsigned sum;    /* sum of bytes read by tasks, so the reads are not elided */
+};
+
+/* A worker of benchmark_cv_pool_n().  Each task touches the worker's own
+   buffer, which stays in cache only if the worker ran recently. */
+static void pool_worker (struct pool_state *ps) {
+	unsigned char buf[POOL_WORK_BYTES];
+	unsigned sum = 0;
+	memset (buf, 1, sizeof (buf));
+	nsync_mu_lock (&ps->mu);
+	while (!ps->stop) {
+		if (ps->queued == 0) {
+			nsync_cv_wait (&ps->work_cv, &ps->mu);
+		} else {
+			int i;
+			ps->queued--;
+			nsync_mu_unlock (&ps->mu);
+			for (i = 0; i != POOL_WORK_BYTES; i += 64) {
+				sum += buf[i]++;
+			}
+			nsync_mu_lock (&ps->mu);
+			ps->done++;
+			nsync_cv_signal (&ps->done_cv);
+		}
+	}
+	ps->sum += sum;
+	ps->running--;
+	nsync_cv_signal (&ps->done_cv);
+	nsync_mu_unlock (&ps->mu);
+}
+
+CLOSURE_DECL_BODY1 (pool_worker, struct pool_state *)
+
+/* Measure the time per task of a pool of POOL_WORKERS worker threads,
+   woken under the given policy, given one task at a time.  */
+static void benchmark_cv_pool_n (testing t, int policy) {
+	struct pool_state ps;
+	int i;
+	memset ((void *) &ps, 0, sizeof (ps));
+	nsync_cv_set_policy (&ps.work_cv, policy);
+	ps.running = POOL_WORKERS;
+	for (i = 0; i != POOL_WORKERS; i++) {
+		closure_fork (closure_pool_worker (&pool_worker, &ps));
+	}
+	nsync_mu_lock (&ps.mu);
+	for (i = 0; i != testing_n (t); i++) {
+		ps.queued++;
+		nsync_cv_signal (&ps.work_cv);
+		while (ps.done != i + 1) {
+			nsync_cv_wait (&ps.done_cv, &ps.mu);
+		}
+	}
+	ps.stop = 1;
+	nsync_cv_broadcast (&ps.work_cv);
+	while (ps.running != 0) {
+		nsync_cv_wait (&ps.done_cv, &ps.mu);
+	}
+	nsync_mu_unlock (&ps.mu);
+}
+
+static void benchmark_cv_pool_fifo (testing t) {
+	benchmark_cv_pool_n (t, NSYNC_CV_FIFO);
+}
+
+static void benchmark_cv_pool_lifo (testing t) {
+	benchmark_cv_pool_n (t, NSYNC_CV_LIFO);
+}
+
+static void benchmark_cv_pool_cpu (testing t) {
+	benchmark_cv_pool_n (t, NSYNC_CV_CPU);
+}
+
+/* --------------------------- */
+
+/* The state shared by the threads of test_cv_wait_pred() and
+   benchmark_cv_dispatch_n(): a dispatcher with DISPATCH_QUEUES queues, each
+   served by its own thread, and one condition variable that is signalled when
+   any queue gains an item.  */
+#define DISPATCH_QUEUES 8
+struct dispatch_state;
+struct dispatch_queue {
+	struct dispatch_state *d;
+	int count;       /* items in the queue; under d->mu */
+};
+struct dispatch_state {
+	nsync_mu mu;     /* protects fields below */
+	nsync_cv cv;     /* signalled when an item is queued, or stop is set */
+	int use_pred;    /* whether consumers use nsync_cv_wait_pred() */
+	int stop;        /* consumers should exit */
+	int running;     /* consumers that have not exited */
+	int queued;      /* items added to queues */
+	int served;      /* items removed from queues */
+	int wakeups;     /* returns from waits on cv */
+	int spurious;    /* of those, the ones that found nothing to do */
+	struct dispatch_queue q[DISPATCH_QUEUES];
+};
+
+/* Return whether the consumer of the dispatch_queue *v has something to do. */
+static int dispatch_ready (const void *v) {
+	const struct dispatch_queue *q = (const struct dispatch_queue *) v;
+	return (q->count != 0 || q->d->stop);
+}
+
+/* Remove items from *q until told to stop, counting the wakeups that find
+   nothing to do.  */
+static void dispatch_consumer (struct dispatch_queue *q) {
+	struct dispatch_state *d = q->d;
+	nsync_mu_lock (&d->mu);
+	while (!d->stop) {
+		if (q->count != 0) {
+			q->count--;
+			d->served++;
+		} else {
+			if (d->use_pred) {
+				nsync_cv_wait_pred (&d->cv, &d->mu, &dispatch_ready, q,
+						    nsync_time_no_deadline, NULL);
+			} else {
+				nsync_cv_wait (&d->cv, &d->mu);
+			}
+			d->wakeups++;
+			if (!dispatch_ready (q)) {
+				d->spurious++;
+			}
+		}
+	}
+	d->running--;
+	nsync_mu_unlock (&d->mu);
+}
+
+CLOSURE_DECL_BODY1 (dispatch_consumer, struct dispatch_queue *)
+
+static int dispatch_served (const void *v) {
+	const struct dispatch_state *d = (const struct dispatch_state *) v;
+	return (d->served == d->queued);
+}
+
+static int dispatch_stopped (const void *v) {
+	return (((const struct dispatch_state *) v)->running == 0);
+}
+
+/* Initialize *d, and start its consumers.  */
+static void dispatch_start (struct dispatch_state *d, int use_pred) {
+	int i;
+	memset ((void *) d, 0, sizeof (*d));
+	d->use_pred = use_pred;
+	d->running = DISPATCH_QUEUES;
+	for (i = 0; i != DISPATCH_QUEUES; i++) {
+		d->q[i].d = d;
+		closure_fork (closure_dispatch_consumer (&dispatch_consumer, &d->q[i]));
+	}
+}
+
+/* Queue n items, one at a time, round robin on the queues of *d, waking
+   consumers with nsync_cv_broadcast() if broadcast!=0, or nsync_cv_signal()
+   otherwise, and wait for each to be served.  */
+static void dispatch_items (struct dispatch_state *d, int n, int broadcast) {
+	int i;
+	nsync_mu_lock (&d->mu);
+	for (i = 0; i != n; i++) {
+		d->q[i % DISPATCH_QUEUES].count++;
+		d->queued++;
+		if (broadcast) {
+			nsync_cv_broadcast (&d->cv);
+		} else {
+			nsync_cv_signal (&d->cv);
+		}
+		nsync_mu_wait (&d->mu, &dispatch_served, d, NULL);
+	}
+	nsync_mu_unlock (&d->mu);
+}
+
+/* Stop the consumers of *d, and wait for them to exit.  */
+static void dispatch_stop (struct dispatch_state *d) {
+	nsync_mu_lock (&d->mu);
+	d->stop = 1;
+	nsync_cv_broadcast (&d->cv);
+	nsync_mu_wait (&d->mu, &dispatch_stopped, d, NULL);
+	nsync_mu_unlock (&d->mu);
+}
+
+/* Check that nsync_cv_wait_pred() returns when, and only when, its predicate
+   is true, and that nsync_cv_signal() wakes a waiter whose predicate is true,
+   rather than the first waiter.  */
+static void test_cv_wait_pred (testing t) {
+	struct dispatch_state d;
+	int outcome;
+	dispatch_start (&d, 1);
+	dispatch_items (&d, 200, 0);
+	dispatch_items (&d, 200, 1);
+	dispatch_stop (&d);
+	if (d.served != 400) {
+		TEST_ERROR (t, ("served %d items; expected 400", d.served));
+	}
+	if (d.spurious != 0) {
+		TEST_ERROR (t, ("%d of %d wakeups were spurious", d.spurious, d.wakeups));
+	}
+
+	/* With no consumers, a wait must time out unless the predicate is true. */
+	memset ((void *) &d, 0, sizeof (d));
+	d.q[0].d = &d;
+	nsync_mu_lock (&d.mu);
+	outcome = nsync_cv_wait_pred (&d.cv, &d.mu, &dispatch_ready, &d.q[0],
+				      nsync_time_add (nsync_time_now (), nsync_time_ms (10)),
+				      NULL);
+	if (outcome != ETIMEDOUT) {
+		TEST_ERROR (t, ("nsync_cv_wait_pred() returned %d; expected ETIMEDOUT", outcome));
+	}
+	d.q[0].count = 1;
+	outcome = nsync_cv_wait_pred (&d.cv, &d.mu, &dispatch_ready, &d.q[0],
+				      nsync_time_no_deadline, NULL);
+	if (outcome != 0) {
+		TEST_ERROR (t, ("nsync_cv_wait_pred() returned %d; expected 0", outcome));
+	}
+	nsync_mu_unlock (&d.mu);
+}
+
+/* The state shared by the threads of test_cv_wait_pred_held_signal(). */
+struct held_signal_state {
+	nsync_mu mu;          /* protects waiting, ready and evals */
+	nsync_cv cv;          /* signalled when ready may have changed */
+	int waiting;          /* whether the waiter is in nsync_cv_wait_pred() */
+	int ready;            /* the waiter's predicate */
+	int evals;            /* evaluations of the predicate */
+	nsync_counter done;   /* decremented once the waiter returns */
+	int outcome;          /* the waiter's nsync_cv_wait_pred() result */
+};
+
+/* The waiter's predicate.  Every thread that calls it holds s->mu, and no
+   other thread evaluates it meanwhile, so evals may be updated even by a
+   thread holding s->mu in read mode.  */
+static int held_signal_ready (const void *v) {
+	struct held_signal_state *s = (struct held_signal_state *) v;
+	s->evals++;
+	return (s->ready);
+}
+
+static int held_signal_waiting (const void *v) {
+	return (((const struct held_signal_state *) v)->waiting);
+}
+
+/* Wait in nsync_cv_wait_pred() until s->ready is set. */
+static void held_signal_waiter (struct held_signal_state *s) {
+	nsync_mu_lock (&s->mu);
+	s->waiting = 1;
+	s->outcome = nsync_cv_wait_pred (&s->cv, &s->mu, &held_signal_ready, s,
+					 nsync_time_add (nsync_time_now (), nsync_time_ms (10000)),
+					 NULL);
+	nsync_mu_unlock (&s->mu);
+	nsync_counter_add (s->done, -1);
+}
+
+CLOSURE_DECL_BODY1 (held_signal_waiter, struct held_signal_state *)
+
+/* Signal s->cv while holding s->mu in write mode if write!=0, and in read
+   mode otherwise.  */
+static void held_signal (struct held_signal_state *s, int write) {
+	if (write) {
+		nsync_mu_lock (&s->mu);
+		nsync_cv_signal (&s->cv);
+		nsync_mu_unlock (&s->mu);
+	} else {
+		nsync_mu_rlock (&s->mu);
+		nsync_cv_signal (&s->cv);
+		nsync_mu_runlock (&s->mu);
+	}
+}
+
+/* Check that a thread that signals an nsync_cv while holding its nsync_mu,
+   in either mode, evaluates the predicate of an nsync_cv_wait_pred() waiter
+   itself, and wakes the waiter only if the predicate is true.  */
+static void test_cv_wait_pred_held_signal (testing t) {
+	int write;
+	for (write = 0; write != 2; write++) {
+		struct held_signal_state s;
+		int evals;
+		memset ((void *) &s, 0, sizeof (s));
+		s.done = nsync_counter_new (1);
+		closure_fork (closure_held_signal_waiter (&held_signal_waiter, &s));
+		/* Once the mutex is free with waiting set, the waiter is on s.cv. */
+		nsync_mu_lock (&s.mu);
+		nsync_mu_wait (&s.mu, &held_signal_waiting, &s, NULL);
+		evals = s.evals;
+		nsync_mu_unlock (&s.mu);
+
+		/* With the predicate false, the waiter should stay asleep.  Were
+		   it woken, it would evaluate the predicate again itself. */
+		held_signal (&s, write);
+		nsync_time_sleep (nsync_time_ms (20));
+		nsync_mu_lock (&s.mu);
+		if (s.evals != evals + 1) {
+			TEST_ERROR (t, ("%s-held signal: predicate evaluated %d times; expected 1",
+					write? "write" : "read", s.evals - evals));
+		}
+		s.ready = 1;
+		nsync_mu_unlock (&s.mu);
+
+		/* With the predicate true, the waiter should return. */
+		held_signal (&s, write);
+		nsync_counter_wait (s.done, nsync_time_no_deadline);
+		if (s.outcome != 0) {
+			TEST_ERROR (t, ("%s-held signal: nsync_cv_wait_pred() returned %d; expected 0",
+					write? "write" : "read", s.outcome));
+		}
+		nsync_counter_free (s.done);
+	}
+}
+
+/* Measure the time to pass an item to one of DISPATCH_QUEUES consumers that
+   share a condition variable, woken by nsync_cv_broadcast().  With
+   use_pred==0, consumers use nsync_cv_wait(), and all wake to check their
+   queues; otherwise they use nsync_cv_wait_pred().  With -v, report the
+   spurious wakeups.  */
+static void benchmark_cv_dispatch_n (testing t, int use_pred) {
+	struct dispatch_state d;
+	dispatch_start (&d, use_pred);
+	dispatch_items (&d, testing_n (t), 1);
+	dispatch_stop (&d);
+	if (testing_verbose (t)) {
+		TEST_LOG (t, ("%s: %d items, %d wakeups, %d spurious (%.2f per item)\n",
+			      use_pred? "nsync_cv_wait_pred" : "nsync_cv_wait",
+			      d.served, d.wakeups, d.spurious,
+			      (double) d.spurious / (d.served == 0? 1 : d.served)));
+	}
+}
+
+static void benchmark_cv_dispatch_wait (testing t) {
+	benchmark_cv_dispatch_n (t, 0);
+}
+
+static void benchmark_cv_dispatch_wait_pred (testing t) {
+	benchmark_cv_dispatch_n (t, 1);
+}
+
+/* --------------------------- */
+
+/* The state shared by the threads of benchmark_cv_oversubscribed(). */
+#define OVERSUBSCRIBED_THREADS 64
+struct oversubscribed_state {
+	nsync_mu mu;    /* protects fields below */
+	nsync_cv cv;    /* signalled when busy becomes 0 */
+	int busy;       /* whether some thread is between its critical sections */
+	int running;    /* threads that have not finished */
+};
+
+/* Do n rounds of:  wait for busy==0, set it, then clear it and signal. */
+static void oversubscribed_thread (struct oversubscribed_state *s, int n) {
+	int i;
+	for (i = 0; i != n; i++) {
+		nsync_mu_lock (&s->mu);
+		while (s->busy) {
+			nsync_cv_wait (&s->cv, &s->mu);
+		}
+		s->busy = 1;
+		nsync_mu_unlock (&s->mu);
+		nsync_mu_lock (&s->mu);
+		s->busy = 0;
+		nsync_cv_signal (&s->cv);
+		nsync_mu_unlock (&s->mu);
+	}
+	nsync_mu_lock (&s->mu);
+	s->running--;
+	nsync_cv_broadcast (&s->cv);
+	nsync_mu_unlock (&s->mu);
+}
+
+CLOSURE_DECL_BODY2 (oversubscribed_thread, struct oversubscribed_state *, int)
+
+static int oversubscribed_done (const void *v) {
+	return (((const struct oversubscribed_state *) v)->running == 0);
+}
+
+/* Measure the time per round of OVERSUBSCRIBED_THREADS threads, far more
+   than there are processors, passing a flag through a mutex and condition
+   variable.  Threads are often preempted while holding the internal
+   spinlocks of the mutex and condition variable, so this shows the cost to
+   other threads of waiting for those spinlocks.  */
+static void benchmark_cv_oversubscribed (testing t) {
+	struct oversubscribed_state s;
+	int n = testing_n (t);
+	int i;
+	memset ((void *) &s, 0, sizeof (s));
+	s.running = OVERSUBSCRIBED_THREADS;
+	for (i = 0; i != OVERSUBSCRIBED_THREADS; i++) {
+		int rounds = n / OVERSUBSCRIBED_THREADS;
+		if (i < n % OVERSUBSCRIBED_THREADS) {
+			rounds++;
+		}
+		closure_fork (closure_oversubscribed_thread (&oversubscribed_thread, &s, rounds));
+	}
+	nsync_mu_lock (&s.mu);
+	nsync_mu_wait (&s.mu, &oversubscribed_done, &s, NULL);
+	nsync_mu_unlock (&s.mu);
+}
+
+/* --------------------------- */
+
+/* A client lock type that contains an nsync_mu, and checks that it is
+   acquired and released alternately. */
+struct owned_mu {
+	nsync_mu mu;
+	int held;        /* whether held; under mu */
+	int errors;      /* number of times found in the wrong state; under mu */
+};
+
+static void owned_mu_lock (void *v) {
+	struct owned_mu *om = (struct owned_mu *) v;
+	nsync_mu_lock (&om->mu);
+	om->errors += om->held;
+	om->held = 1;
+}
+static void owned_mu_unlock (void *v) {
+	struct owned_mu *om = (struct owned_mu *) v;
+	om->errors += !om->held;
+	om->held = 0;
+	nsync_mu_unlock (&om->mu);
+}
+static nsync_mu *owned_mu_mu (void *v) {
+	return (&((struct owned_mu *) v)->mu);
+}
+static void owned_mu_acquired (void *v) {
+	struct owned_mu *om = (struct owned_mu *) v;
+	om->errors += om->held;
+	om->held = 1;
+}
+static const struct nsync_lock_funcs_s owned_mu_funcs = {
+	&owned_mu_lock,
+	&owned_mu_unlock,
+	&owned_mu_mu,
+	&owned_mu_acquired
+};
+
+/* The state shared by the threads of test_cv_lock_funcs(). */
+#define TURN_THREADS 4
+#define TURN_ROUNDS 500
+struct turn_state {
+	struct owned_mu om; /* protects fields below */
+	nsync_cv cv;     /* broadcast when turn is incremented */
+	int turn;        /* thread turn%TURN_THREADS may increment turn */
+	int running;     /* threads that have not exited */
+};
+
+/* Increment ts->turn TURN_ROUNDS times, when it is thread id's turn. */
+static void turn_thread (struct turn_state *ts, int id) {
+	int i;
+	owned_mu_lock (&ts->om);
+	for (i = 0; i != TURN_ROUNDS; i++) {
+		while (ts->turn % TURN_THREADS != id) {
+			nsync_cv_wait_with_deadline_funcs (&ts->cv, &ts->om, &owned_mu_funcs,
+							   nsync_time_no_deadline, NULL);
+		}
+		ts->turn++;
+		nsync_cv_broadcast (&ts->cv);
+	}
+	ts->running--;
+	nsync_cv_broadcast (&ts->cv);
+	owned_mu_unlock (&ts->om);
+}
+
+CLOSURE_DECL_BODY2 (turn_thread, struct turn_state *, int)
+
+/* Check nsync_cv_wait_with_deadline_funcs() with a lock that wraps an
+   nsync_mu, where broadcasts made with the lock held transfer waiters to the
+   nsync_mu.  */
+static void test_cv_lock_funcs (testing t) {
+	struct turn_state ts;
+	int i;
+	memset ((void *) &ts, 0, sizeof (ts));
+	ts.running = TURN_THREADS;
+	for (i = 0; i != TURN_THREADS; i++) {
+		closure_fork (closure_turn_thread (&turn_thread, &ts, i));
+	}
+	owned_mu_lock (&ts.om);
+	while (ts.running != 0) {
+		nsync_cv_wait_with_deadline_funcs (&ts.cv, &ts.om, &owned_mu_funcs,
+						   nsync_time_no_deadline, NULL);
+	}
+	if (ts.turn != TURN_THREADS * TURN_ROUNDS) {
+		TEST_ERROR (t, ("turn is %d; expected %d", ts.turn, TURN_THREADS * TURN_ROUNDS));
+	}
+	if (ts.om.errors != 0) {
+		TEST_ERROR (t, ("lock found in wrong state %d times", ts.om.errors));
+	}
+	owned_mu_unlock (&ts.om);
+}
+
 /* --------------------------- */
 
 int main (int argc, char *argv[]) {
@@ -779,5 +1433,18 @@ int main (int argc, char *argv[]) {
 	TEST_RUN (tb, test_cv_cancel);
 	TEST_RUN (tb, test_cv_debug);
 	TEST_RUN (tb, test_cv_transfer);
+	TEST_RUN (tb, test_cv_policy);
+	TEST_RUN (tb, test_cv_wait_pred);
+	TEST_RUN (tb, test_cv_wait_pred_held_signal);
+	TEST_RUN (tb, test_cv_lock_funcs);
+
+	BENCHMARK_RUN (tb, benchmark_cv_broadcast_16);
+	BENCHMARK_RUN (tb, benchmark_cv_broadcast_1024);
+	BENCHMARK_RUN (tb, benchmark_cv_pool_fifo);
+	BENCHMARK_RUN (tb, benchmark_cv_pool_lifo);
+	BENCHMARK_RUN (tb, benchmark_cv_pool_cpu);
+	BENCHMARK_RUN (tb, benchmark_cv_dispatch_wait);
+	BENCHMARK_RUN (tb, benchmark_cv_dispatch_wait_pred);
+	BENCHMARK_RUN (tb, benchmark_cv_oversubscribed);
 	return (testing_base_exit (tb));
 }
@@ -0,0 +1,681 @@
+/* Copyright 2016 Google Inc.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License. */
+
+/* This tests the internal state of nsync_mu, and uses internal hooks to vary
+   its behaviour.  Tests of nsync_mu through its public interface are in
+   mu_test.c. */
+
+#include "platform.h"
+#include "nsync.h"
+#include "compiler.h"
+#include "atomic.h"
+#include "time_extra.h"
+#include "smprintf.h"
+#include "testing.h"
+#include "closure.h"
+#include "dll.h"
+#include "wait_internal.h"
+#include "common.h"
+
+NSYNC_CPP_USING_
+
+/* The state shared by the threads of the tests and benchmarks below that
+   increment a counter under a lock. */
+typedef struct count_state_s {
+	void *mu;                 /* lock protecting count */
+	void (*lock) (void *);    /* operations on mu */
+	void (*unlock) (void *);
+	int loop_count;           /* iterations per thread; constant after init */
+	int count;                /* incremented under *mu */
+
+	nsync_mu done_mu;         /* protects not_yet_done */
+	int not_yet_done;         /* threads not yet finished */
+} count_state;
+
+static int count_state_all_done (const void *v) {
+	return (((const count_state *) v)->not_yet_done == 0);
+}
+
+/* Increment cs->count under cs->mu, cs->loop_count times, then decrement
+   cs->not_yet_done. */
+static void count_loop (count_state *cs) {
+	int i;
+	for (i = 0; i != cs->loop_count; i++) {
+		(*cs->lock) (cs->mu);
+		cs->count++;
+		(*cs->unlock) (cs->mu);
+	}
+	nsync_mu_lock (&cs->done_mu);
+	cs->not_yet_done--;
+	nsync_mu_unlock (&cs->done_mu);
+}
+
+CLOSURE_DECL_BODY1 (count_loop, count_state *)
+
+/* Run "threads" threads executing count_loop() on *cs, and wait for them to
+   finish. */
+static void count_state_run (count_state *cs, int threads) {
+	int i;
+	cs->not_yet_done = threads;
+	for (i = 0; i != threads; i++) {
+		closure_fork (closure_count_loop (&count_loop, cs));
+	}
+	nsync_mu_lock (&cs->done_mu);
+	nsync_mu_wait (&cs->done_mu, &count_state_all_done, cs, NULL);
+	nsync_mu_unlock (&cs->done_mu);
+}
+
+/* Versions of nsync_cohort_mu_lock() and nsync_cohort_mu_unlock() that take
+   "void *" arguments.  */
+static void void_cohort_mu_lock (void *cmu) {
+	nsync_cohort_mu_lock ((nsync_cohort_mu *) cmu);
+}
+static void void_cohort_mu_unlock (void *cmu) {
+	nsync_cohort_mu_unlock ((nsync_cohort_mu *) cmu);
+}
+
+/* Test nsync_cohort_mu with threads spread over three simulated nodes. */
+static void test_cohort_mu_nthread_3node (testing t) {
+	nsync_cohort_mu cmu;
+	count_state cs;
+	memset ((void *) &cmu, 0, sizeof (cmu));
+	memset ((void *) &cs, 0, sizeof (cs));
+	nsync_cohort_mu_set_nodes_ (3);
+	cs.mu = &cmu;
+	cs.lock = &void_cohort_mu_lock;
+	cs.unlock = &void_cohort_mu_unlock;
+	cs.loop_count = 100000;
+	count_state_run (&cs, 5);
+	nsync_cohort_mu_set_nodes_ (-1);
+	if (cs.count != 5 * cs.loop_count) {
+		TEST_ERROR (t, ("test_cohort_mu_nthread_3node final count inconsistent: want %d, got %d",
+				5 * cs.loop_count, cs.count));
+	}
+}
+
+/* --------------------------------------- */
+
+/* Acquire and release *mu in read mode until the reader bias of *mu is
+   enabled, and return whether it was.  */
+static int enable_reader_bias (nsync_mu *mu) {
+	int i;
+	for (i = 0; i != 1000 && (ATM_LOAD (&mu->spin) & MU_RBIAS) == 0; i++) {
+		nsync_mu_rlock (mu);
+		nsync_mu_runlock (mu);
+	}
+	return ((ATM_LOAD (&mu->spin) & MU_RBIAS) != 0);
+}
+
+/* Set *acquired to whether *mu can be acquired, in write mode if write!=0 and
+   read mode otherwise, without blocking.  Release *mu if it was acquired, then
+   decrement *done. */
+static void try_lock (nsync_mu *mu, int write, int *acquired, nsync_counter done) {
+	if (write) {
+		*acquired = nsync_mu_trylock (mu);
+		if (*acquired) {
+			nsync_mu_unlock (mu);
+		}
+	} else {
+		*acquired = nsync_mu_rtrylock (mu);
+		if (*acquired) {
+			nsync_mu_runlock (mu);
+		}
+	}
+	nsync_counter_add (done, -1);
+}
+
+CLOSURE_DECL_BODY4 (try_lock, nsync_mu *, int, int *, nsync_counter)
+
+/* Return whether *mu can be acquired in another thread, in write mode if
+   write!=0 and read mode otherwise, without blocking. */
+static int try_lock_in_thread (nsync_mu *mu, int write) {
+	int acquired = 0;
+	nsync_counter done = nsync_counter_new (1);
+	closure_fork (closure_try_lock (&try_lock, mu, write, &acquired, done));
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	nsync_counter_free (done);
+	return (acquired);
+}
+
+/* Acquire *mu in write mode, set *value to 1, release *mu, and then
+   decrement *done. */
+static void lock_set (nsync_mu *mu, int *value, nsync_counter done) {
+	nsync_mu_lock (mu);
+	*value = 1;
+	nsync_mu_unlock (mu);
+	nsync_counter_add (done, -1);
+}
+
+CLOSURE_DECL_BODY3 (lock_set, nsync_mu *, int *, nsync_counter)
+
+static int int_is_0 (const void *value) { return (*(const int *)value == 0); }
+
+/* Check the operation of a reader-biased nsync_mu held in read mode. */
+static void test_rlock_bias (testing t) {
+	nsync_mu mu;
+	nsync_cv cv;
+	int value = 0;
+	nsync_counter done;
+	if (!HAVE_THREAD_LOCAL) {
+		return; /* reader bias is never enabled */
+	}
+	nsync_mu_init (&mu);
+	nsync_cv_init (&cv);
+	nsync_mu_set_reader_bias (&mu, 1);
+	if (!enable_reader_bias (&mu)) {
+		TEST_FATAL (t, ("reader bias not enabled by reads"));
+	}
+
+	/* A read hold is not recorded in mu.word, but is seen by the
+	   assertions.  */
+	nsync_mu_rlock (&mu);
+	if ((ATM_LOAD (&mu.word) & MU_ANY_LOCK) != 0) {
+		TEST_ERROR (t, ("biased read lock recorded in mu.word"));
+	}
+	nsync_mu_rassert_held (&mu);
+	if (!nsync_mu_is_reader (&mu)) {
+		TEST_FATAL (t, ("expected mu held in reader mode"));
+	}
+
+	/* Can get read lock holding read lock, but not write lock. */
+	if (!try_lock_in_thread (&mu, 0)) {
+		TEST_ERROR (t, ("nsync_mu_rtrylock() failed while biased read lock held"));
+	}
+	if (try_lock_in_thread (&mu, 1)) {
+		TEST_ERROR (t, ("nsync_mu_trylock() succeeded while biased read lock held"));
+	}
+	if ((ATM_LOAD (&mu.spin) & MU_RBIAS) == 0) {
+		TEST_ERROR (t, ("failed nsync_mu_trylock() left reader bias off"));
+	}
+
+	/* A writer waits for the biased reader, and revokes the bias. */
+	done = nsync_counter_new (1);
+	closure_fork (closure_lock_set (&lock_set, &mu, &value, done));
+	nsync_time_sleep (nsync_time_ms (50));
+	if (nsync_counter_value (done) == 0) {
+		TEST_FATAL (t, ("thread was able to acquire write lock while read lock held"));
+	}
+	nsync_mu_runlock (&mu);
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	nsync_counter_free (done);
+	if ((ATM_LOAD (&mu.spin) & MU_RBIAS) != 0) {
+		TEST_ERROR (t, ("reader bias still on after write lock"));
+	}
+
+	/* Waiting on a condition variable converts a biased read hold to
+	   one in mu.word, possibly returning spuriously.  */
+	if (!enable_reader_bias (&mu)) {
+		TEST_FATAL (t, ("reader bias not re-enabled by reads"));
+	}
+	nsync_mu_rlock (&mu);
+	nsync_cv_wait_with_deadline (&cv, &mu, nsync_time_add (nsync_time_now (),
+							       nsync_time_ms (10)), NULL);
+	if ((ATM_LOAD (&mu.word) & MU_RLOCK_FIELD) != MU_RLOCK || !nsync_mu_is_reader (&mu)) {
+		TEST_ERROR (t, ("read lock not recorded in mu.word after nsync_cv_wait()"));
+	}
+	nsync_mu_runlock (&mu);
+
+	/* nsync_mu_wait() with a true condition returns without releasing a
+	   biased read hold.  */
+	nsync_mu_rlock (&mu);
+	if ((ATM_LOAD (&mu.word) & MU_ANY_LOCK) != 0) {
+		TEST_ERROR (t, ("biased read lock recorded in mu.word"));
+	}
+	value = 0;
+	nsync_mu_wait (&mu, &int_is_0, &value, NULL);
+	if ((ATM_LOAD (&mu.word) & MU_ANY_LOCK) != 0 || !nsync_mu_is_reader (&mu)) {
+		TEST_ERROR (t, ("biased read lock moved by nsync_mu_wait() with true condition"));
+	}
+
+	/* Once it must block, nsync_mu_wait() converts the hold as
+	   nsync_cv_wait() does.  */
+	value = 1;
+	if (nsync_mu_wait_with_deadline (&mu, &int_is_0, &value, NULL,
+					 nsync_time_add (nsync_time_now (), nsync_time_ms (10)),
+					 NULL) != ETIMEDOUT) {
+		TEST_ERROR (t, ("nsync_mu_wait_with_deadline() did not time out"));
+	}
+	if ((ATM_LOAD (&mu.word) & MU_RLOCK_FIELD) != MU_RLOCK || !nsync_mu_is_reader (&mu)) {
+		TEST_ERROR (t, ("read lock not recorded in mu.word after nsync_mu_wait()"));
+	}
+	nsync_mu_runlock (&mu);
+
+	nsync_mu_lock (&mu);
+	nsync_mu_set_reader_bias (&mu, 0);
+	nsync_mu_unlock (&mu);
+	if (enable_reader_bias (&mu)) {
+		TEST_ERROR (t, ("reader bias enabled after nsync_mu_set_reader_bias (&mu, 0)"));
+	}
+}
+
+/* Return whether a writer is revoking the reader bias of *mu, and the threads
+   with slot writer_slot are blocked in nsync.  */
+static int writer_blocked_in_revoke (nsync_mu *mu, uint32_t writer_slot) {
+	return ((ATM_LOAD (&mu->spin) & MU_RBIAS) == 0 &&
+		ATM_LOAD (&nsync_slot_blocked_[writer_slot].n) != 0);
+}
+
+/* Acquire *mu in read mode and decrement *held.  Keep *mu until a writer
+   with slot writer_slot is blocked revoking its reader bias, or for 5s, and
+   set *blocked to whether it was.  Then release *mu and decrement *done.  */
+static void rlock_until_blocked (nsync_mu *mu, uint32_t writer_slot, int *blocked,
+				 nsync_counter held, nsync_counter done) {
+	nsync_time deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (5000));
+	nsync_mu_rlock (mu);
+	nsync_counter_add (held, -1);
+	while (!writer_blocked_in_revoke (mu, writer_slot) &&
+	       nsync_time_cmp (nsync_time_now (), deadline) < 0) {
+		nsync_time_sleep (nsync_time_ms (1));
+	}
+	*blocked = writer_blocked_in_revoke (mu, writer_slot);
+	nsync_mu_runlock (mu);
+	nsync_counter_add (done, -1);
+}
+
+CLOSURE_DECL_BODY5 (rlock_until_blocked, nsync_mu *, uint32_t, int *, nsync_counter, nsync_counter)
+
+/* Check that a writer waiting for a long-held biased read lock to be
+   released blocks, rather than spinning.  */
+static void test_rlock_bias_long_reader (testing t) {
+	nsync_mu mu;
+	nsync_counter held;
+	nsync_counter done;
+	uint32_t slot = nsync_thread_slot_ ();
+	int blocked = 0;
+	if (!HAVE_THREAD_LOCAL) {
+		return; /* reader bias is never enabled */
+	}
+	nsync_mu_init (&mu);
+	nsync_mu_set_reader_bias (&mu, 1);
+	if (!enable_reader_bias (&mu)) {
+		TEST_FATAL (t, ("reader bias not enabled by reads"));
+	}
+	held = nsync_counter_new (1);
+	done = nsync_counter_new (1);
+	closure_fork (closure_rlock_until_blocked (&rlock_until_blocked, &mu, slot,
+						   &blocked, held, done));
+	nsync_counter_wait (held, nsync_time_no_deadline);
+	if ((ATM_LOAD (&mu.word) & MU_ANY_LOCK) != 0) {
+		TEST_ERROR (t, ("read lock not taken via reader bias"));
+	}
+	nsync_mu_lock (&mu);
+	nsync_mu_unlock (&mu);
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	if (!blocked) {
+		TEST_ERROR (t, ("writer did not block while waiting for a biased reader"));
+	}
+	nsync_counter_free (done);
+	nsync_counter_free (held);
+}
+
+/* --------------------------------------- */
+
+/* Attempt to acquire *mu, in read mode if read!=0 and write mode otherwise,
+   with a deadline 100ms hence if cancel_note==NULL, and with *cancel_note and
+   no deadline otherwise.  Panic if the attempt does not fail, then decrement
+   *done. */
+static void lock_fail (nsync_mu *mu, int read, nsync_note cancel_note, nsync_counter done) {
+	nsync_time abs_deadline = nsync_time_no_deadline;
+	int outcome;
+	if (cancel_note == NULL) {
+		abs_deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (100));
+	}
+	if (read) {
+		outcome = nsync_mu_rlock_with_deadline (mu, abs_deadline, cancel_note);
+	} else {
+		outcome = nsync_mu_lock_with_deadline (mu, abs_deadline, cancel_note);
+	}
+	if (outcome == 0) {
+		testing_panic ("lock_fail: acquired a held lock");
+	}
+	nsync_counter_add (done, -1);
+}
+
+CLOSURE_DECL_BODY4 (lock_fail, nsync_mu *, int, nsync_note, nsync_counter)
+
+/* Check that writers and readers that time out or are cancelled while queued
+   on an nsync_mu leave its queue empty, and its waiter bits clear.  */
+static void test_mu_lock_deadline_queue (testing t) {
+	nsync_mu mu;
+	nsync_note cancel;
+	nsync_counter done;
+	nsync_mu_init (&mu);
+	nsync_mu_lock (&mu);
+	done = nsync_counter_new (4);
+	cancel = nsync_note_new (NULL, nsync_time_no_deadline);
+	closure_fork (closure_lock_fail (&lock_fail, &mu, 0, NULL, done));
+	closure_fork (closure_lock_fail (&lock_fail, &mu, 1, NULL, done));
+	closure_fork (closure_lock_fail (&lock_fail, &mu, 0, cancel, done));
+	closure_fork (closure_lock_fail (&lock_fail, &mu, 1, cancel, done));
+	nsync_time_sleep (nsync_time_ms (200));
+	nsync_note_notify (cancel);
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	if (mu.waiters != NULL) {
+		TEST_ERROR (t, ("mu queue not empty after timeouts and cancellations"));
+	}
+	if ((ATM_LOAD (&mu.word) & (MU_WAITING | MU_WRITER_WAITING)) != 0) {
+		TEST_ERROR (t, ("mu waiter bits set after timeouts and cancellations"));
+	}
+	nsync_mu_unlock (&mu);
+	nsync_note_free (cancel);
+	nsync_counter_free (done);
+}
+
+/* Until *stop is non-zero, acquire *mu in read mode, hold it for 1ms, and
+   release it.  Then decrement *done.  */
+static void rlock_loop (nsync_mu *mu, nsync_atomic_uint32_ *stop, nsync_counter done) {
+	while (ATM_LOAD (stop) == 0) {
+		nsync_mu_rlock (mu);
+		nsync_time_sleep (nsync_time_ms (1));
+		nsync_mu_runlock (mu);
+	}
+	nsync_counter_add (done, -1);
+}
+
+CLOSURE_DECL_BODY3 (rlock_loop, nsync_mu *, nsync_atomic_uint32_ *, nsync_counter)
+
+/* Check that a writer with a deadline acquires a reader-biased nsync_mu that
+   readers hold continuously, and that one that times out leaves the bias
+   on.  */
+static void test_rlock_bias_timed_writer (testing t) {
+	enum { readers = 4 };
+	nsync_mu mu;
+	nsync_atomic_uint32_ stop;
+	nsync_counter done;
+	int i;
+	if (!HAVE_THREAD_LOCAL) {
+		return; /* reader bias is never enabled */
+	}
+	nsync_mu_init (&mu);
+	nsync_mu_set_reader_bias (&mu, 1);
+	if (!enable_reader_bias (&mu)) {
+		TEST_FATAL (t, ("reader bias not enabled by reads"));
+	}
+	ATM_STORE (&stop, 0);
+	done = nsync_counter_new (readers);
+	for (i = 0; i != readers; i++) {
+		closure_fork (closure_rlock_loop (&rlock_loop, &mu, &stop, done));
+	}
+	nsync_time_sleep (nsync_time_ms (20));
+	if (nsync_mu_lock_with_deadline (&mu, nsync_time_add (nsync_time_now (),
+							      nsync_time_ms (200)),
+					 NULL) != 0) {
+		TEST_ERROR (t, ("writer with deadline starved by biased readers"));
+	} else {
+		nsync_mu_unlock (&mu);
+	}
+	ATM_STORE (&stop, 1);
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	nsync_counter_free (done);
+
+	/* A writer that times out waiting for a biased reader restores the
+	   bias that the reader relies on.  */
+	if (!enable_reader_bias (&mu)) {
+		TEST_FATAL (t, ("reader bias not re-enabled by reads"));
+	}
+	nsync_mu_rlock (&mu);
+	done = nsync_counter_new (1);
+	closure_fork (closure_lock_fail (&lock_fail, &mu, 0, NULL, done));
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	nsync_counter_free (done);
+	if ((ATM_LOAD (&mu.spin) & MU_RBIAS) == 0) {
+		TEST_ERROR (t, ("timed-out writer left reader bias off"));
+	}
+	if (try_lock_in_thread (&mu, 1)) {
+		TEST_ERROR (t, ("nsync_mu_trylock() succeeded while biased read lock held"));
+	}
+	nsync_mu_runlock (&mu);
+}
+
+/* --------------------------------------- */
+
+/* The number of mutexes in test_mu_pending_shared(), and the threads and
+   iterations per mutex.  */
+#define SHARED_MUS 4
+#define SHARED_THREADS 4
+#define SHARED_LOOPS 200
+
+/* Acquire *mu, then sleep briefly, so that other threads queue. */
+static void mu_lock_and_sleep (void *mu) {
+	nsync_mu_lock ((nsync_mu *) mu);
+	nsync_time_sleep (nsync_time_us (10));
+}
+
+/* An nsync_mu padded to 1024 bytes. */
+typedef struct spaced_mu_s {
+	nsync_mu mu;
+	char pad[1024 - sizeof (nsync_mu)];
+} spaced_mu;
+
+/* Check that nsync_mu locks whose first-time waiters share a pending stack
+   (see nsync_mu_drain_pending_()) each see all their waiters.  The mutexes
+   lie 1024 bytes apart, so that they map to the same stack.  Spinning is
+   disabled, and each holder sleeps, so that threads queue.  */
+static void test_mu_pending_shared (testing t) {
+	spaced_mu *mus = (spaced_mu *) malloc (SHARED_MUS * sizeof (mus[0]));
+	count_state cs[SHARED_MUS];
+	int i;
+	int j;
+	nsync_mu_set_spin_limit_ (0);
+	for (i = 0; i != SHARED_MUS; i++) {
+		nsync_mu_init (&mus[i].mu);
+		memset ((void *) &cs[i], 0, sizeof (cs[i]));
+		cs[i].mu = &mus[i].mu;
+		cs[i].lock = &mu_lock_and_sleep;
+		cs[i].unlock = (void (*) (void *)) &nsync_mu_unlock;
+		cs[i].loop_count = SHARED_LOOPS;
+		cs[i].not_yet_done = SHARED_THREADS;
+	}
+	for (j = 0; j != SHARED_THREADS; j++) {
+		for (i = 0; i != SHARED_MUS; i++) {
+			closure_fork (closure_count_loop (&count_loop, &cs[i]));
+		}
+	}
+	for (i = 0; i != SHARED_MUS; i++) {
+		nsync_mu_lock (&cs[i].done_mu);
+		nsync_mu_wait (&cs[i].done_mu, &count_state_all_done, &cs[i], NULL);
+		nsync_mu_unlock (&cs[i].done_mu);
+		if (cs[i].count != SHARED_THREADS * SHARED_LOOPS) {
+			TEST_ERROR (t, ("mutex %d: count %d; expected %d", i, cs[i].count,
+					SHARED_THREADS * SHARED_LOOPS));
+		}
+	}
+	nsync_mu_set_spin_limit_ (-1);
+	free (mus);
+}
+
+/* Measure the performance of highly contended nsync_mu locks, with small
+   critical sections, with spinning disabled, for comparison with
+   benchmark_mu_contended in mu_test.c.  */
+static void benchmark_mu_contended_nospin (testing t) {
+	nsync_mu mu;
+	count_state cs;
+	nsync_mu_init (&mu);
+	memset ((void *) &cs, 0, sizeof (cs));
+	cs.mu = &mu;
+	cs.lock = (void (*) (void *)) &nsync_mu_lock;
+	cs.unlock = (void (*) (void *)) &nsync_mu_unlock;
+	cs.loop_count = testing_n (t);
+	nsync_mu_set_spin_limit_ (0);
+	count_state_run (&cs, 4);
+	nsync_mu_set_spin_limit_ (-1);
+}
+
+/* Measure the performance of highly contended nsync_cohort_mu locks, with
+   small critical sections, with the threads spread over two simulated nodes,
+   so that ownership moves between nodes.  */
+static void benchmark_cohort_mu_contended_2node (testing t) {
+	nsync_cohort_mu cmu;
+	count_state cs;
+	memset ((void *) &cmu, 0, sizeof (cmu));
+	memset ((void *) &cs, 0, sizeof (cs));
+	cs.mu = &cmu;
+	cs.lock = &void_cohort_mu_lock;
+	cs.unlock = &void_cohort_mu_unlock;
+	cs.loop_count = testing_n (t);
+	nsync_cohort_mu_set_nodes_ (2);
+	count_state_run (&cs, 4);
+	nsync_cohort_mu_set_nodes_ (-1);
+}
+
+/* --------------------------------------- */
+
+/* The state shared by the threads of benchmark_waiter_churn(). */
+typedef struct churn_state_s {
+	int loop_count;   /* iterations per thread; constant after init */
+	nsync_mu done_mu; /* protects not_yet_done */
+	int not_yet_done; /* threads not yet finished */
+} churn_state;
+
+static int churn_state_all_done (const void *v) {
+	return (((const churn_state *) v)->not_yet_done == 0);
+}
+
+/* Allocate and free waiters as nested waits would, cs->loop_count times, so
+   that each iteration uses more waiters than a thread keeps for itself, then
+   decrement cs->not_yet_done.  */
+static void churn_loop (churn_state *cs) {
+	int i;
+	for (i = 0; i != cs->loop_count; i++) {
+		waiter *outer = nsync_waiter_new_ ();
+		waiter *middle = nsync_waiter_new_ ();
+		waiter *inner = nsync_waiter_new_ ();
+		nsync_waiter_free_ (inner);
+		nsync_waiter_free_ (middle);
+		nsync_waiter_free_ (outer);
+	}
+	nsync_mu_lock (&cs->done_mu);
+	cs->not_yet_done--;
+	nsync_mu_unlock (&cs->done_mu);
+}
+
+CLOSURE_DECL_BODY1 (churn_loop, churn_state *)
+
+/* Measure the throughput of four threads that repeatedly allocate and free
+   waiters beyond the one each thread reserves.  */
+static void benchmark_waiter_churn (testing t) {
+	churn_state cs;
+	int threads = 4;
+	int i;
+	memset ((void *) &cs, 0, sizeof (cs));
+	cs.loop_count = testing_n (t) / threads;
+	cs.not_yet_done = threads;
+	for (i = 0; i != threads; i++) {
+		closure_fork (closure_churn_loop (&churn_loop, &cs));
+	}
+	nsync_mu_lock (&cs.done_mu);
+	nsync_mu_wait (&cs.done_mu, &churn_state_all_done, &cs, NULL);
+	nsync_mu_unlock (&cs.done_mu);
+}
+
+/* Run a burst of "threads" threads, each of which uses three waiters, and
+   wait for them to finish.  */
+static void waiter_burst (int threads) {
+	churn_state cs;
+	int i;
+	memset ((void *) &cs, 0, sizeof (cs));
+	cs.loop_count = 1;
+	cs.not_yet_done = threads;
+	for (i = 0; i != threads; i++) {
+		closure_fork (closure_churn_loop (&churn_loop, &cs));
+	}
+	nsync_mu_lock (&cs.done_mu);
+	nsync_mu_wait (&cs.done_mu, &churn_state_all_done, &cs, NULL);
+	nsync_mu_unlock (&cs.done_mu);
+}
+
+/* Wait until at most "in_use" waiters are not free, or a few seconds have
+   passed, and return the pool's statistics in *stats.  The threads of a
+   burst return their waiters only as they exit, after waiter_burst()
+   returns.  */
+static void waiter_pool_settle (uint32_t in_use, struct nsync_waiter_pool_stats_s *stats) {
+	int i;
+	nsync_waiter_pool_stats (stats);
+	for (i = 0; i != 200 && stats->live - stats->free > in_use; i++) {
+		nsync_time_sleep (nsync_time_ms (5));
+		nsync_waiter_pool_stats (stats);
+	}
+}
+
+/* Check that bursts of short-lived threads do not make the waiter pool grow
+   without bound, and that nsync_waiter_pool_trim() deallocates free
+   waiters.  */
+static void test_waiter_pool_trim (testing t) {
+	struct nsync_waiter_pool_stats_s before;
+	struct nsync_waiter_pool_stats_s after;
+	uint32_t in_use;
+	int burst;
+	waiter_pool_settle (2, &before);
+	/* Waiters held by this thread and by threads of other tests that have
+	   not yet exited. */
+	in_use = before.live - before.free + 4;
+	for (burst = 0; burst != 4; burst++) {
+		waiter_burst (200);
+		waiter_pool_settle (in_use, &after);
+		if (after.live - after.free > in_use) {
+			TEST_ERROR (t, ("burst %d: %u waiters still in use; expected at most %u",
+					burst, after.live - after.free, in_use));
+		}
+		if (after.peak < after.live) {
+			TEST_ERROR (t, ("burst %d: peak %u < live %u", burst, after.peak, after.live));
+		}
+		if (after.live > 3 * 200 * 2 + before.live) {
+			TEST_ERROR (t, ("burst %d: %u waiters live after burst; started with %u",
+					burst, after.live, before.live));
+		}
+	}
+	nsync_waiter_pool_trim ();
+	nsync_waiter_pool_stats (&after);
+	/* At most a slab's worth of free waiters should remain for each
+	   waiter in use. */
+	if (after.free > 16 * (after.live - after.free)) {
+		TEST_ERROR (t, ("%u waiters free after trim, with %u in use",
+				after.free, after.live - after.free));
+	}
+}
+
+/* Measure the cost per thread of bursts of 64 short-lived threads that
+   each use a few waiters, and check that the pool reaches a steady state.  */
+static void benchmark_waiter_pool_bursts (testing t) {
+	struct nsync_waiter_pool_stats_s stats;
+	int bursts = testing_n (t) / 64;
+	int i;
+	for (i = 0; i != bursts; i++) {
+		waiter_burst (64);
+	}
+	nsync_waiter_pool_stats (&stats);
+	if (stats.live > 3 * 64 * 4 + 1024) {
+		TEST_ERROR (t, ("%u waiters live after %d bursts (peak %u, free %u)",
+				stats.live, bursts, stats.peak, stats.free));
+	}
+}
+
+int main (int argc, char *argv[]) {
+	testing_base tb = testing_new (argc, argv, 0);
+
+	TEST_RUN (tb, test_rlock_bias);
+	TEST_RUN (tb, test_rlock_bias_long_reader);
+	TEST_RUN (tb, test_mu_lock_deadline_queue);
+	TEST_RUN (tb, test_rlock_bias_timed_writer);
+	TEST_RUN (tb, test_cohort_mu_nthread_3node);
+	TEST_RUN (tb, test_mu_pending_shared);
+	TEST_RUN (tb, test_waiter_pool_trim);
+
+	BENCHMARK_RUN (tb, benchmark_mu_contended_nospin);
+	BENCHMARK_RUN (tb, benchmark_cohort_mu_contended_2node);
+	BENCHMARK_RUN (tb, benchmark_waiter_churn);
+	BENCHMARK_RUN (tb, benchmark_waiter_pool_bursts);
+
+	return (testing_base_exit (tb));
+}
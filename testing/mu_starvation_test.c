@@ -333,9 +333,87 @@ static void test_starve_with_writer (testing t) {
 	nsync_mu_unlock (&sd.control_mu);
 }
 
+/* The number of acquisitions timed by starve_with_writer_latencies(). */
+#define LATENCY_SAMPLES 10
+
+/* Start a starve_with_writer() thread that hogs a mutex that is in fair mode
+   iff fair!=0, then acquire and release the mutex LATENCY_SAMPLES times with
+   nsync_mu_lock(), and set latency[] to the times taken by the acquisitions,
+   in ascending order. */
+static void starve_with_writer_latencies (int fair, nsync_time *latency) {
+	nsync_time deadline;
+	int i;
+	int j;
+	starve_data sd;
+	starve_data_init (&sd, 1); /* one thread, started below */
+	nsync_mu_set_fair (&sd.mu, fair);
+	deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (25000)); /* runs for at most 25s. */
+
+	closure_fork (closure_starve_with_writer (&starve_with_writer, &sd,
+						  nsync_time_ms (10), deadline));
+
+	nsync_mu_lock (&sd.control_mu);
+	nsync_mu_wait (&sd.control_mu, &started, &sd, NULL);
+	nsync_mu_unlock (&sd.control_mu);
+
+	for (i = 0; i != LATENCY_SAMPLES; i++) {
+		nsync_time start = nsync_time_now ();
+		nsync_mu_lock (&sd.mu);
+		latency[i] = nsync_time_sub (nsync_time_now (), start);
+		nsync_mu_unlock (&sd.mu);
+		nsync_time_sleep (nsync_time_ms (2));
+	}
+
+	nsync_mu_lock (&sd.mu);
+	sd.cancel = 1; /* Tell threads to exit. */
+	nsync_mu_unlock (&sd.mu);
+
+	nsync_mu_lock (&sd.control_mu);
+	nsync_mu_wait (&sd.control_mu, &done, &sd, NULL); /* wait for exit. */
+	nsync_mu_unlock (&sd.control_mu);
+
+	/* Insertion sort, so the tail is at the end. */
+	for (i = 1; i != LATENCY_SAMPLES; i++) {
+		nsync_time x = latency[i];
+		for (j = i; j != 0 && nsync_time_cmp (latency[j-1], x) > 0; j--) {
+			latency[j] = latency[j-1];
+		}
+		latency[j] = x;
+	}
+}
+
+/* Compare the time nsync_mu_lock() takes to acquire a mutex hogged by a
+   starve_with_writer() thread in throughput mode and in fair mode.  In
+   throughput mode, an acquisition may take many of the hog's 10ms hold times,
+   because the hog reacquires before the woken waiter can run, until the
+   mu_long_wait bit kicks in (see test_starve_with_writer).  In fair mode, the
+   hog's release passes the lock to the waiter, so each acquisition should wait
+   for about one hold time. */
+static void test_starve_with_writer_fair (testing t) {
+	nsync_time throughput_latency[LATENCY_SAMPLES];
+	nsync_time fair_latency[LATENCY_SAMPLES];
+	nsync_time fair_limit = nsync_time_ms (1000);
+	starve_with_writer_latencies (0, throughput_latency);
+	starve_with_writer_latencies (1, fair_latency);
+	if (testing_verbose (t)) {
+		TEST_LOG (t, ("nsync_mu_lock() latency: throughput mode median %.1fms max %.1fms; "
+			      "fair mode median %.1fms max %.1fms\n",
+			      nsync_time_to_dbl (throughput_latency[LATENCY_SAMPLES/2]) * 1e3,
+			      nsync_time_to_dbl (throughput_latency[LATENCY_SAMPLES-1]) * 1e3,
+			      nsync_time_to_dbl (fair_latency[LATENCY_SAMPLES/2]) * 1e3,
+			      nsync_time_to_dbl (fair_latency[LATENCY_SAMPLES-1]) * 1e3));
+	}
+	if (nsync_time_cmp (fair_latency[LATENCY_SAMPLES-1], fair_limit) > 0) {
+		TEST_ERROR (t, ("expected nsync_mu_lock() in fair mode to take at most %.1fms, "
+			   "took %.1fms\n", nsync_time_to_dbl (fair_limit) * 1e3,
+			   nsync_time_to_dbl (fair_latency[LATENCY_SAMPLES-1]) * 1e3));
+	}
+}
+
 int main (int argc, char *argv[]) {
 	testing_base tb = testing_new (argc, argv, 0);
 	TEST_RUN (tb, test_starve_with_readers);
 	TEST_RUN (tb, test_starve_with_writer);
+	TEST_RUN (tb, test_starve_with_writer_fair);
 	return (testing_base_exit (tb));
 }
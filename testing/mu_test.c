@@ -14,6 +14,7 @@
 
 #include "platform.h"
 #include "nsync.h"
+#include "compiler.h"
 #include "time_extra.h"
 #include "smprintf.h"
 #include "testing.h"
@@ -28,11 +29,12 @@ typedef struct test_data_s {
 	int loop_count; /* Iteration count for each test thread; constant after init */
 	
 	/* mu_in_use protects i, id, loop_count, and finished_threads. */
-	void *mu_in_use; /* points at mu, mutex, or rwmutex depending on which is in use. */
+	void *mu_in_use; /* points at mu, cmu, mutex, or rwmutex depending on which is in use. */
 	void (*lock) (void *);  /* operations on mu_in_use */
 	void (*unlock) (void *);
 	
 	nsync_mu mu;
+	nsync_cohort_mu cmu;
 	pthread_mutex_t mutex;
 	pthread_rwlock_t rwmutex;
 	
@@ -129,6 +131,73 @@ static void test_mu_nthread (testing t) {
 	} while (nsync_time_cmp (nsync_time_now (), deadline) < 0);
 }
 
+/* Test that a mutex in fair mode can be locked and unlocked many times from
+   several threads.  */
+static void test_mu_nthread_fair (testing t) {
+	int loop_count = 10000;
+	nsync_time deadline;
+	deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (1500));
+	do {
+		int i;
+		test_data td;
+		memset ((void *) &td, 0, sizeof (td));
+		td.t = t;
+		td.n_threads = 5;
+		td.loop_count = loop_count;
+		td.mu_in_use = &td.mu;
+		td.lock = &void_mu_lock;
+		td.unlock = &void_mu_unlock;
+		nsync_mu_set_fair (&td.mu, 1);
+		for (i = 0; i != td.n_threads; i++) {
+			closure_fork (closure_counting (&counting_loop, &td, i));
+		}
+		test_data_wait_for_all_threads (&td);
+		if (td.i != td.n_threads*td.loop_count) {
+			TEST_FATAL (t, ("test_mu_nthread_fair final count inconsistent: want %d, got %d",
+				   td.n_threads*td.loop_count, td.i));
+		}
+		loop_count *= 2;
+	} while (nsync_time_cmp (nsync_time_now (), deadline) < 0);
+}
+
+/* Versions of nsync_cohort_mu_lock() and nsync_cohort_mu_unlock() that take
+   "void *" arguments.  */
+static void void_cohort_mu_lock (void *cmu) {
+	nsync_cohort_mu_lock ((nsync_cohort_mu *) cmu);
+}
+static void void_cohort_mu_unlock (void *cmu) {
+	nsync_cohort_mu_unlock ((nsync_cohort_mu *) cmu);
+}
+
+/* Create a few threads, each of which increments an integer a fixed number of
+   times, using an nsync_cohort_mu for mutual exclusion.  It checks that the
+   integer is incremented the correct number of times. */
+static void test_cohort_mu_nthread (testing t) {
+	int loop_count = 100000;
+	nsync_time deadline;
+	deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (1500));
+	do {
+		int i;
+		test_data td;
+		memset ((void *) &td, 0, sizeof (td));
+		td.t = t;
+		td.n_threads = 5;
+		td.loop_count = loop_count;
+		td.mu_in_use = &td.cmu;
+		td.lock = &void_cohort_mu_lock;
+		td.unlock = &void_cohort_mu_unlock;
+		for (i = 0; i != td.n_threads; i++) {
+			closure_fork (closure_counting (&counting_loop, &td, i));
+		}
+		test_data_wait_for_all_threads (&td);
+		if (td.i != td.n_threads*td.loop_count) {
+			TEST_FATAL (t, ("test_cohort_mu_nthread final count inconsistent: want %d, got %d",
+				   td.n_threads*td.loop_count, td.i));
+		}
+		loop_count *= 2;
+	} while (nsync_time_cmp (nsync_time_now (), deadline) < 0);
+}
+
 /* void pthread_mutex_lock */
 static void void_pthread_mutex_lock (void *mu) {
         pthread_mutex_lock ((pthread_mutex_t *) mu);
@@ -264,6 +333,352 @@ static void test_try_mu_nthread (testing t) {
 
 /* --------------------------------------- */
 
+/* The body of each thread executed by test_mu_nthread_rbias().
+   Most iterations acquire td->mu in read mode, and check that no writer is
+   present; every eighth acquires it in write mode and increments td->i.
+   *td represents the test data that the threads share, and id is an integer
+   unique to each test thread. */
+static void counting_loop_rbias (test_data *td, int id) {
+	int n = td->loop_count;
+	int i;
+	for (i = 0; i != n; i++) {
+		if ((i & 7) == 0) {
+			nsync_mu_lock (&td->mu);
+			td->id = id;
+			td->i++;
+			if (td->id != id) {
+				testing_panic ("td->id != id");
+			}
+			td->id = -1;
+			nsync_mu_unlock (&td->mu);
+		} else {
+			nsync_mu_rlock (&td->mu);
+			if (td->id != -1) {
+				testing_panic ("writer present while read lock held");
+			}
+			nsync_mu_runlock (&td->mu);
+		}
+	}
+	test_data_thread_finished (td);
+}
+
+/* Test that a reader-biased nsync_mu excludes writers from readers and from
+   each other.  */
+static void test_mu_nthread_rbias (testing t) {
+	int loop_count = 10000;
+	nsync_time deadline;
+	deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (1500));
+	do {
+		int i;
+		test_data td;
+		memset ((void *) &td, 0, sizeof (td));
+		td.t = t;
+		td.n_threads = 5;
+		td.loop_count = loop_count;
+		td.mu_in_use = &td.mu;
+		td.lock = &void_mu_lock;
+		td.unlock = &void_mu_unlock;
+		td.id = -1;
+		nsync_mu_set_reader_bias (&td.mu, 1);
+		for (i = 0; i != td.n_threads; i++) {
+			closure_fork (closure_counting (&counting_loop_rbias, &td, i));
+		}
+		test_data_wait_for_all_threads (&td);
+		if (td.i != td.n_threads*((td.loop_count+7)/8)) {
+			TEST_FATAL (t, ("test_mu_nthread_rbias final count inconsistent: want %d, got %d",
+				   td.n_threads*((td.loop_count+7)/8), td.i));
+		}
+		loop_count *= 2;
+	} while (nsync_time_cmp (nsync_time_now (), deadline) < 0);
+}
+
+/* The body of each thread executed by test_mu_nthread_deadline().
+   Each iteration acquires td->mu with nsync_mu_lock_with_deadline(), or, on
+   odd iterations, nsync_mu_rlock_with_deadline(), using a deadline so short
+   that many attempts time out, and retries until it succeeds.
+   *td represents the test data that the threads share, and id is an integer
+   unique to each test thread. */
+static void counting_loop_deadline (test_data *td, int id) {
+	int n = td->loop_count;
+	int i;
+	for (i = 0; i != n; i++) {
+		nsync_time abs_deadline;
+		if ((i & 1) == 0) {
+			do {
+				abs_deadline = nsync_time_add (nsync_time_now (),
+							       nsync_time_us (rand () % 100));
+			} while (nsync_mu_lock_with_deadline (&td->mu, abs_deadline, NULL) != 0);
+			td->id = id;
+			td->i++;
+			if (td->id != id) {
+				testing_panic ("td->id != id");
+			}
+			td->id = -1;
+			nsync_mu_unlock (&td->mu);
+		} else {
+			do {
+				abs_deadline = nsync_time_add (nsync_time_now (),
+							       nsync_time_us (rand () % 100));
+			} while (nsync_mu_rlock_with_deadline (&td->mu, abs_deadline, NULL) != 0);
+			if (td->id != -1) {
+				testing_panic ("writer present while read lock held");
+			}
+			nsync_mu_runlock (&td->mu);
+		}
+	}
+	test_data_thread_finished (td);
+}
+
+/* Test that acquiring an nsync_mu with nsync_mu_lock_with_deadline() and
+   nsync_mu_rlock_with_deadline(), with frequent timeouts, provides mutual
+   exclusion and leaves the mutex usable.  */
+static void test_mu_nthread_deadline (testing t) {
+	int loop_count = 1000;
+	nsync_time deadline;
+	deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (1500));
+	do {
+		int i;
+		test_data td;
+		memset ((void *) &td, 0, sizeof (td));
+		td.t = t;
+		td.n_threads = 5;
+		td.loop_count = loop_count;
+		td.mu_in_use = &td.mu;
+		td.lock = &void_mu_lock;
+		td.unlock = &void_mu_unlock;
+		td.id = -1;
+		for (i = 0; i != td.n_threads; i++) {
+			closure_fork (closure_counting (&counting_loop_deadline, &td, i));
+		}
+		test_data_wait_for_all_threads (&td);
+		if (td.i != td.n_threads*((td.loop_count+1)/2)) {
+			TEST_FATAL (t, ("test_mu_nthread_deadline final count inconsistent: want %d, got %d",
+				   td.n_threads*((td.loop_count+1)/2), td.i));
+		}
+		loop_count *= 2;
+	} while (nsync_time_cmp (nsync_time_now (), deadline) < 0);
+}
+
+/* Increment td->i, checking that no other thread does so concurrently.
+   For use with nsync_mu_run_locked().  */
+static void td_increment (void *v) {
+	test_data *td = (test_data *) v;
+	if (td->id != -1) {
+		testing_panic ("td->id != -1");
+	}
+	td->id = -2;
+	td->i++;
+	td->id = -1;
+}
+
+/* As counting_loop(), but incrementing td->i with nsync_mu_run_locked(), or,
+   on every fourth iteration, with nsync_mu_lock().  */
+static void counting_loop_run_locked (test_data *td, int id UNUSED) {
+	int n = td->loop_count;
+	int i = 0;
+	for (i = 0; i != n; i++) {
+		if ((i & 3) == 0) {
+			nsync_mu_lock (&td->mu);
+			td_increment (td);
+			nsync_mu_unlock (&td->mu);
+		} else {
+			nsync_mu_run_locked (&td->mu, &td_increment, td);
+		}
+	}
+	test_data_thread_finished (td);
+}
+
+/* Test that critical sections run with nsync_mu_run_locked() from several
+   threads are mutually exclusive with each other and with those protected by
+   nsync_mu_lock(), and that each runs exactly once.  */
+static void test_mu_nthread_run_locked (testing t) {
+	int loop_count = 10000;
+	nsync_time deadline;
+	deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (1500));
+	do {
+		int i;
+		test_data td;
+		memset ((void *) &td, 0, sizeof (td));
+		td.t = t;
+		td.n_threads = 5;
+		td.loop_count = loop_count;
+		td.mu_in_use = &td.mu;
+		td.lock = &void_mu_lock;
+		td.unlock = &void_mu_unlock;
+		td.id = -1;
+		for (i = 0; i != td.n_threads; i++) {
+			closure_fork (closure_counting (&counting_loop_run_locked, &td, i));
+		}
+		test_data_wait_for_all_threads (&td);
+		if (td.i != td.n_threads*td.loop_count) {
+			TEST_FATAL (t, ("test_mu_nthread_run_locked final count inconsistent: want %d, got %d",
+				   td.n_threads*td.loop_count, td.i));
+		}
+		loop_count *= 2;
+	} while (nsync_time_cmp (nsync_time_now (), deadline) < 0);
+}
+
+/* The number of accounts in a multi_state. */
+#define MULTI_ACCOUNTS 8
+
+/* A multi_state represents accounts, each protected by its own lock, that
+   threads in test_mu_lock_n() and the multi-lock benchmarks lock in groups. */
+typedef struct multi_state_s {
+	testing t;
+	nsync_mu mu[MULTI_ACCOUNTS];
+	int balance[MULTI_ACCOUNTS]; /* balance[i] is protected by mu[i] */
+	volatile int writer[MULTI_ACCOUNTS]; /* id+1 of writer holding mu[i], or 0; under mu[i] */
+	int use_lock_n; /* whether to use nsync_mu_rwlock_n(), rather than ordered locking */
+	int loop_count;
+
+	nsync_mu done_mu;
+	int not_yet_done; /* threads not yet complete, under done_mu */
+} multi_state;
+
+static int multi_state_all_done (const void *v) {
+	return (((const multi_state *)v)->not_yet_done == 0);
+}
+
+/* Acquire *ms->mu[acct[i]] for i in [0,n), in read mode if read[i] is
+   non-zero, by acquiring them in address order.  Requires that acct[] be
+   distinct.  The nsync_mu_rwlock_n() alternative to this.  */
+static void multi_state_lock_ordered (multi_state *ms, const int *acct,
+				      const int *read, int n) {
+	int i;
+	for (i = 0; i != MULTI_ACCOUNTS; i++) { /* &ms->mu[] is in address order */
+		int j;
+		for (j = 0; j != n && acct[j] != i; j++) {
+		}
+		if (j != n) {
+			if (read[j]) {
+				nsync_mu_rlock (&ms->mu[i]);
+			} else {
+				nsync_mu_lock (&ms->mu[i]);
+			}
+		}
+	}
+}
+
+/* Loop ms->loop_count times, each time picking up to four accounts at
+   random, acquiring their locks with nsync_mu_rwlock_n() or in address order,
+   some in read mode, and moving money between those locked in write mode.  */
+static void multi_state_transfer_loop (multi_state *ms, int id) {
+	unsigned seed = (unsigned) id * 7919 + 1;
+	int loop;
+	for (loop = 0; loop != ms->loop_count; loop++) {
+		nsync_mu *mus[4];
+		int acct[4];
+		int read[4];
+		int n = 0;
+		int i;
+		int k;
+		while (n != 4) {
+			seed = seed * 1103515245 + 12345;
+			k = (int) ((seed >> 16) % MULTI_ACCOUNTS);
+			for (i = 0; i != n && acct[i] != k; i++) {
+			}
+			if (i == n) {
+				acct[n] = k;
+				read[n] = (((seed >> 24) & 3) == 0);
+				mus[n] = &ms->mu[k];
+				n++;
+			}
+		}
+		if (ms->use_lock_n) {
+			nsync_mu_rwlock_n (mus, read, n);
+		} else {
+			multi_state_lock_ordered (ms, acct, read, n);
+		}
+		for (i = 0; i != n; i++) {
+			if (ms->writer[acct[i]] != 0) {
+				testing_panic ("writer present while account locked");
+			}
+		}
+		for (i = 0; i != n; i++) {
+			if (!read[i]) {
+				ms->writer[acct[i]] = id + 1;
+			}
+		}
+		/* Each account held in write mode passes money to the next. */
+		for (i = 0, k = -1; i != n; i++) {
+			if (!read[i]) {
+				if (k != -1) {
+					ms->balance[acct[k]] -= 3;
+					ms->balance[acct[i]] += 3;
+				}
+				k = i;
+			}
+		}
+		for (i = 0; i != n; i++) {
+			if (!read[i]) {
+				if (ms->writer[acct[i]] != id + 1) {
+					testing_panic ("another writer present while account locked");
+				}
+				ms->writer[acct[i]] = 0;
+			}
+		}
+		nsync_mu_rwunlock_n (mus, read, n);
+	}
+	nsync_mu_lock (&ms->done_mu);
+	ms->not_yet_done--;
+	nsync_mu_unlock (&ms->done_mu);
+}
+
+CLOSURE_DECL_BODY2 (multi_state_transfer_loop, multi_state *, int)
+
+/* Run "threads" threads executing multi_state_transfer_loop() on *ms, and
+   wait for them to finish.  */
+static void multi_state_run (multi_state *ms, int threads) {
+	int i;
+	ms->not_yet_done = threads;
+	for (i = 0; i != threads; i++) {
+		closure_fork (closure_multi_state_transfer_loop (
+			&multi_state_transfer_loop, ms, i));
+	}
+	nsync_mu_lock (&ms->done_mu);
+	nsync_mu_wait (&ms->done_mu, &multi_state_all_done, ms, NULL);
+	nsync_mu_unlock (&ms->done_mu);
+}
+
+/* Test that nsync_mu_rwlock_n() provides mutual exclusion without deadlock
+   when threads acquire overlapping sets of locks in different orders and
+   modes.  */
+static void test_mu_lock_n (testing t) {
+	multi_state ms;
+	nsync_mu *mus[3];
+	int i;
+	int total = 0;
+	memset ((void *) &ms, 0, sizeof (ms));
+	ms.t = t;
+	ms.use_lock_n = 1;
+	ms.loop_count = 20000;
+	multi_state_run (&ms, 6);
+	for (i = 0; i != MULTI_ACCOUNTS; i++) {
+		total += ms.balance[i];
+	}
+	if (total != 0) {
+		TEST_ERROR (t, ("test_mu_lock_n balances sum to %d, want 0", total));
+	}
+
+	/* A lock that appears twice is acquired once. */
+	mus[0] = &ms.mu[0];
+	mus[1] = &ms.mu[1];
+	mus[2] = &ms.mu[0];
+	nsync_mu_lock_n (mus, 3);
+	nsync_mu_assert_held (&ms.mu[0]);
+	nsync_mu_assert_held (&ms.mu[1]);
+	nsync_mu_unlock_n (mus, 3);
+	for (i = 0; i != 2; i++) {
+		if (!nsync_mu_trylock (&ms.mu[i])) {
+			TEST_ERROR (t, ("nsync_mu_unlock_n() left a lock held"));
+		} else {
+			nsync_mu_unlock (&ms.mu[i]);
+		}
+	}
+}
+
+/* --------------------------------------- */
+
 /* An integer protected by a mutex, and with an associated
    condition variable that is signalled when the counter reaches 0. */
 typedef struct counter_s {
@@ -779,6 +1194,312 @@ static void test_rlock (testing t) {
 	}
 }
 
+static int int_is_0 (const void *value) { return (*(const int *)value == 0); }
+
+/* First acquire *mu in upgradable read mode, then:
+   - if expected_value != -1, compare *value against expected_value.
+   - sleep for "sleep".
+   Then release *mu and decrement *done. */
+static void ulock_uunlock (testing t, const char *id, int verbose, nsync_mu *mu,
+			   int *value, int expected_value, nsync_time sleep,
+			   counter *sleeping, counter *done) {
+	if (verbose) {
+		TEST_LOG (t, ("ulock_uunlock %s\n", id));
+	}
+	if (sleeping != NULL) {
+		counter_inc (sleeping, -1);
+	}
+	nsync_mu_ulock (mu);
+	nsync_mu_rassert_held (mu);
+	if (expected_value != -1 && *value != expected_value) {
+		testing_panic (smprintf ("ulock_uunlock %s expected "
+					 "value %d, *value=%d", id, expected_value, *value));
+	}
+	nsync_time_sleep (sleep);
+	nsync_mu_uunlock (mu);
+	counter_inc (done, -1);
+}
+
+/* Acquire *mu in write mode, set *value to 0, and release *mu. */
+static void lock_clear (nsync_mu *mu, int *value) {
+	nsync_mu_lock (mu);
+	*value = 0;
+	nsync_mu_unlock (mu);
+}
+
+CLOSURE_DECL_BODY2 (lock_clear, nsync_mu *, int *)
+
+/* Check nsync_mu_downgrade(). */
+static void test_rlock_downgrade (testing t) {
+	nsync_mu mu;
+	nsync_cv cv;
+	int value = 0;
+	counter *thread_done;
+	counter *lock_unlock_sleeping;
+	counter *lock_unlock_done;
+	counter *rlock_runlock_sleeping;
+	counter *rlock_runlock_done;
+	static const int verbose = 0;
+	nsync_mu_init (&mu);
+	nsync_cv_init (&cv);
+
+	/* Queue a writer, then a reader, behind a write lock. */
+	nsync_mu_lock (&mu);
+	lock_unlock_done = counter_new (1);
+	lock_unlock_sleeping = counter_new (1);
+	closure_fork (closure_lock_unlock (&lock_unlock, t, "a", verbose,
+					   &mu, &value, 0, nsync_time_zero,
+					   lock_unlock_sleeping, lock_unlock_done));
+	counter_wait_for_zero (lock_unlock_sleeping);
+	nsync_time_sleep (nsync_time_ms (50));
+	rlock_runlock_done = counter_new (1);
+	rlock_runlock_sleeping = counter_new (1);
+	closure_fork (closure_lock_unlock (&rlock_runlock, t, "b", verbose,
+					   &mu, &value, 0, nsync_time_zero,
+					   rlock_runlock_sleeping, rlock_runlock_done));
+	counter_wait_for_zero (rlock_runlock_sleeping);
+	nsync_time_sleep (nsync_time_ms (50));
+	if (counter_value (lock_unlock_done) == 0 || counter_value (rlock_runlock_done) == 0) {
+		TEST_FATAL (t, ("thread was able to acquire lock while write lock held"));
+	}
+
+	/* Downgrading wakes the reader, but not the writer. */
+	nsync_mu_downgrade (&mu);
+	nsync_mu_rassert_held (&mu);
+	if (!nsync_mu_is_reader (&mu)) {
+		TEST_FATAL (t, ("expected mu held in reader mode after nsync_mu_downgrade()"));
+	}
+	counter_wait_for_zero (rlock_runlock_done);
+	nsync_time_sleep (nsync_time_ms (50));
+	if (counter_value (lock_unlock_done) == 0) {
+		TEST_FATAL (t, ("thread was able to acquire write lock while read lock held"));
+	}
+	thread_done = counter_new (1);
+	closure_fork (closure_attempt_trylock (&attempt_trylock, t, "c", verbose,
+					       &mu, 0, 1, &value, -1, thread_done));
+	counter_wait_for_zero (thread_done);
+	nsync_mu_runlock (&mu);
+	counter_wait_for_zero (lock_unlock_done);
+	if (value != 1) {
+		TEST_ERROR (t, ("writer did not run after downgraded lock released"));
+	}
+
+	/* A downgraded lock can be used with nsync_mu_wait() and
+	   nsync_cv_wait(), which reacquire it in read mode.  */
+	nsync_mu_lock (&mu);
+	nsync_mu_downgrade (&mu);
+	closure_fork (closure_lock_clear (&lock_clear, &mu, &value));
+	nsync_mu_wait (&mu, &int_is_0, &value, NULL);
+	nsync_mu_rassert_held (&mu);
+	if (!nsync_mu_is_reader (&mu)) {
+		TEST_ERROR (t, ("not held in read mode after nsync_mu_wait()"));
+	}
+	nsync_mu_runlock (&mu);
+	nsync_mu_lock (&mu);
+	nsync_mu_downgrade (&mu);
+	nsync_cv_wait_with_deadline (&cv, &mu, nsync_time_add (nsync_time_now (),
+							       nsync_time_ms (10)), NULL);
+	nsync_mu_rassert_held (&mu);
+	if (!nsync_mu_is_reader (&mu)) {
+		TEST_ERROR (t, ("not held in read mode after nsync_cv_wait()"));
+	}
+	nsync_mu_runlock (&mu);
+
+	free (thread_done);
+	free (lock_unlock_done);
+	free (lock_unlock_sleeping);
+	free (rlock_runlock_done);
+	free (rlock_runlock_sleeping);
+}
+
+/* Check nsync_mu_ulock(), nsync_mu_uunlock() and nsync_mu_upgrade(). */
+static void test_rlock_upgrade (testing t) {
+	nsync_mu mu;
+	nsync_cv cv;
+	int value = 0;
+	counter *thread_done;
+	counter *ulock_sleeping;
+	counter *ulock_done;
+	counter *rlock_runlock_sleeping;
+	counter *rlock_runlock_done;
+	nsync_time start;
+	static const int verbose = 0;
+	nsync_mu_init (&mu);
+	nsync_cv_init (&cv);
+
+	/* An upgradable read lock admits readers, but not writers or other
+	   upgradable readers.  */
+	nsync_mu_ulock (&mu);
+	nsync_mu_rassert_held (&mu);
+	if (!nsync_mu_is_reader (&mu)) {
+		TEST_FATAL (t, ("expected mu held in reader mode"));
+	}
+	thread_done = counter_new (1);
+	closure_fork (closure_attempt_trylock (&attempt_rtrylock, t, "a", verbose,
+					       &mu, 1, 1, &value, 0, thread_done));
+	counter_wait_for_zero (thread_done);
+	counter_inc (thread_done, 1);
+	closure_fork (closure_attempt_trylock (&attempt_trylock, t, "b", verbose,
+					       &mu, 0, 1, &value, -1, thread_done));
+	counter_wait_for_zero (thread_done);
+	ulock_done = counter_new (1);
+	ulock_sleeping = counter_new (1);
+	closure_fork (closure_lock_unlock (&ulock_uunlock, t, "c", verbose,
+					   &mu, &value, 0, nsync_time_zero,
+					   ulock_sleeping, ulock_done));
+	counter_wait_for_zero (ulock_sleeping);
+	nsync_time_sleep (nsync_time_ms (50));
+	if (counter_value (ulock_done) == 0) {
+		TEST_FATAL (t, ("thread was able to acquire two upgradable read locks"));
+	}
+	nsync_mu_uunlock (&mu);
+	counter_wait_for_zero (ulock_done);
+
+	/* nsync_mu_upgrade() waits for other readers to release. */
+	nsync_mu_ulock (&mu);
+	rlock_runlock_done = counter_new (1);
+	rlock_runlock_sleeping = counter_new (1);
+	closure_fork (closure_lock_unlock (&rlock_runlock, t, "d", verbose,
+					   &mu, &value, 0, nsync_time_ms (200),
+					   rlock_runlock_sleeping, rlock_runlock_done));
+	counter_wait_for_zero (rlock_runlock_sleeping);
+	nsync_time_sleep (nsync_time_ms (50));
+	start = nsync_time_now ();
+	nsync_mu_upgrade (&mu);
+	nsync_mu_assert_held (&mu);
+	if (nsync_mu_is_reader (&mu)) {
+		TEST_FATAL (t, ("expected mu held in write mode after nsync_mu_upgrade()"));
+	}
+	if (counter_value (rlock_runlock_done) != 0) {
+		TEST_ERROR (t, ("nsync_mu_upgrade() returned while a reader held the lock"));
+	}
+	check_times (t, "e", start, nsync_time_ms (100), nsync_time_ms (1000));
+	value++;
+	nsync_mu_unlock (&mu);
+
+	/* An upgradable read lock is held in read mode by nsync_mu_wait()
+	   and nsync_cv_wait(), which let writers in, but it remains
+	   upgradable.  */
+	value = 1;
+	nsync_mu_ulock (&mu);
+	closure_fork (closure_lock_clear (&lock_clear, &mu, &value));
+	nsync_mu_wait (&mu, &int_is_0, &value, NULL);
+	nsync_mu_rassert_held (&mu);
+	if (!nsync_mu_is_reader (&mu)) {
+		TEST_ERROR (t, ("not held in read mode after nsync_mu_wait()"));
+	}
+	/* nsync_mu_upgrade() panics unless mu is held in upgradable read mode. */
+	nsync_mu_upgrade (&mu);
+	nsync_mu_unlock (&mu);
+	nsync_mu_ulock (&mu);
+	nsync_cv_wait_with_deadline (&cv, &mu, nsync_time_add (nsync_time_now (),
+							       nsync_time_ms (10)), NULL);
+	nsync_mu_rassert_held (&mu);
+	if (!nsync_mu_is_reader (&mu)) {
+		TEST_ERROR (t, ("not held in read mode after nsync_cv_wait()"));
+	}
+	/* nsync_mu_uunlock() panics unless mu is held in upgradable read mode. */
+	nsync_mu_uunlock (&mu);
+	if (!nsync_mu_trylock (&mu)) {
+		TEST_ERROR (t, ("lock still held after nsync_mu_uunlock()"));
+	} else {
+		nsync_mu_unlock (&mu);
+	}
+
+	free (thread_done);
+	free (ulock_done);
+	free (ulock_sleeping);
+	free (rlock_runlock_done);
+	free (rlock_runlock_sleeping);
+}
+
+CLOSURE_DECL_BODY6 (lock_with_deadline, testing, const char *, nsync_mu *, int,
+		    nsync_note, counter *)
+
+/* Attempt to acquire *mu in write mode (or read mode if read!=0) with a
+   deadline 100ms hence and *cancel_note, and check that the attempt fails
+   with expected_outcome.  Then decrement *done. */
+static void lock_with_deadline (testing t, const char *id, nsync_mu *mu, int read,
+				nsync_note cancel_note, counter *done) {
+	nsync_time start = nsync_time_now ();
+	nsync_time delay = nsync_time_ms (100);
+	int expected_outcome = (cancel_note == NULL? ETIMEDOUT : ECANCELED);
+	int outcome;
+	if (cancel_note != NULL) {
+		delay = nsync_time_ms (10000);
+	}
+	if (read) {
+		outcome = nsync_mu_rlock_with_deadline (mu, nsync_time_add (start, delay),
+							cancel_note);
+	} else {
+		outcome = nsync_mu_lock_with_deadline (mu, nsync_time_add (start, delay),
+						       cancel_note);
+	}
+	if (outcome != expected_outcome) {
+		testing_panic (smprintf ("lock_with_deadline %s: expected %d, got %d",
+					 id, expected_outcome, outcome));
+	}
+	if (cancel_note == NULL) {
+		check_times (t, id, start, delay, nsync_time_ms (10000));
+	}
+	counter_inc (done, -1);
+}
+
+/* Check nsync_mu_lock_with_deadline() and nsync_mu_rlock_with_deadline(). */
+static void test_mu_lock_deadline (testing t) {
+	nsync_mu mu;
+	nsync_note cancel;
+	counter *done;
+	int value = 0;
+	nsync_mu_init (&mu);
+
+	/* Acquisition of a free lock succeeds. */
+	if (nsync_mu_lock_with_deadline (&mu, nsync_time_zero, NULL) != 0) {
+		TEST_FATAL (t, ("nsync_mu_lock_with_deadline() of free mu failed"));
+	}
+	nsync_mu_assert_held (&mu);
+	nsync_mu_unlock (&mu);
+	if (nsync_mu_rlock_with_deadline (&mu, nsync_time_zero, NULL) != 0) {
+		TEST_FATAL (t, ("nsync_mu_rlock_with_deadline() of free mu failed"));
+	}
+	nsync_mu_rassert_held (&mu);
+	nsync_mu_runlock (&mu);
+
+	/* Queued writers and readers time out, or are cancelled, while *mu
+	   is held.  */
+	nsync_mu_lock (&mu);
+	done = counter_new (4);
+	cancel = nsync_note_new (NULL, nsync_time_no_deadline);
+	closure_fork (closure_lock_with_deadline (&lock_with_deadline, t, "a", &mu, 0, NULL, done));
+	closure_fork (closure_lock_with_deadline (&lock_with_deadline, t, "b", &mu, 1, NULL, done));
+	closure_fork (closure_lock_with_deadline (&lock_with_deadline, t, "c", &mu, 0, cancel, done));
+	closure_fork (closure_lock_with_deadline (&lock_with_deadline, t, "d", &mu, 1, cancel, done));
+	nsync_time_sleep (nsync_time_ms (200));
+	nsync_note_notify (cancel);
+	counter_wait_for_zero (done);
+	nsync_mu_unlock (&mu);
+
+	/* An already-cancelled acquisition of a held lock fails at once,
+	   but one of a free lock succeeds. */
+	nsync_mu_rlock (&mu);
+	if (nsync_mu_lock_with_deadline (&mu, nsync_time_no_deadline, cancel) != ECANCELED) {
+		TEST_ERROR (t, ("cancelled nsync_mu_lock_with_deadline() of held mu succeeded"));
+	}
+	nsync_mu_runlock (&mu);
+	if (nsync_mu_lock_with_deadline (&mu, nsync_time_no_deadline, cancel) != 0) {
+		TEST_ERROR (t, ("cancelled nsync_mu_lock_with_deadline() of free mu failed"));
+	}
+	nsync_mu_unlock (&mu);
+
+	/* The lock still works. */
+	counter_inc (done, 1);
+	closure_fork (closure_lock_unlock (&lock_unlock, t, "e", 0, &mu, &value, 0,
+					   nsync_time_zero, NULL, done));
+	counter_wait_for_zero (done);
+	nsync_note_free (cancel);
+	free (done);
+}
+
 /* --------------------------------------- */
 
 /* Measure the performance of an uncontended nsync_mu. */
@@ -871,6 +1592,20 @@ static void benchmark_rmu_uncontended (testing t) {
 	}
 }
 
+/* Measure the performance of an uncontended reader-biased
+   nsync_mu in read mode. */
+static void benchmark_rmu_uncontended_bias (testing t) {
+	int i;
+	int n = testing_n (t);
+	nsync_mu mu;
+	nsync_mu_init (&mu);
+	nsync_mu_set_reader_bias (&mu, 1);
+	for (i = 0; i != n; i++) {
+		nsync_mu_rlock (&mu);
+		nsync_mu_runlock (&mu);
+	}
+}
+
 /* Measure the performance of an uncontended nsync_mu
    in read mode with a blocked waiter. */
 static void benchmark_rmu_uncontended_waiter (testing t) {
@@ -947,9 +1682,13 @@ typedef struct contended_state_s {
 
 	/* locks to test */
 	nsync_mu mu;
+	nsync_cohort_mu cmu;
 	pthread_mutex_t mutex;
 	pthread_rwlock_t rwmutex;
 	int count; /* counter protected by a lock above */
+	int read_only; /* if set, the lock is acquired in read mode, and count only read */
+	int run_locked; /* if set, count is incremented with nsync_mu_run_locked() on mu */
+	int threads; /* number of threads; 0 means 4 */
 	
 	nsync_mu start_done_mu;
 	int start; /* whether threads should start, under start_done_mu */
@@ -964,6 +1703,11 @@ static int contended_state_all_done (const void *v) {
 	return (((const contended_state *)v)->not_yet_done == 0);
 }
 
+/* Increment cs->count.  For use with nsync_mu_run_locked(). */
+static void contended_state_inc (void *v) {
+	((contended_state *) v)->count++;
+}
+
 /* Wait for cs.start to become non-zero, then loop, acquiring and
    releasing mu on each iteration until cs.deadline is reached, then decrement
    cs.not_yet_done. */
@@ -973,14 +1717,22 @@ static void contended_state_contend_loop (contended_state *cs,
 	int n = testing_n (cs->t);
 	int j;
 	int i;
+	volatile int sum = 0;
 	nsync_mu_rlock (&cs->start_done_mu);
 	nsync_mu_wait (&cs->start_done_mu, &contended_state_may_start, cs, NULL);
 	nsync_mu_runlock (&cs->start_done_mu);
 
 	for (j = 0; j < n; j += 10000) {
-		for (i = 0; i != 10000; i++) {
+		for (i = 0; i != 10000 && cs->run_locked; i++) {
+			nsync_mu_run_locked (&cs->mu, &contended_state_inc, cs);
+		}
+		for (; i != 10000; i++) {
 			(*lock) (mu);
-			cs->count++;
+			if (cs->read_only) {
+				sum += cs->count;
+			} else {
+				cs->count++;
+			}
 			(*unlock) (mu);
 		}
 	}
@@ -1000,7 +1752,7 @@ static void contended_state_run_test (contended_state *cs, testing t,
 				      void (*unlock) (void *)) {
 	int i;
 	cs->t = t;
-	cs->not_yet_done = 4; /* number of threads */
+	cs->not_yet_done = (cs->threads != 0? cs->threads : 4); /* number of threads */
 	cs->start = 0;
 	cs->count = 0;
 	for (i = 0; i != cs->not_yet_done; i++) {
@@ -1022,6 +1774,74 @@ static void benchmark_mu_contended (testing t) {
 				  (void (*) (void*))&nsync_mu_unlock);
 }
 
+/* Measure the performance of highly contended nsync_mu locks, with small
+   critical sections run with nsync_mu_run_locked(), for comparison with
+   benchmark_mu_contended.  */
+static void benchmark_mu_contended_run_locked (testing t) {
+	contended_state cs;
+	memset ((void *) &cs, 0, sizeof (cs));
+	cs.run_locked = 1;
+	contended_state_run_test (&cs, t, &cs.mu, (void (*) (void*))&nsync_mu_lock,
+				  (void (*) (void*))&nsync_mu_unlock);
+}
+
+/* Measure the performance of nsync_mu locks with small critical sections,
+   contended by far more threads than processors, so that most acquisitions
+   follow a wait in the queue.  Each thread does the benchmark's iterations.  */
+static void benchmark_mu_contended_128 (testing t) {
+	contended_state cs;
+	memset ((void *) &cs, 0, sizeof (cs));
+	cs.threads = 128;
+	contended_state_run_test (&cs, t, &cs.mu, (void (*) (void*))&nsync_mu_lock,
+				  (void (*) (void*))&nsync_mu_unlock);
+}
+
+/* Measure the performance of nsync_mu locks with small critical sections,
+   contended by 64 threads restricted to at most 2 processors, so that
+   threads are often preempted while holding the mutex or one of nsync's
+   internal spinlocks.  A thread that slept waiting for a spinlock while
+   holding the mutex would stall the others here.  */
+static void benchmark_mu_contended_64_on_2cpus (testing t) {
+	contended_state cs;
+	memset ((void *) &cs, 0, sizeof (cs));
+	cs.threads = 64;
+	testing_restrict_cpus (2);
+	contended_state_run_test (&cs, t, &cs.mu, (void (*) (void*))&nsync_mu_lock,
+				  (void (*) (void*))&nsync_mu_unlock);
+	testing_restrict_cpus (0);
+}
+
+/* Measure the performance of highly contended
+   nsync_cohort_mu locks, with small critical sections.  */
+static void benchmark_cohort_mu_contended (testing t) {
+	contended_state cs;
+	memset ((void *) &cs, 0, sizeof (cs));
+	contended_state_run_test (&cs, t, &cs.cmu, &void_cohort_mu_lock,
+				  &void_cohort_mu_unlock);
+}
+
+/* Measure the performance of nsync_mu locks acquired in read mode by
+   several threads, with small critical sections.  */
+static void benchmark_rmu_contended (testing t) {
+	contended_state cs;
+	memset ((void *) &cs, 0, sizeof (cs));
+	cs.read_only = 1;
+	contended_state_run_test (&cs, t, &cs.mu, (void (*) (void*))&nsync_mu_rlock,
+				  (void (*) (void*))&nsync_mu_runlock);
+}
+
+/* Measure the performance of reader-biased nsync_mu locks acquired in read
+   mode by several threads, with small critical sections, for comparison with
+   benchmark_rmu_contended.  */
+static void benchmark_rmu_contended_bias (testing t) {
+	contended_state cs;
+	memset ((void *) &cs, 0, sizeof (cs));
+	cs.read_only = 1;
+	nsync_mu_set_reader_bias (&cs.mu, 1);
+	contended_state_run_test (&cs, t, &cs.mu, (void (*) (void*))&nsync_mu_rlock,
+				  (void (*) (void*))&nsync_mu_runlock);
+}
+
 /* Measure the performance of highly contended
    pthread_mutex_t locks, with small critical sections.  */
 static void benchmark_mutex_contended (testing t) {
@@ -1044,21 +1864,148 @@ static void benchmark_wmutex_contended (testing t) {
 	pthread_rwlock_destroy (&cs.rwmutex);
 }
 
+/* Measure the throughput of threads that lock overlapping sets of four of
+   eight nsync_mu locks, some in read mode, with nsync_mu_rwlock_n().  */
+static void benchmark_mu_lock_n_contended (testing t) {
+	multi_state ms;
+	memset ((void *) &ms, 0, sizeof (ms));
+	ms.t = t;
+	ms.use_lock_n = 1;
+	ms.loop_count = testing_n (t);
+	multi_state_run (&ms, 4);
+}
+
+/* As benchmark_mu_lock_n_contended(), but acquiring the locks in address
+   order, for comparison.  */
+static void benchmark_mu_lock_ordered_contended (testing t) {
+	multi_state ms;
+	memset ((void *) &ms, 0, sizeof (ms));
+	ms.t = t;
+	ms.use_lock_n = 0;
+	ms.loop_count = testing_n (t);
+	multi_state_run (&ms, 4);
+}
+
+/* The state shared by the threads of benchmark_mu_writer_to_readers(). */
+typedef struct handoff_state_s {
+	nsync_mu mu;      /* held by the writer while readers queue */
+	nsync_mu ctl_mu;  /* protects fields below */
+	nsync_cv round_cv; /* broadcast when round is incremented */
+	int readers;      /* number of reader threads; constant after init */
+	int rounds;       /* number of handoffs; constant after init */
+	int round;        /* current round; readers await its increment */
+	int arrived;      /* readers about to acquire mu, over all rounds */
+	int finished;     /* readers that have released mu, over all rounds */
+	int running;      /* reader threads not yet done */
+} handoff_state;
+
+/* Conditions for nsync_mu_wait() on hs->ctl_mu.  The target values are
+   computed from hs->round.  */
+static int handoff_all_arrived (const void *v) {
+	const handoff_state *hs = (const handoff_state *) v;
+	return (hs->arrived == hs->readers * (hs->round + 1));
+}
+static int handoff_all_finished (const void *v) {
+	const handoff_state *hs = (const handoff_state *) v;
+	return (hs->finished == hs->readers * (hs->round + 1));
+}
+static int handoff_none_running (const void *v) {
+	return (((const handoff_state *) v)->running == 0);
+}
+
+/* A reader thread of benchmark_mu_writer_to_readers().  In each round,
+   announce arrival, acquire and release hs->mu in read mode, which blocks
+   until the writer releases it, and then wait for the next round.  */
+static void handoff_reader (handoff_state *hs) {
+	int r;
+	for (r = 0; r != hs->rounds; r++) {
+		nsync_mu_lock (&hs->ctl_mu);
+		while (hs->round != r) {
+			nsync_cv_wait (&hs->round_cv, &hs->ctl_mu);
+		}
+		hs->arrived++;
+		nsync_mu_unlock (&hs->ctl_mu);
+		nsync_mu_rlock (&hs->mu);
+		nsync_mu_runlock (&hs->mu);
+		nsync_mu_lock (&hs->ctl_mu);
+		hs->finished++;
+		nsync_mu_unlock (&hs->ctl_mu);
+	}
+	nsync_mu_lock (&hs->ctl_mu);
+	hs->running--;
+	nsync_mu_unlock (&hs->ctl_mu);
+}
+
+CLOSURE_DECL_BODY1 (handoff_reader, handoff_state *)
+
+/* Measure the latency, per woken reader, of a writer's nsync_mu_unlock()
+   that releases an nsync_mu to 200 waiting readers, which are woken as a
+   group.  The timer runs only during the nsync_mu_unlock() call.  */
+static void benchmark_mu_writer_to_readers (testing t) {
+	handoff_state hs;
+	int i;
+	testing_stop_timer (t);
+	memset ((void *) &hs, 0, sizeof (hs));
+	hs.readers = 200;
+	hs.rounds = testing_n (t) / hs.readers;
+	hs.running = hs.readers;
+	for (i = 0; i != hs.readers; i++) {
+		closure_fork (closure_handoff_reader (&handoff_reader, &hs));
+	}
+	for (i = 0; i != hs.rounds; i++) {
+		nsync_mu_lock (&hs.mu);
+		nsync_mu_lock (&hs.ctl_mu);
+		nsync_mu_wait (&hs.ctl_mu, &handoff_all_arrived, &hs, NULL);
+		nsync_mu_unlock (&hs.ctl_mu);
+		testing_start_timer (t);
+		nsync_mu_unlock (&hs.mu);
+		testing_stop_timer (t);
+		nsync_mu_lock (&hs.ctl_mu);
+		nsync_mu_wait (&hs.ctl_mu, &handoff_all_finished, &hs, NULL);
+		hs.round++;
+		nsync_cv_broadcast (&hs.round_cv);
+		nsync_mu_unlock (&hs.ctl_mu);
+	}
+	nsync_mu_lock (&hs.ctl_mu);
+	nsync_mu_wait (&hs.ctl_mu, &handoff_none_running, &hs, NULL);
+	nsync_mu_unlock (&hs.ctl_mu);
+	testing_start_timer (t);
+}
+
 int main (int argc, char *argv[]) {
 	testing_base tb = testing_new (argc, argv, 0);
 
 	TEST_RUN (tb, test_rlock);
+	TEST_RUN (tb, test_rlock_downgrade);
+	TEST_RUN (tb, test_rlock_upgrade);
+	TEST_RUN (tb, test_mu_lock_deadline);
 	TEST_RUN (tb, test_mu_nthread);
+	TEST_RUN (tb, test_mu_nthread_fair);
+	TEST_RUN (tb, test_cohort_mu_nthread);
 	TEST_RUN (tb, test_mutex_nthread);
 	TEST_RUN (tb, test_rwmutex_nthread);
 	TEST_RUN (tb, test_try_mu_nthread);
+	TEST_RUN (tb, test_mu_nthread_rbias);
+	TEST_RUN (tb, test_mu_nthread_deadline);
+	TEST_RUN (tb, test_mu_lock_n);
+	TEST_RUN (tb, test_mu_nthread_run_locked);
 
 	BENCHMARK_RUN (tb, benchmark_mu_contended);
+	BENCHMARK_RUN (tb, benchmark_mu_contended_run_locked);
+	BENCHMARK_RUN (tb, benchmark_mu_contended_128);
+	BENCHMARK_RUN (tb, benchmark_mu_contended_64_on_2cpus);
+	BENCHMARK_RUN (tb, benchmark_mu_writer_to_readers);
+	BENCHMARK_RUN (tb, benchmark_cohort_mu_contended);
+	BENCHMARK_RUN (tb, benchmark_rmu_contended);
+	BENCHMARK_RUN (tb, benchmark_rmu_contended_bias);
 	BENCHMARK_RUN (tb, benchmark_mutex_contended);
 	BENCHMARK_RUN (tb, benchmark_wmutex_contended);
+	BENCHMARK_RUN (tb, benchmark_mu_lock_n_contended);
+	BENCHMARK_RUN (tb, benchmark_mu_lock_ordered_contended);
 
 	BENCHMARK_RUN (tb, benchmark_mu_uncontended);
 	BENCHMARK_RUN (tb, benchmark_rmu_uncontended);
+	BENCHMARK_RUN (tb, benchmark_rmu_uncontended_bias);
 	BENCHMARK_RUN (tb, benchmark_mutex_uncontended);
 	BENCHMARK_RUN (tb, benchmark_wmutex_uncontended);
 	BENCHMARK_RUN (tb, benchmark_rmutex_uncontended);
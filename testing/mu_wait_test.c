@@ -202,6 +202,17 @@ static void test_mu_producer_consumer6 (testing t) {
 	free (q);
 }
 
+/* Send a stream of integers from a producer thread to
+   a consumer thread via a queue with limit 10**1, whose mutex
+   is in fair mode. */
+static void test_mu_producer_consumer_fair (testing t) {
+	mu_queue *q = mu_queue_new (10);
+	nsync_mu_set_fair (&q->mu, 1);
+	closure_fork (closure_producer_mu_n (&producer_mu_n, t, q, 0, MU_PRODUCER_CONSUMER_N));
+	consumer_mu_n (t, q, 0, MU_PRODUCER_CONSUMER_N);
+	free (q);
+}
+
 /* A perpetually false wait condition. */
 static int false_condition (const void *v UNUSED) {
 	return (0);
@@ -326,6 +337,159 @@ static void test_mu_cancel (testing t) {
 	}
 }
 
+/* --------------------------- */
+
+/* The number of waiters in the keyed wait test and benchmarks below. */
+#define KEYED_SLOTS 100
+
+/* State shared by a set of waiters, each waiting for its own slot. */
+typedef struct keyed_state_s {
+	nsync_mu mu;             /* protects fields below */
+	int keyed;               /* whether waiters use nsync_mu_wait_keyed() */
+	int slot[KEYED_SLOTS];   /* slot[i]==-1 tells waiter i to proceed */
+	int parked;              /* number of waiters that have started */
+	int running;             /* number of waiters that have not finished */
+	int acks;                /* number of slots consumed by waiters */
+	int want_acks;           /* value of acks awaited by the main thread */
+} keyed_state;
+
+/* Return whether the slot *v tells its waiter to proceed. */
+static int slot_set (const void *v) {
+	return (*(const int *) v == -1);
+}
+
+static int int_is_zero (const void *v) {
+	return (*(const int *) v == 0);
+}
+
+/* Return whether ks->parked == KEYED_SLOTS. */
+static int all_parked (const void *v) {
+	const keyed_state *ks = (const keyed_state *) v;
+	return (ks->parked == KEYED_SLOTS);
+}
+
+/* Return whether ks->acks has reached ks->want_acks. */
+static int acks_done (const void *v) {
+	const keyed_state *ks = (const keyed_state *) v;
+	return (ks->acks >= ks->want_acks);
+}
+
+/* rounds times, wait for ks->slot[i] to be set, and acknowledge it by
+   clearing it and incrementing ks->acks.  Then decrement ks->running.  */
+static void keyed_waiter (keyed_state *ks, int i, int rounds) {
+	int r;
+	nsync_mu_lock (&ks->mu);
+	ks->parked++;
+	for (r = 0; r != rounds; r++) {
+		if (ks->keyed) {
+			nsync_mu_wait_keyed (&ks->mu, &slot_set, &ks->slot[i], &ks->slot[i]);
+		} else {
+			nsync_mu_wait (&ks->mu, &slot_set, &ks->slot[i], NULL);
+		}
+		ks->slot[i] = 0;
+		ks->acks++;
+		nsync_mu_touch_key (&ks->mu, &ks->acks);
+	}
+	ks->running--;
+	nsync_mu_touch_key (&ks->mu, &ks->running);
+	nsync_mu_unlock (&ks->mu);
+}
+
+CLOSURE_DECL_BODY3 (keyed_waiter, keyed_state *, int, int)
+
+/* Start KEYED_SLOTS waiters on *ks, each running keyed_waiter() for rounds
+   rounds, and wait until all have started.  */
+static void keyed_state_start (keyed_state *ks, int keyed, int rounds) {
+	int i;
+	memset ((void *) ks, 0, sizeof (*ks));
+	ks->keyed = keyed;
+	ks->running = KEYED_SLOTS;
+	for (i = 0; i != KEYED_SLOTS; i++) {
+		closure_fork (closure_keyed_waiter (&keyed_waiter, ks, i, rounds));
+	}
+	nsync_mu_lock (&ks->mu);
+	nsync_mu_wait (&ks->mu, &all_parked, ks, NULL);
+	nsync_mu_unlock (&ks->mu);
+}
+
+/* Check that keyed waiters are woken when their keys are touched, and that
+   keyed and unkeyed waits on the same mutex can be mixed.  */
+static void test_mu_wait_keyed (testing t) {
+	int r;
+	int i;
+	int rounds = 20;
+	keyed_state *ks = (keyed_state *) malloc (sizeof (*ks));
+	keyed_state_start (ks, 1, rounds / 2);
+	for (r = 0; r != rounds; r++) {
+		/* Set every other slot, starting at r%2. */
+		nsync_mu_lock (&ks->mu);
+		for (i = r % 2; i < KEYED_SLOTS; i += 2) {
+			ks->slot[i] = -1;
+			nsync_mu_touch_key (&ks->mu, &ks->slot[i]);
+			ks->want_acks++;
+		}
+		/* Wait for the waiters to consume them, alternating between
+		   keyed and unkeyed waits.  */
+		if ((r & 2) == 0) {
+			nsync_mu_wait_keyed (&ks->mu, &acks_done, ks, &ks->acks);
+		} else {
+			nsync_mu_wait (&ks->mu, &acks_done, ks, NULL);
+		}
+		for (i = 0; i != KEYED_SLOTS; i++) {
+			if (ks->slot[i] != 0) {
+				TEST_ERROR (t, ("round %d: slot %d not consumed", r, i));
+			}
+		}
+		nsync_mu_unlock (&ks->mu);
+	}
+	nsync_mu_lock (&ks->mu);
+	nsync_mu_wait_keyed (&ks->mu, &int_is_zero, &ks->running, &ks->running);
+	if (ks->acks != rounds * (KEYED_SLOTS / 2)) {
+		TEST_ERROR (t, ("got %d acknowledgements, want %d",
+			   ks->acks, rounds * (KEYED_SLOTS / 2)));
+	}
+	nsync_mu_unlock (&ks->mu);
+	free (ks);
+}
+
+/* With KEYED_SLOTS waiters parked on distinct conditions on ks->mu, time
+   critical sections that each update ks->want_acks, which no waiter examines, and
+   one in 16 of which also modify a slot without making its condition true.
+   Without keyed waits, each unlock evaluates all the conditions; with them,
+   only the slot's condition is reevaluated, and only after it is touched.  */
+static void benchmark_mu_wait_distinct (testing t, int keyed) {
+	int i;
+	int n = testing_n (t);
+	keyed_state *ks = (keyed_state *) malloc (sizeof (*ks));
+	keyed_state_start (ks, keyed, 1);
+	for (i = 0; i != n; i++) {
+		nsync_mu_lock (&ks->mu);
+		ks->want_acks++;
+		if ((i & 15) == 0) {
+			int *slot = &ks->slot[(i >> 4) % KEYED_SLOTS];
+			*slot = (*slot + 1) & 0xffff;
+			nsync_mu_touch_key (&ks->mu, slot);
+		}
+		nsync_mu_unlock (&ks->mu);
+	}
+	nsync_mu_lock (&ks->mu);
+	for (i = 0; i != KEYED_SLOTS; i++) {
+		ks->slot[i] = -1;
+		nsync_mu_touch_key (&ks->mu, &ks->slot[i]);
+	}
+	nsync_mu_wait_keyed (&ks->mu, &int_is_zero, &ks->running, &ks->running);
+	nsync_mu_unlock (&ks->mu);
+	free (ks);
+}
+
+static void benchmark_mu_wait_distinct_keyed (testing t) {
+	benchmark_mu_wait_distinct (t, 1);
+}
+
+static void benchmark_mu_wait_distinct_unkeyed (testing t) {
+	benchmark_mu_wait_distinct (t, 0);
+}
+
 int main (int argc, char *argv[]) {
 	testing_base tb = testing_new (argc, argv, 0);
 	TEST_RUN (tb, test_mu_producer_consumer0);
@@ -335,7 +499,11 @@ int main (int argc, char *argv[]) {
 	TEST_RUN (tb, test_mu_producer_consumer4);
 	TEST_RUN (tb, test_mu_producer_consumer5);
 	TEST_RUN (tb, test_mu_producer_consumer6);
+	TEST_RUN (tb, test_mu_producer_consumer_fair);
 	TEST_RUN (tb, test_mu_deadline);
 	TEST_RUN (tb, test_mu_cancel);
+	TEST_RUN (tb, test_mu_wait_keyed);
+	BENCHMARK_RUN (tb, benchmark_mu_wait_distinct_keyed);
+	BENCHMARK_RUN (tb, benchmark_mu_wait_distinct_unkeyed);
 	return (testing_base_exit (tb));
 }
@@ -15,9 +15,14 @@
 #include "platform.h"
 #include "nsync.h"
 #include "time_extra.h"
+#include "compiler.h"
+#include "atomic.h"
 #include "smprintf.h"
 #include "closure.h"
 #include "testing.h"
+#include "dll.h"
+#include "wait_internal.h"
+#include "common.h"
 
 NSYNC_CPP_USING_
 
@@ -102,6 +107,32 @@ static void test_note_unnotified (testing t) {
 	nsync_note_free (n);
 }
 
+/* Test that a note whose deadline has just passed is seen as notified at once,
+   even though the cheap clock used to check deadlines may lag. */
+static void test_note_expiry_exact (testing t) {
+	int i;
+	for (i = 0; i != 1000; i++) {
+		nsync_note n = nsync_note_new (NULL, nsync_time_add (nsync_time_now (),
+								     nsync_time_us (i % 10)));
+		nsync_time deadline = nsync_note_expiry (n);
+		while (nsync_time_cmp (deadline, nsync_time_now ()) > 0) {
+		}
+		if (!nsync_note_is_notified (n)) {
+			TEST_ERROR (t, ("note is not notified just after its deadline"));
+		}
+		if (!nsync_time_expired_ (deadline)) {
+			TEST_ERROR (t, ("deadline is not expired just after it passed"));
+		}
+		nsync_note_free (n);
+	}
+	if (nsync_time_expired_ (nsync_time_add (nsync_time_now (), nsync_time_ms (1000)))) {
+		TEST_ERROR (t, ("deadline a second hence has expired"));
+	}
+	if (nsync_time_expired_ (nsync_time_no_deadline)) {
+		TEST_ERROR (t, ("nsync_time_no_deadline has expired"));
+	}
+}
+
 /* Test expiry on a note. */
 static void test_note_expiry (testing t) {
 	nsync_time start;
@@ -321,12 +352,396 @@ static void test_note_in_tree (testing t) {
 	}
 }
 
+/* Set note[i] to a new child of parent for i in [0, count), then decrement
+   *done. */
+static void new_children (nsync_note parent, nsync_note *note, int count, nsync_counter done) {
+	int i;
+	for (i = 0; i != count; i++) {
+		note[i] = nsync_note_new (parent, nsync_time_no_deadline);
+	}
+	nsync_counter_add (done, -1);
+}
+
+CLOSURE_DECL_BODY4 (new_children, nsync_note, nsync_note *, int, nsync_counter)
+
+/* Free note[i] for i in [0, count) in steps of stride, then decrement *done. */
+static void free_notes (nsync_note *note, int count, int stride, nsync_counter done) {
+	int i;
+	for (i = 0; i < count; i += stride) {
+		nsync_note_free (note[i]);
+	}
+	nsync_counter_add (done, -1);
+}
+
+CLOSURE_DECL_BODY4 (free_notes, nsync_note *, int, int, nsync_counter)
+
+#define WIDE_THREADS 4
+
+/* Give root count children, created by WIDE_THREADS threads at once, in note[].
+   If free_evens, free the even-numbered children in WIDE_THREADS threads while
+   notifying root.  Otherwise, just notify root.  */
+static void wide_tree (nsync_note root, nsync_note *note, int count, int free_evens) {
+	nsync_counter done = nsync_counter_new (WIDE_THREADS);
+	int start = 0;
+	int i;
+	for (i = 0; i != WIDE_THREADS; i++) {
+		int n = count / WIDE_THREADS + (i < count % WIDE_THREADS);
+		closure_fork (closure_new_children (&new_children, root, note + start, n, done));
+		start += n;
+	}
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	nsync_counter_free (done);
+	done = nsync_counter_new (free_evens? WIDE_THREADS : 0);
+	if (free_evens) {
+		for (i = 0; i != WIDE_THREADS; i++) {
+			closure_fork (closure_free_notes (&free_notes, note + 2 * i,
+							  count - 2 * i, 2 * WIDE_THREADS, done));
+		}
+	}
+	nsync_note_notify (root);
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	nsync_counter_free (done);
+}
+
+#define WIDE_CHILDREN 1000000
+
+/* Stress a note with a million children, created by several threads at once,
+   some freed while the note is notified.  */
+static void test_note_wide_tree (testing t) {
+	nsync_note root = nsync_note_new (NULL, nsync_time_no_deadline);
+	nsync_note *note = (nsync_note *) malloc (WIDE_CHILDREN * sizeof (note[0]));
+	int i;
+	wide_tree (root, note, WIDE_CHILDREN, 1);
+	for (i = 1; i < WIDE_CHILDREN; i += 2) {
+		if (!nsync_note_is_notified (note[i])) {
+			TEST_ERROR (t, ("child %d of notified note is not notified", i));
+			break;
+		}
+	}
+	for (i = 1; i < WIDE_CHILDREN; i += 2) {
+		nsync_note_free (note[i]);
+	}
+	free (note);
+	nsync_note_free (root);
+}
+
+#define DEEP_NOTES 100000
+
+/* Stress a chain of DEEP_NOTES notes, each the child of the last.  The chain
+   is first notified from its root, and then, after freeing every other note
+   so that the survivors are adopted by their grandparents, notified again. */
+static void test_note_deep_tree (testing t) {
+	nsync_note *note = (nsync_note *) malloc (DEEP_NOTES * sizeof (note[0]));
+	int pass;
+	int i;
+	for (pass = 0; pass != 2; pass++) {
+		note[0] = nsync_note_new (NULL, nsync_time_no_deadline);
+		for (i = 1; i != DEEP_NOTES; i++) {
+			note[i] = nsync_note_new (note[i - 1], nsync_time_no_deadline);
+		}
+		if (pass == 1) {
+			for (i = 1; i < DEEP_NOTES; i += 2) {
+				nsync_note_free (note[i]);
+			}
+		}
+		if (nsync_note_is_notified (note[DEEP_NOTES - 2])) {
+			TEST_ERROR (t, ("unnotified note in chain is notified (pass %d)", pass));
+		}
+		nsync_note_notify (note[0]);
+		for (i = 0; i < DEEP_NOTES; i += 1 + pass) {
+			if (!nsync_note_is_notified (note[i])) {
+				TEST_ERROR (t, ("note %d of notified chain is not notified (pass %d)",
+						i, pass));
+				break;
+			}
+		}
+		for (i = 0; i < DEEP_NOTES; i += 1 + pass) {
+			nsync_note_free (note[i]);
+		}
+	}
+	free (note);
+}
+
+/* Measure the cost per child of creating testing_n (t) children of one note
+   from WIDE_THREADS threads at once, notifying the note, and freeing the
+   children.  */
+static void benchmark_note_wide_tree (testing t) {
+	int n = testing_n (t);
+	nsync_note root = nsync_note_new (NULL, nsync_time_no_deadline);
+	nsync_note *note = (nsync_note *) malloc (n * sizeof (note[0]));
+	int i;
+	wide_tree (root, note, n, 0);
+	for (i = 0; i != n; i++) {
+		nsync_note_free (note[i]);
+	}
+	free (note);
+	nsync_note_free (root);
+}
+
+/* Call nsync_note_is_notified (n) iterations times, then decrement *c. */
+static void poll_note (testing t, nsync_note n, int iterations, nsync_counter c) {
+	int i;
+	int notified = 0;
+	for (i = 0; i != iterations; i++) {
+		notified += nsync_note_is_notified (n);
+	}
+	if (notified != 0) {
+		TEST_ERROR (t, ("polled note is notified"));
+	}
+	nsync_counter_add (c, -1);
+}
+
+CLOSURE_DECL_BODY4 (poll_note, testing, nsync_note, int, nsync_counter)
+
+#define POLL_THREADS 4
+
+/* Measure the time for POLL_THREADS threads to poll one note, as request
+   handlers poll a per-request note for cancellation.  The note has a parent
+   and a distant deadline, so it is not notified.  */
+static void benchmark_note_poll (testing t) {
+	int n = testing_n (t);
+	nsync_note parent = nsync_note_new (NULL, nsync_time_no_deadline);
+	nsync_note note = nsync_note_new (parent, nsync_time_add (nsync_time_now (),
+								  nsync_time_ms (3600 * 1000)));
+	nsync_counter c = nsync_counter_new (POLL_THREADS);
+	int i;
+	for (i = 0; i != POLL_THREADS; i++) {
+		closure_fork (closure_poll_note (&poll_note, t, note,
+						    n / POLL_THREADS + (i < n % POLL_THREADS), c));
+	}
+	nsync_counter_wait (c, nsync_time_no_deadline);
+	nsync_counter_free (c);
+	nsync_note_free (note);
+	nsync_note_free (parent);
+}
+
+/* Measure the cost of checking whether a deadline has passed, as
+   nsync_note_is_notified() does for a note with a finite deadline.  */
+static void benchmark_deadline_check (testing t) {
+	int n = testing_n (t);
+	nsync_time deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (3600 * 1000));
+	int expired = 0;
+	int i;
+	for (i = 0; i != n; i++) {
+		expired += nsync_time_expired_ (deadline);
+	}
+	if (expired != 0) {
+		TEST_ERROR (t, ("deadline an hour hence has expired"));
+	}
+}
+
+/* Like benchmark_deadline_check, but comparing against nsync_time_now(),
+   as the check did before the coarse clock was used.  */
+static void benchmark_deadline_check_now (testing t) {
+	int n = testing_n (t);
+	nsync_time deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (3600 * 1000));
+	int expired = 0;
+	int i;
+	for (i = 0; i != n; i++) {
+		expired += (nsync_time_cmp (deadline, nsync_time_now ()) <= 0);
+	}
+	if (expired != 0) {
+		TEST_ERROR (t, ("deadline an hour hence has expired"));
+	}
+}
+
+/* Return whether *n has been notified, without notifying it if it has merely
+   expired, as nsync_note_is_notified() would. */
+static int note_notified_already (nsync_note n) {
+	return ((ATM_LOAD_ACQ (&n->notified) & NOTE_NOTIFIED) != 0);
+}
+
+/* Run the expiry service until *stop is notified, then decrement *done. */
+static void expiry_service (nsync_note stop, nsync_counter done) {
+	nsync_note_expiry_run (stop);
+	nsync_counter_add (done, -1);
+}
+
+CLOSURE_DECL_BODY2 (expiry_service, nsync_note, nsync_counter)
+
+/* Start the expiry service in a new thread, and return once it is running.
+   The service stops when *stop is notified, and then decrements *done. */
+static void start_expiry_service (testing t, nsync_note stop, nsync_counter done) {
+	int running = 0;
+	int i;
+	closure_fork (closure_expiry_service (&expiry_service, stop, done));
+	/* Notes are armed only once the service is running; probe until one is. */
+	for (i = 0; !running && i != 1000; i++) {
+		nsync_note probe = nsync_note_new (NULL, nsync_time_add (nsync_time_now (),
+									 nsync_time_ms (1)));
+		nsync_time_sleep (nsync_time_ms (10));
+		running = note_notified_already (probe);
+		nsync_note_free (probe);
+	}
+	if (!running) {
+		TEST_ERROR (t, ("note expiry service did not start"));
+	}
+}
+
+/* Verify that the expiry service notifies notes and their descendants at
+   their deadlines, with no thread examining them.  */
+static void test_note_expiry_service (testing t) {
+	nsync_note stop = nsync_note_new (NULL, nsync_time_no_deadline);
+	nsync_counter done = nsync_counter_new (1);
+	nsync_time deadline;
+	nsync_note parent;
+	nsync_note child;
+	nsync_note orphan_parent;
+	nsync_note orphan;
+	nsync_note distant;
+
+	start_expiry_service (t, stop, done);
+	deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (50));
+	parent = nsync_note_new (NULL, deadline);
+	child = nsync_note_new (parent, nsync_time_no_deadline);
+	orphan_parent = nsync_note_new (NULL, deadline);
+	orphan = nsync_note_new (orphan_parent, nsync_time_no_deadline);
+	nsync_note_free (orphan_parent); /* orphan must be armed in its own right */
+	distant = nsync_note_new (NULL, nsync_time_add (nsync_time_now (),
+							nsync_time_ms (3600 * 1000)));
+	if (note_notified_already (parent) || note_notified_already (orphan)) {
+		TEST_ERROR (t, ("note notified before its deadline"));
+	}
+	nsync_time_sleep (nsync_time_ms (500));
+	if (!note_notified_already (parent)) {
+		TEST_ERROR (t, ("expiry service did not notify note"));
+	}
+	if (!note_notified_already (child)) {
+		TEST_ERROR (t, ("expiry service did not notify child note"));
+	}
+	if (!note_notified_already (orphan)) {
+		TEST_ERROR (t, ("expiry service did not notify reparented note"));
+	}
+	if (note_notified_already (distant)) {
+		TEST_ERROR (t, ("expiry service notified note before its deadline"));
+	}
+
+	nsync_note_notify (stop);
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	nsync_note_free (distant);
+	nsync_note_free (orphan);
+	nsync_note_free (child);
+	nsync_note_free (parent);
+	nsync_counter_free (done);
+	nsync_note_free (stop);
+}
+
+/* Test that a note that loses its covering parent while the expiry service
+   is stopped does not pass that coverage on to children created after the
+   service restarts. */
+static void test_note_expiry_service_restart (testing t) {
+	nsync_note stop = nsync_note_new (NULL, nsync_time_no_deadline);
+	nsync_counter done = nsync_counter_new (1);
+	nsync_note parent;
+	nsync_note child;
+	nsync_note grandchild;
+
+	start_expiry_service (t, stop, done);
+	parent = nsync_note_new (NULL, nsync_time_add (nsync_time_now (),
+						       nsync_time_ms (300)));
+	child = nsync_note_new (parent, nsync_time_no_deadline);
+	nsync_note_notify (stop);
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	nsync_counter_free (done);
+	nsync_note_free (stop);
+
+	nsync_note_free (parent); /* child cannot be armed: no service */
+
+	stop = nsync_note_new (NULL, nsync_time_no_deadline);
+	done = nsync_counter_new (1);
+	start_expiry_service (t, stop, done);
+	grandchild = nsync_note_new (child, nsync_time_no_deadline);
+	nsync_time_sleep (nsync_time_ms (800));
+	if (!note_notified_already (grandchild)) {
+		TEST_ERROR (t, ("expiry service did not notify note created after restart"));
+	}
+
+	nsync_note_notify (stop);
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	nsync_note_free (grandchild);
+	nsync_note_free (child);
+	nsync_counter_free (done);
+	nsync_note_free (stop);
+}
+
+/* Create and free testing_n (t) notes with a distant deadline, as a server
+   might for each request.  */
+static void new_free_notes (testing t) {
+	int n = testing_n (t);
+	nsync_time deadline = nsync_time_add (nsync_time_now (), nsync_time_ms (3600 * 1000));
+	int i;
+	for (i = 0; i != n; i++) {
+		nsync_note_free (nsync_note_new (NULL, deadline));
+	}
+}
+
+/* Measure the cost of creating and freeing a note with a deadline when
+   the expiry service is not running.  */
+static void benchmark_note_new_free (testing t) {
+	new_free_notes (t);
+}
+
+/* Measure the same while the expiry service is running, so that each note is
+   placed on and removed from the timing wheel.  The difference from
+   benchmark_note_new_free is the overhead per armed note.  */
+static void benchmark_note_new_free_armed (testing t) {
+	nsync_note stop = nsync_note_new (NULL, nsync_time_no_deadline);
+	nsync_counter done = nsync_counter_new (1);
+	start_expiry_service (t, stop, done);
+	new_free_notes (t);
+	nsync_note_notify (stop);
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	nsync_counter_free (done);
+	nsync_note_free (stop);
+}
+
+/* Call new_free_notes (t), then decrement *done.  */
+static void new_free_notes_thread (testing t, nsync_counter done) {
+	new_free_notes (t);
+	nsync_counter_add (done, -1);
+}
+
+CLOSURE_DECL_BODY2 (new_free_notes_thread, testing, nsync_counter)
+
+/* Measure benchmark_note_new_free_armed with 8 threads creating and freeing
+   notes concurrently, to show contention on the timing wheels.  Each thread
+   does the benchmark's iterations.  */
+static void benchmark_note_new_free_armed_8threads (testing t) {
+	nsync_note stop = nsync_note_new (NULL, nsync_time_no_deadline);
+	nsync_counter done = nsync_counter_new (1);
+	nsync_counter threads_done = nsync_counter_new (8);
+	int i;
+	start_expiry_service (t, stop, done);
+	for (i = 0; i != 8; i++) {
+		closure_fork (closure_new_free_notes_thread (&new_free_notes_thread,
+							     t, threads_done));
+	}
+	nsync_counter_wait (threads_done, nsync_time_no_deadline);
+	nsync_note_notify (stop);
+	nsync_counter_wait (done, nsync_time_no_deadline);
+	nsync_counter_free (threads_done);
+	nsync_counter_free (done);
+	nsync_note_free (stop);
+}
+
 int main (int argc, char *argv[]) {
 	testing_base tb = testing_new (argc, argv, 0);
 	TEST_RUN (tb, test_note_prenotified);
 	TEST_RUN (tb, test_note_unnotified);
 	TEST_RUN (tb, test_note_expiry);
+	TEST_RUN (tb, test_note_expiry_exact);
 	TEST_RUN (tb, test_note_notify);
 	TEST_RUN (tb, test_note_in_tree);
+	TEST_RUN (tb, test_note_wide_tree);
+	TEST_RUN (tb, test_note_deep_tree);
+	TEST_RUN (tb, test_note_expiry_service);
+	TEST_RUN (tb, test_note_expiry_service_restart);
+	BENCHMARK_RUN (tb, benchmark_note_poll);
+	BENCHMARK_RUN (tb, benchmark_deadline_check);
+	BENCHMARK_RUN (tb, benchmark_deadline_check_now);
+	BENCHMARK_RUN (tb, benchmark_note_wide_tree);
+	BENCHMARK_RUN (tb, benchmark_note_new_free);
+	BENCHMARK_RUN (tb, benchmark_note_new_free_armed);
+	BENCHMARK_RUN (tb, benchmark_note_new_free_armed_8threads);
 	return (testing_base_exit (tb));
 }
@@ -28,9 +28,15 @@ NSYNC_CPP_USING_
 
    The setting of GOMAXPROCS, and the exact choices of the thread scheduler can
    have great effect on the timings. */
+typedef struct wrapped_mu_s {
+	nsync_mu mu;
+	int acquisitions;
+} wrapped_mu;
+
 typedef struct ping_pong_s {
 	nsync_mu mu;
 	nsync_cv cv[2];
+	wrapped_mu wmu;
 	
 	pthread_mutex_t mutex;
 	pthread_rwlock_t rwmutex;
@@ -147,6 +153,85 @@ static void benchmark_ping_pong_mu_cv (testing t) {
 
 /* --------------------------------------- */
 
+/* Functions on a wrapped_mu, a client lock type that contains an nsync_mu. */
+static void wrapped_mu_lock (void *v) {
+	wrapped_mu *wmu = (wrapped_mu *) v;
+	nsync_mu_lock (&wmu->mu);
+	wmu->acquisitions++;
+}
+static void wrapped_mu_unlock (void *v) {
+	nsync_mu_unlock (&((wrapped_mu *) v)->mu);
+}
+static nsync_mu *wrapped_mu_mu (void *v) {
+	return (&((wrapped_mu *) v)->mu);
+}
+static void wrapped_mu_acquired (void *v) {
+	((wrapped_mu *) v)->acquisitions++;
+}
+static const struct nsync_lock_funcs_s wrapped_mu_funcs = {
+	&wrapped_mu_lock,
+	&wrapped_mu_unlock,
+	&wrapped_mu_mu,
+	&wrapped_mu_acquired
+};
+
+/* Run by each thread in benchmark_ping_pong_wrapped_mu_cv(). */
+static void wrapped_mu_cv_ping_pong (ping_pong *pp, int parity) {
+	wrapped_mu_lock (&pp->wmu);
+	while (pp->i < pp->limit) {
+		while ((pp->i & 1) == parity) {
+			nsync_cv_wait_with_deadline_generic (&pp->cv[parity], &pp->wmu,
+							     &wrapped_mu_lock,
+							     &wrapped_mu_unlock,
+							     nsync_time_no_deadline, NULL);
+		}
+		pp->i++;
+		nsync_cv_signal (&pp->cv[1-parity]);
+	}
+	wrapped_mu_unlock (&pp->wmu);
+	ping_pong_done (pp);
+}
+
+/* Measure the wakeup speed of a lock wrapping an nsync_mu, used with nsync_cv
+   via nsync_cv_wait_with_deadline_generic(), to ping-pong back and forth
+   between two threads.  Each woken thread must then acquire the lock.  */
+static void benchmark_ping_pong_wrapped_mu_cv (testing t) {
+	ping_pong pp;
+	ping_pong_init (&pp, testing_n (t));
+	closure_fork (closure_ping_pong (&wrapped_mu_cv_ping_pong, &pp, 0));
+	wrapped_mu_cv_ping_pong (&pp, 1);
+	ping_pong_destroy (&pp);
+}
+
+/* Run by each thread in benchmark_ping_pong_wrapped_mu_cv_funcs(). */
+static void wrapped_mu_cv_funcs_ping_pong (ping_pong *pp, int parity) {
+	wrapped_mu_lock (&pp->wmu);
+	while (pp->i < pp->limit) {
+		while ((pp->i & 1) == parity) {
+			nsync_cv_wait_with_deadline_funcs (&pp->cv[parity], &pp->wmu,
+							   &wrapped_mu_funcs,
+							   nsync_time_no_deadline, NULL);
+		}
+		pp->i++;
+		nsync_cv_signal (&pp->cv[1-parity]);
+	}
+	wrapped_mu_unlock (&pp->wmu);
+	ping_pong_done (pp);
+}
+
+/* As benchmark_ping_pong_wrapped_mu_cv(), but via
+   nsync_cv_wait_with_deadline_funcs(), so woken threads may be transferred to
+   the nsync_mu's queue, as with benchmark_ping_pong_mu_cv().  */
+static void benchmark_ping_pong_wrapped_mu_cv_funcs (testing t) {
+	ping_pong pp;
+	ping_pong_init (&pp, testing_n (t));
+	closure_fork (closure_ping_pong (&wrapped_mu_cv_funcs_ping_pong, &pp, 0));
+	wrapped_mu_cv_funcs_ping_pong (&pp, 1);
+	ping_pong_destroy (&pp);
+}
+
+/* --------------------------------------- */
+
 /* Run by each thread in benchmark_ping_pong_mu_cv_unexpired_deadline(). */
 static void mu_cv_unexpired_deadline_ping_pong (ping_pong *pp, int parity) {
 	nsync_time deadline_in1hour;
@@ -369,6 +454,8 @@ int main (int argc, char *argv[]) {
 	BENCHMARK_RUN (tb, benchmark_ping_pong_mu);
 	BENCHMARK_RUN (tb, benchmark_ping_pong_mu_unexpired_deadline);
 	BENCHMARK_RUN (tb, benchmark_ping_pong_mu_cv);
+	BENCHMARK_RUN (tb, benchmark_ping_pong_wrapped_mu_cv);
+	BENCHMARK_RUN (tb, benchmark_ping_pong_wrapped_mu_cv_funcs);
 	BENCHMARK_RUN (tb, benchmark_ping_pong_mu_cv_unexpired_deadline);
 	BENCHMARK_RUN (tb, benchmark_ping_pong_mutex_cond);
 	BENCHMARK_RUN (tb, benchmark_ping_pong_mutex_cond_unexpired_deadline);
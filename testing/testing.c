@@ -13,6 +13,9 @@
   limitations under the License. */
 
 #include "platform.h"
+#if defined(__linux__)
+#include <sched.h>
+#endif
 #include "atm_log.h"
 #include "nsync.h"
 #include "compiler.h"
@@ -460,6 +463,44 @@ int testing_is_uniprocessor (testing t) {
 	return (is_uniprocessor);
 }
 
+#if defined(__linux__)
+static cpu_set_t saved_cpus;  /* the calling thread's processors before restriction */
+static int cpus_restricted;   /* whether saved_cpus is to be restored */
+#endif
+
+/* Restrict the calling thread, and the threads it creates from now on, to
+   the first ncpus of the processors on which it may now run, and return
+   the number of processors it is restricted to.  If ncpus==0, undo the
+   restriction and return 0.  Return 0 if the platform has no way to
+   restrict threads to processors.  */
+int testing_restrict_cpus (int ncpus UNUSED) {
+	int result = 0;
+#if defined(__linux__)
+	if (ncpus == 0) {
+		if (cpus_restricted) {
+			sched_setaffinity (0, sizeof (saved_cpus), &saved_cpus);
+			cpus_restricted = 0;
+		}
+	} else if (sched_getaffinity (0, sizeof (saved_cpus), &saved_cpus) == 0) {
+		cpu_set_t cpus;
+		int cpu;
+		CPU_ZERO (&cpus);
+		for (cpu = 0; cpu != CPU_SETSIZE && result != ncpus; cpu++) {
+			if (CPU_ISSET (cpu, &saved_cpus)) {
+				CPU_SET (cpu, &cpus);
+				result++;
+			}
+		}
+		if (sched_setaffinity (0, sizeof (cpus), &cpus) == 0) {
+			cpus_restricted = 1;
+		} else {
+			result = 0;
+		}
+	}
+#endif
+	return (result);
+}
+
 void testing_stop_timer (testing t) {
 	if (nsync_time_cmp (t->stop_time, nsync_time_zero) != 0) {
 		abort ();
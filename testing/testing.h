@@ -38,6 +38,13 @@ void testing_start_timer (testing t);
    greatly reduced. */
 int testing_is_uniprocessor (testing t);
 
+/* Restrict the calling thread, and the threads it creates from now on, to
+   the first ncpus of the processors on which it may now run, and return
+   the number of processors it is restricted to.  If ncpus==0, undo the
+   restriction.  Return 0 if the platform cannot restrict threads to
+   processors.  */
+int testing_restrict_cpus (int ncpus);
+
 /* Given a testing_base, run f (t), where t has type testing.
    Output will be for a test. */
 #define TEST_RUN(tb, f) testing_run_ ((tb), &f, #f, 0)